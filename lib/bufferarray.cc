@@ -23,6 +23,8 @@
 #include "bufferstore.h"
 #include "bufferarray.h"
 
+#include <utility>
+
 bufferArray::bufferArray()
 {
     len = 0;
@@ -49,10 +51,10 @@ pop()
 {
     bufferStore ret;
     if (len > 0) {
-	ret = buff[0];
+	ret = std::move(buff[0]);
 	len--;
 	for (long i = 0; i < len; i++) {
-	    buff[i] = buff[i + 1];
+	    buff[i] = std::move(buff[i + 1]);
 	}
     }
     return ret;
@@ -60,17 +62,23 @@ pop()
 
 void bufferArray::
 append(const bufferStore & b)
+{
+    append(bufferStore(b));
+}
+
+void bufferArray::
+append(bufferStore && b)
 {
     if (len == lenAllocd) {
 	lenAllocd += ALLOC_MIN;
 	bufferStore *nb = new bufferStore[lenAllocd];
 	for (long i = 0; i < len; i++) {
-	    nb[i] = buff[i];
+	    nb[i] = std::move(buff[i]);
 	}
 	delete []buff;
 	buff = nb;
     }
-    buff[len++] = b;
+    buff[len++] = std::move(b);
 }
 
 void bufferArray::
@@ -80,7 +88,7 @@ push(const bufferStore & b)
 	lenAllocd += ALLOC_MIN;
     bufferStore *nb = new bufferStore[lenAllocd];
     for (long i = len; i > 0; i--) {
-	nb[i] = buff[i - 1];
+	nb[i] = std::move(buff[i - 1]);
     }
     nb[0] = b;
     delete[]buff;
@@ -143,7 +151,7 @@ operator +=(const bufferArray &a)
     lenAllocd += a.lenAllocd;
     bufferStore *nb = new bufferStore[lenAllocd];
     for (int i = 0; i < len; i++)
-	nb[len + i] = buff[i];
+	nb[i] = std::move(buff[i]);
     for (int i = 0; i < a.len; i++)
 	nb[len + i] = a.buff[i];
     len += a.len;
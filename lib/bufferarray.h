@@ -125,6 +125,14 @@ public:
     */
     void append(const bufferStore& b);
 
+    /**
+    * Appends a bufferStore, taking over its content
+    * without copying it.
+    *
+    * @param b The bufferStore to be appended. It is left empty.
+    */
+    void append(bufferStore&& b);
+
     /**
     * Evaluates the current length.
     *
@@ -29,6 +29,8 @@
 // Should be iostream.h, but won't build on Sun WorkShop C++ 5.0
 #include <iomanip>
 #include <string>
+#include <atomic>
+#include <utility>
 
 #include <stdlib.h>
 #include <ctype.h>
@@ -36,59 +38,198 @@
 
 using namespace std;
 
+static atomic<unsigned long> copied(0);
+static atomic<unsigned long> allocs(0);
+
+#ifdef BUFFER_POOL
+/**
+ * Blocks freed by bufferStores of a thread, for reuse by the next
+ * ones. There is a list for each size, from MIN_LEN up to MAX_POOLED
+ * bytes, doubling from one to the next.
+ */
+class blockPool {
+public:
+    enum { CLASSES = 8, MAX_FREE = 16 };
+
+    blockPool() { memset(count, 0, sizeof(count)); }
+
+    ~blockPool() {
+	for (int i = 0; i < CLASSES; i++)
+	    while (count[i] > 0)
+		::free(blocks[i][--count[i]]);
+    }
+
+    unsigned char *get(int c) {
+	return (count[c] > 0) ? blocks[c][--count[c]] : 0;
+    }
+
+    bool put(int c, unsigned char *b) {
+	if (count[c] == MAX_FREE)
+	    return false;
+	blocks[c][count[c]++] = b;
+	return true;
+    }
+
+private:
+    unsigned char *blocks[CLASSES][MAX_FREE];
+    int count[CLASSES];
+};
+
+static thread_local blockPool pool;
+#endif
+
+int bufferStore::sizeClass(long len) {
+    int c = 0;
+    // -1 for blocks too large to be pooled
+    for (long l = MIN_LEN; l <= MAX_POOLED; l *= 2) {
+	if (l == len)
+	    return c;
+	c++;
+    }
+    return -1;
+}
+
+unsigned char *bufferStore::getBlock(long size) {
+#ifdef BUFFER_POOL
+    int c = sizeClass(size);
+    if (c >= 0) {
+	unsigned char *b = pool.get(c);
+	if (b)
+	    return b;
+    }
+#endif
+    unsigned char *b = (unsigned char *)malloc(size);
+    assert(b);
+    allocs.fetch_add(1, memory_order_relaxed);
+    return b;
+}
+
+void bufferStore::putBlock(unsigned char *b, long size) {
+#ifdef BUFFER_POOL
+    int c = sizeClass(size);
+    if ((c >= 0) && pool.put(c, b))
+	return;
+#endif
+    ::free(b);
+}
+
 bufferStore::bufferStore()
-    : len(0)
-    , lenAllocd(0)
-    , start(0)
-    , buff(0)
+    : len(HEADROOM)
+    , lenAllocd(INLINE_LEN)
+    , start(HEADROOM)
+    , buff(small)
 {
 }
 
 bufferStore::bufferStore(const bufferStore &a)
-    : start(0)
+    : len(HEADROOM)
+    , lenAllocd(INLINE_LEN)
+    , start(HEADROOM)
+    , buff(small)
 {
-    lenAllocd = (a.getLen() > MIN_LEN) ? a.getLen() : MIN_LEN;
-    buff = (unsigned char *)malloc(lenAllocd);
-    assert(buff);
-    len = a.getLen();
-    memcpy(buff, a.getString(0), len);
+    addBuff(a);
+}
+
+bufferStore::bufferStore(bufferStore &&a)
+    : len(HEADROOM)
+    , lenAllocd(INLINE_LEN)
+    , start(HEADROOM)
+    , buff(small)
+{
+    takeFrom(a);
 }
 
 bufferStore::bufferStore(const unsigned char *_buff, long _len)
-    : start(0)
+    : len(HEADROOM)
+    , lenAllocd(INLINE_LEN)
+    , start(HEADROOM)
+    , buff(small)
 {
-    lenAllocd = (_len > MIN_LEN) ? _len : MIN_LEN;
-    buff = (unsigned char *)malloc(lenAllocd);
-    assert(buff);
-    len = _len;
-    memcpy(buff, _buff, len);
+    addBytes(_buff, _len);
 }
 
 bufferStore &bufferStore::operator =(const bufferStore &a) {
     if (this != &a) {
-        checkAllocd(a.getLen());
-        len = a.getLen();
-        memcpy(buff, a.getString(0), len);
-        start = 0;
+        init();
+        addBuff(a);
     }
     return *this;
 }
 
+bufferStore &bufferStore::operator =(bufferStore &&a) {
+    if (this != &a) {
+        release();
+        takeFrom(a);
+    }
+    return *this;
+}
+
+void bufferStore::swap(bufferStore &a) {
+    bool inl = (buff == small);
+    bool aInl = (a.buff == a.small);
+
+    std::swap(len, a.len);
+    std::swap(lenAllocd, a.lenAllocd);
+    std::swap(start, a.start);
+    std::swap(buff, a.buff);
+    if (inl || aInl) {
+	unsigned char t[INLINE_LEN];
+	memcpy(t, small, INLINE_LEN);
+	memcpy(small, a.small, INLINE_LEN);
+	memcpy(a.small, t, INLINE_LEN);
+	if (aInl)
+	    buff = small;
+	if (inl)
+	    a.buff = a.small;
+    }
+}
+
+void bufferStore::takeFrom(bufferStore &a) {
+    // Short content is copied, a block on the heap changes hands.
+    // Copying all of the inline storage is cheaper than working out
+    // which part is used.
+    if (a.buff == a.small)
+	memcpy(small, a.small, INLINE_LEN);
+    else {
+	buff = a.buff;
+	lenAllocd = a.lenAllocd;
+    }
+    start = a.start;
+    len = a.len;
+    a.buff = a.small;
+    a.lenAllocd = INLINE_LEN;
+    a.start = a.len = HEADROOM;
+}
+
+void bufferStore::release() {
+    if (buff != small)
+	putBlock(buff, lenAllocd);
+    buff = small;
+    lenAllocd = INLINE_LEN;
+    start = len = HEADROOM;
+}
+
+unsigned long bufferStore::copiedBytes() {
+    return copied.load(memory_order_relaxed);
+}
+
+unsigned long bufferStore::allocations() {
+    return allocs.load(memory_order_relaxed);
+}
+
 void bufferStore::init() {
-    start = 0;
-    len = 0;
+    start = HEADROOM;
+    len = HEADROOM;
 }
 
 void bufferStore::init(const unsigned char *_buff, long _len) {
-    checkAllocd(_len);
-    start = 0;
-    len = _len;
-    memcpy(buff, _buff, len);
+    init();
+    addBytes(_buff, _len);
 }
 
 bufferStore::~bufferStore() {
-    if (buff)
-	::free(buff);
+    if (buff != small)
+	putBlock(buff, lenAllocd);
 }
 
 unsigned long bufferStore::getLen() const {
@@ -140,12 +281,27 @@ void bufferStore::discardFirstBytes(int n) {
 
 void bufferStore::checkAllocd(long newLen) {
     if (newLen >= lenAllocd) {
-	do {
-	    lenAllocd = (lenAllocd < MIN_LEN) ? MIN_LEN : (lenAllocd * 2);
-	} while (newLen >= lenAllocd);
-	assert(lenAllocd);
-	buff = (unsigned char *)realloc(buff, lenAllocd);
-	assert(buff);
+	long l = MIN_LEN;
+	while (newLen >= l)
+	    l *= 2;
+	unsigned char *nb = getBlock(l);
+	memcpy(nb + start, buff + start, len - start);
+	if (buff != small)
+	    putBlock(buff, lenAllocd);
+	buff = nb;
+	lenAllocd = l;
+    }
+}
+
+void bufferStore::makeHeadroom(long n) {
+    // Only if the headroom has been used up, e.g. by content
+    // written in front of the data read from a socket.
+    if (start < n) {
+	long shift = n - start + HEADROOM;
+	checkAllocd(len + shift);
+	memmove(buff + start + shift, buff + start, len - start);
+	start += shift;
+	len += shift;
     }
 }
 
@@ -159,6 +315,7 @@ void bufferStore::addString(const char *s) {
     checkAllocd(len + l);
     memcpy(&buff[len], s, l);
     len += l;
+    copied.fetch_add(l, memory_order_relaxed);
 }
 
 void bufferStore::addStringT(const char *s) {
@@ -170,6 +327,7 @@ void bufferStore::addBytes(const unsigned char *s, int l) {
     checkAllocd(len + l);
     memcpy(&buff[len], s, l);
     len += l;
+    copied.fetch_add(l, memory_order_relaxed);
 }
 
 void bufferStore::addBuff(const bufferStore &s, long maxLen) {
@@ -180,9 +338,16 @@ void bufferStore::addBuff(const bufferStore &s, long maxLen) {
     if (l > 0) {
 	memcpy(&buff[len], s.getString(0), l);
 	len += l;
+	copied.fetch_add(l, memory_order_relaxed);
     }
 }
 
+unsigned char *bufferStore::addSpace(long l) {
+    checkAllocd(len + l);
+    len += l;
+    return &buff[len - l];
+}
+
 void bufferStore::addWord(int a) {
     checkAllocd(len + 2);
     buff[len++] = a & 0xff;
@@ -198,20 +363,18 @@ void bufferStore::addDWord(long a) {
 }
 
 void bufferStore::truncate(long newLen) {
-    if (newLen < len)
-	len = newLen;
+    if (newLen < (long)getLen())
+	len = start + newLen;
 }
 
 void bufferStore::prependByte(unsigned char cc) {
-    checkAllocd(len + 1);
-    memmove(&buff[1], buff, len++);
-    buff[0] = cc;
+    makeHeadroom(1);
+    buff[--start] = cc;
 }
 
 void bufferStore::prependWord(int a) {
-    checkAllocd(len + 2);
-    memmove(&buff[2], buff, len);
-    len += 2;
-    buff[0] = a & 0xff;
-    buff[1] = (a>>8) & 0xff;
+    makeHeadroom(2);
+    start -= 2;
+    buff[start] = a & 0xff;
+    buff[start + 1] = (a>>8) & 0xff;
 }
@@ -31,6 +31,12 @@
  *
  * bufferStore provides an array of bytes which
  * can be accessed using various types.
+ *
+ * Short content is kept within the instance, longer content in a
+ * block on the heap. A few bytes in front of the content are kept
+ * free, so that protocol headers can be prepended without moving
+ * it. If configured with the buffer pool, freed blocks are kept by
+ * the thread for the next bufferStore needing one of the same size.
  */
 class bufferStore {
 public:
@@ -62,11 +68,45 @@ public:
     */
     bufferStore(const bufferStore &);
 
+    /**
+    * Constructs a new bufferStore, taking over the
+    * content of another one, which is left empty.
+    *
+    * @param b The bufferStore to take the content from.
+    */
+    bufferStore(bufferStore &&);
+
     /**
     * Copies a bufferStore.
     */
     bufferStore &operator =(const bufferStore &);
 
+    /**
+    * Takes over the content of another bufferStore,
+    * which is left empty, without copying it.
+    */
+    bufferStore &operator =(bufferStore &&);
+
+    /**
+    * Exchanges the content with that of another
+    * bufferStore, without copying it.
+    *
+    * @param b The bufferStore to exchange with.
+    */
+    void swap(bufferStore &b);
+
+    /**
+    * Retrieves the number of bytes copied into any
+    * bufferStore so far.
+    */
+    static unsigned long copiedBytes();
+
+    /**
+    * Retrieves the number of times any bufferStore
+    * has allocated or grown its memory so far.
+    */
+    static unsigned long allocations();
+
     /**
     * Retrieves the length of a bufferStore.
     *
@@ -214,6 +254,16 @@ public:
     *               whole content of @p b is appended.
     */
     void addBuff(const bufferStore &b, long maxLen = -1);
+    /**
+    * Appends space to the content of this instance, for the
+    * caller to fill in, e.g. by reading from a file descriptor.
+    *
+    * @param len Length of the space.
+    *
+    * @returns A pointer to the space. It is only valid until the
+    *          content is changed otherwise.
+    */
+    unsigned char *addSpace(long len);
 
     /**
     * Truncates the buffer.
@@ -225,6 +275,8 @@ public:
 
     /**
     * Prepends a byte to the content of this instance.
+    * This only moves the content, if the room in front
+    * of it has been used up.
     *
     * @param c The byte to append.
     */
@@ -239,13 +291,30 @@ public:
 
 private:
     void checkAllocd(long newLen);
-
+    void makeHeadroom(long n);
+    void takeFrom(bufferStore &b);
+    void release();
+    static int sizeClass(long len);
+    static unsigned char *getBlock(long size);
+    static void putBlock(unsigned char *b, long size);
+
+    enum c {
+	// Bytes kept free in front of new content, for prepending
+	HEADROOM = 8,
+	// Size of the storage within the instance, enough for most
+	// protocol messages
+	INLINE_LEN = 80,
+	// Smallest and largest block on the heap that is reused
+	MIN_LEN = 256,
+	MAX_POOLED = 32768
+    };
+
+    // Content is from buff[start] to buff[len - 1].
     long len;
     long lenAllocd;
     long start;
     unsigned char * buff;
-
-    enum c { MIN_LEN = 300 };
+    unsigned char small[INLINE_LEN];
 };
 
 inline bool bufferStore::empty() const {
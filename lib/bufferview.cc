@@ -0,0 +1,79 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include "bufferstore.h"
+#include "bufferview.h"
+
+using namespace std;
+
+bufferView::bufferView(const bufferStore &b)
+    : data((const unsigned char *)b.getString(0))
+    , len(b.getLen())
+{
+}
+
+bufferView bufferView::sub(long pos, long n) const {
+    if ((pos < 0) || (pos > len))
+	return bufferView();
+    if ((n < 0) || (n > len - pos))
+	n = len - pos;
+    return bufferView(data + pos, n);
+}
+
+void bufferCursor::seek(long newPos) {
+    if ((newPos < 0) || (newPos > len))
+	failed = true;
+    else
+	pos = newPos;
+}
+
+string bufferCursor::getString(long n) {
+    if (!need(n))
+	return string();
+    string s((const char *)data + pos, n);
+    pos += n;
+    return s;
+}
+
+const char *bufferCursor::getStringT(long &n) {
+    const void *z = memchr(data + pos, 0, len - pos);
+    if (!z) {
+	failed = true;
+	n = 0;
+	return NULL;
+    }
+    const char *s = (const char *)data + pos;
+    n = (const unsigned char *)z - (data + pos);
+    pos += n + 1;
+    return s;
+}
+
+string bufferCursor::getStringT() {
+    long n;
+    const char *s = getStringT(n);
+    return s ? string(s, n) : string();
+}
+
+bufferView bufferCursor::getView(long n) {
+    if (!need(n))
+	return bufferView();
+    bufferView v(data + pos, n);
+    pos += n;
+    return v;
+}
@@ -0,0 +1,236 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _BUFFERVIEW_H_
+#define _BUFFERVIEW_H_
+
+#include "config.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+class bufferStore;
+
+/**
+ * A read-only view of a range of bytes, e.g. of the content of a
+ * @ref bufferStore . It neither owns nor copies the bytes, so it
+ * is only valid as long as they are not changed.
+ */
+class bufferView {
+public:
+    /**
+    * Constructs an empty view.
+    */
+    bufferView() : data(0), len(0) {}
+
+    /**
+    * Constructs a view of some bytes.
+    *
+    * @param buf Pointer to the first byte.
+    * @param len Number of bytes.
+    */
+    bufferView(const unsigned char *buf, long _len) : data(buf), len(_len) {}
+
+    /**
+    * Constructs a view of the content of a bufferStore.
+    */
+    bufferView(const bufferStore &b);
+
+    /**
+    * Retrieves the number of bytes.
+    */
+    long getLen() const { return len; }
+
+    /**
+    * Tests if the view is empty.
+    */
+    bool empty() const { return len == 0; }
+
+    /**
+    * Retrieves a pointer to the bytes.
+    */
+    const unsigned char *getBytes() const { return data; }
+
+    /**
+    * Retrieves a part of the view.
+    *
+    * @param pos The index of the first byte of the part.
+    * @param n The number of bytes. If less than 0 or too large,
+    *          the part extends to the end of the view.
+    *
+    * @returns The part, empty if @p pos is beyond the end.
+    */
+    bufferView sub(long pos, long n = -1) const;
+
+private:
+    const unsigned char *data;
+    long len;
+};
+
+/**
+ * Reads little endian values one after the other from a
+ * @ref bufferView , as they come in responses of the Psion.
+ *
+ * Every read is checked against the end of the view. A read beyond
+ * it returns 0 or an empty string, leaves the position unchanged and
+ * marks the cursor as failed, so that a parser can check once, after
+ * reading a record, if the record was complete.
+ */
+class bufferCursor {
+public:
+    /**
+    * Constructs a cursor at the start of a view.
+    */
+    bufferCursor(const bufferView &v)
+	: data(v.getBytes()), len(v.getLen()), pos(0), failed(false) {}
+
+    /**
+    * Tests if all reads so far were within the view.
+    */
+    bool ok() const { return !failed; }
+
+    /**
+    * Retrieves the index of the next byte to read.
+    */
+    long tell() const { return pos; }
+
+    /**
+    * Retrieves the number of bytes left to read.
+    */
+    long remaining() const { return len - pos; }
+
+    /**
+    * Tests if all bytes have been read.
+    */
+    bool atEnd() const { return pos >= len; }
+
+    /**
+    * Moves to the byte at index @p newPos .
+    */
+    void seek(long newPos);
+
+    /**
+    * Skips @p n bytes.
+    */
+    void skip(long n) { if (need(n)) pos += n; }
+
+    /**
+    * Skips to the next index that is a multiple of @p n .
+    */
+    void align(long n) { skip((n - pos % n) % n); }
+
+    /**
+    * Reads a byte.
+    */
+    uint8_t getByte();
+
+    /**
+    * Reads a word.
+    */
+    uint16_t getWord();
+
+    /**
+    * Reads a dword.
+    */
+    uint32_t getDWord();
+
+    /**
+    * Reads a string of a given length.
+    *
+    * @param n The length in bytes.
+    */
+    std::string getString(long n);
+
+    /**
+    * Reads a 0 terminated string, including the terminator.
+    * Fails, if there is none.
+    *
+    * @returns The string, without the terminator.
+    */
+    std::string getStringT();
+
+    /**
+    * Reads a 0 terminated string, including the terminator,
+    * without copying it. Fails, if there is none.
+    *
+    * @param n Set to the length of the string, without the
+    *          terminator.
+    *
+    * @returns A pointer to the string, or NULL on failure.
+    */
+    const char *getStringT(long &n);
+
+    /**
+    * Reads some bytes, without copying them.
+    *
+    * @param n The number of bytes.
+    */
+    bufferView getView(long n);
+
+private:
+    bool need(long n) {
+	if ((n < 0) || (n > len - pos)) {
+	    failed = true;
+	    return false;
+	}
+	return true;
+    }
+
+    const unsigned char *data;
+    long len;
+    long pos;
+    bool failed;
+};
+
+inline uint8_t bufferCursor::getByte() {
+    if (!need(1))
+	return 0;
+    return data[pos++];
+}
+
+// On little endian hosts, values are copied with memcpy, which
+// compilers turn into a single load that may be unaligned.
+inline uint16_t bufferCursor::getWord() {
+    if (!need(2))
+	return 0;
+    const unsigned char *p = data + pos;
+    pos += 2;
+#ifdef WORDS_BIGENDIAN
+    return p[0] | (p[1] << 8);
+#else
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+#endif
+}
+
+inline uint32_t bufferCursor::getDWord() {
+    if (!need(4))
+	return 0;
+    const unsigned char *p = data + pos;
+    pos += 4;
+#ifdef WORDS_BIGENDIAN
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+#else
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+#endif
+}
+
+#endif
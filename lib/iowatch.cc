@@ -23,57 +23,96 @@
 #include "iowatch.h"
 
 #include <unistd.h>
-#include <stdio.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <memory.h>
+#include <fcntl.h>
+
+#include "ignore-value.h"
+
+using namespace std;
 
 IOWatch::IOWatch() {
-    num = 0;
-    io = new int [FD_SETSIZE];
-    memset(io, -1, FD_SETSIZE);
+    if (pipe(wakePipe) == 0) {
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+	addIO(wakePipe[0]);
+    } else
+	wakePipe[0] = wakePipe[1] = -1;
 }
 
 IOWatch::~IOWatch() {
-    delete [] io;
+    if (wakePipe[0] != -1) {
+	close(wakePipe[0]);
+	close(wakePipe[1]);
+    }
 }
 
 void IOWatch::addIO(const int fd) {
-    int pos;
-    for (pos = 0; pos < num && fd < io[pos]; pos++);
-    if (io[pos] == fd)
+    if (fd < 0)
+	return;
+    if (fd >= (int)slot.size())
+	slot.resize(fd + 1, -1);
+    if (slot[fd] != -1)
 	return;
-    for (int i = num; i > pos; i--)
-	io[i] = io[i-1];
-    io[pos] = fd;
-    num++;
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    slot[fd] = fds.size();
+    fds.push_back(p);
 }
 
 void IOWatch::remIO(const int fd) {
-    int pos;
-    for (pos = 0; pos < num && fd != io[pos]; pos++);
-    if (pos != num) {
-	num--;
-	for (int i = pos; i <num; i++) io[i] = io[i+1];
-    }
+    if ((fd < 0) || (fd >= (int)slot.size()) || (slot[fd] == -1))
+	return;
+    // Move the last entry into the gap. Its revents move along, so
+    // isReady() stays valid for the remaining descriptors.
+    int pos = slot[fd];
+    fds[pos] = fds.back();
+    slot[fds[pos].fd] = pos;
+    fds.pop_back();
+    slot[fd] = -1;
 }
 
 bool IOWatch::watch(const long secs, const long usecs) {
-    if (num > 0) {
-	int maxfd = 0;
-	fd_set iop;
-	FD_ZERO(&iop);
-	for (int i = 0; i < num; i++) {
-	    FD_SET(io[i], &iop);
-	    if (io[i] > maxfd)
-		maxfd = io[i];
+    if (fds.size() > 0) {
+	int timeout = secs * 1000 + (usecs + 999) / 1000;
+	int res = poll(&fds[0], fds.size(), timeout);
+	if (isReady(wakePipe[0])) {
+	    char dummy[16];
+	    while (read(wakePipe[0], dummy, sizeof(dummy)) > 0)
+		;
 	}
-	struct timeval t;
-	t.tv_usec = usecs;
-	t.tv_sec = secs;
-	return (select(maxfd+1, &iop, NULL, NULL, &t) > 0);
+	return (res > 0);
     }
     sleep(secs);
     usleep(usecs);
     return false;
 }
+
+bool IOWatch::isReady(const int fd) const {
+    if ((fd < 0) || (fd >= (int)slot.size()) || (slot[fd] == -1))
+	return false;
+    return (fds[slot[fd]].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
+void IOWatch::watchWrite(const int fd, const bool on) {
+    if ((fd < 0) || (fd >= (int)slot.size()) || (slot[fd] == -1))
+	return;
+    if (on)
+	fds[slot[fd]].events |= POLLOUT;
+    else
+	fds[slot[fd]].events &= ~POLLOUT;
+}
+
+bool IOWatch::isWritable(const int fd) const {
+    if ((fd < 0) || (fd >= (int)slot.size()) || (slot[fd] == -1))
+	return false;
+    return (fds[slot[fd]].revents & POLLOUT) != 0;
+}
+
+void IOWatch::wakeup() {
+    if (wakePipe[1] != -1) {
+	// If the pipe is full, a wakeup is pending anyway.
+	char c = 0;
+	ignore_value(write(wakePipe[1], &c, 1));
+    }
+}
@@ -21,14 +21,20 @@
 #ifndef _IOWATCH_H_
 #define _IOWATCH_H_
 
+#include <vector>
+#include <poll.h>
+
 /**
- * A simple wrapper for select()
+ * A simple wrapper for poll()
  *
- * IOWatch is a simple wrapper for the select
- * system call. In particular, it takes care
- * of passing the maximum file descriptor
- * argument (arg 1) of select() correctly.
- * IOWatch handles select on read descriptors only.
+ * IOWatch keeps a set of file descriptors and waits
+ * for any of them to become readable. The set is
+ * maintained incrementally, so that waiting does not
+ * depend on the number of descriptors being watched.
+ * After @ref watch returned, @ref isReady tells which of
+ * the descriptors actually are readable.
+ * Descriptors can additionally be watched for writability,
+ * and another thread can interrupt a running @ref watch.
  */
 class IOWatch {
 public:
@@ -59,7 +65,7 @@ public:
     void remIO(const int fd);
 
     /**
-    * Performs a select() call.
+    * Performs a poll() call.
     *
     * @param secs Number of seconds to wait.
     * @param usecs Number of microseconds to wait.
@@ -69,9 +75,47 @@ public:
     */
     bool watch(const long secs, const long usecs);
 
+    /**
+    * Checks the result of the last @ref watch call.
+    *
+    * @param fd The file descriptor to check.
+    *
+    * @return true, if the descriptor was found readable
+    * 	(or closed by the peer) by the last call to @ref watch.
+    */
+    bool isReady(const int fd) const;
+
+    /**
+    * Enables or disables watching a descriptor
+    * for writability. The descriptor must have been
+    * added by @ref addIO before.
+    *
+    * @param fd The file descriptor.
+    * @param on true, if @ref watch should return when the
+    * 	descriptor becomes writable.
+    */
+    void watchWrite(const int fd, const bool on);
+
+    /**
+    * Checks the result of the last @ref watch call.
+    *
+    * @param fd The file descriptor to check.
+    *
+    * @return true, if the descriptor was found writable.
+    */
+    bool isWritable(const int fd) const;
+
+    /**
+    * Makes a running or the next call to @ref watch
+    * return immediately. This may be called from
+    * any thread.
+    */
+    void wakeup();
+
 private:
-    int num;
-    int *io;
+    std::vector<struct pollfd> fds;
+    std::vector<int> slot;
+    int wakePipe[2];
 };
 
 #endif
@@ -0,0 +1,334 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _MSGSCHEMA_H_
+#define _MSGSCHEMA_H_
+
+#include "config.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "bufferstore.h"
+#include "bufferview.h"
+
+/**
+ * @file
+ * Layouts of the messages exchanged with the servers of the Psion.
+ *
+ * A command declares the fields of its request and response once, as
+ * a @ref msgLayout of the field types below, e.g.
+ *
+ * <pre>
+ * typedef msgCommand<OPEN_FILE,
+ *                    msgLayout<msgDWord, msgStringW>,
+ *                    msgLayout<msgDWord> > openFile;
+ * </pre>
+ *
+ * openFile::request::encode(a, attr, name) then appends exactly the
+ * bytes of the request to a, growing it once, and
+ * openFile::response::decode(a, handle) reads the response with a
+ * @ref bufferCursor , without copying it.
+ *
+ * Each field type has the number of bytes it takes at least as
+ * fixedLen, and size(), put() and get() for its value.
+ */
+
+/**
+ * A byte.
+ */
+struct msgByte {
+    enum { fixedLen = 1 };
+    template <typename T> static long size(const T &) { return 1; }
+    template <typename T> static unsigned char *put(unsigned char *p, const T &v) {
+	p[0] = (uint32_t)v & 0xff;
+	return p + 1;
+    }
+    template <typename T> static void get(bufferCursor &c, T &v) {
+	v = (T)c.getByte();
+    }
+};
+
+/**
+ * A little endian word.
+ */
+struct msgWord {
+    enum { fixedLen = 2 };
+    template <typename T> static long size(const T &) { return 2; }
+    template <typename T> static unsigned char *put(unsigned char *p, const T &v) {
+	uint32_t w = v;
+	p[0] = w & 0xff;
+	p[1] = (w >> 8) & 0xff;
+	return p + 2;
+    }
+    template <typename T> static void get(bufferCursor &c, T &v) {
+	v = (T)c.getWord();
+    }
+};
+
+/**
+ * A little endian dword.
+ */
+struct msgDWord {
+    enum { fixedLen = 4 };
+    template <typename T> static long size(const T &) { return 4; }
+    template <typename T> static unsigned char *put(unsigned char *p, const T &v) {
+	uint32_t d = v;
+	p[0] = d & 0xff;
+	p[1] = (d >> 8) & 0xff;
+	p[2] = (d >> 16) & 0xff;
+	p[3] = (d >> 24) & 0xff;
+	return p + 4;
+    }
+    template <typename T> static void get(bufferCursor &c, T &v) {
+	v = (T)c.getDWord();
+    }
+};
+
+/**
+ * A 64 bit value, as two dwords, the low one first.
+ */
+struct msgQWord {
+    enum { fixedLen = 8 };
+    static long size(uint64_t) { return 8; }
+    static unsigned char *put(unsigned char *p, uint64_t v) {
+	p = msgDWord::put(p, (uint32_t)(v & 0xffffffff));
+	return msgDWord::put(p, (uint32_t)(v >> 32));
+    }
+    template <typename T> static void get(bufferCursor &c, T &v) {
+	uint64_t lo = c.getDWord();
+	v = lo | ((uint64_t)c.getDWord() << 32);
+    }
+};
+
+/**
+ * A string, preceded by its length as a word or, with @p L of
+ * @ref msgDWord , as a dword.
+ */
+template <typename L>
+struct msgStringL {
+    enum { fixedLen = L::fixedLen };
+    static long size(const std::string &s) { return fixedLen + s.size(); }
+    static unsigned char *put(unsigned char *p, const std::string &s) {
+	p = L::put(p, s.size());
+	memcpy(p, s.data(), s.size());
+	return p + s.size();
+    }
+    static void get(bufferCursor &c, std::string &s) {
+	long n;
+	L::get(c, n);
+	s = c.getString(n);
+    }
+    static void get(bufferCursor &c, bufferView &v) {
+	long n;
+	L::get(c, n);
+	v = c.getView(n);
+    }
+};
+
+typedef msgStringL<msgWord> msgStringW;
+typedef msgStringL<msgDWord> msgStringD;
+
+/**
+ * A 0 terminated string, filled up with 0 to at least @p N bytes.
+ */
+template <long N>
+struct msgStringTPad {
+    enum { fixedLen = N ? N : 1 };
+    static long size(const char *s) {
+	long n = strlen(s) + 1;
+	return (n < N) ? N : n;
+    }
+    static long size(const std::string &s) { return size(s.c_str()); }
+    static unsigned char *put(unsigned char *p, const char *s) {
+	long n = strlen(s) + 1;
+	memcpy(p, s, n);
+	if (n < N) {
+	    memset(p + n, 0, N - n);
+	    n = N;
+	}
+	return p + n;
+    }
+    static unsigned char *put(unsigned char *p, const std::string &s) {
+	return put(p, s.c_str());
+    }
+    static void get(bufferCursor &c, std::string &s) {
+	long start = c.tell();
+	s = c.getStringT();
+	if (c.tell() - start < N)
+	    c.skip(N - (c.tell() - start));
+    }
+    static void get(bufferCursor &c, const char *&s) {
+	long start = c.tell();
+	long n;
+	s = c.getStringT(n);
+	if (c.tell() - start < N)
+	    c.skip(N - (c.tell() - start));
+    }
+};
+
+typedef msgStringTPad<0> msgStringT;
+
+/**
+ * A string of @p N bytes, read into a char array of more than @p N
+ * elements and terminated there.
+ */
+template <long N>
+struct msgChars {
+    enum { fixedLen = N };
+    template <long M> static void get(bufferCursor &c, char (&v)[M]) {
+	static_assert(M > N, "no room for the terminator");
+	bufferView b = c.getView(N);
+	memcpy(v, b.getBytes(), b.getLen());
+	v[b.getLen()] = '\0';
+    }
+};
+
+/**
+ * @p N bytes without a meaning known or needed. They take no value;
+ * put() writes 0 and get() skips them.
+ */
+template <long N>
+struct msgSkip {
+    enum { fixedLen = N };
+};
+
+/**
+ * The bytes up to the end of the message, e.g. file data. This must
+ * be the last field.
+ */
+struct msgBytes {
+    enum { fixedLen = 0 };
+    static long size(const bufferView &v) { return v.getLen(); }
+    static unsigned char *put(unsigned char *p, const bufferView &v) {
+	memcpy(p, v.getBytes(), v.getLen());
+	return p + v.getLen();
+    }
+    static void get(bufferCursor &c, bufferView &v) {
+	v = c.getView(c.remaining());
+    }
+};
+
+/**
+ * The fields of a message, one value for each field except
+ * @ref msgSkip .
+ * @internal
+ */
+template <typename... F>
+struct msgFields;
+
+template <>
+struct msgFields<> {
+    enum { fixedLen = 0 };
+    static long size() { return 0; }
+    static unsigned char *put(unsigned char *p) { return p; }
+    static void get(bufferCursor &) {}
+};
+
+template <typename F, typename... R>
+struct msgFields<F, R...> {
+    typedef msgFields<R...> rest;
+    enum { fixedLen = F::fixedLen + rest::fixedLen };
+
+    template <typename A, typename... As>
+    static long size(const A &a, const As &... as) {
+	return F::size(a) + rest::size(as...);
+    }
+    template <typename A, typename... As>
+    static unsigned char *put(unsigned char *p, const A &a, const As &... as) {
+	return rest::put(F::put(p, a), as...);
+    }
+    template <typename A, typename... As>
+    static void get(bufferCursor &c, A &a, As &... as) {
+	F::get(c, a);
+	rest::get(c, as...);
+    }
+};
+
+template <long N, typename... R>
+struct msgFields<msgSkip<N>, R...> {
+    typedef msgFields<R...> rest;
+    enum { fixedLen = N + rest::fixedLen };
+
+    template <typename... As>
+    static long size(const As &... as) {
+	return N + rest::size(as...);
+    }
+    template <typename... As>
+    static unsigned char *put(unsigned char *p, const As &... as) {
+	memset(p, 0, N);
+	return rest::put(p + N, as...);
+    }
+    template <typename... As>
+    static void get(bufferCursor &c, As &... as) {
+	c.skip(N);
+	rest::get(c, as...);
+    }
+};
+
+/**
+ * The layout of a request or response.
+ */
+template <typename... F>
+struct msgLayout : public msgFields<F...> {
+    typedef msgFields<F...> fields;
+
+    /**
+    * Appends a message to a bufferStore. The bufferStore is grown
+    * once, by the exact size of the message.
+    *
+    * @param b The bufferStore.
+    * @param as The values of the fields.
+    */
+    template <typename... As>
+    static void encode(bufferStore &b, const As &... as) {
+	fields::put(b.addSpace(fields::size(as...)), as...);
+    }
+
+    /**
+    * Reads the fields of a message. Bytes behind the last field
+    * are ignored.
+    *
+    * @param v The message.
+    * @param as The values of the fields are returned here.
+    *
+    * @returns false, if the message is too short.
+    */
+    template <typename... As>
+    static bool decode(const bufferView &v, As &... as) {
+	bufferCursor c(v);
+	fields::get(c, as...);
+	return c.ok();
+    }
+};
+
+/**
+ * A command of a server on the Psion.
+ *
+ * @param Code The command code.
+ * @param Request The @ref msgLayout of the request.
+ * @param Response The @ref msgLayout of the response.
+ */
+template <int Code, typename Request, typename Response = msgLayout<> >
+struct msgCommand {
+    enum { code = Code };
+    typedef Request request;
+    typedef Response response;
+};
+
+#endif
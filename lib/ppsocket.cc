@@ -36,6 +36,9 @@
 #include <ctype.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -48,14 +51,45 @@
 
 using namespace std;
 
+// The path of a name of the form unix:PATH, NULL for any other name
+static const char *
+unixPath(const char *name)
+{
+    if (name && !strncmp(name, "unix:", 5))
+	return name + 5;
+    return NULL;
+}
+
+static socklen_t
+addrLen(const struct sockaddr_storage &a)
+{
+    if (a.ss_family == AF_UNIX)
+	return sizeof(struct sockaddr_un);
+    return sizeof(struct sockaddr_in);
+}
+
+static string
+unixName(const struct sockaddr_storage &a)
+{
+    const struct sockaddr_un *u = (const struct sockaddr_un *)&a;
+
+    if ((a.ss_family != AF_UNIX) || !u->sun_path[0])
+	return "none";
+    return string("unix:") + u->sun_path;
+}
+
 ppsocket::ppsocket(const ppsocket & another)
 {
     m_Socket = another.m_Socket;
     m_HostAddr = another.m_HostAddr;
     m_PeerAddr = another.m_PeerAddr;
+    m_Family = another.m_Family;
+    // Only the listening socket itself removes its node.
+    m_Unlink = false;
     m_Bound = another.m_Bound;
     m_LastError = another.m_LastError;
     myWatch = another.myWatch;
+    m_RxPos = m_RxLen = 0;
 }
 
 
@@ -69,9 +103,12 @@ ppsocket::ppsocket()
     ((struct sockaddr_in *) &m_HostAddr)->sin_family = AF_INET;
     ((struct sockaddr_in *) &m_PeerAddr)->sin_family = AF_INET;
 
+    m_Family = AF_INET;
+    m_Unlink = false;
     m_Bound = false;
     m_LastError = 0;
     myWatch = 0L;
+    m_RxPos = m_RxLen = 0;
 }
 
 ppsocket::~ppsocket()
@@ -82,14 +119,18 @@ ppsocket::~ppsocket()
 	shutdown(m_Socket, SHUT_RDWR);
 	::close(m_Socket);
     }
+    if (m_Unlink)
+	unlink(((struct sockaddr_un *)&m_HostAddr)->sun_path);
 }
 
 void ppsocket::
 setWatch(IOWatch *watch) {
-    if (watch) {
+    if (watch && (watch != myWatch)) {
 	if (myWatch && (m_Socket != INVALID_SOCKET))
 	   myWatch->remIO(m_Socket);
 	myWatch = watch;
+	if (m_Socket != INVALID_SOCKET)
+	    myWatch->addIO(m_Socket);
     }
 }
 
@@ -107,11 +148,14 @@ reconnect()
 	return (false);
     m_LastError = 0;
     m_Bound = false;
-    if (::bind(m_Socket, &m_HostAddr, sizeof(m_HostAddr)) != 0) {
+    if ((m_Family != AF_UNIX) &&
+	(::bind(m_Socket, (struct sockaddr *)&m_HostAddr,
+		addrLen(m_HostAddr)) != 0)) {
 	m_LastError = errno;
 	return (false);
     }
-    if (::connect(m_Socket, &m_PeerAddr, sizeof(m_PeerAddr)) != 0) {
+    if (::connect(m_Socket, (struct sockaddr *)&m_PeerAddr,
+		  addrLen(m_PeerAddr)) != 0) {
 	m_LastError = errno;
 	return (false);
     }
@@ -128,6 +172,8 @@ toString()
     char *tmp = 0L;
     int port;
 
+    if (m_Family == AF_UNIX)
+	return unixName(m_HostAddr) + " -> " + unixName(m_PeerAddr);
     tmp = inet_ntoa(((struct sockaddr_in *) &m_HostAddr)->sin_addr);
     ret += tmp ? tmp : "none:none";
     if (tmp) {
@@ -149,25 +195,36 @@ toString()
 bool ppsocket::
 connect(const char * const Peer, int PeerPort, const char * const Host, int HostPort)
 {
-    //****************************************************
-    //* If we aren't already bound set the host and bind *
-    //****************************************************
+    const char *path = unixPath(Peer);
+
+    if (path) {
+	//*********************************************
+	//* A Unix domain socket needs no local name *
+	//*********************************************
+	if (!setUnix(&m_PeerAddr, path) || !createSocket())
+	    return (false);
+    } else {
+	//****************************************************
+	//* If we aren't already bound set the host and bind *
+	//****************************************************
 
-    if (!bindSocket(Host, HostPort)) {
-	if (m_LastError != 0) {
+	if (!bindSocket(Host, HostPort)) {
+	    if (m_LastError != 0) {
+		return (false);
+	    }
+	}
+	//****************
+	//* Set the peer *
+	//****************
+	if (!setPeer(Peer, PeerPort)) {
 	    return (false);
 	}
     }
-    //****************
-    //* Set the peer *
-    //****************
-    if (!setPeer(Peer, PeerPort)) {
-	return (false);
-    }
     //***********
     //* Connect *
     //***********
-    if (::connect(m_Socket, &m_PeerAddr, sizeof(m_PeerAddr)) != 0) {
+    if (::connect(m_Socket, (struct sockaddr *)&m_PeerAddr,
+		  addrLen(m_PeerAddr)) != 0) {
 	m_LastError = errno;
 	return (false);
     }
@@ -179,13 +236,20 @@ connect(const char * const Peer, int PeerPort, const char * const Host, int Host
 bool ppsocket::
 listen(const char * const Host, int Port)
 {
-    //****************************************************
-    //* If we aren't already bound set the host and bind *
-    //****************************************************
+    const char *path = unixPath(Host);
 
-    if (!bindSocket(Host, Port)) {
-	if (m_LastError != 0) {
+    if (path) {
+	if (!bindUnix(path))
 	    return (false);
+    } else {
+	//****************************************************
+	//* If we aren't already bound set the host and bind *
+	//****************************************************
+
+	if (!bindSocket(Host, Port)) {
+	    if (m_LastError != 0) {
+		return (false);
+	    }
 	}
     }
     //**********************
@@ -223,8 +287,10 @@ accept(string *Peer, IOWatch *iow)
     //* Accept a connection *
     //***********************
 
-    len = sizeof(struct sockaddr);
-    accepted->m_Socket = ::accept(m_Socket, &accepted->m_PeerAddr, &len);
+    len = sizeof(accepted->m_PeerAddr);
+    accepted->m_Socket = ::accept(m_Socket,
+				  (struct sockaddr *)&accepted->m_PeerAddr,
+				  &len);
 
     if (accepted->m_Socket == INVALID_SOCKET) {
 	m_LastError = errno;
@@ -242,12 +308,30 @@ accept(string *Peer, IOWatch *iow)
     fcntl(accepted->m_Socket, F_SETFL, flags);
 
     accepted->m_HostAddr = m_HostAddr;
+    accepted->m_Family = m_Family;
     accepted->m_Bound = true;
 
     //****************************************************
     //* If required get the name of the connected client *
     //****************************************************
-    if (Peer) {
+    if (Peer && (m_Family == AF_UNIX)) {
+	// Unix domain clients are nameless, the process is what counts.
+	uid_t uid;
+	gid_t gid;
+	pid_t pid;
+	char buf[64];
+
+	if (!accepted->getPeerCred(&uid, &gid, &pid))
+	    *Peer = "local";
+	else {
+	    if (pid == -1)
+		snprintf(buf, sizeof(buf), "local uid %ld", (long)uid);
+	    else
+		snprintf(buf, sizeof(buf), "local pid %ld uid %ld",
+			 (long)pid, (long)uid);
+	    *Peer = buf;
+	}
+    } else if (Peer) {
 	peer = inet_ntoa(((struct sockaddr_in *) &accepted->m_PeerAddr)->sin_addr);
 	if (peer)
 	    *Peer = peer;
@@ -262,6 +346,8 @@ accept(string *Peer, IOWatch *iow)
 bool ppsocket::
 dataToGet(int sec, int usec) const
 {
+    if (hasBuffered())
+	return true;
     fd_set io;
     FD_ZERO(&io);
     FD_SET(m_Socket, &io);
@@ -271,6 +357,27 @@ dataToGet(int sec, int usec) const
     return (select(m_Socket + 1, &io, NULL, NULL, &t) != 0) ? true : false;
 }
 
+bool ppsocket::
+isReady() const
+{
+    return myWatch && (m_Socket != INVALID_SOCKET) &&
+	(hasBuffered() || myWatch->isReady(m_Socket));
+}
+
+bool ppsocket::
+isWritable() const
+{
+    return myWatch && (m_Socket != INVALID_SOCKET) &&
+	myWatch->isWritable(m_Socket);
+}
+
+void ppsocket::
+watchWrite(bool on)
+{
+    if (myWatch && (m_Socket != INVALID_SOCKET))
+	myWatch->watchWrite(m_Socket, on);
+}
+
 int ppsocket::
 getBufferStore(bufferStore & a, bool wait)
 {
@@ -279,61 +386,105 @@ getBufferStore(bufferStore & a, bool wait)
     */
 
     uint32_t l;
-    long count = 0;
-    unsigned char *buff;
-    unsigned char *bp;
     if (!wait && !dataToGet(0, 0))
 	return 0;
     a.init();
-    if (recv(&l, sizeof(l), MSG_NOSIGNAL) != sizeof(l)) {
+    if (!fillRx(sizeof(l)))
 	return -1;
-    }
+    memcpy(&l, m_RxBuf + m_RxPos, sizeof(l));
+    m_RxPos += sizeof(l);
     l = ntohl(l);
     if (l > 16384)
 	    return -1;
-    bp = buff = new unsigned char[l];
-    while (l > 0) {
-	int j = recv(bp, l, MSG_NOSIGNAL);
-	if (j == SOCKET_ERROR || j == 0) {
-	    delete[]buff;
-	    return -1;
+    // What was read ahead, then the rest straight into the buffer
+    uint32_t n = m_RxLen - m_RxPos;
+    if (n > l)
+	n = l;
+    a.addBytes(m_RxBuf + m_RxPos, n);
+    m_RxPos += n;
+    if (m_RxPos == m_RxLen)
+	m_RxPos = m_RxLen = 0;
+    if (l > n) {
+	unsigned char *bp = a.addSpace(l - n);
+	l -= n;
+	while (l > 0) {
+	    int j = recv(bp, l, MSG_NOSIGNAL);
+	    if (j == SOCKET_ERROR || j == 0) {
+		a.init();
+		return -1;
+	    }
+	    l -= j;
+	    bp += j;
 	}
-	count += j;
-	l -= j;
-	bp += j;
-    };
-    a.init(buff, count);
-    delete[]buff;
+    }
     return (a.getLen() == 0) ? 0 : 1;
 }
 
 bool ppsocket::
-sendBufferStore(const bufferStore & a)
+fillRx(int len)
 {
-    long l = a.getLen();
-    uint32_t hl = htonl(l);
-    long sent = 0;
-    int retries = 0;
-    int i;
+    // Make room behind the buffered data, and read whatever is
+    // there, until at least len bytes are buffered.
+    if (m_RxPos > 0) {
+	memmove(m_RxBuf, m_RxBuf + m_RxPos, m_RxLen - m_RxPos);
+	m_RxLen -= m_RxPos;
+	m_RxPos = 0;
+    }
+    while (m_RxLen < len) {
+	int j = recv(m_RxBuf + m_RxLen, RX_SIZE - m_RxLen, MSG_NOSIGNAL);
+	if (j == SOCKET_ERROR || j == 0)
+	    return false;
+	m_RxLen += j;
+    }
+    return true;
+}
 
-    bufferStore b;
-    b.addBytes(reinterpret_cast<const unsigned char *>(&hl), sizeof(hl));
-    b.addBuff(a);
-    l += 4;
-    while (l > 0) {
-	i = send((const char *)b.getString(sent), l, MSG_NOSIGNAL);
-	if (i == SOCKET_ERROR || i == 0)
-	    return (false);
-	sent += i;
-	l -= i;
-	if (++retries > 5) {
-	    m_LastError = 0;
-	    return (false);
+bool ppsocket::
+sendBufferStore(const bufferStore & a)
+{
+    uint32_t hl = htonl(a.getLen());
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = &hl;
+    iov[0].iov_len = sizeof(hl);
+    iov[1].iov_base = (void *)a.getString(0);
+    iov[1].iov_len = a.getLen();
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (msg.msg_iovlen > 0) {
+	ssize_t i = sendmsg(m_Socket, &msg, MSG_NOSIGNAL);
+	if ((i < 0) && (errno == EINTR))
+	    continue;
+	if (i <= 0) {
+	    m_LastError = (i < 0) ? errno : 0;
+	    return false;
+	}
+	// Skip what has been sent, if it was not all.
+	while ((msg.msg_iovlen > 0) && ((size_t)i >= msg.msg_iov->iov_len)) {
+	    i -= msg.msg_iov->iov_len;
+	    msg.msg_iov++;
+	    msg.msg_iovlen--;
+	}
+	if (msg.msg_iovlen > 0) {
+	    msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + i;
+	    msg.msg_iov->iov_len -= i;
 	}
     }
     return true;
 }
 
+int ppsocket::
+sendNoWait(const void *buf, int len)
+{
+    int i = send(buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if ((i < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+	return 0;
+    return i;
+}
+
 int ppsocket::
 recv(void *buf, int len, int flags)
 {
@@ -367,6 +518,10 @@ closeSocket(void)
 	return false;
     }
     m_Socket = INVALID_SOCKET;
+    if (m_Unlink) {
+	unlink(((struct sockaddr_un *)&m_HostAddr)->sun_path);
+	m_Unlink = false;
+    }
     return true;
 }
 
@@ -398,7 +553,8 @@ bindSocket(const char * const Host, int Port)
 	return false;
 
     // Now bind the socket
-    if (::bind(m_Socket, &m_HostAddr, sizeof(m_HostAddr)) != 0) {
+    if (::bind(m_Socket, (struct sockaddr *)&m_HostAddr,
+	       addrLen(m_HostAddr)) != 0) {
 	m_LastError = errno;
 	return false;
     }
@@ -407,6 +563,39 @@ bindSocket(const char * const Host, int Port)
     return true;
 }
 
+bool ppsocket::
+bindUnix(const char *Path)
+{
+    struct stat st;
+
+    // If we are already bound return false but with no last error
+    if (m_Bound) {
+	m_LastError = 0;
+	return false;
+    }
+    if (!setUnix(&m_HostAddr, Path) || !createSocket())
+	return false;
+
+    // A socket nobody accepts on any more is left over from a
+    // previous run and is replaced. Anything else stays.
+    if ((lstat(Path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+	ppsocket probe;
+	string name = string("unix:") + Path;
+	if (!probe.connect(name.c_str(), 0) &&
+	    (probe.m_LastError == ECONNREFUSED))
+	    unlink(Path);
+    }
+
+    if (::bind(m_Socket, (struct sockaddr *)&m_HostAddr,
+	       addrLen(m_HostAddr)) != 0) {
+	m_LastError = errno;
+	return false;
+    }
+    m_Bound = true;
+    m_Unlink = true;
+    return true;
+}
+
 bool ppsocket::
 bindInRange(const char * const Host, int Low, int High, int Retries)
 {
@@ -431,7 +620,8 @@ bindInRange(const char * const Host, int Low, int High, int Retries)
 	for (port = Low; port <= High; port++) {
 	    if (!setHost(Host, port))
 		return false;
-	    if (::bind(m_Socket, &m_HostAddr, sizeof(m_HostAddr)) == 0)
+	    if (::bind(m_Socket, (struct sockaddr *)&m_HostAddr,
+		       addrLen(m_HostAddr)) == 0)
 		break;
 	}
 	if (port > High) {
@@ -443,7 +633,8 @@ bindInRange(const char * const Host, int Low, int High, int Retries)
 	    port = Low + (rand() % (High - Low));
 	    if (!setHost(Host, port))
 		return false;
-	    if (::bind(m_Socket, &m_HostAddr, sizeof(m_HostAddr)) == 0)
+	    if (::bind(m_Socket, (struct sockaddr *)&m_HostAddr,
+		       addrLen(m_HostAddr)) == 0)
 		break;
 	}
 	if (i >= Retries) {
@@ -492,7 +683,8 @@ createSocket(void)
 	return true;
 
     // Create the socket
-    m_Socket = ::socket(PF_INET, SOCK_STREAM, 0);
+    m_Socket = ::socket((m_Family == AF_UNIX) ? PF_UNIX : PF_INET,
+			SOCK_STREAM, 0);
     if (m_Socket == INVALID_SOCKET) {
 	m_LastError = errno;
 	return false;
@@ -543,6 +735,13 @@ getPeer(string *Peer, int *Port)
 {
     char *peer;
 
+    if (m_Family == AF_UNIX) {
+	if (Peer)
+	    *Peer = unixName(m_PeerAddr);
+	if (Port)
+	    *Port = 0;
+	return true;
+    }
     if (Peer) {
 	peer = inet_ntoa(((struct sockaddr_in *) &m_PeerAddr)->sin_addr);
 	if (!peer) {
@@ -596,6 +795,13 @@ getHost(string *Host, int *Port)
 {
     char *host;
 
+    if (m_Family == AF_UNIX) {
+	if (Host)
+	    *Host = unixName(m_HostAddr);
+	if (Port)
+	    *Port = 0;
+	return true;
+    }
     if (Host) {
 	host = inet_ntoa(((struct sockaddr_in *)&m_HostAddr)->sin_addr);
 	if (!host) {
@@ -608,3 +814,68 @@ getHost(string *Host, int *Port)
 	*Port = ntohs(((struct sockaddr_in *)&m_HostAddr)->sin_port);
     return true;
 }
+
+bool ppsocket::
+setUnix(struct sockaddr_storage *Addr, const char *Path)
+{
+    struct sockaddr_un *a = (struct sockaddr_un *)Addr;
+
+    if (strlen(Path) >= sizeof(a->sun_path)) {
+	m_LastError = errno = ENAMETOOLONG;
+	return false;
+    }
+    memset(Addr, 0, sizeof(*Addr));
+    a->sun_family = AF_UNIX;
+    strcpy(a->sun_path, Path);
+    m_Family = AF_UNIX;
+    return true;
+}
+
+bool ppsocket::
+getPeerCred(uid_t *Uid, gid_t *Gid, pid_t *Pid)
+{
+    if ((m_Family != AF_UNIX) || (m_Socket == INVALID_SOCKET)) {
+	m_LastError = EINVAL;
+	return false;
+    }
+#if defined(SO_PEERCRED) && defined(__linux__)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(m_Socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+	m_LastError = errno;
+	return false;
+    }
+    if (Uid)
+	*Uid = cred.uid;
+    if (Gid)
+	*Gid = cred.gid;
+    if (Pid)
+	*Pid = cred.pid;
+    return true;
+#elif defined(HAVE_GETPEEREID)
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(m_Socket, &uid, &gid) != 0) {
+	m_LastError = errno;
+	return false;
+    }
+    if (Uid)
+	*Uid = uid;
+    if (Gid)
+	*Gid = gid;
+    if (Pid)
+	*Pid = -1;
+    return true;
+#else
+    m_LastError = ENOSYS;
+    return false;
+#endif
+}
+
+bool ppsocket::
+isLocal() const
+{
+    return m_Family == AF_UNIX;
+}
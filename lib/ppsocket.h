@@ -33,6 +33,10 @@ class IOWatch;
 
 /**
  * A class for dealing with sockets.
+ *
+ * Wherever a host is given, a name of the form unix:PATH selects
+ * the Unix domain stream socket at PATH instead, and the port is
+ * ignored.
  */
 class ppsocket
 {
@@ -56,7 +60,8 @@ public:
     /**
     * Connects to a given host.
     *
-    * @param Peer     The Host to connect to (name or dotquad-string).
+    * @param Peer     The Host to connect to (name, dotquad-string
+    *                 or unix:PATH).
     * @param PeerPort The port to connect to.
     * @param Host     The local address to bind to.
     * @param HostPort The local port to bind to.
@@ -82,9 +87,11 @@ public:
     virtual std::string toString();
 
     /**
-    * Starts listening.
+    * Starts listening. A Unix domain socket left behind by a
+    * process that is gone is replaced, and the socket is removed
+    * again by @ref closeSocket.
     *
-    * @param Host The local address to bind to.
+    * @param Host The local address to bind to, or unix:PATH.
     * @param Port The local port to listen on.
     *
     * @returns true on success, false otherwise.
@@ -102,7 +109,8 @@ public:
     ppsocket *accept(std::string *Peer, IOWatch *);
 
     /**
-    * Check and optionally wait for incoming data.
+    * Check and optionally wait for incoming data. Data already
+    * read ahead by @ref getBufferStore counts as well.
     *
     * @param sec Timeout in seconds
     * @param usec Timeout in microseconds
@@ -111,9 +119,47 @@ public:
     */
     bool dataToGet(int sec, int usec) const;
 
+    /**
+    * Check for data read ahead by @ref getBufferStore, which
+    * @ref IOWatch does not know about.
+    *
+    * @returns true if data is buffered, false otherwise.
+    */
+    bool hasBuffered() const { return m_RxPos < m_RxLen; }
+
+    /**
+    * Check the result of the last @ref IOWatch::watch call
+    * on the registered IOWatch.
+    *
+    * @returns true if the socket was found readable, false otherwise.
+    */
+    bool isReady() const;
+
+    /**
+    * Check the result of the last @ref IOWatch::watch call
+    * on the registered IOWatch.
+    *
+    * @returns true if the socket was found writable, false otherwise.
+    */
+    bool isWritable() const;
+
+    /**
+    * Enable or disable watching the socket for writability
+    * on the registered IOWatch.
+    *
+    * @param on true, to make @ref IOWatch::watch return
+    *           when the socket becomes writable.
+    */
+    void watchWrite(bool on);
+
     /**
     * Receive data into a @ref bufferStore .
     *
+    * Whatever the peer has sent is read at once, up to the size of
+    * an internal buffer, so that several short messages take one
+    * system call. The rest of a longer message is received right
+    * into @p a .
+    *
     * @param a The bufferStore to fill with received data.
     * @param wait If true, wait until something is received, else return
     *              if no data is available.
@@ -123,13 +169,25 @@ public:
     int getBufferStore(bufferStore &a, bool wait = true);
 
     /**
-    * Sends data from a @ref bufferStore .
+    * Sends data from a @ref bufferStore . The length and the data
+    * are passed to the system together, without copying them.
     *
     * @param a The bufferStore to send.
     * @returns true on success, false otherwise.
     */
     bool sendBufferStore(const bufferStore &a);
 
+    /**
+    * Sends raw data without blocking.
+    *
+    * @param buf The data to send.
+    * @param len The number of bytes to send.
+    * @returns The number of bytes actually sent, which may be
+    *          less than len or 0 if the socket is busy, or -1
+    *          on error.
+    */
+    int sendNoWait(const void *buf, int len);
+
     /**
     * Closes the connection.
     *
@@ -193,6 +251,25 @@ public:
     */
     bool getHost(std::string *Host, int *Port);
 
+    /**
+    * Retrieves the credentials of the process at the other end
+    * of a Unix domain socket, as they were when it connected.
+    *
+    * @param Uid The user ID of the peer is returned here.
+    * @param Gid The group ID of the peer is returned here.
+    * @param Pid The process ID of the peer is returned here, or
+    *            -1 if the system does not tell.
+    *
+    * @returns true on success, false otherwise, e.g. for a TCP
+    *          socket.
+    */
+    bool getPeerCred(uid_t *Uid, gid_t *Gid, pid_t *Pid);
+
+    /**
+    * Check, whether this is a Unix domain socket.
+    */
+    bool isLocal() const;
+
     /**
     * Registers an @ref IOWatch for this socket.
     * This IOWatch gets the socket added/removed
@@ -211,16 +288,27 @@ private:
     int getLastError(void) { return(m_LastError); }
     bool setPeer(const char * const Peer, int Port);
     bool setHost(const char * const Host, int Port);
+    bool setUnix(struct sockaddr_storage *Addr, const char *Path);
+    bool bindUnix(const char *Path);
     int recv(void *buf, int len, int flags);
+    bool fillRx(int len);
     int send(const void * const buf, int len, int flags);
 	
-    struct sockaddr m_HostAddr;
-    struct sockaddr m_PeerAddr;
+    struct sockaddr_storage m_HostAddr;
+    struct sockaddr_storage m_PeerAddr;
+    int m_Family;
+    bool m_Unlink;
     int m_Socket;
     int m_Port;
     bool m_Bound;
     int m_LastError;
     IOWatch *myWatch;
+
+    // Data read ahead of the message being received
+    enum { RX_SIZE = 4096 };
+    unsigned char m_RxBuf[RX_SIZE];
+    int m_RxPos;
+    int m_RxLen;
 };
 
 #endif
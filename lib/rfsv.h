@@ -57,6 +57,8 @@ class rfsvDirhandle {
 private:
     uint32_t h;
     bufferStore b;
+    // Index of the next entry in b
+    long pos;
 };
 
 /**
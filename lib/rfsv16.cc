@@ -23,6 +23,7 @@
 
 #include "rfsv16.h"
 #include "bufferstore.h"
+#include "bufferview.h"
 #include "ppsocket.h"
 #include "bufferarray.h"
 
@@ -119,6 +120,7 @@ opendir(const uint32_t attr, const char *name, rfsvDirhandle &dH) {
     Enum<rfsv::errs> res = fopendir(name, handle);
     dH.h = handle;
     dH.b.init();
+    dH.pos = 0;
     return res;
 }
 
@@ -127,36 +129,49 @@ closedir(rfsvDirhandle &dH) {
     return fclose(dH.h);
 }
 
+bool rfsv16::
+parseDirent(bufferCursor &c, PlpDirent &e)
+{
+    uint16_t version = c.getWord();
+    if (version != 2)
+	return false;
+    e.attr = c.getWord();
+    e.size = c.getDWord();
+    uint32_t siboTime = c.getDWord();
+    c.skip(4);
+    e.name = c.getStringT();
+    if (!c.ok())
+	return false;
+    e.time.setSiboTime(siboTime);
+    //e.UID     = PlpUID(0,0,0);
+    return true;
+}
+
 Enum<rfsv::errs> rfsv16::
 readdir(rfsvDirhandle &dH, PlpDirent &e) {
     Enum<rfsv::errs> res = E_PSI_GEN_NONE;
 
-    if (dH.b.getLen() < 17) {
+    if (dH.b.getLen() - dH.pos < 17) {
 	dH.b.init();
+	dH.pos = 0;
 	dH.b.addWord(dH.h & 0xFFFF);
 	if (!sendCommand(SIBO_FDIRREAD, dH.b))
 	    return E_PSI_FILE_DISC;
 	res = getResponse(dH.b);
 	if (res == E_PSI_GEN_NONE) {
 	    uint16_t bufferLen = dH.b.getWord(0);
-	    dH.b.discardFirstBytes(2);
-	    if (dH.b.getLen() != bufferLen)
+	    dH.pos = 2;
+	    if (dH.b.getLen() - 2 != bufferLen)
 		return E_PSI_GEN_FAIL;
 	}
     }
-    if ((res == E_PSI_GEN_NONE) && (dH.b.getLen() > 16)) {
-	uint16_t version = dH.b.getWord(0);
-	if (version != 2)
+    if ((res == E_PSI_GEN_NONE) && (dH.b.getLen() - dH.pos > 16)) {
+	bufferCursor c(bufferView(dH.b).sub(dH.pos));
+	if (!parseDirent(c, e))
 	    return E_PSI_GEN_FAIL;
-	e.attr    = attr2std((uint32_t)dH.b.getWord(2));
-	e.size    = dH.b.getDWord(4);
-	e.time.setSiboTime(dH.b.getDWord(8));
-	e.name    = dH.b.getString(16);
-	//e.UID     = PlpUID(0,0,0);
+	dH.pos += c.tell();
+	e.attr    = attr2std(e.attr);
 	e.attrstr = attr2String(e.attr);
-
-	dH.b.discardFirstBytes(17 + e.name.length());
-
     }
     return res;
 }
@@ -451,17 +466,17 @@ sendCommand(enum commands cc, bufferStore & data)
     }
 
     bool result;
-    bufferStore a;
-    a.addWord(cc);
-    a.addWord(data.getLen());
-    a.addBuff(data);
-    result = skt->sendBufferStore(a);
+    // The header goes in front of the data, without copying it.
+    data.prependWord(data.getLen());
+    data.prependWord(cc);
+    result = skt->sendBufferStore(data);
     if (!result) {
 	reconnect();
-	result = skt->sendBufferStore(a);
+	result = skt->sendBufferStore(data);
 	if (!result)
 	    status = E_PSI_FILE_DISC;
     }
+    data.discardFirstBytes(4);
     return result;
 }
 
@@ -24,6 +24,7 @@
 #include <rfsv.h>
 
 class rfsvfactory;
+class bufferCursor;
 
 /**
  * This is the implementation of the @ref rfsv protocol for
@@ -74,6 +75,19 @@ public:
     uint32_t opMode(const uint32_t);
     int getProtocolVersion() { return 3; }
 
+    /**
+    * Parses an entry of a SIBO_FDIRREAD response.
+    *
+    * @param c A cursor at the start of the entry. On success, it is
+    *          moved to the start of the next one.
+    * @param e The entry is returned here. Its attributes are left
+    *          in SIBO format.
+    *
+    * @returns false, if the entry is incomplete or of an unknown
+    *          version.
+    */
+    static bool parseDirent(bufferCursor &c, PlpDirent &e);
+
 private:
     enum commands {
 	SIBO_FOPEN = 0, // File Open
@@ -22,6 +22,8 @@
 
 #include "rfsv32.h"
 #include "bufferstore.h"
+#include "bufferview.h"
+#include "msgschema.h"
 #include "ppsocket.h"
 #include "bufferarray.h"
 #include "plpdirent.h"
@@ -36,6 +38,73 @@
 
 using namespace std;
 
+struct rfsv32::msgs {
+    typedef msgLayout<msgDWord> dword;
+    typedef msgLayout<msgStringW> name;
+    typedef msgLayout<msgDWord, msgStringW> attrName;
+
+    typedef msgCommand<OPEN_FILE, attrName, dword> openFile;
+    typedef msgCommand<TEMP_FILE, msgLayout<>,
+		       msgLayout<msgDWord, msgStringW> > tempFile;
+    typedef msgCommand<CREATE_FILE, attrName, dword> createFile;
+    typedef msgCommand<REPLACE_FILE, attrName, dword> replaceFile;
+    typedef msgCommand<OPEN_DIR, attrName, dword> openDir;
+    typedef msgCommand<CLOSE_HANDLE, dword> closeHandle;
+    typedef msgCommand<READ_DIR, dword, msgLayout<msgBytes> > readDir;
+    // time lo, time hi
+    typedef msgCommand<MODIFIED, name,
+		       msgLayout<msgDWord, msgDWord> > modified;
+    typedef msgCommand<SET_MODIFIED,
+		       msgLayout<msgDWord, msgDWord, msgStringW> > setModified;
+    typedef msgCommand<ATT, name, dword> att;
+    // attr, size, time lo, time hi, UIDs, as in a directory entry
+    typedef msgCommand<REMOTE_ENTRY, name,
+		       msgLayout<msgSkip<4>, msgDWord, msgDWord, msgDWord,
+				 msgDWord, msgDWord, msgDWord,
+				 msgDWord> > remoteEntry;
+    // attributes to set, to clear, name
+    typedef msgCommand<SET_ATT,
+		       msgLayout<msgDWord, msgDWord, msgStringW> > setAtt;
+    // a byte for each drive, A to Z
+    typedef msgCommand<GET_DRIVE_LIST, msgLayout<>,
+		       msgLayout<msgBytes> > getDriveList;
+    // media type, drive and media attributes, UID, size lo and hi,
+    // space lo and hi, name
+    typedef msgCommand<DRIVE_INFO, dword,
+		       msgLayout<msgDWord, msgSkip<4>, msgDWord, msgDWord,
+				 msgDWord, msgDWord, msgDWord, msgDWord,
+				 msgDWord, msgSkip<4>, msgBytes> > driveInfo;
+    // handle, length
+    typedef msgCommand<READ_FILE, msgLayout<msgDWord, msgDWord>,
+		       msgLayout<msgBytes> > readFile;
+    typedef msgCommand<WRITE_FILE, msgLayout<msgDWord, msgBytes> > writeFile;
+    // length, handle to, handle from
+    typedef msgCommand<READ_WRITE_FILE,
+		       msgLayout<msgDWord, msgDWord, msgDWord>,
+		       dword> readWriteFile;
+    // handle, size
+    typedef msgCommand<SET_SIZE, msgLayout<msgDWord, msgDWord> > setSize;
+    // position, handle, mode
+    typedef msgCommand<SEEK_FILE, msgLayout<msgDWord, msgDWord, msgDWord>,
+		       dword> seekFile;
+    typedef msgCommand<MK_DIR_ALL, name> mkDirAll;
+    typedef msgCommand<RM_DIR, name> rmDir;
+    typedef msgCommand<RENAME, msgLayout<msgStringW, msgStringW> > rename;
+    typedef msgCommand<DELETE, name> remove;
+    // drive, name, 0
+    typedef msgCommand<SET_VOLUME_LABEL,
+		       msgLayout<msgDWord, msgStringW, msgByte> > setVolumeLabel;
+};
+
+template <typename M, typename... A>
+bool rfsv32::
+sendCommand(bufferStore &data, const A &... args)
+{
+    data.init();
+    M::request::encode(data, args...);
+    return sendCommand((enum commands)M::code, data);
+}
+
 rfsv32::rfsv32(ppsocket * _skt)
 {
     skt = _skt;
@@ -48,17 +117,11 @@ Enum<rfsv::errs> rfsv32::
 fopen(uint32_t attr, const char *name, uint32_t &handle)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addDWord(attr);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(OPEN_FILE, a))
+    if (!sendCommand<msgs::openFile>(a, attr, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
-    if (res == E_PSI_GEN_NONE && a.getLen() == 4) {
-	handle = a.getDWord(0);
-	return E_PSI_GEN_NONE;
-    }
+    if ((res == E_PSI_GEN_NONE) && !msgs::openFile::response::decode(a, handle))
+	return E_PSI_GEN_FAIL;
     return res;
 }
 
@@ -66,13 +129,12 @@ Enum<rfsv::errs> rfsv32::
 mktemp(uint32_t &handle, string &tmpname)
 {
     bufferStore a;
-    if (!sendCommand(TEMP_FILE, a))
+    if (!sendCommand<msgs::tempFile>(a))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
-    if (res == E_PSI_GEN_NONE) {
-	handle = a.getDWord(0);
-	tmpname = a.getString(6);
-    }
+    if ((res == E_PSI_GEN_NONE) &&
+	!msgs::tempFile::response::decode(a, handle, tmpname))
+	return E_PSI_GEN_FAIL;
     return res;
 }
 
@@ -80,15 +142,11 @@ Enum<rfsv::errs> rfsv32::
 fcreatefile(uint32_t attr, const char *name, uint32_t &handle)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addDWord(attr);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(CREATE_FILE, a))
+    if (!sendCommand<msgs::createFile>(a, attr, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
-    if (res == E_PSI_GEN_NONE && a.getLen() == 4)
-	handle = a.getDWord(0);
+    if ((res == E_PSI_GEN_NONE) && !msgs::createFile::response::decode(a, handle))
+	return E_PSI_GEN_FAIL;
     return res;
 }
 
@@ -96,15 +154,11 @@ Enum<rfsv::errs> rfsv32::
 freplacefile(const uint32_t attr, const char * const name, uint32_t &handle)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addDWord(attr);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(REPLACE_FILE, a))
+    if (!sendCommand<msgs::replaceFile>(a, attr, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
-    if (res == E_PSI_GEN_NONE && a.getLen() == 4)
-	handle = a.getDWord(0);
+    if ((res == E_PSI_GEN_NONE) && !msgs::replaceFile::response::decode(a, handle))
+	return E_PSI_GEN_FAIL;
     return res;
 }
 
@@ -112,15 +166,11 @@ Enum<rfsv::errs> rfsv32::
 fopendir(const uint32_t attr, const char * const name, uint32_t &handle)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addDWord(attr | EPOC_ATTR_GETUID);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(OPEN_DIR, a))
+    if (!sendCommand<msgs::openDir>(a, attr | EPOC_ATTR_GETUID, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
-    if (!res && a.getLen() == 4)
-	handle = a.getDWord(0);
+    if ((res == E_PSI_GEN_NONE) && !msgs::openDir::response::decode(a, handle))
+	return E_PSI_GEN_FAIL;
     return res;
 }
 
@@ -128,8 +178,7 @@ Enum<rfsv::errs> rfsv32::
 fclose(uint32_t handle)
 {
     bufferStore a;
-    a.addDWord(handle);
-    if (!sendCommand(CLOSE_HANDLE, a))
+    if (!sendCommand<msgs::closeHandle>(a, handle))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -140,6 +189,7 @@ opendir(const uint32_t attr, const char *name, rfsvDirhandle &dH) {
     Enum<rfsv::errs> res = fopendir(std2attr(attr), name, handle);
     dH.h = handle;
     dH.b.init();
+    dH.pos = 0;
     return res;
 }
 
@@ -148,37 +198,46 @@ closedir(rfsvDirhandle &dH) {
     return fclose(dH.h);
 }
 
+bool rfsv32::
+parseDirent(bufferCursor &c, PlpDirent &e)
+{
+    long shortLen = c.getDWord();
+    e.attr = c.getDWord();
+    e.size = c.getDWord();
+    uint32_t timeLo = c.getDWord();
+    uint32_t timeHi = c.getDWord();
+    uint32_t uid1 = c.getDWord();
+    uint32_t uid2 = c.getDWord();
+    uint32_t uid3 = c.getDWord();
+    long longLen = c.getDWord();
+    e.name = c.getString(longLen);
+    c.align(4);
+    c.skip(shortLen);
+    c.align(4);
+    if (!c.ok())
+	return false;
+    e.UID = PlpUID(uid1, uid2, uid3);
+    e.time = PsiTime(timeHi, timeLo);
+    return true;
+}
+
 Enum<rfsv::errs> rfsv32::
 readdir(rfsvDirhandle &dH, PlpDirent &e) {
     Enum<rfsv::errs> res = E_PSI_GEN_NONE;
 
-    if (dH.b.getLen() < 17) {
-	dH.b.init();
-	dH.b.addDWord(dH.h);
-	if (!sendCommand(READ_DIR, dH.b))
+    if (dH.b.getLen() - dH.pos < 17) {
+	dH.pos = 0;
+	if (!sendCommand<msgs::readDir>(dH.b, dH.h))
 	    return E_PSI_FILE_DISC;
 	res = getResponse(dH.b);
     }
-    if ((res == E_PSI_GEN_NONE) && (dH.b.getLen() > 16)) {
-	long shortLen   = dH.b.getDWord(0);
-	long longLen    = dH.b.getDWord(32);
-
-	e.attr    = attr2std(dH.b.getDWord(4));
-	e.size    = dH.b.getDWord(8);
-	e.UID     = PlpUID(dH.b.getDWord(20), dH.b.getDWord(24), dH.b.getDWord(28));
-	e.time    = PsiTime(dH.b.getDWord(16), dH.b.getDWord(12));
-	e.name    = "";
+    if ((res == E_PSI_GEN_NONE) && (dH.b.getLen() - dH.pos > 16)) {
+	bufferCursor c(bufferView(dH.b).sub(dH.pos));
+	if (!parseDirent(c, e))
+	    return E_PSI_GEN_FAIL;
+	dH.pos += c.tell();
+	e.attr    = attr2std(e.attr);
 	e.attrstr = string(attr2String(e.attr));
-
-	int d = 36;
-	for (int i = 0; i < longLen; i++, d++)
-	    e.name += dH.b.getByte(d);
-	while (d % 4)
-	    d++;
-	d += shortLen;
-	while (d % 4)
-	    d++;
-	dH.b.discardFirstBytes(d);
     }
     return res;
 }
@@ -218,15 +277,15 @@ Enum<rfsv::errs> rfsv32::
 fgetmtime(const char * const name, PsiTime &mtime)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(MODIFIED, a))
+    if (!sendCommand<msgs::modified>(a, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
     if (res != E_PSI_GEN_NONE)
 	return res;
-    mtime.setPsiTime(a.getDWord(4), a.getDWord(0));
+    uint32_t lo, hi;
+    if (!msgs::modified::response::decode(a, lo, hi))
+	return E_PSI_GEN_FAIL;
+    mtime.setPsiTime(hi, lo);
     return res;
 }
 
@@ -234,12 +293,9 @@ Enum<rfsv::errs> rfsv32::
 fsetmtime(const char * const name, PsiTime mtime)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addDWord(mtime.getPsiTimeLo());
-    a.addDWord(mtime.getPsiTimeHi());
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(SET_MODIFIED, a))
+    if (!sendCommand<msgs::setModified>(a, mtime.getPsiTimeLo(),
+					 mtime.getPsiTimeHi(),
+					 convertSlash(name)))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -248,15 +304,15 @@ Enum<rfsv::errs> rfsv32::
 fgetattr(const char * const name, uint32_t &attr)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(ATT, a))
+    if (!sendCommand<msgs::att>(a, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
     if (res != E_PSI_GEN_NONE)
 	return res;
-    attr = attr2std(a.getDWord(0));
+    uint32_t eattr;
+    if (!msgs::att::response::decode(a, eattr))
+	return E_PSI_GEN_FAIL;
+    attr = attr2std(eattr);
     return res;
 }
 
@@ -265,8 +321,6 @@ fgeteattr(const char * const name, PlpDirent &e)
 {
     bufferStore a;
     string n = convertSlash(name);
-    a.addWord(n.size());
-    a.addString(n.c_str());
     const char *p = strrchr(n.c_str(), '\\');
     if (p)
 	p++;
@@ -274,18 +328,19 @@ fgeteattr(const char * const name, PlpDirent &e)
 	p = n.c_str();
     e.name = p;
 
-    if (!sendCommand(REMOTE_ENTRY, a))
+    if (!sendCommand<msgs::remoteEntry>(a, n))
 	return E_PSI_FILE_DISC;
     Enum<rfsv::errs> res = getResponse(a);
     if (res != E_PSI_GEN_NONE)
 	return res;
-    // long shortLen = a.getDWord(0);
-    // long longLen = a.getDWord(32);
+    uint32_t eattr, timeLo, timeHi, uid1, uid2, uid3;
+    if (!msgs::remoteEntry::response::decode(a, eattr, e.size, timeLo,
+					      timeHi, uid1, uid2, uid3))
+	return E_PSI_GEN_FAIL;
 
-    e.attr    = attr2std(a.getDWord(4));
-    e.size    = a.getDWord(8);
-    e.UID     = PlpUID(a.getDWord(20), a.getDWord(24), a.getDWord(28));
-    e.time    = PsiTime(a.getDWord(16), a.getDWord(12));
+    e.attr    = attr2std(eattr);
+    e.UID     = PlpUID(uid1, uid2, uid3);
+    e.time    = PsiTime(timeHi, timeLo);
     e.attrstr = string(attr2String(e.attr));
 
     return res;
@@ -295,12 +350,8 @@ Enum<rfsv::errs> rfsv32::
 fsetattr(const char * const name, const uint32_t seta, const uint32_t unseta)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addDWord(std2attr(seta));
-    a.addDWord(std2attr(unseta));
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(SET_ATT, a))
+    if (!sendCommand<msgs::setAtt>(a, std2attr(seta), std2attr(unseta),
+				    convertSlash(name)))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -316,20 +367,21 @@ dircount(const char * const name, uint32_t &count)
 
     while (1) {
 	bufferStore a;
-	a.addDWord(handle);
-	if (!sendCommand(READ_DIR, a))
+	if (!sendCommand<msgs::readDir>(a, handle))
 	    return E_PSI_FILE_DISC;
 	res = getResponse(a);
 	if (res != E_PSI_GEN_NONE)
 	    break;
-	while (a.getLen() > 16) {
-	    int d = 36 + a.getDWord(32);
-	    while (d % 4)
-		d++;
-	    d += a.getDWord(0);
-	    while (d % 4)
-		d++;
-	    a.discardFirstBytes(d);
+	bufferCursor c(a);
+	while (c.remaining() > 16) {
+	    long shortLen = c.getDWord();
+	    c.skip(28);
+	    c.skip(c.getDWord());
+	    c.align(4);
+	    c.skip(shortLen);
+	    c.align(4);
+	    if (!c.ok())
+		break;
 	    count++;
 	}
     }
@@ -345,14 +397,17 @@ devlist(uint32_t &devbits)
     bufferStore a;
     Enum<rfsv::errs> res;
 
-    if (!sendCommand(GET_DRIVE_LIST, a))
+    if (!sendCommand<msgs::getDriveList>(a))
 	return E_PSI_FILE_DISC;
     res = getResponse(a);
     devbits = 0;
-    if ((res == E_PSI_GEN_NONE) && (a.getLen() == 26)) {
+    bufferView drives;
+    if ((res == E_PSI_GEN_NONE) &&
+	msgs::getDriveList::response::decode(a, drives) &&
+	(drives.getLen() == 26)) {
 	for (int i = 25; i >= 0; i--) {
 	    devbits <<= 1;
-	    if (a.getByte(i) != 0)
+	    if (drives.getBytes()[i] != 0)
 		devbits |= 1;
 	}
     }
@@ -365,19 +420,25 @@ devinfo(const char drive, PlpDrive &dinfo)
     bufferStore a;
     Enum<rfsv::errs> res;
 
-    a.addDWord(toupper(drive) - 'A');
-    if (!sendCommand(DRIVE_INFO, a))
+    if (!sendCommand<msgs::driveInfo>(a, toupper(drive) - 'A'))
 	return E_PSI_FILE_DISC;
     res = getResponse(a);
     if (res == E_PSI_GEN_NONE) {
-	dinfo.setMediaType(a.getDWord(0));
-	dinfo.setDriveAttribute(a.getDWord(8));
-	dinfo.setMediaAttribute(a.getDWord(12));
-	dinfo.setUID(a.getDWord(16));
-	dinfo.setSize(a.getDWord(20), a.getDWord(24));
-	dinfo.setSpace(a.getDWord(28), a.getDWord(32));
-	a.addByte(0);
-	dinfo.setName(toupper(drive), a.getString(40));
+	uint32_t mediaType, driveAttr, mediaAttr, uid;
+	uint32_t sizeLo, sizeHi, spaceLo, spaceHi;
+	bufferView name;
+	if (!msgs::driveInfo::response::decode(a, mediaType, driveAttr,
+					       mediaAttr, uid, sizeLo, sizeHi,
+					       spaceLo, spaceHi, name))
+	    return E_PSI_GEN_FAIL;
+	dinfo.setMediaType(mediaType);
+	dinfo.setDriveAttribute(driveAttr);
+	dinfo.setMediaAttribute(mediaAttr);
+	dinfo.setUID(uid);
+	dinfo.setSize(sizeLo, sizeHi);
+	dinfo.setSpace(spaceLo, spaceHi);
+	const char *n = (const char *)name.getBytes();
+	dinfo.setName(toupper(drive), string(n, strnlen(n, name.getLen())).c_str());
     }
     return res;
 }
@@ -391,21 +452,21 @@ sendCommand(enum commands cc, bufferStore & data)
 	    return false;
     }
     bool result;
-    bufferStore a;
-    a.addWord(cc);
-    a.addWord(serNum);
+    // The header goes in front of the data, without copying it.
+    data.prependWord(serNum);
+    data.prependWord(cc);
     if (serNum < 0xffff)
 	serNum++;
     else
 	serNum = 0;
-    a.addBuff(data);
-    result = skt->sendBufferStore(a);
+    result = skt->sendBufferStore(data);
     if (!result) {
 	reconnect();
-	result = skt->sendBufferStore(a);
+	result = skt->sendBufferStore(data);
 	if (!result)
 	    status = E_PSI_FILE_DISC;
     }
+    data.discardFirstBytes(4);
     return result;
 }
 
@@ -432,18 +493,18 @@ fread(const uint32_t handle, unsigned char * const buf, const uint32_t len, uint
     unsigned char *p = buf;
 
     do {
-	a.addDWord(handle);
-	a.addDWord(((len - count) > RFSV_SENDLEN)?RFSV_SENDLEN:(len - count));
-	if (!sendCommand(READ_FILE, a))
+	uint32_t n = ((len - count) > RFSV_SENDLEN)?RFSV_SENDLEN:(len - count);
+	if (!sendCommand<msgs::readFile>(a, handle, n))
 	    return E_PSI_FILE_DISC;
 	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	    return res;
-	if ((l = a.getLen()) > 0) {
-	    memcpy(p, a.getString(), l);
+	bufferView data;
+	msgs::readFile::response::decode(a, data);
+	if ((l = data.getLen()) > 0) {
+	    memcpy(p, data.getBytes(), l);
 	    count += l;
 	    p += l;
 	}
-	a.init();
     } while ((count < len) && (l > 0));
     return res;
 }
@@ -460,10 +521,7 @@ fwrite(const uint32_t handle, const unsigned char * const buf, const uint32_t le
 	l = ((len - count) > RFSV_SENDLEN)?RFSV_SENDLEN:(len - count);
 	if (l > 0) {
 	    bufferStore a;
-	    bufferStore tmp(p, l);
-	    a.addDWord(handle);
-	    a.addBuff(tmp);
-	    if (!sendCommand(WRITE_FILE, a))
+	    if (!sendCommand<msgs::writeFile>(a, handle, bufferView(p, l)))
 		return E_PSI_FILE_DISC;
 	    if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 		return res;
@@ -586,19 +644,18 @@ copyOnPsion(const char *from, const char *to, void *ptr, cpCallback_t cb)
     uint32_t total = 0;
     while (res == E_PSI_GEN_NONE) {
 	bufferStore b;
-	b.addDWord(RFSV_SENDLEN * 10);
-	b.addDWord(handle_to);
-	b.addDWord(handle_from);
-	if (!sendCommand(READ_WRITE_FILE, b))
+	if (!sendCommand<msgs::readWriteFile>(b, RFSV_SENDLEN * 10, handle_to,
+					       handle_from))
 	    return E_PSI_FILE_DISC;
 	res = getResponse(b);
 	if (res != E_PSI_GEN_NONE)
 	    break;
-	if (b.getLen() != 4) {
+	uint32_t len;
+	if ((b.getLen() != msgs::readWriteFile::response::fixedLen) ||
+	    !msgs::readWriteFile::response::decode(b, len)) {
 	    res = E_PSI_GEN_FAIL;
 	    break;
 	}
-	uint32_t len = b.getDWord(0);
 	total += len;
 	if (cb && !cb(ptr, total))
 	    res = E_PSI_FILE_CANCEL;
@@ -616,9 +673,7 @@ Enum<rfsv::errs> rfsv32::
 fsetsize(uint32_t handle, uint32_t size)
 {
     bufferStore a;
-    a.addDWord(handle);
-    a.addDWord(size);
-    if (!sendCommand(SET_SIZE, a))
+    if (!sendCommand<msgs::setSize>(a, handle, size))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -656,54 +711,43 @@ fseek(const uint32_t handle, const int32_t pos, const uint32_t mode, uint32_t &r
 
     if ((mode == PSI_SEEK_CUR) && (mypos >= 0)) {
 	/* get and save current position */
-	a.addDWord(0);
-	a.addDWord(handle);
-	a.addDWord(PSI_SEEK_CUR);
-	if (!sendCommand(SEEK_FILE, a))
+	if (!sendCommand<msgs::seekFile>(a, 0, handle, PSI_SEEK_CUR))
 	    return E_PSI_FILE_DISC;
 	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	    return res;
-	savpos = a.getDWord(0);
+	if (!msgs::seekFile::response::decode(a, savpos))
+	    return E_PSI_GEN_FAIL;
 	if (mypos == 0) {
 	    resultpos = savpos;
 	    return res;
 	}
-	a.init();
     }
     if ((mode == PSI_SEEK_END) && (mypos >= 0)) {
 	/* get and save end position */
-	a.addDWord(0);
-	a.addDWord(handle);
-	a.addDWord(PSI_SEEK_END);
-	if (!sendCommand(SEEK_FILE, a))
+	if (!sendCommand<msgs::seekFile>(a, 0, handle, PSI_SEEK_END))
 	    return E_PSI_FILE_DISC;
 	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	    return res;
-	savpos = a.getDWord(0);
+	if (!msgs::seekFile::response::decode(a, savpos))
+	    return E_PSI_GEN_FAIL;
 	if (mypos == 0) {
 	    resultpos = savpos;
 	    return res;
 	}
 	/* Expand file */
-	a.init();
-	a.addDWord(handle);
-	a.addDWord(savpos + mypos);
-	if (!sendCommand(SET_SIZE, a))
+	if (!sendCommand<msgs::setSize>(a, handle, savpos + mypos))
 	    return E_PSI_FILE_DISC;
 	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	    return res;
 	mypos = 0;
-	a.init();
     }
     /* Now the real seek */
-    a.addDWord(mypos);
-    a.addDWord(handle);
-    a.addDWord(mode);
-    if (!sendCommand(SEEK_FILE, a))
+    if (!sendCommand<msgs::seekFile>(a, mypos, handle, mode))
 	return E_PSI_FILE_DISC;
     if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	return res;
-    realpos = a.getDWord(0);
+    if (!msgs::seekFile::response::decode(a, realpos))
+	return E_PSI_GEN_FAIL;
     switch (mode) {
 	case PSI_SEEK_SET:
 	    calcpos = mypos;
@@ -718,21 +762,16 @@ fseek(const uint32_t handle, const int32_t pos, const uint32_t mode, uint32_t &r
     }
     if (calcpos > realpos) {
 	/* Beyond end of file */
-	a.init();
-	a.addDWord(handle);
-	a.addDWord(calcpos);
-	if (!sendCommand(SET_SIZE, a))
+	if (!sendCommand<msgs::setSize>(a, handle, calcpos))
 	    return E_PSI_FILE_DISC;
 	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	    return res;
-	a.addDWord(calcpos);
-	a.addDWord(handle);
-	a.addDWord(PSI_SEEK_SET);
-	if (!sendCommand(SEEK_FILE, a))
+	if (!sendCommand<msgs::seekFile>(a, calcpos, handle, PSI_SEEK_SET))
 	    return E_PSI_FILE_DISC;
 	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
 	    return res;
-	realpos = a.getDWord(0);
+	if (!msgs::seekFile::response::decode(a, realpos))
+	    return E_PSI_GEN_FAIL;
     }
     resultpos = realpos;
     return res;
@@ -745,9 +784,7 @@ mkdir(const char *name)
     string n = convertSlash(name);
     if (n.find_last_of('\\') != (n.size() - 1))
 	n += '\\';
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(MK_DIR_ALL, a))
+    if (!sendCommand<msgs::mkDirAll>(a, n))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -759,9 +796,7 @@ rmdir(const char *name)
     string n = convertSlash(name);
     if (n.find_last_of('\\') != (n.size() - 1))
 	n += '\\';
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(RM_DIR, a))
+    if (!sendCommand<msgs::rmDir>(a, n))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -770,13 +805,8 @@ Enum<rfsv::errs> rfsv32::
 rename(const char *oldname, const char *newname)
 {
     bufferStore a;
-    string on = convertSlash(oldname);
-    string nn = convertSlash(newname);
-    a.addWord(on.size());
-    a.addString(on.c_str());
-    a.addWord(nn.size());
-    a.addString(nn.c_str());
-    if (!sendCommand(RENAME, a))
+    if (!sendCommand<msgs::rename>(a, convertSlash(oldname),
+				    convertSlash(newname)))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -785,10 +815,7 @@ Enum<rfsv::errs> rfsv32::
 remove(const char *name)
 {
     bufferStore a;
-    string n = convertSlash(name);
-    a.addWord(n.size());
-    a.addString(n.c_str());
-    if (!sendCommand(DELETE, a))
+    if (!sendCommand<msgs::remove>(a, convertSlash(name)))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -797,10 +824,8 @@ Enum<rfsv::errs> rfsv32::
 setVolumeName(const char drive , const char * const name)
 {
     bufferStore a;
-    a.addDWord(toupper(drive) - 'A');
-    a.addWord(strlen(name));
-    a.addStringT(name);
-    if (!sendCommand(SET_VOLUME_LABEL, a))
+    if (!sendCommand<msgs::setVolumeLabel>(a, toupper(drive) - 'A',
+					    string(name), 0))
 	return E_PSI_FILE_DISC;
     return getResponse(a);
 }
@@ -26,6 +26,7 @@
 #include <plpdirent.h>
 
 class rfsvfactory;
+class bufferCursor;
 
 /**
  * This is the implementation of the @ref rfsv protocol for
@@ -76,6 +77,18 @@ public:
     uint32_t opMode(const uint32_t);
     int getProtocolVersion() { return 5; }
 
+    /**
+    * Parses an entry of a READ_DIR response.
+    *
+    * @param c A cursor at the start of the entry. On success, it is
+    *          moved to the start of the next one.
+    * @param e The entry is returned here. Its attributes are left
+    *          in EPOC format.
+    *
+    * @returns false, if the entry is incomplete.
+    */
+    static bool parseDirent(bufferCursor &c, PlpDirent &e);
+
 private:
 
     enum file_attrib {
@@ -200,6 +213,20 @@ private:
     // Communication
     bool sendCommand(enum commands, bufferStore &);
     Enum<rfsv::errs> getResponse(bufferStore &);
+
+    /**
+    * The layouts of the commands, see msgschema.h .
+    */
+    struct msgs;
+
+    /**
+    * Sends the command @p M with a request made of @p args .
+    *
+    * @param data The request is encoded here, replacing the content.
+    * @param args The values of the fields of the request.
+    */
+    template <typename M, typename... A>
+    bool sendCommand(bufferStore &data, const A &... args);
 };
 
 #endif
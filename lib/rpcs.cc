@@ -20,7 +20,9 @@
 #include "config.h"
 
 #include "rpcs.h"
+#include "rpcsmsgs.h"
 #include "bufferstore.h"
+#include "bufferview.h"
 #include "ppsocket.h"
 #include "bufferarray.h"
 #include "psiprocess.h"
@@ -140,16 +142,16 @@ sendCommand(enum commands cc, bufferStore & data)
             return false;
     }
     bool result;
-    bufferStore a;
-    a.addByte(cc);
-    a.addBuff(data);
-    result = skt->sendBufferStore(a);
+    // The command goes in front of the data, without copying it.
+    data.prependByte(cc);
+    result = skt->sendBufferStore(data);
     if (!result) {
         reconnect();
-        result = skt->sendBufferStore(a);
+        result = skt->sendBufferStore(data);
         if (!result)
             status = rfsv::E_PSI_FILE_DISC;
     }
+    data.discardFirstBytes(1);
     return result;
 }
 
@@ -184,14 +186,13 @@ getNCPversion(int &major, int &minor)
     Enum<rfsv::errs> res;
     bufferStore a;
 
-    if (!sendCommand(QUERY_NCP, a))
+    if (!sendCommand<msgs::queryNcp>(a))
         return rfsv::E_PSI_FILE_DISC;
     if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
         return res;
-    if (a.getLen() != 2)
+    if ((a.getLen() != msgs::queryNcp::response::fixedLen) ||
+        !msgs::queryNcp::response::decode(a, major, minor))
         return rfsv::E_PSI_GEN_FAIL;
-    major = a.getByte(0);
-    minor = a.getByte(1);
     return res;
 }
 
@@ -200,23 +201,13 @@ execProgram(const char *program, const char *args)
 {
     bufferStore a;
 
-    a.addStringT(program);
-    int l = strlen(program);
-    for (int i = 127; i > l; i--)
-        a.addByte(0);
-
     /**
     * This is a hack for the jotter app on mx5 pro. (and probably others)
     * Jotter seems to read its arguments one char past normal apps.
     * Without this hack, The Drive-Character gets lost. Other apps don't
     * seem to be hurt by the additional blank.
     */
-    a.addByte(strlen(args)+1);
-    a.addByte(' ');
-
-    a.addStringT(args);
-
-    if (!sendCommand(EXEC_PROG, a))
+    if (!sendCommand<msgs::execProg>(a, program, strlen(args) + 1, ' ', args))
         return rfsv::E_PSI_FILE_DISC;
     return getResponse(a, true);
 }
@@ -226,8 +217,7 @@ stopProgram(const char *program)
 {
     bufferStore a;
 
-    a.addStringT(program);
-    if (!sendCommand(STOP_PROG, a))
+    if (!sendCommand<msgs::stopProg>(a, program))
         return rfsv::E_PSI_FILE_DISC;
     return getResponse(a, true);
 }
@@ -237,12 +227,34 @@ queryProgram(const char *program)
 {
     bufferStore a;
 
-    a.addStringT(program);
-    if (!sendCommand(QUERY_PROG, a))
+    if (!sendCommand<msgs::queryProg>(a, program))
         return rfsv::E_PSI_FILE_DISC;
     return getResponse(a, true);
 }
 
+bool rpcs::
+parseProcesses(const bufferView &v, processList &ret, bool s5mx)
+{
+    bufferCursor c(v);
+    while (!c.atEnd()) {
+        long nl;
+        long al;
+        const char *name = c.getStringT(nl);
+        const char *args = c.getStringT(al);
+        if (!c.ok())
+            return false;
+        // The name is followed by ".$" and the process id.
+        const char *p = strstr(name, ".$");
+        int pid = 0;
+        if (p) {
+            sscanf(p + 2, "%d", &pid);
+            nl = p - name;
+        }
+        ret.push_back(PsiProcess(pid, string(name, nl).c_str(), args, s5mx));
+    }
+    return true;
+}
+
 Enum<rfsv::errs> rpcs::
 queryPrograms(processList &ret)
 {
@@ -253,8 +265,8 @@ queryPrograms(processList &ret)
     Enum<rfsv::errs> res;
 
     // First, check how many drives we need to query
-    a.addStringT("M:"); // Drive M only exists on a SIBO
-    if (!sendCommand(rpcs::GET_UNIQUEID, a))
+    // Drive M only exists on a SIBO
+    if (!sendCommand<msgs::getUniqueId>(a, "M:"))
         return rfsv::E_PSI_FILE_DISC;
     if (getResponse(a, false) == rfsv::E_PSI_GEN_NONE)
         // A SIBO; Must query all possible drives
@@ -279,34 +291,12 @@ queryPrograms(processList &ret)
     }
     bool s5mx = (mtCacheS5mx == 15);
     while (*dptr) {
-        a.init();
-        a.addByte(*dptr);
-        if (!sendCommand(rpcs::QUERY_DRIVE, a))
+        if (!sendCommand<msgs::queryDrive>(a, *dptr))
             return rfsv::E_PSI_FILE_DISC;
         if (getResponse(a, false) == rfsv::E_PSI_GEN_NONE) {
             anySuccess = true;
-            int l = a.getLen();
-            while (l > 0) {
-                const char *s;
-                char *p;
-                int pid;
-                int sl;
-
-                s = a.getString(0);
-                sl = strlen(s) + 1;
-                l -= sl;
-                a.discardFirstBytes(sl);
-                if ((p = strstr((char *)s, ".$"))) {
-                    *p = '\0'; p += 2;
-                    sscanf(p, "%d", &pid);
-                } else
-                    pid = 0;
-                PsiProcess proc(pid, s, a.getString(0), s5mx);
-                ret.push_back(proc);
-                sl = strlen(a.getString(0)) + 1;
-                l -= sl;
-                a.discardFirstBytes(sl);
-            }
+            if (!parseProcesses(a, ret, s5mx))
+                return rfsv::E_PSI_GEN_FAIL;
         }
         dptr++;
     }
@@ -325,17 +315,13 @@ formatOpen(const char drive, int &handle, int &count)
     Enum<rfsv::errs> res;
     bufferStore a;
 
-    a.addByte(toupper(drive));
-    a.addByte(':');
-    a.addByte(0);
-    if (!sendCommand(FORMAT_OPEN, a))
+    if (!sendCommand<msgs::formatOpen>(a, toupper(drive), ':', 0))
         return rfsv::E_PSI_FILE_DISC;
     if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
         return res;
-    if (a.getLen() != 4)
+    if ((a.getLen() != msgs::formatOpen::response::fixedLen) ||
+        !msgs::formatOpen::response::decode(a, handle, count))
         return rfsv::E_PSI_GEN_FAIL;
-    handle = a.getWord(0);
-    count = a.getWord(2);
     return res;
 }
 
@@ -344,8 +330,7 @@ formatRead(int handle)
 {
     bufferStore a;
 
-    a.addWord(handle);
-    if (!sendCommand(FORMAT_READ, a))
+    if (!sendCommand<msgs::formatRead>(a, handle))
         return rfsv::E_PSI_FILE_DISC;
     return getResponse(a, true);
 }
@@ -356,14 +341,13 @@ getUniqueID(const char *device, long &id)
     Enum<rfsv::errs> res;
     bufferStore a;
 
-    a.addStringT(device);
-    if (!sendCommand(GET_UNIQUEID, a))
+    if (!sendCommand<msgs::getUniqueId>(a, device))
         return rfsv::E_PSI_FILE_DISC;
     if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
         return res;
-    if (a.getLen() != 4)
+    if ((a.getLen() != msgs::getUniqueId::response::fixedLen) ||
+        !msgs::getUniqueId::response::decode(a, id))
         return rfsv::E_PSI_GEN_FAIL;
-    id = a.getDWord(0);
     return res;
 }
 
@@ -373,7 +357,7 @@ getOwnerInfo(bufferArray &owner)
     Enum<rfsv::errs> res;
     bufferStore a;
 
-    if (!sendCommand(GET_OWNERINFO, a))
+    if (!sendCommand<msgs::getOwnerInfo>(a))
         return rfsv::E_PSI_FILE_DISC;
     if ((res = (enum rfsv::errs)getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
         return res;
@@ -402,13 +386,15 @@ getMachineType(Enum<machs> &type)
     Enum<rfsv::errs> res;
     bufferStore a;
 
-    if (!sendCommand(GET_MACHINETYPE, a))
+    if (!sendCommand<msgs::getMachineType>(a))
         return rfsv::E_PSI_FILE_DISC;
     if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
         return res;
-    if (a.getLen() != 2)
+    uint16_t t;
+    if ((a.getLen() != msgs::getMachineType::response::fixedLen) ||
+        !msgs::getMachineType::response::decode(a, t))
         return rfsv::E_PSI_GEN_FAIL;
-    type = (enum machs)a.getWord(0);
+    type = (enum machs)t;
     mtCacheS5mx |= 4;
     if (res == rfsv::E_PSI_GEN_NONE) {
         if (type == rpcs::PSI_MACH_S5)
@@ -424,8 +410,7 @@ fuser(const char *name, char *buf, int maxlen)
     bufferStore a;
     char *p;
 
-    a.addStringT(name);
-    if (!sendCommand(FUSER, a))
+    if (!sendCommand<msgs::fuser>(a, name))
         return rfsv::E_PSI_FILE_DISC;
     if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
         return res;
@@ -439,7 +424,7 @@ Enum<rfsv::errs> rpcs::
 quitServer(void)
 {
     bufferStore a;
-    if (!sendCommand(QUIT_SERVER, a))
+    if (!sendCommand<msgs::quitServer>(a))
         return rfsv::E_PSI_FILE_DISC;
     return getResponse(a, true);
 }
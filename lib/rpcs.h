@@ -30,6 +30,7 @@
 class ppsocket;
 class bufferStore;
 class bufferArray;
+class bufferView;
 
 typedef std::vector<PsiProcess> processList;
 
@@ -325,6 +326,18 @@ public:
      */
     Enum<rfsv::errs> queryPrograms(processList &ret);
 
+    /**
+     * Parses a QUERY_DRIVE response.
+     *
+     * @param v The response, a list of "NAME.$PID" and argument
+     *          strings, each 0 terminated.
+     * @param ret The processes are appended here.
+     * @param s5mx true, if the Psion is a Series 5mx.
+     *
+     * @returns false, if the response is incomplete.
+     */
+    static bool parseProcesses(const bufferView &v, processList &ret, bool s5mx);
+
     /**
     * Retrieves the command line of a running process.
     *
@@ -503,6 +516,20 @@ protected:
     bool sendCommand(enum commands cc, bufferStore &data);
     Enum<rfsv::errs> getResponse(bufferStore &data, bool statusIsFirstByte);
     const char *getConnectName();
+
+    /**
+    * The layouts of the commands, see rpcsmsgs.h .
+    */
+    struct msgs;
+
+    /**
+    * Sends the command @p M with a request made of @p args .
+    *
+    * @param data The request is encoded here, replacing the content.
+    * @param args The values of the fields of the request.
+    */
+    template <typename M, typename... A>
+    bool sendCommand(bufferStore &data, const A &... args);
 };
 
 #endif
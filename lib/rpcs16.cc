@@ -24,6 +24,7 @@
 #include "bufferstore.h"
 #include "bufferarray.h"
 #include "ppsocket.h"
+#include "rpcsmsgs.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,10 +45,10 @@ getCmdLine(const char *process, string &ret)
     bufferStore a;
     Enum<rfsv::errs> res;
 
-    a.addStringT(process);
-    if (!sendCommand(rpcs::GET_CMDLINE, a))
+    if (!sendCommand<msgs::getCmdLine>(a, process))
 	return rfsv::E_PSI_FILE_DISC;
-    if ((res = getResponse(a, true)) == rfsv::E_PSI_GEN_NONE)
-	ret = a.getString(0);
+    if (((res = getResponse(a, true)) == rfsv::E_PSI_GEN_NONE) &&
+	!msgs::getCmdLine::response::decode(a, ret))
+	return rfsv::E_PSI_GEN_FAIL;
     return res;
 }
@@ -23,6 +23,7 @@
 #include "bufferstore.h"
 #include "bufferarray.h"
 #include "ppsocket.h"
+#include "rpcsmsgs.h"
 
 #include <iostream>
 
@@ -45,11 +46,11 @@ getCmdLine(const char *process, string &ret)
     bufferStore a;
     Enum<rfsv::errs> res;
 
-    a.addStringT(process);
-    if (!sendCommand(rpcs::GET_CMDLINE, a))
+    if (!sendCommand<msgs::getCmdLine>(a, process))
 	return rfsv::E_PSI_FILE_DISC;
-    if ((res = getResponse(a, true)) == rfsv::E_PSI_GEN_NONE)
-	ret = a.getString(0);
+    if (((res = getResponse(a, true)) == rfsv::E_PSI_GEN_NONE) &&
+	!msgs::getCmdLine::response::decode(a, ret))
+	return rfsv::E_PSI_GEN_FAIL;
     return res;
 }
 
@@ -59,63 +60,36 @@ getMachineInfo(machineInfo &mi)
     bufferStore a;
     Enum<rfsv::errs> res;
 
-    if (!sendCommand(rpcs::GET_MACHINE_INFO, a))
+    if (!sendCommand<msgs::getMachineInfo>(a))
 	return rfsv::E_PSI_FILE_DISC;
     if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE)
 	return res;
-    if (a.getLen() != 256)
+    uint32_t machineType, uiLanguage, mainBatteryStatus, backupBatteryStatus;
+    if ((a.getLen() != msgs::getMachineInfo::response::fixedLen) ||
+	!msgs::getMachineInfo::response::decode(a,
+	    machineType, mi.romMajor, mi.romMinor, mi.romBuild,
+	    mi.machineName, mi.displayWidth, mi.displayHeight, mi.machineUID,
+	    mi.time.tv_low, mi.time.tv_high, mi.countryCode,
+	    mi.tz.utc_offset, mi.tz.dst_zones, mi.tz.home_zone,
+	    mi.mainBatteryInsertionTime.tv_low,
+	    mi.mainBatteryInsertionTime.tv_high, mainBatteryStatus,
+	    mi.mainBatteryUsedTime.tv_low, mi.mainBatteryUsedTime.tv_high,
+	    mi.mainBatteryCurrent, mi.mainBatteryUsedPower,
+	    mi.mainBatteryVoltage, mi.mainBatteryMaxVoltage,
+	    backupBatteryStatus, mi.backupBatteryVoltage,
+	    mi.backupBatteryMaxVoltage,
+	    mi.externalPower, mi.externalPowerUsedTime.tv_low,
+	    mi.externalPowerUsedTime.tv_high,
+	    mi.ramSize, mi.romSize, mi.ramMaxFree, mi.ramFree,
+	    mi.ramDiskSize, mi.registrySize, mi.romProgrammable, uiLanguage))
 	return rfsv::E_PSI_GEN_FAIL;
-    mi.machineType = (enum rpcs::machs)a.getDWord(0);
-    strncpy(mi.machineName, a.getString(16), 16);
-    mi.machineName[16] = '\0';
-    mi.machineUID = a.getDWord(44);
-    mi.machineUID <<= 32;
-    mi.machineUID |= a.getDWord(40);
-    mi.countryCode = a.getDWord(56);
-    mi.uiLanguage = (enum rpcs::languages)a.getDWord(164);
-
-    mi.romMajor = a.getByte(4);
-    mi.romMinor = a.getByte(5);
-    mi.romBuild = a.getWord(6);
-    mi.romSize = a.getDWord(140);
-
-    mi.ramSize = a.getDWord(136);
-    mi.ramMaxFree = a.getDWord(144);
-    mi.ramFree = a.getDWord(148);
-    mi.ramDiskSize = a.getDWord(152);
-
-    mi.registrySize = a.getDWord(156);
-    mi.romProgrammable = (a.getDWord(160) != 0);
-
-    mi.displayWidth = a.getDWord(32);
-    mi.displayHeight = a.getDWord(36);
-
-    mi.time.tv_low = a.getDWord(48);
-    mi.time.tv_high = a.getDWord(52);
-
-    mi.tz.utc_offset = a.getDWord(60);
-    mi.tz.dst_zones = a.getDWord(64);
-    mi.tz.home_zone = a.getDWord(68);
+    mi.machineType = (enum rpcs::machs)machineType;
+    mi.uiLanguage = (enum rpcs::languages)uiLanguage;
+    mi.mainBatteryStatus = (enum rpcs::batterystates)mainBatteryStatus;
+    mi.backupBatteryStatus = (enum rpcs::batterystates)backupBatteryStatus;
 
     PsiZone::getInstance().setZone(mi.tz);
 
-    mi.mainBatteryInsertionTime.tv_low = a.getDWord(72);
-    mi.mainBatteryInsertionTime.tv_high = a.getDWord(76);
-    mi.mainBatteryStatus = (enum rpcs::batterystates)a.getDWord(80);
-    mi.mainBatteryUsedTime.tv_low = a.getDWord(84);
-    mi.mainBatteryUsedTime.tv_high = a.getDWord(88);
-    mi.mainBatteryCurrent = a.getDWord(92);
-    mi.mainBatteryUsedPower = a.getDWord(96);
-    mi.mainBatteryVoltage = a.getDWord(100);
-    mi.mainBatteryMaxVoltage = a.getDWord(104);
-
-    mi.backupBatteryStatus = (enum rpcs::batterystates)a.getDWord(108);
-    mi.backupBatteryVoltage = a.getDWord(112);
-    mi.backupBatteryMaxVoltage = a.getDWord(116);
-    mi.externalPowerUsedTime.tv_low = a.getDWord(124);
-    mi.externalPowerUsedTime.tv_high = a.getDWord(128);
-    mi.externalPower = (a.getDWord(120) != 0);
-
     mtCacheS5mx |= 8;
     if (res == rfsv::E_PSI_GEN_NONE) {
 	if (!strcmp(mi.machineName, "SERIES5mx"))
@@ -134,10 +108,7 @@ regOpenIter(uint32_t uid, char *match, uint16_t &handle)
     Enum<rfsv::errs> res;
 
     cout << "Oiter" << endl;
-    a.addDWord(uid);
-    a.addDWord(strlen(match));
-    a.addStringT(match);
-    if (!sendCommand(rpcs::REG_OPEN_ITER, a))
+    if (!sendCommand<msgs::regOpenIter>(a, uid, strlen(match), match))
 	return rfsv::E_PSI_FILE_DISC;
     res = getResponse(a, true);
     cout << "ro: r=" << res << " a=" << a << endl;
@@ -153,8 +124,7 @@ regReadIter(uint16_t handle)
     Enum<rfsv::errs> res;
 
     cout << "Riter" << endl;
-    a.addWord(handle);
-    if (!sendCommand(rpcs::REG_READ_ITER, a))
+    if (!sendCommand<msgs::regReadIter>(a, handle))
 	return rfsv::E_PSI_FILE_DISC;
     res = getResponse(a, true);
     cout << "ro: r=" << res << " a=" << a << endl;
@@ -176,14 +146,11 @@ setTime(time_t time)
     if ((res = getMachineInfo(mi)) == rfsv::E_PSI_GEN_NONE) {
         if (PsiZone::getInstance().getZone(ptz)) {
             pt = PsiTime(time + ptz.utc_offset);
-            a.addDWord(pt.getPsiTimeLo());
-            a.addDWord(pt.getPsiTimeHi());
-            a.addDWord(mi.countryCode);
-            a.addDWord(ptz.utc_offset);
-            a.addDWord(ptz.dst_zones);
-            a.addDWord(ptz.home_zone);
             // cout << "a=" << a << endl;
-            if (!sendCommand(rpcs::SET_TIME, a))
+            if (!sendCommand<msgs::setTime>(a, pt.getPsiTimeLo(),
+                                            pt.getPsiTimeHi(), mi.countryCode,
+                                            ptz.utc_offset, ptz.dst_zones,
+                                            ptz.home_zone))
                 return rfsv::E_PSI_FILE_DISC;
             return rfsv::E_PSI_GEN_NONE;
         } else
@@ -198,12 +165,11 @@ configOpen(uint16_t &handle, uint32_t size)
     bufferStore a;
     Enum<rfsv::errs> res;
 
-    a.addDWord(size);
-    if (!sendCommand(rpcs::CONFIG_OPEN, a))
+    if (!sendCommand<msgs::configOpen>(a, size))
 	return rfsv::E_PSI_FILE_DISC;
     res = getResponse(a, true);
-    if (res == rfsv::E_PSI_GEN_NONE && (a.getLen() >= 2))
-	handle = a.getWord(0);
+    if (res == rfsv::E_PSI_GEN_NONE)
+	msgs::configOpen::response::decode(a, handle);
     return res;
 }
 
@@ -218,10 +184,7 @@ configRead(uint32_t size, bufferStore &ret)
     if ((res = configOpen(handle, size)) != rfsv::E_PSI_GEN_NONE)
 	return res;
     do {
-	a.init();
-	a.addWord(handle);
-	a.addDWord(2047);
-	if (!sendCommand(rpcs::CONFIG_READ, a))
+	if (!sendCommand<msgs::configRead>(a, handle, 2047))
 	    return rfsv::E_PSI_FILE_DISC;
 	if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE) {
 	    closeHandle(handle);
@@ -244,13 +207,10 @@ configWrite(bufferStore data)
     if ((res = configOpen(handle, data.getLen())) != rfsv::E_PSI_GEN_NONE)
 	return res;
     do {
-	a.init();
 	long l = (data.getLen() > 2047) ? 2047 : data.getLen();
-	a.addWord(handle);
-	a.addBuff(data, l);
-	data.discardFirstBytes(l);
-	if (!sendCommand(rpcs::CONFIG_WRITE, a))
+	if (!sendCommand<msgs::configWrite>(a, handle, bufferView(data).sub(0, l)))
 	    return rfsv::E_PSI_FILE_DISC;
+	data.discardFirstBytes(l);
 	if ((res = getResponse(a, true)) != rfsv::E_PSI_GEN_NONE) {
 	    closeHandle(handle);
 	    return res;
@@ -264,8 +224,7 @@ closeHandle(uint16_t handle)
 {
     bufferStore a;
 
-    a.addWord(handle);
-    if (!sendCommand(rpcs::CLOSE_HANDLE, a))
+    if (!sendCommand<msgs::closeHandle>(a, handle))
 	return rfsv::E_PSI_FILE_DISC;
     return getResponse(a, true);
 }
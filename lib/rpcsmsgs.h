@@ -0,0 +1,109 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _RPCSMSGS_H_
+#define _RPCSMSGS_H_
+
+#include "rpcs.h"
+#include "msgschema.h"
+
+/**
+ * The layouts of the commands of SYS$RPCS, shared by @ref rpcs16
+ * and @ref rpcs32 . The status, which getResponse() takes off a
+ * response, is not part of the layouts.
+ * @internal
+ */
+struct rpcs::msgs {
+    typedef msgLayout<msgStringT> name;
+
+    // major, minor
+    typedef msgCommand<QUERY_NCP, msgLayout<>,
+		       msgLayout<msgByte, msgByte> > queryNcp;
+    // program, padded; length of the arguments plus 1, ' ', arguments
+    typedef msgCommand<EXEC_PROG,
+		       msgLayout<msgStringTPad<128>, msgByte, msgByte,
+				 msgStringT> > execProg;
+    // drive; "NAME.$PID" and arguments of each process
+    typedef msgCommand<QUERY_DRIVE, msgLayout<msgByte>,
+		       msgLayout<msgBytes> > queryDrive;
+    typedef msgCommand<STOP_PROG, name> stopProg;
+    typedef msgCommand<QUERY_PROG, name> queryProg;
+    // drive letter, ':', 0; handle, count
+    typedef msgCommand<FORMAT_OPEN, msgLayout<msgByte, msgByte, msgByte>,
+		       msgLayout<msgWord, msgWord> > formatOpen;
+    typedef msgCommand<FORMAT_READ, msgLayout<msgWord> > formatRead;
+    typedef msgCommand<GET_UNIQUEID, name, msgLayout<msgDWord> > getUniqueId;
+    typedef msgCommand<GET_OWNERINFO, msgLayout<>,
+		       msgLayout<msgBytes> > getOwnerInfo;
+    typedef msgCommand<GET_MACHINETYPE, msgLayout<>,
+		       msgLayout<msgWord> > getMachineType;
+    typedef msgCommand<GET_CMDLINE, name, name> getCmdLine;
+    typedef msgCommand<FUSER, name, msgLayout<msgBytes> > fuser;
+    typedef msgCommand<QUIT_SERVER, msgLayout<> > quitServer;
+
+    typedef msgCommand<GET_MACHINE_INFO, msgLayout<>,
+		       msgLayout<
+	// machine type, ROM major, minor and build
+	msgDWord, msgByte, msgByte, msgWord, msgSkip<8>,
+	// machine name, display width and height, UID
+	msgChars<16>, msgDWord, msgDWord, msgQWord,
+	// time lo and hi, country, UTC offset, DST zones, home zone
+	msgDWord, msgDWord, msgDWord, msgDWord, msgDWord, msgDWord,
+	// main battery: insertion time lo and hi, status, used time lo
+	// and hi, current, used power, voltage, max. voltage
+	msgDWord, msgDWord, msgDWord, msgDWord, msgDWord, msgDWord,
+	msgDWord, msgDWord, msgDWord,
+	// backup battery: status, voltage, max. voltage
+	msgDWord, msgDWord, msgDWord,
+	// external power, its used time lo and hi
+	msgDWord, msgDWord, msgDWord, msgSkip<4>,
+	// RAM size, ROM size, max. free RAM, free RAM, RAM disk size,
+	// registry size, ROM programmable, UI language
+	msgDWord, msgDWord, msgDWord, msgDWord, msgDWord, msgDWord,
+	msgDWord, msgDWord, msgSkip<88> > > getMachineInfo;
+    static_assert(getMachineInfo::response::fixedLen == 256,
+		  "GET_MACHINE_INFO responses have 256 bytes");
+
+    typedef msgCommand<CLOSE_HANDLE, msgLayout<msgWord> > closeHandle;
+    // UID, length of match, match; handle
+    typedef msgCommand<REG_OPEN_ITER,
+		       msgLayout<msgDWord, msgDWord, msgStringT>,
+		       msgLayout<msgWord> > regOpenIter;
+    typedef msgCommand<REG_READ_ITER, msgLayout<msgWord> > regReadIter;
+    // time lo and hi, country, UTC offset, DST zones, home zone
+    typedef msgCommand<SET_TIME,
+		       msgLayout<msgDWord, msgDWord, msgDWord, msgDWord,
+				 msgDWord, msgDWord> > setTime;
+    // size; handle
+    typedef msgCommand<CONFIG_OPEN, msgLayout<msgDWord>,
+		       msgLayout<msgWord> > configOpen;
+    // handle, length
+    typedef msgCommand<CONFIG_READ, msgLayout<msgWord, msgDWord>,
+		       msgLayout<msgBytes> > configRead;
+    typedef msgCommand<CONFIG_WRITE, msgLayout<msgWord, msgBytes> > configWrite;
+};
+
+template <typename M, typename... A>
+bool rpcs::
+sendCommand(bufferStore &data, const A &... args)
+{
+    data.init();
+    M::request::encode(data, args...);
+    return sendCommand((enum commands)M::code, data);
+}
+
+#endif
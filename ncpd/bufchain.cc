@@ -0,0 +1,358 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <cstring>
+#include <new>
+#include <iomanip>
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include <bufferstore.h>
+
+#include "bufchain.h"
+
+using namespace std;
+
+struct bufferChain::block {
+    atomic<int> refs;
+    // The bytes from front to back are claimed by chains.
+    atomic<long> front;
+    atomic<long> back;
+    long size;
+    unsigned char data[1];
+};
+
+static atomic<unsigned long> copied(0);
+
+bufferChain::block *bufferChain::
+newBlock(long size, long headroom)
+{
+    void *m = malloc(sizeof(block) + headroom + size);
+    assert(m);
+    block *b = new (m) block;
+    b->refs.store(1, memory_order_relaxed);
+    b->front.store(headroom, memory_order_relaxed);
+    b->back.store(headroom, memory_order_relaxed);
+    b->size = headroom + size;
+    return b;
+}
+
+void bufferChain::
+ref(block *b)
+{
+    b->refs.fetch_add(1, memory_order_relaxed);
+}
+
+void bufferChain::
+unref(block *b)
+{
+    if (b->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+	b->~block();
+	free(b);
+    }
+}
+
+bufferChain::
+bufferChain()
+    : len(0)
+{
+}
+
+bufferChain::
+bufferChain(const bufferStore &b)
+    : len(0)
+{
+    addBytes((const unsigned char *)b.getString(0), b.getLen());
+}
+
+bufferChain::
+bufferChain(const unsigned char *buf, long _len)
+    : len(0)
+{
+    addBytes(buf, _len);
+}
+
+bufferChain::
+bufferChain(const bufferChain &c)
+    : segs(c.segs), len(c.len)
+{
+    for (size_t i = 0; i < segs.size(); i++)
+	ref(segs[i].b);
+}
+
+bufferChain::
+bufferChain(bufferChain &&c)
+    : segs(std::move(c.segs)), len(c.len)
+{
+    c.segs.clear();
+    c.len = 0;
+}
+
+bufferChain &bufferChain::
+operator =(const bufferChain &c)
+{
+    if (this != &c) {
+	for (size_t i = 0; i < c.segs.size(); i++)
+	    ref(c.segs[i].b);
+	release();
+	segs = c.segs;
+	len = c.len;
+    }
+    return *this;
+}
+
+bufferChain &bufferChain::
+operator =(bufferChain &&c)
+{
+    if (this != &c) {
+	release();
+	segs.swap(c.segs);
+	len = c.len;
+	c.len = 0;
+    }
+    return *this;
+}
+
+bufferChain::
+~bufferChain()
+{
+    release();
+}
+
+void bufferChain::
+release()
+{
+    for (size_t i = 0; i < segs.size(); i++)
+	unref(segs[i].b);
+    segs.clear();
+    len = 0;
+}
+
+void bufferChain::
+init()
+{
+    release();
+}
+
+unsigned char bufferChain::
+getByte(long pos) const
+{
+    for (size_t i = 0; i < segs.size(); i++) {
+	if (pos < segs[i].len)
+	    return segs[i].b->data[segs[i].off + pos];
+	pos -= segs[i].len;
+    }
+    return 0;
+}
+
+unsigned char *bufferChain::
+tailRoom(long n)
+{
+    // Extend the last slice in place, if nobody has claimed the
+    // bytes behind it yet. Otherwise, start a new block.
+    if (!segs.empty()) {
+	slice &s = segs.back();
+	long end = s.off + s.len;
+	if (end + n <= s.b->size &&
+	    s.b->back.compare_exchange_strong(end, end + n)) {
+	    s.len += n;
+	    len += n;
+	    return s.b->data + end;
+	}
+    }
+    slice s;
+    s.b = newBlock((n < MIN_LEN / 2) ? (long)MIN_LEN : 2 * n, HEADROOM);
+    s.off = HEADROOM;
+    s.len = n;
+    s.b->back.store(HEADROOM + n, memory_order_relaxed);
+    segs.push_back(s);
+    len += n;
+    return s.b->data + s.off;
+}
+
+unsigned char *bufferChain::
+headRoom(long n)
+{
+    // Likewise in front of the first slice.
+    if (!segs.empty()) {
+	slice &s = segs.front();
+	long start = s.off;
+	if ((start >= n) &&
+	    s.b->front.compare_exchange_strong(start, start - n)) {
+	    s.off -= n;
+	    s.len += n;
+	    len += n;
+	    return s.b->data + s.off;
+	}
+    }
+    slice s;
+    s.b = newBlock(n, HEADROOM);
+    s.off = HEADROOM;
+    s.len = n;
+    s.b->back.store(HEADROOM + n, memory_order_relaxed);
+    segs.insert(segs.begin(), s);
+    len += n;
+    return s.b->data + s.off;
+}
+
+void bufferChain::
+addByte(unsigned char c)
+{
+    *tailRoom(1) = c;
+    copied.fetch_add(1, memory_order_relaxed);
+}
+
+void bufferChain::
+addDWord(long dw)
+{
+    unsigned char *p = tailRoom(4);
+    p[0] = dw & 0xff;
+    p[1] = (dw >> 8) & 0xff;
+    p[2] = (dw >> 16) & 0xff;
+    p[3] = (dw >> 24) & 0xff;
+    copied.fetch_add(4, memory_order_relaxed);
+}
+
+void bufferChain::
+addBytes(const unsigned char *buf, long n)
+{
+    if (n <= 0)
+	return;
+    memcpy(tailRoom(n), buf, n);
+    copied.fetch_add(n, memory_order_relaxed);
+}
+
+void bufferChain::
+addChain(const bufferChain &c, long pos, long maxLen)
+{
+    long n = c.len - pos;
+    if ((maxLen >= 0) && (maxLen < n))
+	n = maxLen;
+    for (size_t i = 0; (i < c.segs.size()) && (n > 0); i++) {
+	slice s = c.segs[i];
+	if (pos >= s.len) {
+	    pos -= s.len;
+	    continue;
+	}
+	s.off += pos;
+	s.len -= pos;
+	pos = 0;
+	if (s.len > n)
+	    s.len = n;
+	ref(s.b);
+	segs.push_back(s);
+	len += s.len;
+	n -= s.len;
+    }
+}
+
+void bufferChain::
+prependByte(unsigned char c)
+{
+    *headRoom(1) = c;
+    copied.fetch_add(1, memory_order_relaxed);
+}
+
+void bufferChain::
+prependWord(int w)
+{
+    unsigned char *p = headRoom(2);
+    p[0] = w & 0xff;
+    p[1] = (w >> 8) & 0xff;
+    copied.fetch_add(2, memory_order_relaxed);
+}
+
+void bufferChain::
+discardFirstBytes(long n)
+{
+    while ((n > 0) && !segs.empty()) {
+	slice &s = segs.front();
+	if (n < s.len) {
+	    s.off += n;
+	    s.len -= n;
+	    len -= n;
+	    return;
+	}
+	n -= s.len;
+	len -= s.len;
+	unref(s.b);
+	segs.erase(segs.begin());
+    }
+}
+
+const unsigned char *bufferChain::
+segment(int i, long &segLen) const
+{
+    segLen = segs[i].len;
+    return segs[i].b->data + segs[i].off;
+}
+
+const unsigned char *bufferChain::
+getBytes()
+{
+    if (segs.size() > 1) {
+	bufferChain c;
+	unsigned char *p = c.tailRoom(len);
+	for (size_t i = 0; i < segs.size(); i++) {
+	    memcpy(p, segs[i].b->data + segs[i].off, segs[i].len);
+	    p += segs[i].len;
+	}
+	copied.fetch_add(len, memory_order_relaxed);
+	*this = std::move(c);
+    }
+    if (segs.empty())
+	return NULL;
+    return segs[0].b->data + segs[0].off;
+}
+
+void bufferChain::
+copyTo(bufferStore &b) const
+{
+    b.init();
+    for (size_t i = 0; i < segs.size(); i++)
+	b.addBytes(segs[i].b->data + segs[i].off, segs[i].len);
+    copied.fetch_add(len, memory_order_relaxed);
+}
+
+unsigned long bufferChain::
+copiedBytes()
+{
+    return copied.load(memory_order_relaxed);
+}
+
+ostream &operator<<(ostream &s, const bufferChain &c) {
+    // save stream flags
+    ostream::fmtflags old = s.flags();
+
+    for (long i = 0; i < c.len; i++)
+	s << hex << setw(2) << setfill('0') << (int)c.getByte(i) << " ";
+
+    // restore stream flags
+    s.flags(old);
+    s << "(";
+
+    for (long i = 0; i < c.len; i++) {
+	unsigned char ch = c.getByte(i);
+	s << (unsigned char)(isprint(ch) ? ch : '.');
+    }
+
+    return s << ")";
+}
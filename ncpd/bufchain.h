@@ -0,0 +1,190 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _bufchain_h
+#define _bufchain_h
+
+#include "config.h"
+
+#include <atomic>
+#include <ostream>
+#include <vector>
+
+class bufferStore;
+
+/**
+ * A sequence of bytes, made up of slices of reference counted
+ * blocks.
+ *
+ * Copying a chain, appending a part of one chain to another or
+ * discarding bytes at its start copies no data, so a frame can be
+ * cut out of a message, queued and retransmitted without its
+ * payload being copied again. New blocks leave some headroom in
+ * front of their data, so that the link and NCP headers can be
+ * prepended in place.
+ *
+ * The bytes a chain has written into a block are never changed
+ * again, and any number of chains in any threads may read them.
+ * A chain only writes to the bytes in front of or behind the
+ * data in a block, after claiming them atomically, so that it
+ * never writes to bytes another chain refers to.
+ */
+class bufferChain {
+public:
+    /**
+     * Constructs an empty chain.
+     */
+    bufferChain();
+
+    /**
+     * Constructs a chain with a copy of the content of a bufferStore.
+     */
+    bufferChain(const bufferStore &b);
+
+    /**
+     * Constructs a chain with a copy of some data.
+     */
+    bufferChain(const unsigned char *buf, long len);
+
+    bufferChain(const bufferChain &c);
+    bufferChain(bufferChain &&c);
+    bufferChain &operator =(const bufferChain &c);
+    bufferChain &operator =(bufferChain &&c);
+    ~bufferChain();
+
+    /**
+     * Get the length of the content in bytes.
+     */
+    long getLen() const { return len; }
+
+    /**
+     * Tests if the chain is empty.
+     */
+    bool empty() const { return len == 0; }
+
+    /**
+     * Get the byte at index @p pos.
+     */
+    unsigned char getByte(long pos = 0) const;
+
+    /**
+     * Remove all content.
+     */
+    void init();
+
+    /**
+     * Append a byte.
+     */
+    void addByte(unsigned char c);
+
+    /**
+     * Append a dword, least significant byte first.
+     */
+    void addDWord(long dw);
+
+    /**
+     * Append a copy of some data.
+     */
+    void addBytes(const unsigned char *buf, long len);
+
+    /**
+     * Append a part of another chain, without copying its data.
+     *
+     * @param c The chain to append from.
+     * @param pos The index of the first byte to append.
+     * @param maxLen The number of bytes to append. If less than 0,
+     *               everything from @p pos on is appended.
+     */
+    void addChain(const bufferChain &c, long pos = 0, long maxLen = -1);
+
+    /**
+     * Prepend a byte.
+     */
+    void prependByte(unsigned char c);
+
+    /**
+     * Prepend a word, least significant byte first.
+     */
+    void prependWord(int w);
+
+    /**
+     * Remove bytes from the start.
+     */
+    void discardFirstBytes(long n);
+
+    /**
+     * Get the number of contiguous pieces of the content.
+     */
+    int segments() const { return segs.size(); }
+
+    /**
+     * Get a contiguous piece of the content.
+     *
+     * @param i The index of the piece, from 0 to segments() - 1.
+     * @param segLen Set to the length of the piece.
+     *
+     * @returns A pointer to the data of the piece.
+     */
+    const unsigned char *segment(int i, long &segLen) const;
+
+    /**
+     * Get the whole content as contiguous bytes. If it is spread
+     * over more than one block, it is copied into a new one first.
+     */
+    const unsigned char *getBytes();
+
+    /**
+     * Copy the whole content into a bufferStore, replacing its
+     * previous content.
+     */
+    void copyTo(bufferStore &b) const;
+
+    /**
+     * Get the number of bytes copied by all chains so far, while
+     * taking over data, assembling it or making it contiguous.
+     */
+    static unsigned long copiedBytes();
+
+    /**
+     * Prints a dump of the content, like that of a bufferStore.
+     */
+    friend std::ostream &operator<<(std::ostream &s, const bufferChain &c);
+
+private:
+    struct block;
+    struct slice {
+	block *b;
+	long off;
+	long len;
+    };
+
+    // Room for the NCP and link headers in front of new blocks
+    enum { HEADROOM = 8, MIN_LEN = 256 };
+
+    static block *newBlock(long size, long headroom);
+    static void ref(block *b);
+    static void unref(block *b);
+
+    unsigned char *tailRoom(long n);
+    unsigned char *headRoom(long n);
+    void release();
+
+    std::vector<slice> segs;
+    long len;
+};
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <cstring>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+
+#define RINGLEN (1024 * 1024) // Must be a power of 2
+#define RINGMASK (RINGLEN - 1)
+
+void *
+capture_run(void *arg)
+{
+    ((capture *)arg)->writer();
+    return NULL;
+}
+
+capture::
+capture(const char *fname)
+{
+    head = tail = 0;
+    stop = false;
+    idle = false;
+    ring = NULL;
+    fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+	return;
+
+    unsigned char hdr[CAPTURE_MAGIC_LEN + 4];
+    uint32_t ver = htonl(CAPTURE_VERSION);
+    memcpy(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    memcpy(hdr + CAPTURE_MAGIC_LEN, &ver, 4);
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+	close(fd);
+	fd = -1;
+	return;
+    }
+    ring = new unsigned char[RINGLEN];
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+    pthread_create(&thread, NULL, capture_run, this);
+}
+
+capture::
+~capture()
+{
+    if (fd == -1)
+	return;
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+    close(fd);
+    delete []ring;
+}
+
+bool capture::
+isOpen()
+{
+    return (fd != -1);
+}
+
+unsigned long capture::
+getDropped()
+{
+    return dropped.get();
+}
+
+void capture::
+put(const unsigned char *data, long len)
+{
+    // Caller must hold mutex and have checked for space
+    while (len > 0) {
+	long n = RINGLEN - (head & RINGMASK);
+	if (n > len)
+	    n = len;
+	memcpy(&ring[head & RINGMASK], data, n);
+	head += n;
+	data += n;
+	len -= n;
+    }
+}
+
+void capture::
+add(enum captureType type, const unsigned char *data, long len)
+{
+    struct timespec now;
+    uint32_t hdr[4];
+
+    if (fd == -1)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hdr[0] = htonl(now.tv_sec);
+    hdr[1] = htonl(now.tv_nsec);
+    hdr[2] = htonl(type);
+    hdr[3] = htonl(len);
+
+    pthread_mutex_lock(&mutex);
+    if ((head - tail) + CAPTURE_HEADER_LEN + len > RINGLEN) {
+	pthread_mutex_unlock(&mutex);
+	dropped.add();
+	return;
+    }
+    put((const unsigned char *)hdr, CAPTURE_HEADER_LEN);
+    put(data, len);
+    if (idle) {
+	idle = false;
+	pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void capture::
+add(enum captureType type, unsigned long val)
+{
+    uint32_t v = htonl(val);
+    add(type, (const unsigned char *)&v, sizeof(v));
+}
+
+void capture::
+writer()
+{
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+	while ((head == tail) && !stop) {
+	    idle = true;
+	    pthread_cond_wait(&cond, &mutex);
+	}
+	if (head == tail)
+	    break;
+	// Write up to the end of the ring at once. The space is
+	// only handed back after writing, so it is not overwritten.
+	unsigned long t = tail;
+	long n = head - t;
+	if (n > (long)(RINGLEN - (t & RINGMASK)))
+	    n = RINGLEN - (t & RINGMASK);
+	pthread_mutex_unlock(&mutex);
+	long done = 0;
+	while (done < n) {
+	    int res = write(fd, &ring[(t & RINGMASK) + done], n - done);
+	    if (res < 0) {
+		if (errno == EINTR)
+		    continue;
+		break;
+	    }
+	    done += res;
+	}
+	pthread_mutex_lock(&mutex);
+	// On a write error, the data is dropped all the same.
+	tail = t + n;
+    }
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,115 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _capture_h_
+#define _capture_h_
+
+#include "config.h"
+#include <pthread.h>
+
+#include "stats.h"
+
+/**
+ * A capture file starts with the 8 byte magic, followed by
+ * a 32 bit version. Then records follow, each with a header of
+ * four 32 bit values: seconds and nanoseconds of the monotonic
+ * clock, record type and data length. All values are stored
+ * in network byte order.
+ */
+#define CAPTURE_MAGIC "PLPCAP\r\n"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LEN 16
+
+/**
+ * Types of records in a capture file.
+ */
+enum captureType {
+    CAP_OPEN = 1,      // serial line opened, data is the baud rate
+    CAP_RAW_RX = 2,    // bytes read from the serial line
+    CAP_RAW_TX = 3,    // bytes written to the serial line
+    CAP_FRAME_RX = 4,  // payload of a received frame
+    CAP_FRAME_TX = 5,  // payload of a frame queued for sending
+    CAP_CRC_ERROR = 6  // payload of a received frame with a bad CRC
+};
+
+/**
+ * Records the traffic on the serial line into a file.
+ *
+ * Records are only copied into a ring buffer by the caller,
+ * a separate thread writes them out, so the data pump never
+ * waits for the disk. If the ring is full, records are dropped
+ * and counted.
+ */
+class capture {
+public:
+    /**
+     * Create a new capture.
+     *
+     * @param fname The name of the file to write to. It is
+     *              truncated if it exists.
+     */
+    capture(const char *fname);
+
+    /**
+     * Write out all pending records and close the file.
+     */
+    ~capture();
+
+    /**
+     * Check, whether the file could be created.
+     */
+    bool isOpen();
+
+    /**
+     * Add a record, stamped with the current time.
+     *
+     * @param type The type of the record.
+     * @param data The data of the record.
+     * @param len The length of the data.
+     */
+    void add(enum captureType type, const unsigned char *data, long len);
+
+    /**
+     * Add a record with a single 32 bit value.
+     */
+    void add(enum captureType type, unsigned long val);
+
+    /**
+     * Get the number of records dropped because the ring was full.
+     */
+    unsigned long getDropped();
+
+private:
+    friend void *capture_run(void *);
+
+    void put(const unsigned char *data, long len);
+    void writer();
+
+    int fd;
+    unsigned char *ring;
+    unsigned long head;
+    unsigned long tail;
+    bool stop;
+    bool idle;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    statCounter dropped;
+};
+
+#endif
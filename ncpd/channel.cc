@@ -84,6 +84,30 @@ ncpDisconnect()
     ncpController->disconnect(ncpChannel);
 }
 
+bool channel::
+ncpHandOver(channel *to)
+{
+    if (!ncpController->handOver(ncpChannel, to))
+	return false;
+    ncpChannel = 0;
+    return true;
+}
+
+void channel::
+ncpRelease()
+{
+    // Called by the destructor of each kind of channel, before
+    // anything of it is gone.
+    if (ncpController)
+	ncpController->releaseChannel(this);
+}
+
+void channel::
+ncpFlowControl(bool stop)
+{
+    ncpController->flowControl(ncpChannel, stop);
+}
+
 PcServer *channel::
 ncpFindPcServer(const char *name)
 {
@@ -108,6 +132,23 @@ ncpGetSpeed()
     return ncpController->getSpeed();
 }
 
+void channel::
+ncpGetQueueStatus(bufferStore &a)
+{
+    ncpController->getQueueStatus(a);
+}
+
+void channel::
+ncpGetStats(std::ostream &s)
+{
+    ncpController->getStats(s);
+}
+
+void channel::
+getStats(std::ostream &, const std::string &)
+{
+}
+
 short int channel::
 ncpProtocolVersion()
 {
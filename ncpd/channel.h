@@ -23,6 +23,9 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <ostream>
+#include <string>
+#include <atomic>
 
 class ncp;
 class bufferStore;
@@ -50,6 +53,9 @@ public:
     virtual void ncpConnectNak() = 0;
     virtual void ncpRegisterAck() = 0;
     void ncpDisconnect();
+    void ncpRelease();
+    bool ncpHandOver(channel *to);
+    void ncpFlowControl(bool stop);
     short int ncpProtocolVersion();
     const char *getNcpConnectName();
     void setNcpConnectName(const char *);
@@ -62,6 +68,17 @@ public:
     void ncpRegisterPcServer(ppsocket *skt, const char *name);
     void ncpUnregisterPcServer(PcServer *server);
     int ncpGetSpeed();
+    void ncpGetQueueStatus(bufferStore &a);
+    void ncpGetStats(std::ostream &s);
+
+    /**
+     * Print channel specific statistics. The default
+     * implementation prints nothing.
+     *
+     * @param s The stream to print on.
+     * @param prefix The prefix for each key.
+     */
+    virtual void getStats(std::ostream &s, const std::string &prefix);
 
 protected:
     short int verbose;
@@ -70,7 +87,7 @@ protected:
 private:
     ncp *ncpController;
     int ncpChannel;
-    bool _terminate;
+    std::atomic<bool> _terminate;
 };
 
 #endif
@@ -0,0 +1,273 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <bufferstore.h>
+
+#include "chanpool.h"
+#include "socketchan.h"
+#include "ncp.h"
+#include "main.h"
+
+using namespace std;
+
+poolChan::
+poolChan(ncp *_ncpController, const char *_service)
+    : channel(_ncpController)
+{
+    service = strdup(_service);
+    connected = false;
+    connectTry = 1;
+    tryStamp = time(0);
+    handedTo = NULL;
+    pthread_mutex_init(&pendingMutex, NULL);
+    // Like a client announcing the service, see socketChan::socketPoll
+    if (strncmp(service, "SYS$RFSV", 8) == 0)
+	ncpConnect();
+    else
+	ncpRegister();
+}
+
+poolChan::
+~poolChan()
+{
+    ncpRelease();
+    pthread_mutex_destroy(&pendingMutex);
+    free(service);
+}
+
+void poolChan::
+ncpDataCallback(bufferStore &a)
+{
+    // Servers only answer requests, so this should not happen.
+    pthread_mutex_lock(&pendingMutex);
+    if (handedTo)
+	handedTo->ncpDataCallback(a);
+    else
+	pending.append(a);
+    pthread_mutex_unlock(&pendingMutex);
+}
+
+const char *poolChan::
+getNcpRegisterName()
+{
+    return service;
+}
+
+void poolChan::
+ncpConnectAck()
+{
+    connected = true;
+}
+
+void poolChan::
+ncpRegisterAck()
+{
+    connectTry++;
+    ncpConnect();
+}
+
+void poolChan::
+ncpConnectTerminate()
+{
+    ncpDisconnect();
+}
+
+void poolChan::
+ncpConnectNak()
+{
+    if (connectTry > 1)
+	ncpConnectTerminate();
+    else {
+	connectTry++;
+	tryStamp = time(0);
+	ncpRegister();
+    }
+}
+
+bool poolChan::
+isStale(time_t now) const
+{
+    return !connected && (now > tryStamp + 15);
+}
+
+void poolChan::
+drop()
+{
+    if (!terminate())
+	ncpDisconnect();
+}
+
+bool poolChan::
+handOver(socketChan *client)
+{
+    if (!ncpHandOver(client))
+	return false;
+    client->setNcpConnectName(getNcpConnectName());
+    client->ncpConnectAck();
+    pthread_mutex_lock(&pendingMutex);
+    handedTo = client;
+    while (!pending.empty()) {
+	client->ncpDataCallback(pending[0]);
+	pending.pop();
+    }
+    pthread_mutex_unlock(&pendingMutex);
+    terminateWhenAsked();
+    return true;
+}
+
+chanPool::
+chanPool(int _idle, bool _verbose)
+{
+    theNCP = NULL;
+    idle = _idle;
+    verbose = _verbose;
+    linkUp = false;
+}
+
+chanPool::
+~chanPool()
+{
+    for (size_t i = 0; i < services.size(); i++) {
+	service *s = services[i];
+	for (size_t j = 0; j < s->chans.size(); j++)
+	    delete s->chans[j];
+	delete s;
+    }
+    for (size_t i = 0; i < done.size(); i++)
+	delete done[i];
+}
+
+void chanPool::
+addService(const char *name, int count)
+{
+    service *s = new service;
+    s->name = name;
+    s->count = count;
+    s->lastUse = time(0);
+    services.push_back(s);
+}
+
+void chanPool::
+setNcp(ncp *ncpController)
+{
+    theNCP = ncpController;
+}
+
+bool chanPool::
+take(const char *name, socketChan *client)
+{
+    for (size_t i = 0; i < services.size(); i++) {
+	service &s = *services[i];
+	if (s.name != name)
+	    continue;
+	s.lastUse = time(0);
+	for (size_t j = 0; j < s.chans.size(); j++) {
+	    poolChan *c = s.chans[j];
+	    if (c->isConnected() && !c->terminate() && c->handOver(client)) {
+		// The NCP may still be calling it, so delete it later.
+		done.push_back(c);
+		s.chans.erase(s.chans.begin() + j);
+		s.hits.add();
+		fill(s);
+		return true;
+	    }
+	}
+	s.misses.add();
+	fill(s);
+	return false;
+    }
+    return false;
+}
+
+void chanPool::
+fill(service &s)
+{
+    if (!theNCP || !theNCP->gotLinkChannel())
+	return;
+    while ((int)s.chans.size() < s.count) {
+	poolChan *c = new poolChan(theNCP, s.name.c_str());
+	if (c->getNcpChannel() <= 0) {
+	    // Out of channels
+	    done.push_back(c);
+	    break;
+	}
+	if (verbose)
+	    lout << "chanpool: opening " << s.name << " channel "
+		 << c->getNcpChannel() << endl;
+	s.chans.push_back(c);
+    }
+}
+
+void chanPool::
+poll()
+{
+    time_t now = time(0);
+
+    for (size_t i = 0; i < done.size(); i++)
+	delete done[i];
+    done.clear();
+    // Fill up as soon as the Psion is there.
+    bool up = theNCP && theNCP->gotLinkChannel();
+    bool arrived = up && !linkUp;
+    linkUp = up;
+    for (size_t i = 0; i < services.size(); i++) {
+	service &s = *services[i];
+	if (arrived)
+	    s.lastUse = now;
+	bool expire = (now > s.lastUse + idle);
+	for (size_t j = 0; j < s.chans.size(); j++) {
+	    poolChan *c = s.chans[j];
+	    if (!c->terminate() && !expire && !c->isStale(now))
+		continue;
+	    if (!c->terminate()) {
+		if (verbose)
+		    lout << "chanpool: closing " << s.name << " channel "
+			 << c->getNcpChannel() << endl;
+		if (expire)
+		    s.expired.add();
+		c->drop();
+	    }
+	    done.push_back(c);
+	    s.chans.erase(s.chans.begin() + j);
+	    j--;
+	}
+	if (!expire)
+	    fill(s);
+    }
+}
+
+void chanPool::
+getStats(ostream &o)
+{
+    for (size_t i = 0; i < services.size(); i++) {
+	service &s = *services[i];
+	int ready = 0;
+	for (size_t j = 0; j < s.chans.size(); j++)
+	    if (s.chans[j]->isConnected() && !s.chans[j]->terminate())
+		ready++;
+	string p = "pool." + s.name;
+	o << p << ".ready " << ready << "\n";
+	o << p << ".hits " << s.hits.get() << "\n";
+	o << p << ".misses " << s.misses.get() << "\n";
+	o << p << ".expired " << s.expired.get() << "\n";
+    }
+}
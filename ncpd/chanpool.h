@@ -0,0 +1,172 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _chanpool_h_
+#define _chanpool_h_
+
+#include "config.h"
+#include <pthread.h>
+#include <time.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "bufferarray.h"
+#include "channel.h"
+#include "stats.h"
+
+class socketChan;
+
+/**
+ * An NCP channel connected to a service of the Psion ahead of time,
+ * and waiting for a client to take it over.
+ */
+class poolChan : public channel {
+public:
+    poolChan(ncp *ncpController, const char *service);
+    virtual ~poolChan();
+
+    void ncpDataCallback(bufferStore &a);
+    const char *getNcpRegisterName();
+    void ncpConnectAck();
+    void ncpRegisterAck();
+    void ncpConnectTerminate();
+    void ncpConnectNak();
+
+    /**
+     * Tests if the Psion has accepted the connection.
+     */
+    bool isConnected() const { return connected; }
+
+    /**
+     * Tests if the Psion has not answered the connect for too long.
+     */
+    bool isStale(time_t now) const;
+
+    /**
+     * Give up the channel, telling the Psion.
+     */
+    void drop();
+
+    /**
+     * Pass the connected NCP channel on to a client. Anything the
+     * Psion has sent meanwhile is passed on as well, and this
+     * instance is left to be deleted.
+     *
+     * @returns true on success, false if the channel is no longer
+     *          connected.
+     */
+    bool handOver(socketChan *client);
+
+private:
+    char *service;
+    // Set by the NCP callbacks on the pump thread as well
+    std::atomic<bool> connected;
+    std::atomic<int> connectTry;
+    std::atomic<time_t> tryStamp;
+    socketChan *handedTo;
+    bufferArray pending;
+    pthread_mutex_t pendingMutex;
+};
+
+/**
+ * Keeps a number of NCP channels connected to some services, so
+ * that a new client of one of them does not have to wait for the
+ * Psion to accept its connection.
+ *
+ * A pool is filled up while clients keep asking for its service,
+ * and is emptied, once none has done so for a while. Channels are
+ * never given back to a pool after a client has used them, as the
+ * server on the Psion keeps the state of a session, e.g. its open
+ * files, until the channel is closed.
+ */
+class chanPool {
+public:
+    /**
+     * Constructs an empty pool.
+     *
+     * @param idle Seconds without a client asking for a service,
+     *             until its channels are closed.
+     * @param verbose If true, log opening and closing channels.
+     */
+    chanPool(int idle = 60, bool verbose = false);
+    ~chanPool();
+
+    /**
+     * Keep channels connected to a service.
+     *
+     * @param service The name a client announces for the service,
+     *                e.g. SYS$RFSV.
+     * @param count The number of channels.
+     */
+    void addService(const char *service, int count);
+
+    /**
+     * Tests if no service has been added.
+     */
+    bool empty() const { return services.empty(); }
+
+    /**
+     * Set the NCP to connect on.
+     */
+    void setNcp(ncp *ncpController);
+
+    /**
+     * Hand a connected channel to a new client, if one is ready.
+     *
+     * @param service The name the client has announced.
+     * @param client The client.
+     *
+     * @returns true, if the client got a channel.
+     */
+    bool take(const char *service, socketChan *client);
+
+    /**
+     * Close idle channels, drop those the Psion did not accept and
+     * connect new ones as needed. This is called periodically from
+     * the main loop.
+     */
+    void poll();
+
+    /**
+     * Print the statistics as "key value" lines.
+     */
+    void getStats(std::ostream &s);
+
+private:
+    struct service {
+	std::string name;
+	int count;
+	time_t lastUse;
+	std::vector<poolChan *> chans;
+	statCounter hits;
+	statCounter misses;
+	statCounter expired;
+    };
+
+    void fill(service &s);
+
+    ncp *theNCP;
+    int idle;
+    bool verbose;
+    bool linkUp;
+    std::vector<service *> services;
+    std::vector<poolChan *> done;
+};
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <string>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <iowatch.h>
+
+#include "devwatch.h"
+
+// Interrupts TIOCMIWAIT, when the line watcher is stopped.
+#define LINE_SIGNAL SIGUSR1
+
+using namespace std;
+
+extern "C" {
+
+static void
+line_signal(int)
+{
+}
+
+};
+
+void *devWatch::
+lineWatch(void *arg)
+{
+#ifdef TIOCMIWAIT
+    devWatch *w = (devWatch *)arg;
+    while (!w->lineStop) {
+	if (ioctl(w->lineFd, TIOCMIWAIT,
+		  TIOCM_DSR | TIOCM_CAR | TIOCM_CTS) == 0) {
+	    w->notify();
+	    continue;
+	}
+	if (errno == EINTR)
+	    continue;
+	// EIO means the device has been hung up, anything
+	// else that it cannot tell about its lines after all.
+	if (errno == EIO)
+	    w->notify();
+	break;
+    }
+    w->lineRunning = false;
+#endif
+    return NULL;
+}
+
+devWatch::
+devWatch(const char *devname)
+{
+    path = devname;
+    lineFd = -1;
+    lineStop = false;
+    lineRunning = false;
+    notifyWatch = -1;
+
+    // Without SA_RESTART, the signal makes TIOCMIWAIT fail
+    // with EINTR, instead of restarting it.
+    struct sigaction sa;
+    sa.sa_handler = line_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(LINE_SIGNAL, &sa, NULL);
+
+#ifdef HAVE_SYS_INOTIFY_H
+    notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    notifyFd = -1;
+#endif
+    watchNode();
+}
+
+devWatch::
+~devWatch()
+{
+    stopLines();
+    if (notifyFd != -1)
+	close(notifyFd);
+}
+
+void devWatch::
+watchLines(int fd)
+{
+#ifdef TIOCMIWAIT
+    int arg;
+
+    if (lineFd != -1)
+	stopLines();
+    // No modem lines (pseudo terminal or some USB adaptors).
+    if (ioctl(fd, TIOCMGET, &arg) < 0)
+	return;
+    lineFd = fd;
+    lineStop = false;
+    lineRunning = true;
+    if (pthread_create(&lineThread, NULL, lineWatch, this) != 0) {
+	lineRunning = false;
+	lineFd = -1;
+    }
+#endif
+}
+
+void devWatch::
+stopLines()
+{
+    if (lineFd == -1)
+	return;
+    lineStop = true;
+    // The signal may come before the thread enters TIOCMIWAIT,
+    // so repeat it until the thread is gone.
+    while (lineRunning) {
+	pthread_kill(lineThread, LINE_SIGNAL);
+	usleep(1000);
+    }
+    pthread_join(lineThread, NULL);
+    lineFd = -1;
+}
+
+void devWatch::
+notify()
+{
+    lineWake.signal();
+}
+
+void devWatch::
+addTo(IOWatch &iow)
+{
+    iow.addIO(lineWake.fd());
+    if (notifyFd != -1)
+	iow.addIO(notifyFd);
+}
+
+bool devWatch::
+changed(IOWatch &iow)
+{
+    bool res = false;
+
+    if (iow.isReady(lineWake.fd())) {
+	lineWake.clear();
+	res = true;
+    }
+#ifdef HAVE_SYS_INOTIFY_H
+    if ((notifyFd == -1) || !iow.isReady(notifyFd))
+	return res;
+    bool rewatch = false;
+    char buf[4096]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int len;
+    while ((len = read(notifyFd, buf, sizeof(buf))) > 0) {
+	const struct inotify_event *e;
+	for (char *p = buf; p < buf + len; p += sizeof(*e) + e->len) {
+	    e = (const struct inotify_event *)p;
+	    if (e->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+		rewatch = true;
+	    else if (e->len && (notifyName == e->name)) {
+		if (notifyIsNode)
+		    res = true;
+		else
+		    rewatch = true;
+	    }
+	}
+    }
+    if (rewatch) {
+	// A directory on the path came or went. The node may
+	// have been created in it before it is watched.
+	watchNode();
+	res = true;
+    }
+#endif
+    return res;
+}
+
+void devWatch::
+watchNode()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (notifyFd == -1)
+	return;
+    if (notifyWatch != -1)
+	inotify_rm_watch(notifyFd, notifyWatch);
+    notifyWatch = -1;
+    // Watch the deepest existing directory on the path, e.g.
+    // /dev/serial/by-id only exists while an adaptor is plugged in.
+    string dir = path;
+    notifyIsNode = true;
+    for (;;) {
+	string::size_type slash = dir.rfind('/');
+	if (slash == string::npos) {
+	    notifyName = dir;
+	    dir = ".";
+	} else {
+	    notifyName = dir.substr(slash + 1);
+	    dir = (slash == 0) ? string("/") : dir.substr(0, slash);
+	}
+	if (notifyName.empty()) {
+	    // Trailing or duplicate slash
+	    if (dir == "/")
+		return;
+	    continue;
+	}
+	notifyWatch = inotify_add_watch(notifyFd, dir.c_str(),
+					IN_CREATE | IN_DELETE | IN_ATTRIB |
+					IN_MOVED_FROM | IN_MOVED_TO |
+					IN_DELETE_SELF | IN_MOVE_SELF);
+	if ((notifyWatch != -1) || (dir == "/") || (dir == "."))
+	    return;
+	notifyIsNode = false;
+    }
+#endif
+}
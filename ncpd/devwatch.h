@@ -0,0 +1,107 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _devwatch_h
+#define _devwatch_h
+
+#include "config.h"
+
+#include <pthread.h>
+#include <atomic>
+#include <string>
+
+#include "ringbuf.h"
+
+class IOWatch;
+
+/**
+ * Watches for a Psion coming and going on the serial device.
+ *
+ * The modem status lines DSR, DCD and CTS of the open device are
+ * waited for with TIOCMIWAIT in a thread of their own, and the
+ * device node is watched with inotify, so that a USB serial
+ * adaptor is noticed as soon as its node shows up again. On any
+ * change, the descriptors added by @ref addTo become readable,
+ * and the main loop can check the link at once, instead of on
+ * its next periodic check.
+ */
+class devWatch {
+public:
+    /**
+     * Constructs a new watcher.
+     *
+     * @param devname The path of the serial device.
+     */
+    devWatch(const char *devname);
+    ~devWatch();
+
+    /**
+     * Start watching the modem status lines of the open device.
+     * Nothing happens, if the device has none.
+     *
+     * @param fd The file descriptor of the device.
+     */
+    void watchLines(int fd);
+
+    /**
+     * Stop watching the modem status lines. This must be called
+     * before the device is closed.
+     */
+    void stopLines();
+
+    /**
+     * Report a change. This may be called from any thread.
+     */
+    void notify();
+
+    /**
+     * Add the descriptors to wait for to an IOWatch.
+     */
+    void addTo(IOWatch &iow);
+
+    /**
+     * Check for changes after IOWatch::watch returned.
+     *
+     * @returns true, if the device may have come or gone since
+     *          the last call.
+     */
+    bool changed(IOWatch &iow);
+
+private:
+    /**
+     * The thread waiting for changes of the modem status lines.
+     */
+    static void *lineWatch(void *arg);
+
+    void watchNode();
+
+    std::string path;
+    wakeupEvent lineWake;
+    int lineFd;
+    pthread_t lineThread;
+    std::atomic<bool> lineStop;
+    std::atomic<bool> lineRunning;
+
+    int notifyFd;
+    int notifyWatch;
+    // The entry looked for in the watched directory, and whether
+    // it is the device node itself or a directory on its path.
+    std::string notifyName;
+    bool notifyIsNode;
+};
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <cstring>
+
+#include "framing.h"
+
+frameCodec::
+frameCodec()
+{
+    crc_table[0][0] = 0;
+    for (int i = 0; i < 128; i++) {
+	unsigned int carry = crc_table[0][i] & 0x8000;
+	unsigned int tmp = (crc_table[0][i] << 1) & 0xffff;
+	crc_table[0][i * 2 + (carry ? 0 : 1)] = tmp ^ 0x1021;
+	crc_table[0][i * 2 + (carry ? 1 : 0)] = tmp;
+    }
+    // crc_table[n][i] is the CRC of byte i followed by n zero bytes.
+    for (int n = 1; n < 4; n++)
+	for (int i = 0; i < 256; i++) {
+	    unsigned short c = crc_table[n - 1][i];
+	    crc_table[n][i] = (c << 8) ^ crc_table[0][c >> 8];
+	}
+    resetDecoder();
+}
+
+void frameCodec::
+resetDecoder()
+{
+    esc = false;
+    lastSYN = startPkt = -1;
+    crcIn = inCRCstate = 0;
+    receivedCRC = 0;
+}
+
+unsigned short frameCodec::
+crc(unsigned short crc, const unsigned char *a, long len) const
+{
+    // Slicing-by-4: the CRC register is folded into the first two
+    // bytes of each block, then all four bytes are looked up at once.
+    while (len >= 4) {
+	crc = crc_table[3][(crc >> 8) ^ a[0]] ^
+	    crc_table[2][(crc & 0xff) ^ a[1]] ^
+	    crc_table[1][a[2]] ^
+	    crc_table[0][a[3]];
+	a += 4;
+	len -= 4;
+    }
+    while (len-- > 0)
+	addToCrc(*a++, &crc);
+    return crc;
+}
+
+void frameCodec::
+encode(ringBuffer &out, const bufferChain &b, bool epoc) const
+{
+    static const unsigned char header[] = { 0x16, 0x10, 0x02 };
+    static const unsigned char dle[] = { 0x10, 0x10 };
+    static const unsigned char etx[] = { 0x10, 0x04 };
+    unsigned short crcOut = 0;
+    long len;
+
+    // The frame is escaped straight from the pieces of the chain.
+    // The CRC covers the unescaped data.
+    out.put(header, sizeof(header));
+    for (int i = 0; i < b.segments(); i++) {
+	const unsigned char *data = b.segment(i, len);
+	crcOut = crc(crcOut, data, len);
+	while (len > 0) {
+	    // Copy the longest run of bytes which need no escaping in
+	    // one go. DLE is always escaped, ETX only when talking to
+	    // EPOC.
+	    const void *e = memchr(data, 0x10, len);
+	    long run = e ? ((const unsigned char *)e - data) : len;
+	    if (epoc) {
+		e = memchr(data, 0x03, run);
+		if (e)
+		    run = (const unsigned char *)e - data;
+	    }
+	    out.put(data, run);
+	    data += run;
+	    len -= run;
+	    if (len > 0) {
+		out.put((*data == 0x10) ? dle : etx, 2);
+		data++;
+		len--;
+	    }
+	}
+    }
+    unsigned char trailer[4];
+    trailer[0] = 0x10;
+    trailer[1] = 0x03;
+    trailer[2] = crcOut >> 8;
+    trailer[3] = crcOut & 0xff;
+    out.put(trailer, sizeof(trailer));
+}
+
+frameCodec::result frameCodec::
+decode(ringBuffer &in, bufferChain &frame, bool dropNoise)
+{
+    int inw = in.writePos();
+    int p = (lastSYN >= 0) ? lastSYN : in.readPos();
+
+    if (startPkt < 0) {
+	while (p != inw) {
+	    unsigned char c = in.at(p);
+	    p = in.advance(p, 1);
+	    if (c != 0x16)
+		continue;
+	    lastSYN = in.advance(p, -1);
+	    if (p == inw)
+		break;
+	    c = in.at(p);
+	    p = in.advance(p, 1);
+	    if (c != 0x10)
+		continue;
+	    if (p == inw)
+		break;
+	    c = in.at(p);
+	    p = in.advance(p, 1);
+	    if (c != 0x02)
+		continue;
+	    lastSYN = startPkt = p;
+	    crcIn = inCRCstate = 0;
+	    frame.init();
+	    esc = false;
+	    break;
+	}
+    }
+    if (startPkt < 0) {
+	// No sync found. Drop the noise, but keep a possible start
+	// of a frame.
+	if (dropNoise)
+	    in.setReadPos((lastSYN >= 0) ? lastSYN : p);
+	return FRAME_NONE;
+    }
+    while (p != inw) {
+	if ((inCRCstate == 0) && !esc) {
+	    // Take everything up to the next DLE (or the end of the
+	    // contiguous part of the ring) in one go.
+	    int avail = ((inw > p) ? inw : in.size()) - p;
+	    const unsigned char *s = in.ptr(p);
+	    const void *e = memchr(s, 0x10, avail);
+	    int run = e ? ((const unsigned char *)e - s) : avail;
+	    if (run > 0) {
+		frame.addBytes(s, run);
+		crcIn = crc(crcIn, s, run);
+		p = in.advance(p, run);
+		continue;
+	    }
+	}
+	unsigned char c = in.at(p);
+	switch (inCRCstate) {
+	    case 0:
+		if (esc) {
+		    esc = false;
+		    switch (c) {
+			case 0x03:
+			    inCRCstate = 1;
+			    break;
+			case 0x04:
+			    addToCrc(0x03, &crcIn);
+			    frame.addByte(0x03);
+			    break;
+			default:
+			    addToCrc(c, &crcIn);
+			    frame.addByte(c);
+			    break;
+		    }
+		} else {
+		    if (c == 0x10)
+			esc = true;
+		    else {
+			addToCrc(c, &crcIn);
+			frame.addByte(c);
+		    }
+		}
+		break;
+	    case 1:
+		receivedCRC = c;
+		receivedCRC <<= 8;
+		inCRCstate = 2;
+		break;
+	    case 2:
+		receivedCRC |= c;
+		p = in.advance(p, 1);
+		in.setReadPos(p);
+		startPkt = lastSYN = -1;
+		inCRCstate = 0;
+		return (receivedCRC == crcIn) ? FRAME_GOOD : FRAME_BAD;
+	}
+	p = in.advance(p, 1);
+    }
+    // The frame so far is in frame already.
+    lastSYN = p;
+    in.setReadPos(p);
+    return FRAME_NONE;
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include "config.h"
+
+#include "bufchain.h"
+#include "ringbuf.h"
+
+/**
+ * The framing of the serial line.
+ *
+ * A frame starts with SYN DLE STX and ends with DLE ETX, followed by
+ * the CRC-CCITT of the payload, high byte first. In the payload, DLE
+ * is sent as DLE DLE, and ETX as DLE EOT when talking to EPOC.
+ *
+ * Frames are written to and read from the @ref ringBuffer of the
+ * line. The encoder keeps no state, so any thread may use it. The
+ * decoder keeps the state of a frame received in parts, and belongs
+ * to the consumer of the ring.
+ */
+class frameCodec {
+public:
+    frameCodec();
+
+    /**
+     * Results of @ref decode.
+     */
+    enum result {
+	FRAME_NONE,   // need more data
+	FRAME_GOOD,   // a frame with a valid CRC
+	FRAME_BAD     // a frame with a wrong CRC
+    };
+
+    /**
+     * Get the number of bytes a frame takes on the line at most.
+     *
+     * @param len The length of the payload.
+     */
+    static long maxEncodedLen(long len) { return 3 + 2 * len + 4; }
+
+    /**
+     * Append a frame to a ring. The caller must have checked, that
+     * @ref maxEncodedLen bytes fit.
+     *
+     * @param out The ring to write to.
+     * @param b The payload.
+     * @param epoc true, if ETX is escaped too.
+     */
+    void encode(ringBuffer &out, const bufferChain &b, bool epoc) const;
+
+    /**
+     * Read the next frame from a ring. Bytes are handed back to
+     * the producer as soon as they are in @p frame.
+     *
+     * @param in The ring to read from.
+     * @param frame The payload is collected here. It is only
+     *              complete, if a frame is returned.
+     * @param dropNoise If false, bytes before a start of a frame
+     *                  are kept in the ring.
+     *
+     * @returns FRAME_NONE if no frame is complete yet, otherwise,
+     *          whether its CRC is right.
+     */
+    result decode(ringBuffer &in, bufferChain &frame, bool dropNoise);
+
+    /**
+     * Check, whether the start of a frame has been seen.
+     */
+    bool inFrame() const { return startPkt >= 0; }
+
+    /**
+     * Forget a frame received in part.
+     */
+    void resetDecoder();
+
+    /**
+     * Get the CRC of a block of bytes.
+     *
+     * @param crc The CRC of the bytes before the block.
+     * @param a The block.
+     * @param len The length of the block.
+     */
+    unsigned short crc(unsigned short crc, const unsigned char *a,
+		       long len) const;
+
+private:
+    inline void addToCrc(unsigned char a, unsigned short *crc) const {
+	*crc =  (*crc << 8) ^ crc_table[0][((*crc >> 8) ^ a) & 0xff];
+    }
+
+    unsigned short crc_table[4][256];
+
+    unsigned short crcIn;
+    unsigned short receivedCRC;
+    unsigned short inCRCstate;
+    int startPkt;
+    int lastSYN;
+    bool esc;
+};
+
+#endif
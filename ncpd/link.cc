@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include <iostream>
+#include <algorithm>
 
 #include <bufferstore.h>
 #include <bufferarray.h>
@@ -30,21 +31,32 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "link.h"
 #include "packet.h"
 #include "ncp.h"
 #include "main.h"
 
+/**
+ * Lower bound of the adaptive retransmission timeout in microseconds.
+ */
+#define LNK_MIN_RTO 100000
+
+/**
+ * Maximum number of doublings of the RTO after timeouts.
+ */
+#define LNK_MAX_BACKOFF 6
+
 extern "C" {
     static void *expire_check(void *arg)
     {
 	Link *l = (Link *)arg;
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	while (1) {
-	    usleep(l->retransTimeout() * 500);
+	while (l->waitRetransmit()) {
+	    l->sendDelayedAck();
 	    l->retransmit();
 	}
+	return NULL;
     }
 };
 
@@ -56,7 +68,9 @@ ENUM_DEFINITION_BEGIN(Link::link_type, Link::LINK_TYPE_UNKNOWN)
     stringRep.add(Link::LINK_TYPE_EPOC,    N_("EPOC"));
 ENUM_DEFINITION_END(Link::link_type)
 
-Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose)
+Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose,
+	   int window, int _ackDelay, capture *cap, const char *baudFile,
+	   const lineTuning *tuning)
     : p(0)
 {
     theNCP = _ncp;
@@ -66,16 +80,52 @@ Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose)
     failed = false;
     seqMask = 7;
     maxOutstanding = 1;
+    if (window < 1)
+	window = 1;
+    if (window > LNK_EPOC_WINDOW)
+	window = LNK_EPOC_WINDOW;
+    maxWindow = window;
+    srtt = rttvar = 0;
+    rtoBackoff = 0;
+    if (_ackDelay > LNK_MAX_ACK_DELAY)
+	_ackDelay = LNK_MAX_ACK_DELAY;
+    ackDelay = (_ackDelay > 0) ? (long)_ackDelay * 1000 : 0;
+    ackPending = false;
+    ackSeq = 0;
+    ackBacklog = 0;
     linkType = LINK_TYPE_UNKNOWN;
-    for (int i = 0; i < 256; i++)
+    waitCount = 0;
+    for (int i = 0; i < 256; i++) {
 	xoff[i] = false;
+	deficit[i] = 0;
+	priority[i] = LNK_PRIO_NORMAL;
+    }
     // generate magic number for sendReqCon()
     srandom(time(NULL));
     conMagic = random();
 
-    p = new packet(fname, baud, this, _verbose);
-
     pthread_mutex_init(&queueMutex, NULL);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    // The deadlines are on the monotonic clock, so a step of the
+    // wall clock does not stall the timer.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timerCond, &attr);
+    pthread_condattr_destroy(&attr);
+#else
+    pthread_cond_init(&timerCond, NULL);
+#endif
+    stopTimer = false;
+    started = false;
+
+    p = new packet(fname, baud, this, _verbose, cap, baudFile, tuning);
+}
+
+void Link::
+start()
+{
+    started = true;
     pthread_create(&checkthread, NULL, expire_check, this);
 
     // submit a link request
@@ -85,7 +135,14 @@ Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose)
 Link::~Link()
 {
     flush();
-    pthread_cancel(checkthread);
+    if (started) {
+	pthread_mutex_lock(&queueMutex);
+	stopTimer = true;
+	pthread_cond_signal(&timerCond);
+	pthread_mutex_unlock(&queueMutex);
+	pthread_join(checkthread, NULL);
+    }
+    pthread_cond_destroy(&timerCond);
     pthread_mutex_destroy(&queueMutex);
     delete p;
 }
@@ -96,6 +153,140 @@ retransTimeout()
     return ((unsigned long)getSpeed() * 1000 / 13200) + 200;
 }
 
+static void
+getnow(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static long
+usecsBetween(const struct timespec &from, const struct timespec &to)
+{
+    return (long)(to.tv_sec - from.tv_sec) * 1000000L +
+	(to.tv_nsec - from.tv_nsec) / 1000;
+}
+
+static void
+addUsecs(struct timespec *ts, long usecs)
+{
+    ts->tv_sec += usecs / 1000000;
+    ts->tv_nsec += (usecs % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000;
+    }
+}
+
+long Link::
+currentRto()
+{
+    long max = (long)retransTimeout() * 1000;
+
+    // Until the first RTT sample, use the baud rate based guess.
+    if (srtt == 0)
+	return max;
+    long rto = srtt + ((4 * rttvar > 10000) ? 4 * rttvar : 10000);
+    if (rto < LNK_MIN_RTO)
+	rto = LNK_MIN_RTO;
+    // A timeout backs off the RTO of new frames too, until an
+    // unambiguous sample shows the real round trip time again.
+    rto <<= rtoBackoff;
+    if (rto > max)
+	rto = max;
+    return rto;
+}
+
+void Link::
+updateRtt(long sample)
+{
+    // Smoothed RTT and RTT variance as in RFC 6298, in microseconds.
+    if (srtt == 0) {
+	srtt = sample;
+	rttvar = sample / 2;
+    } else {
+	long delta = (srtt > sample) ? (srtt - sample) : (sample - srtt);
+	rttvar = (3 * rttvar + delta) / 4;
+	srtt = (7 * srtt + sample) / 8;
+    }
+    if (srtt == 0)
+	srtt = 1;
+    rtoBackoff = 0;
+    rttHist.add(sample);
+    if (verbose & LNK_DEBUG_LOG)
+	lout << "Link: rtt=" << sample << "us srtt=" << srtt << "us rttvar="
+	     << rttvar << "us rto=" << currentRto() << "us" << endl;
+}
+
+void Link::
+queueFrame(ackWaitQueueElement &e)
+{
+    getnow(&e.stamp);
+    e.rto = currentRto();
+    e.resent = false;
+    ackWaitQueue.push_back(e);
+    pthread_cond_signal(&timerCond);
+}
+
+bool Link::
+nextDeadline(struct timespec *deadline)
+{
+    vector<ackWaitQueueElement>::iterator i;
+    bool found = false;
+
+    if (ackPending) {
+	*deadline = ackDeadline;
+	found = true;
+    }
+    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++) {
+	struct timespec d = i->stamp;
+	addUsecs(&d, i->rto);
+	if (!found || (usecsBetween(d, *deadline) > 0)) {
+	    *deadline = d;
+	    found = true;
+	}
+    }
+    return found;
+}
+
+bool Link::
+waitRetransmit()
+{
+    bool ret;
+
+    // Sleep until the earliest retransmission deadline of all packets
+    // on the ackWaitQueue, or indefinitely if nothing is outstanding.
+    pthread_mutex_lock(&queueMutex);
+    while (!stopTimer) {
+	struct timespec deadline;
+	struct timespec now;
+
+	if (!nextDeadline(&deadline)) {
+	    pthread_cond_wait(&timerCond, &queueMutex);
+	    continue;
+	}
+	getnow(&now);
+	long wait = usecsBetween(now, deadline);
+	if (wait <= 0)
+	    break;
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+	pthread_cond_timedwait(&timerCond, &queueMutex, &deadline);
+#else
+	// pthread_cond_timedwait() wants an absolute CLOCK_REALTIME
+	// value. The loop re-checks against the monotonic clock.
+	struct timeval tv;
+	struct timespec abstime;
+	gettimeofday(&tv, NULL);
+	long long ns = (long long)tv.tv_usec * 1000 + (long long)wait * 1000;
+	abstime.tv_sec = tv.tv_sec + ns / 1000000000;
+	abstime.tv_nsec = ns % 1000000000;
+	pthread_cond_timedwait(&timerCond, &queueMutex, &abstime);
+#endif
+    }
+    ret = !stopTimer;
+    pthread_mutex_unlock(&queueMutex);
+    return ret;
+}
+
 void Link::
 reset() {
     txSequence = 1;
@@ -103,10 +294,18 @@ reset() {
     failed = false;
     seqMask = 7;
     maxOutstanding = 1;
+    srtt = rttvar = 0;
+    rtoBackoff = 0;
     linkType = LINK_TYPE_UNKNOWN;
     purgeAllQueues();
-    for (int i = 0; i < 256; i++)
+    pthread_mutex_lock(&queueMutex);
+    ackPending = false;
+    ackBacklog = 0;
+    pthread_mutex_unlock(&queueMutex);
+    for (int i = 0; i < 256; i++) {
 	xoff[i] = false;
+	priority[i] = LNK_PRIO_NORMAL;
+    }
     p->reset();
     // submit a link request
     sendReqReq();
@@ -126,7 +325,7 @@ setVerbose(unsigned short _verbose)
 }
 
 void Link::
-send(const bufferStore & buff)
+send(const bufferChain & buff)
 {
     if (buff.getLen() > 300) {
 	failed = true;
@@ -140,6 +339,12 @@ purgeAllQueues()
     pthread_mutex_lock(&queueMutex);
     ackWaitQueue.clear();
     holdQueue.clear();
+    for (int i = 0; i < 256; i++) {
+	waitQueue[i].clear();
+	deficit[i] = 0;
+    }
+    activeChannels.clear();
+    waitCount = 0;
     pthread_mutex_unlock(&queueMutex);
 }
 
@@ -148,26 +353,128 @@ purgeQueue(int channel)
 {
     pthread_mutex_lock(&queueMutex);
     vector<ackWaitQueueElement>::iterator i;
-    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-	if (i->data.getByte(0) == channel) {
-	    ackWaitQueue.erase(i);
-	    i--;
+    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); )
+	if (i->data.getByte(0) == channel)
+	    i = ackWaitQueue.erase(i);
+	else
+	    i++;
+    vector<bufferChain>::iterator j;
+    for (j = holdQueue.begin(); j != holdQueue.end(); )
+	if (j->getByte(0) == channel)
+	    j = holdQueue.erase(j);
+	else
+	    j++;
+    if ((channel > 0) && (channel < 256)) {
+	if (!waitQueue[channel].empty())
+	    activeChannels.erase(find(activeChannels.begin(),
+				      activeChannels.end(), channel));
+	waitCount -= waitQueue[channel].size();
+	waitQueue[channel].clear();
+	deficit[channel] = 0;
+	priority[channel] = LNK_PRIO_NORMAL;
+    }
+    pthread_mutex_unlock(&queueMutex);
+}
+
+void Link::
+setPriority(int channel, int prio)
+{
+    if ((channel < 0) || (channel > 255))
+	return;
+    if (prio < LNK_PRIO_BULK)
+	prio = LNK_PRIO_BULK;
+    if (prio > LNK_PRIO_INTERACTIVE)
+	prio = LNK_PRIO_INTERACTIVE;
+    pthread_mutex_lock(&queueMutex);
+    priority[channel] = prio;
+    pthread_mutex_unlock(&queueMutex);
+}
+
+int Link::
+getPriority(int channel)
+{
+    if ((channel < 0) || (channel > 255))
+	return LNK_PRIO_NORMAL;
+    return priority[channel];
+}
+
+int Link::
+getQueueDepth(int channel)
+{
+    if ((channel < 0) || (channel > 255))
+	return 0;
+    pthread_mutex_lock(&queueMutex);
+    int depth = waitQueue[channel].size();
+    vector<bufferChain>::iterator i;
+    for (i = holdQueue.begin(); i != holdQueue.end(); i++)
+	if (i->getByte(0) == channel)
+	    depth++;
+    pthread_mutex_unlock(&queueMutex);
+    return depth;
+}
+
+void Link::
+queueWaiting(bufferChain &buf)
+{
+    // Caller must hold queueMutex
+    // Control frames (channel 0) are kept in a queue of their own which
+    // always goes first. A SIBO peer only handles one channel at a time,
+    // so all its frames stay in order in that queue.
+    int channel = 0;
+    if (linkType == LINK_TYPE_EPOC)
+	channel = buf.getByte(0);
+    if ((channel > 0) && waitQueue[channel].empty())
+	activeChannels.push_back(channel);
+    waitQueue[channel].push_back(buf);
+    waitCount++;
+}
+
+bool Link::
+nextWaiting(bufferChain &buf)
+{
+    // Caller must hold queueMutex
+    if (!waitQueue[0].empty()) {
+	buf = waitQueue[0].front();
+	waitQueue[0].pop_front();
+	waitCount--;
+	return true;
+    }
+    // Deficit round-robin: the channel at the head of activeChannels may
+    // send as long as its deficit covers the next frame. Otherwise it
+    // earns its quantum and has to wait for the next round.
+    while (!activeChannels.empty()) {
+	int channel = activeChannels.front();
+	deque<bufferChain> &q = waitQueue[channel];
+	if (q.empty()) {
+	    deficit[channel] = 0;
+	    activeChannels.pop_front();
+	    continue;
 	}
-    vector<bufferStore>::iterator j;
-    for (j = holdQueue.begin(); j != holdQueue.end(); j++)
-	if (j->getByte(0) == channel) {
-	    holdQueue.erase(j);
-	    j--;
+	if (deficit[channel] < q.front().getLen()) {
+	    deficit[channel] += LNK_DRR_QUANTUM * (1 + priority[channel]);
+	    activeChannels.pop_front();
+	    activeChannels.push_back(channel);
+	    continue;
 	}
-    pthread_mutex_unlock(&queueMutex);
+	buf = q.front();
+	q.pop_front();
+	waitCount--;
+	deficit[channel] -= buf.getLen();
+	if (q.empty()) {
+	    deficit[channel] = 0;
+	    activeChannels.pop_front();
+	}
+	return true;
+    }
+    return false;
 }
 
 void Link::
-sendAck(int seq)
+sendAck(int seq, bool flush)
 {
     if (hasFailed())
 	return;
-    bufferStore tmp;
+    bufferChain tmp;
     if (verbose & LNK_DEBUG_LOG)
 	lout << "Link: >> ack seq=" << seq << endl;
     if (seq > 7) {
@@ -177,7 +484,55 @@ sendAck(int seq)
 	tmp.prependWord(seq);
     } else
 	tmp.prependByte(seq);
-    p->send(tmp);
+    acksSent.add();
+    p->send(tmp, flush);
+}
+
+void Link::
+delayAck(int seq)
+{
+    // Acknowledge in-order frames from an EPOC device after ackDelay,
+    // so that a single ack covers all frames received in the meantime.
+    pthread_mutex_lock(&queueMutex);
+    if (ackPending)
+	acksSaved.add();
+    else {
+	ackPending = true;
+	getnow(&ackDeadline);
+	addUsecs(&ackDeadline, ackDelay);
+	pthread_cond_signal(&timerCond);
+    }
+    ackSeq = seq;
+    // Don't let the peer's transmit window run full.
+    if (++ackBacklog >= LNK_EPOC_WINDOW / 2)
+	flushAck();
+    pthread_mutex_unlock(&queueMutex);
+}
+
+void Link::
+flushAck(bool flush)
+{
+    // Caller must hold queueMutex
+    if (!ackPending)
+	return;
+    ackPending = false;
+    if ((verbose & LNK_DEBUG_LOG) && (ackBacklog > 1))
+	lout << "Link: ack covers " << ackBacklog << " frames" << endl;
+    ackBacklog = 0;
+    sendAck(ackSeq, flush);
+}
+
+void Link::
+sendDelayedAck()
+{
+    pthread_mutex_lock(&queueMutex);
+    if (ackPending) {
+	struct timespec now;
+	getnow(&now);
+	if (usecsBetween(now, ackDeadline) <= 0)
+	    flushAck();
+    }
+    pthread_mutex_unlock(&queueMutex);
 }
 
 void Link::
@@ -185,18 +540,17 @@ sendReqCon()
 {
     if (hasFailed())
 	return;
-    bufferStore tmp;
+    bufferChain tmp;
     if (verbose & LNK_DEBUG_LOG)
 	lout << "Link: >> con seq=4" << endl;
     tmp.addByte(0x24);
     tmp.addDWord(conMagic);
     ackWaitQueueElement e;
     e.seq = 0; // expected ACK is 0, _NOT_ 4!
-    gettimeofday(&e.stamp, NULL);
     e.data = tmp;
     e.txcount = 4;
     pthread_mutex_lock(&queueMutex);
-    ackWaitQueue.push_back(e);
+    queueFrame(e);
     pthread_mutex_unlock(&queueMutex);
     p->send(tmp);
 }
@@ -206,17 +560,16 @@ sendReqReq()
 {
     if (hasFailed())
 	return;
-    bufferStore tmp;
+    bufferChain tmp;
     if (verbose & LNK_DEBUG_LOG)
 	lout << "Link: >> con seq=1" << endl;
     tmp.addByte(0x21);
     ackWaitQueueElement e;
     e.seq = 0; // expected response is Ack with seq=0 or ReqCon
-    gettimeofday(&e.stamp, NULL);
     e.data = tmp;
     e.txcount = 4;
     pthread_mutex_lock(&queueMutex);
-    ackWaitQueue.push_back(e);
+    queueFrame(e);
     pthread_mutex_unlock(&queueMutex);
     p->send(tmp);
 }
@@ -226,7 +579,7 @@ sendReq()
 {
     if (hasFailed())
 	return;
-    bufferStore tmp;
+    bufferChain tmp;
     if (verbose & LNK_DEBUG_LOG)
 	lout << "Link: >> con seq=1" << endl;
     tmp.addByte(0x20);
@@ -235,13 +588,12 @@ sendReq()
 }
 
 void Link::
-receive(bufferStore buff)
+receive(bufferChain buff)
 {
-    if (!p)
+    if (!p || !started)
 	return;
 
     vector<ackWaitQueueElement>::iterator i;
-    bool ackFound;
     bool conFound;
     int type = buff.getByte(0);
     int seq = type & 0x0f;
@@ -270,12 +622,19 @@ receive(bufferStore buff)
 		rxSequence++;
 		rxSequence &= seqMask;
 
-	    	sendAck(rxSequence);
+		if ((ackDelay > 0) && (linkType == LINK_TYPE_EPOC))
+		    delayAck(rxSequence);
+		else
+		    sendAck(rxSequence);
 		// Must check for XOFF/XON ncp frames HERE!
 		if ((buff.getLen() == 3) && (buff.getByte(0) == 0)) {
 		    switch (buff.getByte(2)) {
 			case 1:
 			    // XOFF
+			    if (!xoff[buff.getByte(1)]) {
+				getnow(&xoffStamp[buff.getByte(1)]);
+				xoffs.add();
+			    }
 			    xoff[buff.getByte(1)] = true;
 			    if (verbose & LNK_DEBUG_LOG)
 				lout << "Link: got XOFF for channel "
@@ -283,6 +642,12 @@ receive(bufferStore buff)
 			    break;
 			case 2:
 			    // XON
+			    if (xoff[buff.getByte(1)]) {
+				struct timespec now;
+				getnow(&now);
+				xoffHist.add(usecsBetween(xoffStamp[buff.getByte(1)],
+							  now));
+			    }
 			    xoff[buff.getByte(1)] = false;
 			    if (verbose & LNK_DEBUG_LOG)
 				lout << "Link: got XON for channel "
@@ -297,7 +662,13 @@ receive(bufferStore buff)
 		    theNCP->receive(buff);
 
 	    } else {
+		// Out of sequence: tell the peer at once, what we have got.
+		pthread_mutex_lock(&queueMutex);
+		ackPending = false;
+		ackBacklog = 0;
+		pthread_mutex_unlock(&queueMutex);
 	    	sendAck(rxSequence);
+		dupFrames.add();
 		if (verbose & LNK_DEBUG_LOG)
 		    lout << "Link: DUP\n";
 	    }
@@ -305,25 +676,13 @@ receive(bufferStore buff)
 
 	case 0x00:
 	    // Incoming ack
-	    // Find corresponding packet in ackWaitQueue
-	    ackFound = false;
-	    struct timeval refstamp;
-	    pthread_mutex_lock(&queueMutex);
-	    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-		if (i->seq == seq) {
-		    ackFound = true;
-		    refstamp = i->stamp;
-		    ackWaitQueue.erase(i);
-		    if (verbose & LNK_DEBUG_LOG) {
-			lout << "Link: << ack seq=" << seq ;
-			if (verbose & LNK_DEBUG_DUMP)
-			    lout << " " << buff;
-			lout << endl;
-		    }
-		    break;
+	    if (ackFrames(seq)) {
+		if (verbose & LNK_DEBUG_LOG) {
+		    lout << "Link: << ack seq=" << seq ;
+		    if (verbose & LNK_DEBUG_DUMP)
+			lout << " " << buff;
+		    lout << endl;
 		}
-	    pthread_mutex_unlock(&queueMutex);
-	    if (ackFound) {
 		if ((linkType == LINK_TYPE_UNKNOWN) && (seq == 0)) {
 		    // If the remote device runs SIBO protocol, this ACK
 		    // should be 0 (the Ack on our ReqReq request, which is
@@ -339,8 +698,6 @@ receive(bufferStore buff)
 		    if (verbose & LNK_DEBUG_LOG)
 			lout << "Link: 1-linkType set to " << linkType << endl;
 		}
-		// Older packets implicitely ack'ed
-		multiAck(refstamp);
 		// Transmit waiting packets
 		transmitWaitQueue();
 	    } else {
@@ -348,37 +705,42 @@ receive(bufferStore buff)
 		// (Receiving an ack for a packet not on our wait queue is a
 		// hint by the Psion about which was the last packet it
 		// received successfully.)
+		int nextSeq = (seq + 1) & seqMask;
 		pthread_mutex_lock(&queueMutex);
-		struct timeval now;
-		gettimeofday(&now, NULL);
+		struct timespec now;
+		getnow(&now);
 		bool nextFound = false;
 		for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-		    if (i->seq == seq+1) {
+		    if (i->seq == nextSeq) {
 			nextFound = true;
-			if (i->txcount-- == 0) {
-			    // timeout, remove packet
-			    if (verbose & LNK_DEBUG_LOG)
-				lout << "Link: >> TRANSMIT timeout seq=" <<
-				    i->seq << endl;
-			    ackWaitQueue.erase(i);
-			    i--;
-			} else {
-			    // retransmit it
-			    i->stamp = now;
-			    if (verbose & LNK_DEBUG_LOG)
-				lout << "Link: >> RETRANSMIT seq=" << i->seq
-				     << endl;
-			    p->send(i->data);
-			}
+			// With several frames in flight, each of them
+			// may trigger the same hint. Resend at most once
+			// per round trip, and leave giving up to
+			// retransmit(): dropping a frame here would leave
+			// a hole in the sequence the remote never skips.
+			long guard = srtt ? srtt : i->rto;
+			if (usecsBetween(i->stamp, now) < guard)
+			    break;
+			retransmits.add();
+			i->stamp = now;
+			i->resent = true;
+			if (verbose & LNK_DEBUG_LOG)
+			    lout << "Link: >> RETRANSMIT seq=" << i->seq
+				 << endl;
+			p->send(i->data);
 			break;
 		    }
 		pthread_mutex_unlock(&queueMutex);
+		if (!nextFound)
+		    unmatchedAcks.add();
 		if ((verbose & LNK_DEBUG_LOG) && (!nextFound)) {
 		    lout << "Link: << UNMATCHED ack seq=" << seq;
 		    if (verbose & LNK_DEBUG_DUMP)
 			lout << " " << buff;
 		    lout << endl;
 		}
+		if (nextFound)
+		    transmitWaitQueue();
 	    }
 	    break;
 
@@ -399,7 +761,7 @@ receive(bufferStore buff)
 			// EPOC can handle extended sequence numbers
 			seqMask = 0x7ff;
 			// EPOC can handle up to 8 unacknowledged packets
-			maxOutstanding = 8;
+			maxOutstanding = maxWindow;
 			p->setEpoc(true);
 			if (verbose & LNK_DEBUG_LOG) {
 			    lout << "Link: << con seq=" << seq ;
@@ -430,7 +792,7 @@ receive(bufferStore buff)
 		    // EPOC can handle extended sequence numbers
 		    seqMask = 0x7ff;
 		    // EPOC can handle up to 8 unacknowledged packets
-		    maxOutstanding = 8;
+		    maxOutstanding = maxWindow;
 		    p->setEpoc(true);
 		    failed = false;
 		    sendReqCon();
@@ -466,8 +828,8 @@ receive(bufferStore buff)
 void Link::
 transmitHoldQueue(int channel)
 {
-    vector<bufferStore> tmpQueue;
-    vector<bufferStore>::iterator i;
+    vector<bufferChain> tmpQueue;
+    vector<bufferChain>::iterator i;
 
     // First, move desired packets to a temporary queue
     pthread_mutex_lock(&queueMutex);
@@ -480,120 +842,134 @@ transmitHoldQueue(int channel)
     pthread_mutex_unlock(&queueMutex);
 
     // ... then transmit the moved packets
+    if (hasFailed())
+	return;
+    bool sent = false;
+    pthread_mutex_lock(&queueMutex);
     for (i = tmpQueue.begin(); i != tmpQueue.end(); i++)
-	transmit(*i);
+	if (enqueue(*i, false))
+	    sent = true;
+    pthread_mutex_unlock(&queueMutex);
+    if (sent)
+	p->flush();
 }
 
 void Link::
 transmitWaitQueue()
 {
-    vector<bufferStore> tmpQueue;
-    vector<bufferStore>::iterator i;
+    if (hasFailed())
+	return;
 
-    // First, move desired packets to a temporary queue
-    for (i = waitQueue.begin(); i != waitQueue.end(); i++)
-	tmpQueue.push_back(*i);
-    waitQueue.clear();
-    // transmit the moved packets. If the backlock gets
-    // full, they are put into waitQueue again.
-    for (i = tmpQueue.begin(); i != tmpQueue.end(); i++)
-	transmit(*i);
+    // Move waiting packets into the transmit window, as long as
+    // the window has room. All of them are written out
+    // to the serial line at once.
+    bool sent = false;
+    bufferChain buf;
+    pthread_mutex_lock(&queueMutex);
+    while (((int)ackWaitQueue.size() < maxOutstanding) && nextWaiting(buf)) {
+	if (xoff[buf.getByte(0)])
+	    holdQueue.push_back(buf);
+	else {
+	    transmitFrame(buf, false);
+	    sent = true;
+	}
+    }
+    pthread_mutex_unlock(&queueMutex);
+    if (sent)
+	p->flush();
 }
 
 void Link::
-transmit(bufferStore buf)
+transmit(bufferChain buf)
 {
     if (hasFailed())
 	return;
 
+    pthread_mutex_lock(&queueMutex);
+    enqueue(buf, true);
+    pthread_mutex_unlock(&queueMutex);
+}
+
+bool Link::
+enqueue(bufferChain &buf, bool flush)
+{
+    // Caller must hold queueMutex
     int remoteChan = buf.getByte(0);
-    if (xoff[remoteChan]) {
-	pthread_mutex_lock(&queueMutex);
+    if (xoff[remoteChan])
 	holdQueue.push_back(buf);
-	pthread_mutex_unlock(&queueMutex);
+    else if ((waitCount > 0) ||
+	     ((int)ackWaitQueue.size() >= maxOutstanding)) {
+	// If the window is full, put on waitQueue. Packets already
+	// waiting there must go out first, so keep the order.
+	queueWaiting(buf);
     } else {
-
-	// If backlock is full, put on waitQueue
-	int ql;
-	pthread_mutex_lock(&queueMutex);
-	ql = ackWaitQueue.size();
-	pthread_mutex_unlock(&queueMutex);
-	if (ql >= maxOutstanding) {
-	    waitQueue.push_back(buf);
-	    return;
-	}
-
-	ackWaitQueueElement e;
-	e.seq = txSequence++;
-	txSequence &= seqMask;
-	gettimeofday(&e.stamp, NULL);
-	// An empty buffer is considered a new link request
-	if (buf.empty()) {
-	    // Request for new link
-	    e.txcount = 4;
-	    if (verbose & LNK_DEBUG_LOG)
-		lout << "Link: >> req seq=" << e.seq << endl;
-	    buf.prependByte(0x20 + e.seq);
-	} else {
-	    e.txcount = 8;
-	    if (verbose & LNK_DEBUG_LOG) {
-		lout << "Link: >> dat seq=" << e.seq;
-		if (verbose & LNK_DEBUG_DUMP)
-		    lout << " " << buf;
-		lout << endl;
-	    }
-	    if (e.seq > 7) {
-		int hseq = e.seq >> 3;
-		int lseq = 0x30 + ((e.seq & 7) | 8);
-		int seq = (hseq << 8) + lseq;
-		buf.prependWord(seq);
-	    } else
-		buf.prependByte(0x30 + e.seq);
-	}
-	e.data = buf;
-	pthread_mutex_lock(&queueMutex);
-	ackWaitQueue.push_back(e);
-	pthread_mutex_unlock(&queueMutex);
-	p->send(buf);
+	transmitFrame(buf, flush);
+	return true;
     }
+    return false;
 }
 
-static void
-timesub(struct timeval *tv, unsigned long millisecs)
+void Link::
+transmitFrame(bufferChain &buf, bool flush)
 {
-    uint64_t micros = tv->tv_sec;
-    uint64_t sub = millisecs;
-
-    micros <<= 32;
-    micros += tv->tv_usec;
-    micros -= (sub * 1000);
-    tv->tv_usec = micros & 0xffffffff;
-    tv->tv_sec  = (micros >>= 32) & 0xffffffff;
-}
+    // Data frames cannot carry an ack, so send a pending ack right
+    // ahead of the frame instead of waiting for its timer. Both go
+    // out with the same write.
+    flushAck(false);
 
-static bool
-olderthan(struct timeval t1, struct timeval t2)
-{
-    uint64_t m1 = t1.tv_sec;
-    uint64_t m2 = t2.tv_sec;
-    m1 <<= 32;
-    m2 <<= 32;
-    m1 += t1.tv_usec;
-    m2 += t2.tv_usec;
-    return (m1 < m2);
+    ackWaitQueueElement e;
+    e.seq = txSequence++;
+    txSequence &= seqMask;
+    // An empty buffer is considered a new link request
+    if (buf.empty()) {
+	// Request for new link
+	e.txcount = 4;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: >> req seq=" << e.seq << endl;
+	buf.prependByte(0x20 + e.seq);
+    } else {
+	e.txcount = 8;
+	if (verbose & LNK_DEBUG_LOG) {
+	    lout << "Link: >> dat seq=" << e.seq;
+	    if (verbose & LNK_DEBUG_DUMP)
+		lout << " " << buf;
+	    lout << endl;
+	}
+	if (e.seq > 7) {
+	    int hseq = e.seq >> 3;
+	    int lseq = 0x30 + ((e.seq & 7) | 8);
+	    int seq = (hseq << 8) + lseq;
+	    buf.prependWord(seq);
+	} else
+	    buf.prependByte(0x30 + e.seq);
+    }
+    e.data = buf;
+    queueFrame(e);
+    p->send(buf, flush);
 }
 
-void Link::
-multiAck(struct timeval refstamp)
+bool Link::
+ackFrames(int seq)
 {
     vector<ackWaitQueueElement>::iterator i;
+    bool found = false;
+
+    // The ackWaitQueue is ordered by sequence number, and an ack
+    // implicitly acknowledges all frames sent before the one it names.
     pthread_mutex_lock(&queueMutex);
     for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-	if (olderthan(i->stamp, refstamp)) {
-	    ackWaitQueue.erase(i);
-	    i--;
+	if (i->seq == seq) {
+	    if (!i->resent) {
+		struct timespec now;
+		getnow(&now);
+		updateRtt(usecsBetween(i->stamp, now));
+	    }
+	    ackWaitQueue.erase(ackWaitQueue.begin(), i + 1);
+	    found = true;
+	    break;
 	}
     pthread_mutex_unlock(&queueMutex);
+    return found;
 }
 
 void Link::
@@ -607,28 +983,41 @@ retransmit()
 
     pthread_mutex_lock(&queueMutex);
     vector<ackWaitQueueElement>::iterator i;
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    struct timeval expired = now;
-    timesub(&expired, retransTimeout());
-    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-	if (olderthan(i->stamp, expired)) {
+    struct timespec now;
+    getnow(&now);
+    long max = (long)retransTimeout() * 1000;
+    bool resent = false;
+    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); )
+	if (usecsBetween(i->stamp, now) >= i->rto) {
 	    if (i->txcount-- == 0) {
 		// timeout, remove packet
+		txTimeouts.add();
 		if (verbose & LNK_DEBUG_LOG)
 		    lout << "Link: >> TRANSMIT timeout seq=" << i->seq << endl;
-		ackWaitQueue.erase(i);
+		i = ackWaitQueue.erase(i);
 		failed = true;
-		i--;
 	    } else {
-		// retransmit it
+		// retransmit it with exponential backoff
+		retransmits.add();
 		i->stamp = now;
+		i->resent = true;
+		i->rto *= 2;
+		if (i->rto > max)
+		    i->rto = max;
 		if (verbose & LNK_DEBUG_LOG)
-		    lout << "Link: >> RETRANSMIT seq=" << i->seq << endl;
-		p->send(i->data);
+		    lout << "Link: >> RETRANSMIT seq=" << i->seq << " rto="
+			 << i->rto << "us" << endl;
+		p->send(i->data, false);
+		resent = true;
+		i++;
 	    }
-	}
+	} else
+	    i++;
+    if (resent && (rtoBackoff < LNK_MAX_BACKOFF))
+	rtoBackoff++;
     pthread_mutex_unlock(&queueMutex);
+    if (resent)
+	p->flush();
 }
 
 void Link::
@@ -640,7 +1029,10 @@ flush() {
 bool Link::
 stuffToSend()
 {
-    return ((!failed) && (!ackWaitQueue.empty()));
+    pthread_mutex_lock(&queueMutex);
+    bool res = (!failed) && (!ackWaitQueue.empty() || (waitCount > 0));
+    pthread_mutex_unlock(&queueMutex);
+    return res;
 }
 
 bool Link::
@@ -651,7 +1043,8 @@ hasFailed()
 	if (verbose & LNK_DEBUG_LOG)
 	    lout << "Link: hasFailed: " << failed << ", " << lfailed << endl;
     }
-    failed |= lfailed;
+    if (lfailed)
+	failed = true;
     return failed;
 }
 
@@ -666,3 +1059,56 @@ getSpeed()
 {
     return p->getSpeed();
 }
+
+devWatch *Link::
+getDevWatch()
+{
+    return p->getDevWatch();
+}
+
+int Link::
+getWindow()
+{
+    return maxOutstanding;
+}
+
+unsigned long Link::
+getAcksSent()
+{
+    return acksSent.get();
+}
+
+unsigned long Link::
+getAcksSaved()
+{
+    return acksSaved.get();
+}
+
+void Link::
+getStats(std::ostream &s)
+{
+    pthread_mutex_lock(&queueMutex);
+    int inFlight = ackWaitQueue.size();
+    int waiting = waitCount;
+    int held = holdQueue.size();
+    pthread_mutex_unlock(&queueMutex);
+
+    s << "link.type " << linkType << "\n";
+    s << "link.window " << maxOutstanding << "\n";
+    s << "link.srtt_us " << srtt << "\n";
+    s << "link.rttvar_us " << rttvar << "\n";
+    s << "link.rto_us " << currentRto() << "\n";
+    s << "link.in_flight " << inFlight << "\n";
+    s << "link.waiting " << waiting << "\n";
+    s << "link.held " << held << "\n";
+    s << "link.acks_sent " << acksSent.get() << "\n";
+    s << "link.acks_saved " << acksSaved.get() << "\n";
+    s << "link.retransmits " << retransmits.get() << "\n";
+    s << "link.tx_timeouts " << txTimeouts.get() << "\n";
+    s << "link.dup_frames " << dupFrames.get() << "\n";
+    s << "link.unmatched_acks " << unmatchedAcks.get() << "\n";
+    s << "link.xoffs " << xoffs.get() << "\n";
+    rttHist.print(s, "link.rtt");
+    xoffHist.print(s, "link.xoff");
+    p->getStats(s);
+}
@@ -23,18 +23,54 @@
 
 #include "config.h"
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include "bufferstore.h"
 #include "bufferarray.h"
+#include "bufchain.h"
 #include "Enum.h"
+#include "stats.h"
 #include <vector>
+#include <deque>
+#include <atomic>
 
 #define LNK_DEBUG_LOG  4
 #define LNK_DEBUG_DUMP 8
 
+/**
+ * Maximum number of unacknowledged data frames an EPOC
+ * peer accepts. SIBO peers always use a window of 1.
+ */
+#define LNK_EPOC_WINDOW 8
+
+/**
+ * Maximum delay of acks to an EPOC peer in milliseconds. Kept well
+ * below the time after which the peer resends unacknowledged frames.
+ */
+#define LNK_MAX_ACK_DELAY 200
+
+/**
+ * Priority classes for remote channels. Frames waiting for
+ * the transmit window are scheduled by deficit round-robin
+ * across channels, and a channel of a higher class may send
+ * more per round.
+ */
+#define LNK_PRIO_BULK        0
+#define LNK_PRIO_NORMAL      1
+#define LNK_PRIO_INTERACTIVE 2
+
+/**
+ * Bytes a channel of class LNK_PRIO_BULK may send per round.
+ * This is the size of the largest frame, so that every
+ * channel gets at least one frame out per round.
+ */
+#define LNK_DRR_QUANTUM 300
+
 class ncp;
 class packet;
+class capture;
+class devWatch;
+struct lineTuning;
 
 /**
  * Describes a transmitted packet which has not yet
@@ -50,13 +86,22 @@ typedef struct {
      */
     int txcount;
     /**
-     * Time of last transmit.
+     * Time of last transmit (CLOCK_MONOTONIC).
+     */
+    struct timespec stamp;
+    /**
+     * Retransmission timeout in microseconds, counted from stamp.
      */
-    struct timeval stamp;
+    long rto;
+    /**
+     * True, if the packet has been retransmitted. An ack for
+     * such a packet is ambiguous and not used for RTT estimation.
+     */
+    bool resent;
     /**
      * Packet content.
      */
-    bufferStore data;
+    bufferChain data;
 } ackWaitQueueElement;
 
 extern "C" {
@@ -79,20 +124,41 @@ public:
      * @param baud  Speed of serial device.
      * @param ncp   The calling ncp instance.
      * @_verbose    Verbosity (for debugging/troubleshooting)
+     * @param window Maximum number of unacknowledged data frames
+     *               when talking to an EPOC device (1 - LNK_EPOC_WINDOW).
+     * @param ackDelay Time in milliseconds, by which acks to an EPOC
+     *               device may be delayed in order to acknowledge several
+     *               frames at once. 0 acknowledges every frame immediately.
+     *               Larger values than LNK_MAX_ACK_DELAY are clamped.
+     * @param cap   If not NULL, the traffic on the serial line is
+     *              recorded there.
+     * @param baudFile If not NULL, the rate found by auto-baud is
+     *              remembered there for the next start.
+     * @param tuning If not NULL, the low latency settings of the
+     *              serial line.
      */
-    Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose = 0);
+    Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose = 0,
+	 int window = LNK_EPOC_WINDOW, int ackDelay = 0, capture *cap = NULL,
+	 const char *baudFile = NULL, const lineTuning *tuning = NULL);
 
     /**
      * Disconnects from device and destroys instance.
      */
     ~Link();
 
+    /**
+     * Start talking to the peer. Until then, everything received is
+     * ignored, since the calling ncp instance may not be ready to
+     * handle it.
+     */
+    void start();
+
     /**
      * Send a PLP packet to the Peer.
      *
      * @param buff The contents of the PLP packet.
      */
-    void send(const bufferStore &buff);
+    void send(const bufferChain &buff);
 
     /**
      * Query outstanding packets.
@@ -157,25 +223,102 @@ public:
      */
     int getSpeed();
 
+    /**
+     * Get the watcher for the serial device coming and going.
+     */
+    devWatch *getDevWatch();
+
+    /**
+     * Get the transmit window negotiated with the peer.
+     *
+     * @returns The maximum number of unacknowledged data frames.
+     */
+    int getWindow();
+
+    /**
+     * Get the number of ack frames sent.
+     *
+     * @returns The number of acks sent since construction.
+     */
+    unsigned long getAcksSent();
+
+    /**
+     * Get the number of ack frames saved by delayed acknowledgement.
+     *
+     * @returns The number of received data frames which were acknowledged
+     *  implicitly by an ack for a later frame.
+     */
+    unsigned long getAcksSaved();
+
+    /**
+     * Set the priority class of a remote channel.
+     *
+     * @param channel The remote channel.
+     * @param prio One of the LNK_PRIO_.. constants.
+     */
+    void setPriority(int channel, int prio);
+
+    /**
+     * Get the priority class of a remote channel.
+     *
+     * @param channel The remote channel.
+     *
+     * @returns One of the LNK_PRIO_.. constants.
+     */
+    int getPriority(int channel);
+
+    /**
+     * Get the number of frames for a remote channel which
+     * wait for the transmit window or for an XON.
+     *
+     * @param channel The remote channel.
+     *
+     * @returns The number of frames waiting.
+     */
+    int getQueueDepth(int channel);
+
+    /**
+     * Print statistics of the Link and the underlying packet
+     * instance as lines of the form "key value".
+     *
+     * @param s The stream to print on.
+     */
+    void getStats(std::ostream &s);
+
 private:
     friend class packet;
     friend void * expire_check(void *);
 
-    void receive(bufferStore buf);
-    void transmit(bufferStore buf);
-    void sendAck(int seq);
+    void receive(bufferChain buf);
+    void transmit(bufferChain buf);
+    void sendAck(int seq, bool flush = true);
+    void delayAck(int seq);
+    void flushAck(bool flush = true);
+    void sendDelayedAck();
     void sendReqReq();
     void sendReqCon();
     void sendReq();
-    void multiAck(struct timeval);
+    bool ackFrames(int seq);
     void retransmit();
+    bool waitRetransmit();
+    bool nextDeadline(struct timespec *deadline);
+    void updateRtt(long sample);
+    long currentRto();
+    void queueFrame(ackWaitQueueElement &e);
     void transmitHoldQueue(int channel);
     void transmitWaitQueue();
+    bool enqueue(bufferChain &buf, bool flush);
+    void queueWaiting(bufferChain &buf);
+    bool nextWaiting(bufferChain &buf);
+    void transmitFrame(bufferChain &buf, bool flush);
     void purgeAllQueues();
     unsigned long retransTimeout();
 
     pthread_t checkthread;
     pthread_mutex_t queueMutex;
+    pthread_cond_t timerCond;
+    bool stopTimer;
+    std::atomic<bool> started;
 
     ncp *theNCP;
     packet *p;
@@ -183,15 +326,39 @@ private:
     int rxSequence;
     int seqMask;
     int maxOutstanding;
+    int maxWindow;
     unsigned long conMagic;
+    long srtt;
+    long rttvar;
+    int rtoBackoff;
+    long ackDelay;
+    bool ackPending;
+    int ackSeq;
+    int ackBacklog;
+    struct timespec ackDeadline;
     unsigned short verbose;
-    bool failed;
+    std::atomic<bool> failed;
     Enum<link_type> linkType;
 
     std::vector<ackWaitQueueElement> ackWaitQueue;
-    std::vector<bufferStore> holdQueue;
-    std::vector<bufferStore> waitQueue;
+    std::vector<bufferChain> holdQueue;
+    std::deque<bufferChain> waitQueue[256];
+    std::deque<int> activeChannels;
+    int waitCount;
+    int deficit[256];
+    int priority[256];
     bool xoff[256];
+    struct timespec xoffStamp[256];
+
+    statCounter acksSent;
+    statCounter acksSaved;
+    statCounter retransmits;
+    statCounter txTimeouts;
+    statCounter dupFrames;
+    statCounter unmatchedAcks;
+    statCounter xoffs;
+    statHistogram rttHist;
+    statHistogram xoffHist;
 };
 
 #endif
@@ -41,6 +41,11 @@ linkChan::linkChan(ncp * _ncpController, int _ncpChannel):channel(_ncpController
     ncpConnect();
 }
 
+linkChan::~linkChan()
+{
+    ncpRelease();
+}
+
 void linkChan::
 ncpDataCallback(bufferStore & a)
 {
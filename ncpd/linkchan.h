@@ -30,6 +30,7 @@
 class linkChan : public channel {
 public:
     linkChan(ncp *ncpController, int ncpChannel = -1);
+    ~linkChan();
 
     void ncpDataCallback(bufferStore &a);
     const char *getNcpRegisterName();
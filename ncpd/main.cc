@@ -23,6 +23,8 @@
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 #include <bufferstore.h>
 #include <ppsocket.h>
@@ -36,7 +38,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <pwd.h>
 #include <plpintl.h>
 
 #include "ignore-value.h"
@@ -46,6 +50,9 @@
 #include "linkchan.h"
 #include "link.h"
 #include "packet.h"
+#include "capture.h"
+#include "devwatch.h"
+#include "chanpool.h"
 
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
@@ -60,8 +67,10 @@ static bool autoexit = false;
 
 static ncp *theNCP = NULL;
 static IOWatch iow;
-static IOWatch accept_iow;
 static ppsocket skt;
+static ppsocket unixSkt;
+static vector<uid_t> allowUsers;
+static chanPool *pool = NULL;
 static int numScp = 0;
 static socketChan *scp[257]; // MAX_CHANNELS_PSION + 1
 
@@ -89,20 +98,35 @@ int_handler(int)
     active = false;
 };
 
+// Clients on the Unix domain socket are checked against the users
+// given with --allow. Those on TCP cannot be told apart.
+static bool
+allowed(ppsocket *s)
+{
+    uid_t uid;
+
+    if (!s->isLocal() || allowUsers.empty())
+	return true;
+    if (!s->getPeerCred(&uid, NULL, NULL))
+	return false;
+    if ((uid == 0) || (uid == geteuid()))
+	return true;
+    return find(allowUsers.begin(), allowUsers.end(), uid) != allowUsers.end();
+}
+
 void
-checkForNewSocketConnection()
+checkForNewSocketConnection(ppsocket &listener)
 {
     string peer;
-    if (accept_iow.watch(5,0) <= 0) {
-	return;
-    }
-    ppsocket *next = skt.accept(&peer, &iow);
+    ppsocket *next = listener.accept(&peer, &iow);
     if (next != NULL) {
-	next->setWatch(&iow);
 	// New connect
 	if (verbose)
 	    lout << "New socket connection from " << peer << endl;
-	if ((numScp >= theNCP->maxLinks()) || (!theNCP->gotLinkChannel())) {
+	if (!allowed(next)) {
+	    lerr << "Refused connection from " << peer << endl;
+	    delete next;
+	} else if ((numScp >= theNCP->maxLinks()) || (!theNCP->gotLinkChannel())) {
 	    bufferStore a;
 
 	    // Give the client time to send its version request.
@@ -116,28 +140,26 @@ checkForNewSocketConnection()
 	    if (verbose)
 		lout << "rejected" << endl;
 	} else
-	    scp[numScp++] = new socketChan(next, theNCP);
+	    scp[numScp++] = new socketChan(next, theNCP, &iow, pool);
     }
 }
 
-void *
-pollSocketConnections(void *)
+void
+pollSocketConnections(bool all)
 {
-    while (active) {
-        iow.watch(0, 10000);
-        for (int i = 0; i < numScp; i++) {
+    // Only clients with pending data are polled, unless all is set.
+    // Polling everyone once in a while catches connect timeouts and
+    // channels terminated by the NCP.
+    for (int i = 0; i < numScp; i++) {
+	if (all || scp[i]->socketReady())
 	    scp[i]->socketPoll();
-	    if (scp[i]->terminate()) {
-	        // Requested channel termination
-	        delete scp[i];
-	        numScp--;
-	        for (int j = i; j < numScp; j++)
-		    scp[j] = scp[j + 1];
-		i--;
-	    }
-        }
+	if (scp[i]->terminate()) {
+	    // Requested channel termination
+	    delete scp[i];
+	    scp[i] = scp[--numScp];
+	    i--;
+	}
     }
-    return NULL;
 }
 
 static void
@@ -174,6 +196,37 @@ help()
     _("                         Default: Autocycle 115.2k, 57.6k 38.4k, 19.2k\n");
 #endif
     cout << _(
+	" -B, --baudfile=FILE     Remember the rate found by auto-baud for\n"
+	"                         each device in FILE. An empty FILE turns\n"
+	"                         this off.\n"
+	);
+#ifdef DBAUDFILE
+    cout << _("                         Default: ") << DBAUDFILE << "\n";
+#endif
+    cout << _(
+	" -w, --window=N          Send up to N unacknowledged frames to an\n"
+	"                         EPOC device (1-8). Default: 8\n"
+	" -a, --ackdelay=MS       Delay acks to an EPOC device by up to MS\n"
+	"                         milliseconds to acknowledge several frames\n"
+	"                         at once (0-200). Default: 0 (ack every frame)\n"
+	" -c, --capture=FILE      Record the traffic on the serial line\n"
+	"                         into FILE, for use with ncpreplay.\n"
+	" -L, --lowlatency        Make the serial driver pass on received\n"
+	"                         bytes at once (ASYNC_LOW_LATENCY and the\n"
+	"                         latency timer of FTDI adaptors).\n"
+	" -R, --realtime=PRIO     Run the serial I/O thread with realtime\n"
+	"                         priority PRIO (1-99).\n"
+	" -C, --cpu=N             Run the serial I/O thread on CPU N only.\n"
+	" -U, --unix=PATH         Also listen on the Unix domain socket PATH.\n"
+	" -A, --allow=USER        Accept only USER, root and the user ncpd\n"
+	"                         runs as on the Unix domain socket. May be\n"
+	"                         given more than once.\n"
+	" -P, --pool=NAME[:N]     Keep N channels (default 1) connected to\n"
+	"                         the Psion service NAME, e.g. SYS$RFSV,\n"
+	"                         for new clients. May be given more than\n"
+	"                         once.\n"
+	" -I, --poolidle=SECS     Close pooled channels after SECS seconds\n"
+	"                         without a client. Default: 60\n"
 	" -p, --port=[HOST:]PORT  Listen on host HOST, port PORT.\n"
 	"                         Default for HOST: 127.0.0.1\n"
 	"                         Default for PORT: "
@@ -194,6 +247,17 @@ static struct option opts[] = {
     {"port",       required_argument, 0, 'p'},
     {"serial",     required_argument, 0, 's'},
     {"baudrate",   required_argument, 0, 'b'},
+    {"window",     required_argument, 0, 'w'},
+    {"ackdelay",   required_argument, 0, 'a'},
+    {"capture",    required_argument, 0, 'c'},
+    {"baudfile",   required_argument, 0, 'B'},
+    {"lowlatency", no_argument,       0, 'L'},
+    {"realtime",   required_argument, 0, 'R'},
+    {"cpu",        required_argument, 0, 'C'},
+    {"unix",       required_argument, 0, 'U'},
+    {"allow",      required_argument, 0, 'A'},
+    {"pool",       required_argument, 0, 'P'},
+    {"poolidle",   required_argument, 0, 'I'},
     {NULL,         0,                 0,  0 }
 };
 
@@ -226,24 +290,52 @@ parse_destination(const char *arg, const char **host, int *port)
 	*port = atoi(pp);
 }
 
-static void *
-link_thread(void *arg)
+static void
+mainLoop()
 {
+    time_t lastCheck = time(0);
+    time_t restart = 0;
+    devWatch *dw = theNCP->getDevWatch();
+
+    dw->addTo(iow);
+    // The serial line is served by the NCP's own threads. Everything
+    // else happens here: accepting and serving clients, and restarting
+    // the NCP once a second if it has failed. If the device comes or
+    // goes in between, this is done at once. After a failure, the
+    // restart waits for that, but not longer than 5 seconds.
     while (active) {
-        // psion
-        iow.watch(1, 0);
-        if (theNCP->hasFailed()) {
-            if (autoexit) {
-		active = false;
-                break;
+	iow.watch(1, 0);
+	if (!active)
+	    break;
+	if (skt.isReady())
+	    checkForNewSocketConnection(skt);
+	if (unixSkt.isReady())
+	    checkForNewSocketConnection(unixSkt);
+	time_t now = time(0);
+	bool tick = (now != lastCheck);
+	bool changed = dw->changed(iow);
+	pollSocketConnections(tick);
+	if (pool && tick)
+	    pool->poll();
+	if (!tick && !changed)
+	    continue;
+	lastCheck = now;
+	if (changed && verbose)
+	    lout << "ncp: device changed\n";
+	if (restart) {
+	    if ((now >= restart) || changed) {
+		if (verbose)
+		    lout << "ncp: restarting\n";
+		theNCP->reset();
+		restart = 0;
 	    }
-            iow.watch(5, 0);
-            if (verbose)
-                lout << "ncp: restarting\n";
-            theNCP->reset();
-        }
+	} else if (theNCP->hasFailed()) {
+	    if (autoexit)
+		active = false;
+	    else
+		restart = now + 5;
+	}
     }
-    return NULL;
 }
 
 int
@@ -254,8 +346,21 @@ main(int argc, char **argv)
 
     int sockNum = DPORT;
     int baudRate = DSPEED;
+    int window = LNK_EPOC_WINDOW;
+    int ackDelay = 0;
     const char *host = "127.0.0.1";
     const char *serialDevice = NULL;
+    const char *captureFile = NULL;
+    string unixName;
+    vector<pair<string, int> > poolServices;
+    int poolIdle = 60;
+#ifdef DBAUDFILE
+    string baudFile = DBAUDFILE;
+#else
+    string baudFile;
+#endif
+    capture *cap = NULL;
+    lineTuning tuning;
     unsigned short nverbose = 0;
 
     struct servent *se = getservbyname("psion", "tcp");
@@ -266,7 +371,7 @@ main(int argc, char **argv)
 	sockNum = ntohs(se->s_port);
 
     while (1) {
-	int c = getopt_long(argc, argv, "hdeVb:s:p:v:", opts, NULL);
+	int c = getopt_long(argc, argv, "hdeVb:s:p:v:w:a:c:B:LR:C:U:A:P:I:", opts, NULL);
 	if (c == -1)
 	    break;
 	switch (c) {
@@ -318,6 +423,90 @@ main(int argc, char **argv)
 	    case 's':
 		serialDevice = optarg;
 		break;
+	    case 'w':
+		window = atoi(optarg);
+		if ((window < 1) || (window > LNK_EPOC_WINDOW)) {
+		    cerr << _("Invalid window size ") << optarg << endl;
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'a':
+		ackDelay = atoi(optarg);
+		if ((ackDelay < 0) || (ackDelay > LNK_MAX_ACK_DELAY)) {
+		    cerr << _("Invalid ack delay ") << optarg << endl;
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'c':
+		captureFile = optarg;
+		break;
+	    case 'B':
+		baudFile = optarg;
+		break;
+	    case 'L':
+		tuning.lowLatency = true;
+		break;
+	    case 'R':
+		tuning.rtPriority = atoi(optarg);
+		if ((tuning.rtPriority < 1) || (tuning.rtPriority > 99)) {
+		    cerr << _("Invalid realtime priority ") << optarg << endl;
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'C':
+		tuning.cpu = atoi(optarg);
+		if (tuning.cpu < 0) {
+		    cerr << _("Invalid CPU ") << optarg << endl;
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'U':
+		unixName = optarg;
+		break;
+	    case 'A': {
+		struct passwd *pw = getpwnam(optarg);
+		char *end;
+		if (pw)
+		    allowUsers.push_back(pw->pw_uid);
+		else {
+		    long uid = strtol(optarg, &end, 10);
+		    if (!*optarg || *end || (uid < 0)) {
+			cerr << _("Unknown user ") << optarg << endl;
+			usage();
+			return -1;
+		    }
+		    allowUsers.push_back(uid);
+		}
+		break;
+	    }
+	    case 'P': {
+		string name = optarg;
+		int count = 1;
+		string::size_type colon = name.rfind(':');
+		if (colon != string::npos) {
+		    count = atoi(name.c_str() + colon + 1);
+		    name.erase(colon);
+		}
+		if (name.empty() || (count < 1) || (count > 16)) {
+		    cerr << _("Invalid pool ") << optarg << endl;
+		    usage();
+		    return -1;
+		}
+		poolServices.push_back(make_pair(name, count));
+		break;
+	    }
+	    case 'I':
+		poolIdle = atoi(optarg);
+		if (poolIdle < 1) {
+		    cerr << _("Invalid pool idle time ") << optarg << endl;
+		    usage();
+		    return -1;
+		}
+		break;
 	    case 'p':
 		parse_destination(optarg, &host, &sockNum);
 		break;
@@ -330,6 +519,25 @@ main(int argc, char **argv)
 
     if (serialDevice == NULL)
         serialDevice = DDEV;
+    if (!baudFile.empty() && (baudFile[0] != '/')) {
+	// A daemon changes its working directory.
+	char *cwd = getcwd(NULL, 0);
+	if (cwd) {
+	    baudFile = string(cwd) + "/" + baudFile;
+	    free(cwd);
+	}
+    }
+    if (!unixName.empty()) {
+	// Likewise, the socket is removed again at exit.
+	if (unixName[0] != '/') {
+	    char *cwd = getcwd(NULL, 0);
+	    if (cwd) {
+		unixName = string(cwd) + "/" + unixName;
+		free(cwd);
+	    }
+	}
+	unixName = "unix:" + unixName;
+    }
 
     if (dofork)
 	pid = fork();
@@ -339,19 +547,34 @@ main(int argc, char **argv)
 	case 0:
 	    signal(SIGTERM, term_handler);
 	    signal(SIGINT, int_handler);
-	    skt.setWatch(&accept_iow);
+	    skt.setWatch(&iow);
+	    unixSkt.setWatch(&iow);
 	    if (!skt.listen(host, sockNum))
 		cerr << "listen on " << host << ":" << sockNum << ": "
 		     << strerror(errno) << endl;
+	    else if (!unixName.empty() && !unixSkt.listen(unixName.c_str(), 0))
+		cerr << "listen on " << unixName << ": "
+		     << strerror(errno) << endl;
 	    else {
+		if (captureFile) {
+		    // Before a daemon changes its working directory
+		    cap = new capture(captureFile);
+		    if (!cap->isOpen()) {
+			cerr << "capture " << captureFile << ": "
+			     << strerror(errno) << endl;
+			exit(-1);
+		    }
+		}
 		if (dofork) {
 		    openlog("ncpd", LOG_CONS|LOG_PID, LOG_DAEMON);
 		    dlog.setOn(true);
 		    elog.setOn(true);
 		    ilog.setOn(true);
 		    linf << _("daemon started. Listening at ") << host << ":"
-			 << sockNum << _(" using device ") << serialDevice
-			 << endl;
+			 << sockNum;
+		    if (!unixName.empty())
+			linf << _(" and ") << unixName;
+		    linf << _(" using device ") << serialDevice << endl;
 		    setsid();
 		    ignore_value(chdir("/"));
 		    int devnull =
@@ -365,33 +588,29 @@ main(int argc, char **argv)
 		    }
 		}
 		memset(scp, 0, sizeof(scp));
-		theNCP = new ncp(serialDevice, baudRate, nverbose);
+		theNCP = new ncp(serialDevice, baudRate, nverbose, window, ackDelay,
+				 cap, baudFile.c_str(), &tuning);
 		if (!theNCP) {
 		    lerr << "Could not create NCP object" << endl;
 		    exit(-1);
 		}
-		pthread_t thr_a, thr_b;
-		if (pthread_create(&thr_a, NULL, link_thread, NULL) != 0) {
-		    lerr << "Could not create Link thread" << endl;
-		    exit(-1);
-		}
-		if (pthread_create(&thr_b, NULL,
-				   pollSocketConnections, NULL) != 0) {
-		    lerr << "Could not create Socket thread" << endl;
-		    exit(-1);
+		if (!poolServices.empty()) {
+		    pool = new chanPool(poolIdle, verbose);
+		    for (size_t i = 0; i < poolServices.size(); i++)
+			pool->addService(poolServices[i].first.c_str(),
+					 poolServices[i].second);
+		    pool->setNcp(theNCP);
 		}
-		while (active)
-		    checkForNewSocketConnection();
+		mainLoop();
 		linf << _("terminating") << endl;
-		void *ret;
-		pthread_join(thr_a, &ret);
-                linf << _("joined Link thread") << endl;
-		pthread_join(thr_b, &ret);
-                linf << _("joined Socket thread") << endl;
+		// The pooled channels are given back to the NCP.
+		delete pool;
 		delete theNCP;
                 linf << _("shut down NCP") << endl;
+		delete cap;
 	    }
 	    skt.closeSocket();
+	    unixSkt.closeSocket();
             linf << _("socket closed") << endl;
 	    break;
 	case -1:
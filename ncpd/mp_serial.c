@@ -37,6 +37,10 @@
 #include <sys/ttold.h>		/* sun has TIOCEXCL there */
 #endif
 #include <stdlib.h>
+#include <limits.h>
+#ifdef HAVE_LINUX_SERIAL_H
+#include <linux/serial.h>	/* for ASYNC_LOW_LATENCY */
+#endif
 
 #ifdef hpux
 #include <sys/termiox.h>
@@ -54,57 +58,66 @@
 #define O_NOCTTY 0
 #endif
 
-int
-init_serial(const char *dev, int speed, int debug)
-{
-    int fd, baud;
-    int uid, euid;
-    struct termios ti;
-#ifdef hpux
-    struct termiox tx;
-#endif
-    static struct baud {
-	int speed, baud;
-    } btable[] = {
-	{ 9600, B9600 },
+static struct baud {
+    int speed, baud;
+} btable[] = {
+    { 9600, B9600 },
 #ifdef B19200
-	{ 19200, B19200 },
+    { 19200, B19200 },
 #else
 #ifdef EXTA
-	{ 19200, EXTA },
+    { 19200, EXTA },
 #endif
 #endif
 #ifdef B38400
-	{ 38400, B38400 },
+    { 38400, B38400 },
 #else
 #ifdef EXTB
-	{ 38400, EXTB },
+    { 38400, EXTB },
 #endif
 #endif
 #ifdef B57600
-	{ 57600, B57600 },
+    { 57600, B57600 },
 #endif
 #ifdef B115200
-	{ 115200, B115200 },
+    { 115200, B115200 },
+#endif
+    { 4800, B4800 },
+    { 2400, B2400 },
+    { 1200, B1200 },
+    { 300, B300 },
+    { 75, B75 },
+    { 50, B50 },
+    { 0, 0 }
+};
+
+static int
+speed_code(int speed)
+{
+    struct baud *bptr;
+
+    for (bptr = btable; bptr->speed; bptr++)
+	if (bptr->speed == speed)
+	    return bptr->baud;
+    return -1;
+}
+
+int
+init_serial(const char *dev, int speed, int debug)
+{
+    int fd, baud;
+    int uid, euid;
+    struct termios ti;
+#ifdef hpux
+    struct termiox tx;
 #endif
-	{ 4800, B4800 },
-	{ 2400, B2400 },
-	{ 1200, B1200 },
-	{ 300, B300 },
-	{ 75, B75 },
-	{ 50, B50 },
-	{ 0, 0 }
-    }, *bptr;
 
     if (speed) {
-	for (bptr = btable; bptr->speed; bptr++)
-	    if (bptr->speed == speed)
-		break;
-	if (!bptr->baud) {
+	baud = speed_code(speed);
+	if (baud < 0) {
 	    fprintf(stderr, "Cannot match selected speed %d\n", speed);
 	    exit(1);
 	}
-	baud = bptr->baud;
     } else
 	baud = 0;
     
@@ -122,8 +135,13 @@ init_serial(const char *dev, int speed, int debug)
 	exit(1);
     }
     if ((fd = open(dev, O_RDWR | O_NOCTTY, 0)) < 0) {
+	/* The caller waits for the device to show up. */
 	perror(dev);
-	exit(1);
+	if (seteuid(euid)) {
+	    perror("seteuid back");
+	    exit(1);
+	}
+	return -1;
     }
     if (seteuid(euid)) {
 	perror("seteuid back");
@@ -168,6 +186,57 @@ init_serial(const char *dev, int speed, int debug)
     return fd;
 }
 
+int
+ser_speed(int fd, int speed)
+{
+    struct termios ti;
+    int baud = speed_code(speed);
+
+    if ((baud < 0) || (tcgetattr(fd, &ti) < 0))
+	return -1;
+    cfsetispeed(&ti, baud);
+    cfsetospeed(&ti, baud);
+    /* Whatever is in transit is garbage at the new speed. */
+    tcflush(fd, TCIOFLUSH);
+    return tcsetattr(fd, TCSANOW, &ti);
+}
+
+int
+ser_lowlatency(const char *dev, int fd)
+{
+    int res = 0;
+    char *real, *name;
+    char path[PATH_MAX];
+    FILE *f;
+
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct ss;
+
+    /* Hand received data to the reader at once, not after a tick. */
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(fd, TIOCSSERIAL, &ss) == 0)
+	    res |= SER_LOW_LATENCY;
+    }
+#endif
+    /* FTDI adaptors hold back received data for up to latency_timer
+     * milliseconds, 16 by default. */
+    real = realpath(dev, NULL);
+    if (!real)
+	return res;
+    name = strrchr(real, '/');
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer",
+	     name ? name + 1 : real);
+    free(real);
+    f = fopen(path, "w");
+    if (f) {
+	int ok = (fputs("1\n", f) >= 0);
+	if ((fclose(f) == 0) && ok)
+	    res |= SER_LATENCY_TIMER;
+    }
+    return res;
+}
+
 void
 ser_exit(int fd)
 {
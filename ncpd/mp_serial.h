@@ -25,6 +25,12 @@
 extern "C" {
 #endif
 int init_serial(const char *dev, int speed, int debug);
+int ser_speed(int fd, int speed);
+
+/* What ser_lowlatency() could set up */
+#define SER_LOW_LATENCY   1	/* ASYNC_LOW_LATENCY */
+#define SER_LATENCY_TIMER 2	/* latency timer of an FTDI adaptor */
+int ser_lowlatency(const char *dev, int fd);
 void ser_exit(int fd);
 #ifdef __cplusplus
 }
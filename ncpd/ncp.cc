@@ -22,6 +22,7 @@
 
 #include <iostream>
 #include <string>
+#include <sstream>
 
 #include <time.h>
 
@@ -40,14 +41,28 @@
 
 using namespace std;
 
-ncp::ncp(const char *fname, int baud, unsigned short _verbose)
+/**
+ * Transmit priorities of well known services. Bulk transfers
+ * must not hold up interactive requests on other channels.
+ */
+static const struct {
+    const char *name;
+    int priority;
+} servicePriorities[] = {
+    { "SYS$RFSV", LNK_PRIO_BULK },
+    { "SYS$RPCS", LNK_PRIO_NORMAL },
+    { "CLIPSVR", LNK_PRIO_INTERACTIVE },
+    { NULL, 0 }
+};
+
+ncp::ncp(const char *fname, int baud, unsigned short _verbose, int window,
+	 int ackDelay, capture *cap, const char *baudFile,
+	 const lineTuning *tuning)
 {
-    channelPtr = new channel*[MAX_CHANNELS_PSION + 1];
-    assert(channelPtr);
-    messageList = new bufferStore[MAX_CHANNELS_PSION + 1];
-    assert(messageList);
-    remoteChanList = new int[MAX_CHANNELS_PSION + 1];
-    assert(remoteChanList);
+    chans = new chanSlot[MAX_CHANNELS_PSION + 1];
+    assert(chans);
+    pthread_mutex_init(&chanMutex, NULL);
+    pthread_cond_init(&callbackDone, NULL);
 
     failed = false;
     verbose = _verbose;
@@ -56,50 +71,70 @@ ncp::ncp(const char *fname, int baud, unsigned short _verbose)
     maxChannels = MAX_CHANNELS_SIBO;
     protocolVersion = PV_SERIES_5;
     lChan = NULL;
+    lastSentChannel = 0;
 
     // init channels
-    for (int i = 0; i < MAX_CHANNELS_PSION; i++)
-	channelPtr[i] = NULL;
+    for (int i = 0; i <= MAX_CHANNELS_PSION; i++) {
+	chans[i].state = CHAN_FREE;
+	chans[i].ch = NULL;
+	chans[i].remote = -1;
+	chans[i].nextFree = 0;
+    }
+    freeLimit = 1;
+    initFreeList();
 
-    l = new Link(fname, baud, this, verbose);
+    l = new Link(fname, baud, this, verbose, window, ackDelay, cap, baudFile,
+		 tuning);
     assert(l);
+    // Frames from the peer may only arrive once l is set.
+    l->start();
 }
 
 ncp::~ncp()
 {
     bufferStore b;
-    for (int i = 0; i < maxLinks(); i++) {
-	if (isValidChannel(i)) {
-	    bufferStore b2;
-	    b2.addByte(remoteChanList[i]);
-	    controlChannel(i, NCON_MSG_CHANNEL_DISCONNECT, b2);
-	}
-	channelPtr[i] = NULL;
+    vector<pair<int, int> > open;
+    pthread_mutex_lock(&chanMutex);
+    for (int i = 1; i < freeLimit; i++) {
+	if (isValidChannel(i) && (chans[i].remote >= 0))
+	    open.push_back(make_pair(i, chans[i].remote));
+	chans[i].ch = NULL;
+    }
+    pthread_mutex_unlock(&chanMutex);
+    for (size_t i = 0; i < open.size(); i++) {
+	bufferStore b2;
+	b2.addByte(open[i].second);
+	controlChannel(open[i].first, NCON_MSG_CHANNEL_DISCONNECT, b2);
     }
     controlChannel(0, NCON_MSG_NCP_END, b);
     delete l;
-    delete [] channelPtr;
-    delete [] remoteChanList;
-    delete [] messageList;
+    pthread_cond_destroy(&callbackDone);
+    pthread_mutex_destroy(&chanMutex);
+    delete [] chans;
 }
 
 int ncp::
 maxLinks() {
-    return maxChannels;
+    pthread_mutex_lock(&chanMutex);
+    int n = maxChannels;
+    pthread_mutex_unlock(&chanMutex);
+    return n;
 }
 
 void ncp::
 reset() {
-    for (int i = 0; i < maxLinks(); i++) {
+    pthread_mutex_lock(&chanMutex);
+    for (int i = 1; i < freeLimit; i++)
 	if (isValidChannel(i))
-	    channelPtr[i]->terminateWhenAsked();
-	channelPtr[i] = NULL;
-    }
+	    chans[i].ch->terminateWhenAsked();
+    initFreeList();
     failed = false;
-    if (lChan)
-	delete(lChan);
+    linkChan *oldLink = lChan;
     lChan = NULL;
     protocolVersion = PV_SERIES_5; // until detected on receipt of INFO
+    pthread_mutex_unlock(&chanMutex);
+    if (oldLink)
+	delete(oldLink);
     l->reset();
 }
 
@@ -119,35 +154,55 @@ setVerbose(unsigned short _verbose)
 short int ncp::
 getProtocolVersion()
 {
-    return protocolVersion;
+    pthread_mutex_lock(&chanMutex);
+    short int v = protocolVersion;
+    pthread_mutex_unlock(&chanMutex);
+    return v;
 }
 
 void ncp::
-receive(bufferStore s) {
+receive(bufferChain s) {
     if (s.getLen() > 1) {
 	int channel = s.getByte(0);
 	s.discardFirstBytes(1);
 	if (channel == 0) {
-	    decodeControlMessage(s);
+	    bufferStore b;
+	    s.copyTo(b);
+	    decodeControlMessage(b);
 	} else {
 	    int allData = s.getByte(1);
 	    s.discardFirstBytes(2);
-            
+
+	    pthread_mutex_lock(&chanMutex);
             if (protocolVersion == PV_SERIES_3) {
                 channel = lastSentChannel;
             }
                 
 	    if (!isValidChannel(channel)) {
+		pthread_mutex_unlock(&chanMutex);
 		lerr << "ncp: Got message for unknown channel\n";
-	    } else {
-		messageList[channel].addBuff(s);
-		if (allData == LAST_MESS) {
-		    channelPtr[channel]->ncpDataCallback(messageList[channel]);
-		    messageList[channel].init();
-		} else if (allData != NOT_LAST_MESS) {
-		    lerr << "ncp: bizarre third byte!\n";
-		}
+		return;
+	    }
+	    // The parts are only linked, and copied once into a
+	    // contiguous message for the channel.
+	    chanSlot &c = chans[channel];
+	    c.message.addChain(s);
+	    c.stats.rxBytes.add(s.getLen());
+	    if (allData == LAST_MESS) {
+		bufferStore m;
+		c.message.copyTo(m);
+		c.message.init();
+		c.stats.rxMsgs.add();
+		class channel *ch = c.ch;
+		beginCallback(ch);
+		pthread_mutex_unlock(&chanMutex);
+		ch->ncpDataCallback(m);
+		endCallback(ch);
+		return;
 	    }
+	    pthread_mutex_unlock(&chanMutex);
+	    if (allData != NOT_LAST_MESS)
+		lerr << "ncp: bizarre third byte!\n";
 	}
     } else
 	lerr << "Got null message\n";
@@ -156,12 +211,15 @@ receive(bufferStore s) {
 void ncp::
 controlChannel(int chan, enum interControllerMessageType t, bufferStore & command)
 {
-    bufferStore open;
+    // Must not be called with chanMutex held: sending may wait for
+    // the pump, which needs it to deliver incoming frames.
+    bufferChain open;
     open.addByte(0);	// control
 
     open.addByte(chan);
     open.addByte(t);
-    open.addBuff(command);
+    open.addBytes((const unsigned char *)command.getString(0),
+		  command.getLen());
     if (verbose & NCP_DEBUG_LOG)
 	lout << "ncp: >> " << ctrlMsgName(t) << " " << chan << endl;
     l->send(open);
@@ -170,6 +228,16 @@ controlChannel(int chan, enum interControllerMessageType t, bufferStore & comman
 PcServer *ncp::
 findPcServer(const char *name)
 {
+    pthread_mutex_lock(&chanMutex);
+    PcServer *s = lookupPcServer(name);
+    pthread_mutex_unlock(&chanMutex);
+    return s;
+}
+
+PcServer *ncp::
+lookupPcServer(const char *name)
+{
+    // Caller must hold chanMutex
     if (name) {
 	vector<PcServer>::iterator i;
 	for (i = pcServers.begin(); i != pcServers.end(); i++)
@@ -181,18 +249,22 @@ findPcServer(const char *name)
 
 void ncp::
 registerPcServer(ppsocket *skt, const char *name) {
+    pthread_mutex_lock(&chanMutex);
     pcServers.push_back(PcServer(skt, name));
+    pthread_mutex_unlock(&chanMutex);
 }
 
 void ncp::
 unregisterPcServer(PcServer *server) {
     if (server) {
+	pthread_mutex_lock(&chanMutex);
 	vector<PcServer>::iterator i;
 	for (i = pcServers.begin(); i != pcServers.end(); i++)
 	    if (i->self() == server) {
 		pcServers.erase(i);
-		return;
+		break;
 	    }
+	pthread_mutex_unlock(&chanMutex);
     }
 }
 
@@ -208,6 +280,12 @@ decodeControlMessage(bufferStore & buff)
 
     bufferStore b;
     int localChan;
+    // The channel table is only locked while it is looked at. Frames
+    // are sent and channels called back after unlocking.
+    channel *ch = NULL;
+    linkChan *link;
+    bool newLink;
+    short int pv;
 
     switch (imt) {
 	case NCON_MSG_CONNECT_TO_SERVER:
@@ -217,12 +295,16 @@ decodeControlMessage(bufferStore & buff)
 		lout << endl;
 	    }
 
+	    pthread_mutex_lock(&chanMutex);
 	    failed = false;
+	    newLink = (lChan == NULL);
 	    if (!strcmp(buff.getString(0), "LINK.*")) {
 		if (lChan)
 		    localChan = lChan->getNcpChannel();
 		else
-		    localChan = getFirstUnusedChan();
+		    localChan = allocChannel();
+		pv = protocolVersion;
+		pthread_mutex_unlock(&chanMutex);
 
 		// Ack with connect response
 		b.addByte(remoteChan);
@@ -231,28 +313,37 @@ decodeControlMessage(bufferStore & buff)
 		if (verbose & NCP_DEBUG_LOG)
 		    lout << "ncp: Link UP" << endl;
 		linf << _("Connected with a S")
-		     << ((protocolVersion == PV_SERIES_5) ? 5 : 3) << _(" at ")
+		     << ((pv == PV_SERIES_5) ? 5 : 3) << _(" at ")
 		     << getSpeed() << _("baud") << endl;
-		// Create linkchan if it does not yet exist
-		if (!lChan) {
+		// Create linkchan if it does not yet exist. It takes
+		// its channel by connecting to the link service of the
+		// Psion in turn.
+		if (newLink) {
 		    if (verbose & NCP_DEBUG_LOG)
 			lout << "ncp: new passive linkChan" << endl;
-		    channelPtr[localChan] =
-			lChan = new linkChan(this, localChan);
-		    lChan->setVerbose(verbose);
+		    newLinkChan(localChan);
+		}
+		pthread_mutex_lock(&chanMutex);
+		link = lChan;
+		if (link)
+		    beginCallback(link);
+		pthread_mutex_unlock(&chanMutex);
+		if (link) {
+		    link->ncpConnectAck();
+		    endCallback(link);
 		}
-		lChan->ncpConnectAck();
 	    } else {
-		PcServer *s = findPcServer(buff.getString(0));
+		PcServer *s = lookupPcServer(buff.getString(0));
 		bool ok = false;
 
 		if (s) {
-		    localChan = getFirstUnusedChan();
+		    localChan = allocChannel();
 		    ok = s->clientConnect(localChan, remoteChan);
 		    if (!ok)
-			// release channel ptr
-			channelPtr[localChan] = NULL;
+			freeChannel(localChan);
 		}
+		pthread_mutex_unlock(&chanMutex);
+
 		b.addByte(remoteChan);
 		if (ok) {
 		    b.addByte(rfsv::E_PSI_GEN_NONE);
@@ -267,14 +358,11 @@ decodeControlMessage(bufferStore & buff)
 		controlChannel(localChan, NCON_MSG_CONNECT_RESPONSE, b);
 
 		// Create linkchan if it does not yet exist
-		if (!lChan) {
+		if (newLink) {
 		    if (verbose & NCP_DEBUG_LOG)
 			lout << "ncp: new active linkChan" << endl;
-		    channelPtr[localChan] =
-			lChan = new linkChan(this, -1);
-		    lChan->setVerbose(verbose);
+		    newLinkChan(-1);
 		}
-
 	    }
 	    break;
 
@@ -282,25 +370,53 @@ decodeControlMessage(bufferStore & buff)
 
 	    int forChan;
 
-	    failed = false;
 	    forChan = buff.getByte(0);
 	    if (verbose & NCP_DEBUG_LOG)
 		lout << " ch=" << forChan << " stat=";
+	    pthread_mutex_lock(&chanMutex);
+	    failed = false;
 	    if (buff.getByte(1) == 0) {
 		if (verbose & NCP_DEBUG_LOG)
 		    lout << "OK" << endl;
 		if (isValidChannel(forChan)) {
-		    remoteChanList[forChan] = remoteChan;
-		    channelPtr[forChan]->ncpConnectAck();
+		    setRemote(forChan, remoteChan);
+		    ch = chans[forChan].ch;
+		    beginCallback(ch);
+		    pthread_mutex_unlock(&chanMutex);
+		    l->setPriority(remoteChan, servicePriority(ch));
+		    ch->ncpConnectAck();
+		    endCallback(ch);
+		} else if (chans[forChan].state == CHAN_CLOSING) {
+		    pthread_mutex_unlock(&chanMutex);
+		    // Closed before the Psion answered: close its end
+		    // now that it is known. The number is only given
+		    // back afterwards.
+		    b.addByte(remoteChan);
+		    controlChannel(forChan, NCON_MSG_CHANNEL_DISCONNECT, b);
+		    pthread_mutex_lock(&chanMutex);
+		    if (chans[forChan].state == CHAN_CLOSING)
+			freeChannel(forChan);
+		    pthread_mutex_unlock(&chanMutex);
 		} else {
+		    pthread_mutex_unlock(&chanMutex);
 		    if (verbose & NCP_DEBUG_LOG)
 			lout << "ncp: message for unknown channel" << endl;
 		}
 	    } else {
 		if (verbose & NCP_DEBUG_LOG)
 		    lout << "Unknown " << (int) buff.getByte(1) << endl;
-		if (isValidChannel(forChan))
-		    channelPtr[forChan]->ncpConnectNak();
+		if (isValidChannel(forChan)) {
+		    // The owner may retry, or disconnect.
+		    chans[forChan].state = CHAN_RESERVED;
+		    ch = chans[forChan].ch;
+		    beginCallback(ch);
+		} else if (chans[forChan].state == CHAN_CLOSING)
+		    freeChannel(forChan);
+		pthread_mutex_unlock(&chanMutex);
+		if (ch) {
+		    ch->ncpConnectNak();
+		    endCallback(ch);
+		}
 	    }
 	    break;
 
@@ -308,7 +424,6 @@ decodeControlMessage(bufferStore & buff)
 
 	    int ver;
 
-	    failed = false;
 	    ver = buff.getByte(0);
 	    // Series 3c returns '3', as does mclink. PsiWin 1.1
 	    // returns version 2. We return whatever version we're
@@ -318,6 +433,8 @@ decodeControlMessage(bufferStore & buff)
 	    //
 	    if (ver == PV_SERIES_5 || ver == PV_SERIES_3) {
 		bufferStore b;
+		pthread_mutex_lock(&chanMutex);
+		failed = false;
 		protocolVersion = ver;
 		if (verbose & NCP_DEBUG_LOG) {
 		    if (verbose & NCP_DEBUG_DUMP)
@@ -330,7 +447,9 @@ decodeControlMessage(bufferStore & buff)
 		} else {
 		    // Series 5 supports more channels
 		    maxChannels = MAX_CHANNELS_PSION;
+		    growFreeList();
 		}
+		pthread_mutex_unlock(&chanMutex);
 		b.addByte(ver);
 		// Do we send a time of 0 or a real time?
 		// The Psion uses this to determine whether to
@@ -339,7 +458,9 @@ decodeControlMessage(bufferStore & buff)
 		controlChannel(0, NCON_MSG_NCP_INFO, b);
 	    } else {
 		lout << "ALERT!!!! Unexpected Protocol Version!! (Not Series 3/5?)!" << endl;
+		pthread_mutex_lock(&chanMutex);
 		failed = true;
+		pthread_mutex_unlock(&chanMutex);
 	    }
 	    break;
 
@@ -364,24 +485,163 @@ decodeControlMessage(bufferStore & buff)
     }
 }
 
-int ncp::
-getFirstUnusedChan()
+void ncp::
+newLinkChan(int chan)
 {
-    for (int cNum = 1; cNum < maxLinks(); cNum++) {
-	if (channelPtr[cNum] == NULL) {
-	    if (verbose & NCP_DEBUG_LOG)
-		lout << "ncp: getFirstUnusedChan=" << cNum << endl;
-	    channelPtr[cNum] = (channel *)0xdeadbeef;
-	    return cNum;
+    // It connects while it is created, so chanMutex must not be held.
+    linkChan *link = new linkChan(this, chan);
+    link->setVerbose(verbose);
+    pthread_mutex_lock(&chanMutex);
+    lChan = link;
+    pthread_mutex_unlock(&chanMutex);
+}
+
+void ncp::
+beginCallback(channel *ch)
+{
+    // Caller must hold chanMutex
+    callback c = { ch, pthread_self() };
+    callbacks.push_back(c);
+}
+
+void ncp::
+endCallback(channel *ch)
+{
+    pthread_mutex_lock(&chanMutex);
+    for (size_t i = 0; i < callbacks.size(); i++)
+	if ((callbacks[i].ch == ch) &&
+	    pthread_equal(callbacks[i].thread, pthread_self())) {
+	    callbacks.erase(callbacks.begin() + i);
+	    break;
+	}
+    pthread_cond_broadcast(&callbackDone);
+    pthread_mutex_unlock(&chanMutex);
+}
+
+bool ncp::
+inCallback(channel *ch)
+{
+    // Caller must hold chanMutex
+    // A thread deleting a channel from within a callback to it
+    // knows what it does.
+    for (size_t i = 0; i < callbacks.size(); i++)
+	if ((callbacks[i].ch == ch) &&
+	    !pthread_equal(callbacks[i].thread, pthread_self()))
+	    return true;
+    return false;
+}
+
+void ncp::
+releaseChannel(channel *ch)
+{
+    int chan = 0;
+    pthread_mutex_lock(&chanMutex);
+    for (int i = 1; i < freeLimit; i++)
+	if (chans[i].ch == ch) {
+	    chan = i;
+	    break;
 	}
+    pthread_mutex_unlock(&chanMutex);
+    // Deleted without a disconnect, e.g. at shutdown
+    if (chan)
+	disconnect(chan);
+    pthread_mutex_lock(&chanMutex);
+    while (inCallback(ch))
+	pthread_cond_wait(&callbackDone, &chanMutex);
+    pthread_mutex_unlock(&chanMutex);
+}
+
+int ncp::
+allocChannel()
+{
+    // Caller must hold chanMutex
+    int cNum = freeHead;
+    if (cNum == 0)
+	return 0;
+    freeHead = chans[cNum].nextFree;
+    if (freeHead == 0)
+	freeTail = 0;
+    if (verbose & NCP_DEBUG_LOG)
+	lout << "ncp: allocChannel=" << cNum << endl;
+    chanSlot &c = chans[cNum];
+    c.state = CHAN_RESERVED;
+    c.ch = NULL;
+    c.remote = -1;
+    c.nextFree = 0;
+    c.message.init();
+    resetStats(cNum);
+    return cNum;
+}
+
+void ncp::
+freeChannel(int chan)
+{
+    // Caller must hold chanMutex
+    if ((chan <= 0) || (chans[chan].state == CHAN_FREE))
+	return;
+    chanSlot &c = chans[chan];
+    if ((c.remote >= 0) && (remoteToLocal[c.remote] == chan))
+	remoteToLocal[c.remote] = 0;
+    c.state = CHAN_FREE;
+    c.ch = NULL;
+    c.remote = -1;
+    c.nextFree = 0;
+    if (freeTail)
+	chans[freeTail].nextFree = chan;
+    else
+	freeHead = chan;
+    freeTail = chan;
+}
+
+void ncp::
+initFreeList()
+{
+    // Caller must hold chanMutex
+    freeHead = freeTail = 0;
+    freeLimit = 1;
+    memset(remoteToLocal, 0, sizeof(remoteToLocal));
+    growFreeList();
+}
+
+void ncp::
+growFreeList()
+{
+    // Caller must hold chanMutex
+    // Channel 0 is the control channel. The new channels are
+    // handed to freeChannel, as if they had been in use.
+    for (; freeLimit < maxChannels; freeLimit++) {
+	chans[freeLimit].state = CHAN_RESERVED;
+	freeChannel(freeLimit);
+    }
+}
+
+void ncp::
+setRemote(int chan, int remote)
+{
+    // Caller must hold chanMutex
+    int old = remoteToLocal[remote];
+    if (old && (old != chan) && (chans[old].remote == remote)) {
+	// The Psion reuses a channel number only after closing it,
+	// so the old owner has missed its disconnect.
+	lerr << "ncp: channel " << old << " lost its peer to channel "
+	     << chan << endl;
+	if (isValidChannel(old))
+	    chans[old].ch->terminateWhenAsked();
+	freeChannel(old);
     }
-    return 0;
+    chans[chan].remote = remote;
+    chans[chan].state = CHAN_CONNECTED;
+    remoteToLocal[remote] = chan;
 }
 
 bool ncp::
 isValidChannel(int channel)
 {
-    return (channelPtr[channel] && ((long)channelPtr[channel] != 0xdeadbeef));
+    // Caller must hold chanMutex
+    if ((channel <= 0) || (channel > MAX_CHANNELS_PSION))
+	return false;
+    chanState s = chans[channel].state;
+    return (chans[channel].ch && (s != CHAN_FREE) && (s != CHAN_CLOSING));
 }
 
 void ncp::
@@ -389,13 +649,18 @@ RegisterAck(int chan, const char *name)
 {
     if (verbose & NCP_DEBUG_LOG)
 	lout << "ncp: RegisterAck: chan=" << chan << endl;
-    for (int cNum = 1; cNum < maxLinks(); cNum++) {
-	channel *ch = channelPtr[cNum];
-	if (isValidChannel(cNum) && ch->getNcpChannel() == chan) {
-	    ch->setNcpConnectName(name);
-	    ch->ncpRegisterAck();
-	    return;
-	}
+    channel *ch = NULL;
+    pthread_mutex_lock(&chanMutex);
+    if (isValidChannel(chan) && (chans[chan].ch->getNcpChannel() == chan)) {
+	ch = chans[chan].ch;
+	beginCallback(ch);
+    }
+    pthread_mutex_unlock(&chanMutex);
+    if (ch) {
+	ch->setNcpConnectName(name);
+	ch->ncpRegisterAck();
+	endCallback(ch);
+	return;
     }
     lerr << "ncp: RegisterAck: no channel to deliver" << endl;
 }
@@ -403,18 +668,29 @@ RegisterAck(int chan, const char *name)
 void ncp::
 Register(channel * ch)
 {
-    if (lChan) {
+    pthread_mutex_lock(&chanMutex);
+    linkChan *link = lChan;
+    if (link) {
 	int cNum = ch->getNcpChannel();
 	if (cNum == 0)
-	    cNum = getFirstUnusedChan();
+	    cNum = allocChannel();
 	if (cNum > 0) {
-	    channelPtr[cNum] = ch;
+	    // It connects once the RegisterAck tells the name.
+	    chans[cNum].ch = ch;
+	    chans[cNum].state = CHAN_RESERVED;
 	    ch->setNcpChannel(cNum);
-	    lChan->Register(ch);
-	} else
-	    lerr << "ncp: Out of channels in register" << endl;
-    } else
+	    beginCallback(link);
+	    pthread_mutex_unlock(&chanMutex);
+	    link->Register(ch);
+	    endCallback(link);
+	    return;
+	}
+	pthread_mutex_unlock(&chanMutex);
+	lerr << "ncp: Out of channels in register" << endl;
+    } else {
+	pthread_mutex_unlock(&chanMutex);
 	lerr << "ncp: Register without established lChan" << endl;
+    }
 }
 
 int ncp::
@@ -422,12 +698,15 @@ connect(channel * ch)
 {
     // look for first unused chan
 
+    pthread_mutex_lock(&chanMutex);
     int cNum = ch->getNcpChannel();
     if (cNum == 0)
-	cNum = getFirstUnusedChan();
+	cNum = allocChannel();
     if (cNum > 0) {
-	channelPtr[cNum] = ch;
+	chans[cNum].ch = ch;
+	chans[cNum].state = CHAN_CONNECTING;
 	ch->setNcpChannel(cNum);
+	pthread_mutex_unlock(&chanMutex);
 	bufferStore b;
 	if (ch->getNcpConnectName())
 	    b.addString(ch->getNcpConnectName());
@@ -439,6 +718,7 @@ connect(channel * ch)
 	controlChannel(cNum, NCON_MSG_CONNECT_TO_SERVER, b);
 	return cNum;
     }
+    pthread_mutex_unlock(&chanMutex);
     return -1;
 }
 
@@ -446,14 +726,30 @@ void ncp::
 send(int channel, bufferStore & a)
 {
     bool last;
+
+    pthread_mutex_lock(&chanMutex);
+    if (!isValidChannel(channel)) {
+	pthread_mutex_unlock(&chanMutex);
+	lerr << "ncp: Ignored send on unknown channel #" << channel << endl;
+	return;
+    }
+    chans[channel].stats.txMsgs.add();
+    chans[channel].stats.txBytes.add(a.getLen());
+    int remote = chans[channel].remote;
+    lastSentChannel = channel;
+    pthread_mutex_unlock(&chanMutex);
+    // The message is copied once. Each frame only refers to its
+    // part, behind a header of its own.
+    bufferChain msg(a);
+    long pos = 0;
     do {
 	last = true;
 
-	if (a.getLen() > NCP_SENDLEN)
+	if (msg.getLen() - pos > NCP_SENDLEN)
 	    last = false;
 
-	bufferStore out;
-	out.addByte(remoteChanList[channel]);
+	bufferChain out;
+	out.addByte(remote);
 	out.addByte(channel);
 
 	if (last) {
@@ -462,27 +758,76 @@ send(int channel, bufferStore & a)
 	    out.addByte(NOT_LAST_MESS);
 	}
 
-	out.addBuff(a, NCP_SENDLEN);
-	a.discardFirstBytes(NCP_SENDLEN);
+	out.addChain(msg, pos, NCP_SENDLEN);
+	pos += NCP_SENDLEN;
 	l->send(out);
     } while (!last);
-    lastSentChannel = channel;
+    a.init();
 }
 
 void ncp::
 disconnect(int channel)
 {
+    pthread_mutex_lock(&chanMutex);
     if (!isValidChannel(channel)) {
+	pthread_mutex_unlock(&chanMutex);
 	lerr << "ncp: Ignored disconnect for unknown channel #" << channel << endl;
 	return;
     }
-    channelPtr[channel]->terminateWhenAsked();
+    chans[channel].ch->terminateWhenAsked();
     if (verbose & NCP_DEBUG_LOG)
 	lout << "ncp: disconnect: channel=" << channel << endl;
-    channelPtr[channel] = NULL;
+    if (chans[channel].state == CHAN_CONNECTING) {
+	// The channel of the Psion is not known yet. Keep the number
+	// until the connect response tells it.
+	chans[channel].ch = NULL;
+	chans[channel].state = CHAN_CLOSING;
+	pthread_mutex_unlock(&chanMutex);
+	return;
+    }
+    // Nothing to tell the Psion about a channel never connected.
+    int remote = -1;
+    if (chans[channel].state == CHAN_CONNECTED)
+	remote = chans[channel].remote;
+    // The number goes to the end of the free list, so it is not
+    // handed out again before the Psion has been told.
+    freeChannel(channel);
+    pthread_mutex_unlock(&chanMutex);
+    if (remote >= 0) {
+	bufferStore b;
+	b.addByte(remote);
+	controlChannel(channel, NCON_MSG_CHANNEL_DISCONNECT, b);
+    }
+}
+
+bool ncp::
+handOver(int chan, channel *to)
+{
+    // The Psion does not notice: to it, the channel stays the same.
+    pthread_mutex_lock(&chanMutex);
+    if (!isValidChannel(chan) || (chans[chan].state != CHAN_CONNECTED)) {
+	pthread_mutex_unlock(&chanMutex);
+	return false;
+    }
+    if (verbose & NCP_DEBUG_LOG)
+	lout << "ncp: handOver: channel=" << chan << endl;
+    chans[chan].ch = to;
+    to->setNcpChannel(chan);
+    pthread_mutex_unlock(&chanMutex);
+    return true;
+}
+
+void ncp::
+flowControl(int channel, bool stop)
+{
+    // Ask the remote side to pause (or resume) sending on a channel.
+    pthread_mutex_lock(&chanMutex);
+    bool valid = isValidChannel(channel);
+    pthread_mutex_unlock(&chanMutex);
+    if (!valid)
+	return;
     bufferStore b;
-    b.addByte(remoteChanList[channel]);
-    controlChannel(channel, NCON_MSG_CHANNEL_DISCONNECT, b);
+    controlChannel(channel, stop ? NCON_MSG_DATA_XOFF : NCON_MSG_DATA_XON, b);
 }
 
 bool ncp::
@@ -495,25 +840,33 @@ bool ncp::
 hasFailed()
 {
     bool lfailed = l->hasFailed();
+    pthread_mutex_lock(&chanMutex);
     if (failed || lfailed) {
 	if (verbose & NCP_DEBUG_LOG)
 	    lout << "ncp: hasFailed: " << failed << ", " << lfailed << endl;
     }
     failed |= lfailed;
+    bool ret = failed;
+    linkChan *oldLink = NULL;
     if (failed) {
-	if (lChan) {
-	    channelPtr[lChan->getNcpChannel()] = NULL;
-	    delete lChan;
-	}
+	if (lChan)
+	    freeChannel(lChan->getNcpChannel());
+	oldLink = lChan;
 	lChan = NULL;
     }
-    return failed;
+    pthread_mutex_unlock(&chanMutex);
+    if (oldLink)
+	delete oldLink;
+    return ret;
 }
 
 bool ncp::
 gotLinkChannel()
 {
-    return (lChan != NULL);
+    pthread_mutex_lock(&chanMutex);
+    bool ret = (lChan != NULL);
+    pthread_mutex_unlock(&chanMutex);
+    return ret;
 }
 
 int ncp::
@@ -522,6 +875,121 @@ getSpeed()
     return l->getSpeed();
 }
 
+devWatch *ncp::
+getDevWatch()
+{
+    return l->getDevWatch();
+}
+
+int ncp::
+servicePriority(channel *ch)
+{
+    const char *name = ch->getNcpConnectName();
+    if (!name)
+	name = ch->getNcpRegisterName();
+    if (!name)
+	return LNK_PRIO_NORMAL;
+    for (int i = 0; servicePriorities[i].name; i++)
+	if (!strncmp(name, servicePriorities[i].name,
+		     strlen(servicePriorities[i].name)))
+	    return servicePriorities[i].priority;
+    return LNK_PRIO_NORMAL;
+}
+
+void ncp::
+getQueueStatus(bufferStore &a)
+{
+    // One entry per connected channel: local channel, priority
+    // class, frames waiting for transmission and service name.
+    // The Link is asked after unlocking the channel table.
+    vector<pair<int, int> > remotes;
+    vector<string> names;
+    pthread_mutex_lock(&chanMutex);
+    for (int i = 1; i < maxChannels; i++) {
+	if (!isValidChannel(i) || (chans[i].ch == lChan))
+	    continue;
+	const char *name = chans[i].ch->getNcpConnectName();
+	if (!name)
+	    name = chans[i].ch->getNcpRegisterName();
+	remotes.push_back(make_pair(i, chans[i].remote));
+	names.push_back(name ? name : "");
+    }
+    pthread_mutex_unlock(&chanMutex);
+    for (size_t i = 0; i < remotes.size(); i++) {
+	a.addByte(remotes[i].first);
+	a.addByte(l->getPriority(remotes[i].second));
+	a.addWord(l->getQueueDepth(remotes[i].second));
+	a.addStringT(names[i].c_str());
+    }
+}
+
+void ncp::
+resetStats(int channel)
+{
+    // Caller must hold chanMutex
+    chans[channel].stats.txBytes.reset();
+    chans[channel].stats.rxBytes.reset();
+    chans[channel].stats.txMsgs.reset();
+    chans[channel].stats.rxMsgs.reset();
+}
+
+void ncp::
+getStats(ostream &s)
+{
+    // The lines of the channels are collected with the channel table
+    // locked. The Link is asked for its part after unlocking it.
+    struct chanLines {
+	string prefix;
+	string head;
+	string tail;
+	int remote;
+	bool isLink;    // the link channel has no queue
+    };
+    vector<chanLines> lines;
+    pthread_mutex_lock(&chanMutex);
+    short int pv = protocolVersion;
+    int max = maxChannels;
+    for (int i = 1; i < maxChannels; i++) {
+	if (!isValidChannel(i))
+	    continue;
+	channel *ch = chans[i].ch;
+	const char *name = ch->getNcpConnectName();
+	if (!name)
+	    name = ch->getNcpRegisterName();
+	ostringstream prefix;
+	prefix << "chan." << i;
+	string p = prefix.str();
+	ostringstream head;
+	head << p << ".name " << (name ? name : "") << "\n";
+	head << p << ".tx_bytes " << chans[i].stats.txBytes.get() << "\n";
+	head << p << ".rx_bytes " << chans[i].stats.rxBytes.get() << "\n";
+	head << p << ".tx_msgs " << chans[i].stats.txMsgs.get() << "\n";
+	head << p << ".rx_msgs " << chans[i].stats.rxMsgs.get() << "\n";
+	ostringstream tail;
+	ch->getStats(tail, p);
+	chanLines c = { p, head.str(), tail.str(), chans[i].remote,
+			ch == lChan };
+	lines.push_back(c);
+    }
+    pthread_mutex_unlock(&chanMutex);
+
+    s << "ncp.protocol " << pv << "\n";
+    s << "ncp.max_channels " << max << "\n";
+    s << "ncp.copied_bytes " << bufferChain::copiedBytes() << "\n";
+    s << "bufferstore.copied_bytes " << bufferStore::copiedBytes() << "\n";
+    s << "bufferstore.allocations " << bufferStore::allocations() << "\n";
+    for (size_t i = 0; i < lines.size(); i++) {
+	const chanLines &c = lines[i];
+	s << c.head;
+	if (!c.isLink) {
+	    s << c.prefix << ".priority " << l->getPriority(c.remote) << "\n";
+	    s << c.prefix << ".queue " << l->getQueueDepth(c.remote) << "\n";
+	}
+	s << c.tail;
+    }
+    l->getStats(s);
+}
+
 const char *ncp::
 ctrlMsgName(unsigned char msgType)
 {
@@ -23,14 +23,23 @@
 
 #include "config.h"
 
+#include <ostream>
 #include <vector>
 
+#include <pthread.h>
+
 #include "bufferstore.h"
+#include "bufchain.h"
 #include "linkchan.h"
 #include "ppsocket.h"
+#include "link.h"
+#include "stats.h"
 
 class Link;
 class channel;
+class capture;
+class devWatch;
+struct lineTuning;
 
 #define NCP_DEBUG_LOG  1
 #define NCP_DEBUG_DUMP 2
@@ -52,13 +61,17 @@ private:
 
 class ncp {
 public:
-    ncp(const char *fname, int baud, unsigned short _verbose = 0);
+    ncp(const char *fname, int baud, unsigned short _verbose = 0,
+	int window = LNK_EPOC_WINDOW, int ackDelay = 0, capture *cap = NULL,
+	const char *baudFile = NULL, const lineTuning *tuning = NULL);
     ~ncp();
 
     int connect(channel *c); // returns channel, or -1 if failure
     void Register(channel *c);
     void RegisterAck(int, const char *);
     void disconnect(int channel);
+    bool handOver(int chan, channel *to); // pass on a connected channel
+    void flowControl(int channel, bool stop);
     void send(int channel, bufferStore &a);
     void reset();
     int  maxLinks();
@@ -74,6 +87,25 @@ public:
     unsigned short getVerbose();
     short int getProtocolVersion();
     int getSpeed();
+    devWatch *getDevWatch();
+    void getQueueStatus(bufferStore &a);
+
+    /**
+     * Print statistics of all connected channels, followed
+     * by those of the Link, as lines of the form "key value".
+     *
+     * @param s The stream to print on.
+     */
+    void getStats(std::ostream &s);
+
+    /**
+     * Forget a channel before it is deleted. A channel still using
+     * an NCP channel is disconnected first. Waits until no other
+     * thread is calling the channel back.
+     *
+     * @param ch The channel.
+     */
+    void releaseChannel(channel *ch);
 
 private:
     friend class Link;
@@ -91,18 +123,81 @@ private:
 	NCON_MSG_NCP_END=8
     };
     enum protocolVersionType { PV_SERIES_5 = 6, PV_SERIES_3 = 3 };
-    void receive(bufferStore s);
-    int getFirstUnusedChan();
+
+    /**
+     * Traffic counters of a single channel.
+     */
+    struct channelStats {
+	statCounter txBytes;
+	statCounter rxBytes;
+	statCounter txMsgs;
+	statCounter rxMsgs;
+    };
+
+    /**
+     * States of a local NCP channel.
+     */
+    enum chanState {
+	CHAN_FREE,        // on the free list
+	CHAN_RESERVED,    // allocated, no connect request sent (yet)
+	CHAN_CONNECTING,  // waiting for the connect response
+	CHAN_CONNECTED,   // the channel of the Psion is known
+	CHAN_CLOSING      // closed locally while still connecting
+    };
+
+    /**
+     * A local NCP channel.
+     */
+    struct chanSlot {
+	chanState state;
+	channel *ch;           // owner, NULL while reserved for none
+	int remote;            // channel of the Psion, -1 if not known
+	int nextFree;          // next slot on the free list, 0 at its end
+	bufferChain message;   // parts of the incoming message so far
+	channelStats stats;
+    };
+
+    void receive(bufferChain s);
+    PcServer *lookupPcServer(const char *name);
+    void newLinkChan(int chan);
+    void beginCallback(channel *ch);
+    void endCallback(channel *ch);
+    bool inCallback(channel *ch);
+    int allocChannel();
+    void freeChannel(int chan);
+    void initFreeList();
+    void growFreeList();
+    void setRemote(int chan, int remote);
     bool isValidChannel(int);
+    int servicePriority(channel *ch);
+    void resetStats(int channel);
     void decodeControlMessage(bufferStore &buff);
     void controlChannel(int chan, enum interControllerMessageType t, bufferStore &command);
     const char * ctrlMsgName(unsigned char);
 
     Link *l;
     unsigned short verbose;
-    channel **channelPtr;
-    bufferStore *messageList;
-    int *remoteChanList;
+    // Guards the channel table and everything below it, as ncp is
+    // called from both the main loop and the pump. It is never held
+    // while sending or calling back a channel.
+    pthread_mutex_t chanMutex;
+    // Channels being called back, which must not be deleted until
+    // the call returns. See releaseChannel().
+    struct callback {
+	channel *ch;
+	pthread_t thread;
+    };
+    std::vector<callback> callbacks;
+    pthread_cond_t callbackDone;
+    chanSlot *chans;
+    // Free channels are handed out oldest first, so that a number is
+    // not reused while frames for its last owner may be under way.
+    int freeHead;
+    int freeTail;
+    // Channels below this are on the free list or in use.
+    int freeLimit;
+    // Local channel of each channel of the Psion, 0 if none
+    int remoteToLocal[256];
     bool failed;
     short int protocolVersion;
     linkChan *lChan;
@@ -0,0 +1,861 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <plpintl.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <atomic>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include <bufferstore.h>
+#include <bufferarray.h>
+
+#include "capture.h"
+#include "framing.h"
+#include "stats.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <getopt.h>
+
+using namespace std;
+
+/**
+ * A record of a capture file.
+ */
+struct record {
+    long long stamp; // microseconds
+    int type;
+    string data;
+};
+
+/**
+ * Counts complete frames in a stream of bytes from the serial line.
+ */
+class frameCounter {
+public:
+    frameCounter() : state(0), count(0) {}
+
+    void add(const unsigned char *p, long len) {
+	while (len-- > 0) {
+	    unsigned char c = *p++;
+	    switch (state) {
+		case 0: // SYN
+		    if (c == 0x16)
+			state = 1;
+		    break;
+		case 1: // DLE
+		    state = (c == 0x10) ? 2 : ((c == 0x16) ? 1 : 0);
+		    break;
+		case 2: // STX
+		    state = (c == 0x02) ? 3 : 0;
+		    break;
+		case 3: // payload
+		    if (c == 0x10)
+			state = 4;
+		    break;
+		case 4: // escaped byte or ETX
+		    state = (c == 0x03) ? 5 : 3;
+		    break;
+		case 5: // CRC high byte
+		    state = 6;
+		    break;
+		case 6: // CRC low byte
+		    state = 0;
+		    count++;
+		    break;
+	    }
+	}
+    }
+
+    unsigned long getCount() { return count; }
+
+private:
+    int state;
+    unsigned long count;
+};
+
+static const char *
+typeName(int type)
+{
+    switch (type) {
+	case CAP_OPEN:
+	    return "OPEN";
+	case CAP_RAW_RX:
+	    return "RAW_RX";
+	case CAP_RAW_TX:
+	    return "RAW_TX";
+	case CAP_FRAME_RX:
+	    return "FRAME_RX";
+	case CAP_FRAME_TX:
+	    return "FRAME_TX";
+	case CAP_CRC_ERROR:
+	    return "CRC_ERROR";
+    }
+    return "UNKNOWN";
+}
+
+static unsigned long
+recordValue(const record &r)
+{
+    uint32_t v = 0;
+    if (r.data.size() >= sizeof(v))
+	memcpy(&v, r.data.data(), sizeof(v));
+    return ntohl(v);
+}
+
+static bool
+readCapture(const char *fname, vector<record> &recs)
+{
+    FILE *f = fopen(fname, "rb");
+    if (!f) {
+	cerr << "ncpreplay: " << fname << ": " << strerror(errno) << endl;
+	return false;
+    }
+    unsigned char magic[CAPTURE_MAGIC_LEN + 4];
+    uint32_t ver;
+    if ((fread(magic, 1, sizeof(magic), f) != sizeof(magic)) ||
+	memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+	cerr << "ncpreplay: " << fname << _(": not a capture file") << endl;
+	fclose(f);
+	return false;
+    }
+    memcpy(&ver, magic + CAPTURE_MAGIC_LEN, sizeof(ver));
+    if (ntohl(ver) != CAPTURE_VERSION) {
+	cerr << "ncpreplay: " << fname << _(": unsupported version ")
+	     << ntohl(ver) << endl;
+	fclose(f);
+	return false;
+    }
+    uint32_t hdr[4];
+    while (fread(hdr, 1, CAPTURE_HEADER_LEN, f) == CAPTURE_HEADER_LEN) {
+	record r;
+	long len = ntohl(hdr[3]);
+	r.stamp = (long long)ntohl(hdr[0]) * 1000000 + ntohl(hdr[1]) / 1000;
+	r.type = ntohl(hdr[2]);
+	r.data.resize(len);
+	if ((len > 0) && (fread(&r.data[0], 1, len, f) != (size_t)len)) {
+	    cerr << "ncpreplay: " << fname << _(": truncated record") << endl;
+	    break;
+	}
+	recs.push_back(r);
+    }
+    fclose(f);
+    return true;
+}
+
+static void
+dump(const vector<record> &recs)
+{
+    long long start = recs.empty() ? 0 : recs[0].stamp;
+
+    for (size_t i = 0; i < recs.size(); i++) {
+	const record &r = recs[i];
+	long long t = r.stamp - start;
+	cout << setfill(' ') << setw(6) << dec << (t / 1000000) << "."
+	     << setfill('0') << setw(6) << (t % 1000000) << " "
+	     << setfill(' ') << left << setw(9) << typeName(r.type) << right;
+	if (r.type == CAP_OPEN) {
+	    cout << " baud=" << recordValue(r) << endl;
+	    continue;
+	}
+	cout << " len=" << r.data.size();
+	for (size_t j = 0; j < r.data.size(); j++)
+	    cout << " " << hex << setfill('0') << setw(2)
+		 << (int)(unsigned char)r.data[j];
+	cout << dec << setfill(' ') << endl;
+    }
+}
+
+static void
+report(const vector<record> &recs)
+{
+    unsigned long rawBytes[2] = { 0, 0 };
+    unsigned long frames[2] = { 0, 0 };
+    unsigned long payload[2] = { 0, 0 };
+    unsigned long crcErrors = 0;
+    unsigned long opens = 0;
+    unsigned long baud = 0;
+    long long lineFree = 0;
+    statHistogram gaps;
+    struct gap { long long at; long long len; } top[5];
+    int ntop = 0;
+
+    if (recs.empty()) {
+	cout << _("Empty capture") << endl;
+	return;
+    }
+    long long start = recs[0].stamp;
+    long long duration = recs.back().stamp - start;
+    for (size_t i = 0; i < recs.size(); i++) {
+	const record &r = recs[i];
+	switch (r.type) {
+	    case CAP_OPEN:
+		opens++;
+		baud = recordValue(r);
+		break;
+	    case CAP_RAW_RX:
+	    case CAP_RAW_TX: {
+		int dir = (r.type == CAP_RAW_TX);
+		rawBytes[dir] += r.data.size();
+		// An idle gap is the time between the end of one chunk
+		// on the line (at 10 bits per byte) and the next one.
+		if (lineFree && (r.stamp > lineFree)) {
+		    long long g = r.stamp - lineFree;
+		    gaps.add(g);
+		    // Keep the five longest gaps, longest first.
+		    if ((ntop < 5) || (g > top[4].len)) {
+			int j = (ntop < 5) ? ntop++ : 4;
+			for (; (j > 0) && (top[j - 1].len < g); j--)
+			    top[j] = top[j - 1];
+			top[j].at = lineFree - start;
+			top[j].len = g;
+		    }
+		}
+		long long busy = baud ?
+		    (long long)r.data.size() * 10000000LL / baud : 0;
+		if (r.stamp + busy > lineFree)
+		    lineFree = r.stamp + busy;
+		break;
+	    }
+	    case CAP_FRAME_RX:
+	    case CAP_FRAME_TX: {
+		int dir = (r.type == CAP_FRAME_TX);
+		frames[dir]++;
+		payload[dir] += r.data.size();
+		break;
+	    }
+	    case CAP_CRC_ERROR:
+		crcErrors++;
+		break;
+	}
+    }
+
+    cout << "duration_us " << duration << endl;
+    cout << "baud " << baud << endl;
+    cout << "opens " << opens << endl;
+    cout << "crc_errors " << crcErrors << endl;
+    for (int dir = 0; dir < 2; dir++) {
+	const char *d = dir ? "tx" : "rx";
+	cout << d << "_line_bytes " << rawBytes[dir] << endl;
+	cout << d << "_frames " << frames[dir] << endl;
+	cout << d << "_payload_bytes " << payload[dir] << endl;
+	if (baud && duration)
+	    cout << d << "_utilization_pct " << fixed << setprecision(1)
+		 << (rawBytes[dir] * 10.0 * 1000000.0 * 100.0 /
+		     ((double)baud * duration)) << endl;
+    }
+    gaps.print(cout, "idle_gap");
+    for (int i = 0; i < ntop; i++)
+	cout << "idle_gap.top " << top[i].len << "us at " << top[i].at
+	     << "us" << endl;
+}
+
+static long long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// CPU time, so that other processes do not count
+static long long
+cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Time the life of a bufferStore for each frame of the capture, the
+ * way messages pass through plptools: the body is built, a header
+ * byte is prepended, and the message is queued, taken from the queue
+ * and copied once.
+ */
+static void
+bench(const vector<record> &recs, int rounds)
+{
+    vector<const record *> msgs;
+    unsigned long small = 0;
+
+    for (size_t i = 0; i < recs.size(); i++) {
+	const record &r = recs[i];
+	if (((r.type != CAP_FRAME_RX) && (r.type != CAP_FRAME_TX)) ||
+	    r.data.empty())
+	    continue;
+	msgs.push_back(&r);
+	if (r.data.size() <= 64)
+	    small++;
+    }
+    if (msgs.empty()) {
+	cout << _("No frames in capture") << endl;
+	return;
+    }
+
+    unsigned long allocs = bufferStore::allocations();
+    unsigned long sum = 0;
+    long long start = cpu_ns();
+    for (int n = 0; n < rounds; n++) {
+	bufferArray q;
+	for (size_t i = 0; i < msgs.size(); i++) {
+	    const unsigned char *p = (const unsigned char *)msgs[i]->data.data();
+	    bufferStore a;
+	    a.addBytes(p + 1, msgs[i]->data.size() - 1);
+	    a.prependByte(p[0]);
+	    q.append(std::move(a));
+	    // Keep a few messages queued, like a link window.
+	    if (q.length() > 4) {
+		bufferStore b = q.pop();
+		bufferStore c(b);
+		sum += c.getLen();
+	    }
+	}
+    }
+    long long elapsed = cpu_ns() - start;
+    double total = (double)msgs.size() * rounds;
+
+    cout << "bench.frames " << msgs.size() << endl;
+    cout << "bench.small_frames_pct " << fixed << setprecision(1)
+	 << 100.0 * small / msgs.size() << endl;
+    cout << "bench.ns_per_message " << setprecision(0)
+	 << elapsed / total << endl;
+    cout << "bench.allocs_per_message " << setprecision(2)
+	 << (bufferStore::allocations() - allocs) / total << endl;
+    // Keeps the compiler from dropping the work.
+    cout << "bench.bytes " << sum << endl;
+}
+
+/**
+ * Collect the frames of the capture, with their total length and the
+ * most any of them takes on the line. Returns false if there are none.
+ */
+static bool
+captureFrames(const vector<record> &recs, vector<bufferChain> &frames,
+	      unsigned long &bytes, long &maxLen)
+{
+    bytes = 0;
+    maxLen = 0;
+    for (size_t i = 0; i < recs.size(); i++) {
+	const record &r = recs[i];
+	if (((r.type != CAP_FRAME_RX) && (r.type != CAP_FRAME_TX)) ||
+	    r.data.empty())
+	    continue;
+	frames.push_back(bufferChain((const unsigned char *)r.data.data(),
+				     r.data.size()));
+	bytes += r.data.size();
+	long l = frameCodec::maxEncodedLen(r.data.size());
+	if (l > maxLen)
+	    maxLen = l;
+    }
+    if (frames.empty()) {
+	cout << _("No frames in capture") << endl;
+	return false;
+    }
+    return true;
+}
+
+/**
+ * Time the framing of the serial line with the frames of the
+ * capture: each one is escaped into the ring of the line, the way
+ * ncpd sends it to EPOC, and decoded again, the way ncpd receives it.
+ */
+static void
+benchFraming(const vector<record> &recs, int rounds)
+{
+    vector<bufferChain> frames;
+    unsigned long bytes;
+    long maxLen;
+
+    if (!captureFrames(recs, frames, bytes, maxLen))
+	return;
+
+    frameCodec codec;
+    ringBuffer ring((maxLen > 65536) ? maxLen + 1 : 65536);
+    bufferChain rcv;
+    unsigned long lineBytes = 0;
+    unsigned long good = 0;
+    unsigned long sum = 0;
+    long long encNs = 0;
+    long long decNs = 0;
+    long long t = cpu_ns();
+    for (int n = 0; n < rounds; n++) {
+	size_t i = 0;
+	while (i < frames.size()) {
+	    // Fill the ring, then empty it.
+	    while ((i < frames.size()) &&
+		   (ring.space() >= frameCodec::maxEncodedLen(frames[i].getLen())))
+		codec.encode(ring, frames[i++], true);
+	    lineBytes += ring.used();
+	    long long now = cpu_ns();
+	    encNs += now - t;
+	    t = now;
+	    frameCodec::result r;
+	    while ((r = codec.decode(ring, rcv, true)) != frameCodec::FRAME_NONE) {
+		if (r == frameCodec::FRAME_GOOD) {
+		    good++;
+		    sum += rcv.getLen();
+		}
+		rcv.init();
+	    }
+	    now = cpu_ns();
+	    decNs += now - t;
+	    t = now;
+	}
+    }
+    double total = (double)bytes * rounds;
+
+    cout << "bench.frames " << frames.size() << endl;
+    cout << "bench.payload_bytes " << bytes << endl;
+    cout << "bench.line_bytes_per_payload_byte " << fixed << setprecision(3)
+	 << lineBytes / total << endl;
+    cout << "bench.encode_mb_per_s " << setprecision(1)
+	 << total * 1000 / encNs << endl;
+    cout << "bench.decode_mb_per_s " << total * 1000 / decNs << endl;
+    cout << "bench.decode_errors " << frames.size() * rounds - good << endl;
+    // Keeps the compiler from dropping the work.
+    cout << "bench.bytes " << sum << endl;
+}
+
+/**
+ * Both ends of a ring, as between the senders and the pump of ncpd.
+ */
+struct ringTest {
+    const vector<bufferChain> *frames;
+    int rounds;
+    ringBuffer *ring;
+    wakeupEvent dataEvent;
+    wakeupEvent spaceEvent;
+    std::atomic<bool> done;
+};
+
+static void *
+ringProducer(void *arg)
+{
+    ringTest *t = (ringTest *)arg;
+    const vector<bufferChain> &frames = *t->frames;
+    frameCodec codec;
+
+    for (int n = 0; n < t->rounds; n++)
+	for (size_t i = 0; i < frames.size(); i++) {
+	    long len = frameCodec::maxEncodedLen(frames[i].getLen());
+	    while (t->ring->space() < len)
+		t->spaceEvent.wait(100);
+	    codec.encode(*t->ring, frames[i], true);
+	    t->dataEvent.signal();
+	}
+    t->done = true;
+    t->dataEvent.signal();
+    return NULL;
+}
+
+/**
+ * Send the frames of the capture through a small ring from one
+ * thread to another, the way the senders of ncpd hand them to the
+ * pump, and check that each one arrives intact. Meant to be run
+ * under ThreadSanitizer too.
+ */
+static void
+stressRing(const vector<record> &recs, int rounds)
+{
+    vector<bufferChain> frames;
+    unsigned long bytes;
+    long maxLen;
+
+    if (!captureFrames(recs, frames, bytes, maxLen))
+	return;
+
+    // As small as possible, so that both ends meet often and the
+    // frames wrap around the end of the ring.
+    ringBuffer ring(maxLen + 1);
+    ringTest t;
+    t.frames = &frames;
+    t.rounds = rounds;
+    t.ring = &ring;
+    t.done = false;
+
+    frameCodec codec;
+    bufferChain rcv;
+    unsigned long got = 0;
+    unsigned long bad = 0;
+    unsigned long total = frames.size() * rounds;
+    long long start = now_us();
+    pthread_t producer;
+    if (pthread_create(&producer, NULL, ringProducer, &t) != 0) {
+	perror("pthread_create");
+	return;
+    }
+    while (got < total) {
+	frameCodec::result r = codec.decode(ring, rcv, true);
+	t.spaceEvent.signal();
+	if (r == frameCodec::FRAME_NONE) {
+	    // A frame lost on the way shows up as a short count.
+	    if (t.done && ring.empty())
+		break;
+	    t.dataEvent.wait(100);
+	    continue;
+	}
+	const bufferChain &f = frames[got % frames.size()];
+	bool same = (r == frameCodec::FRAME_GOOD) &&
+	    (rcv.getLen() == f.getLen());
+	for (long i = 0; same && (i < f.getLen()); i++)
+	    same = (rcv.getByte(i) == f.getByte(i));
+	if (!same)
+	    bad++;
+	got++;
+	rcv.init();
+    }
+    pthread_join(producer, NULL);
+    long long elapsed = now_us() - start;
+
+    cout << "ring.size " << ring.size() << endl;
+    cout << "ring.frames " << total << endl;
+    cout << "ring.received " << got << endl;
+    cout << "ring.corrupt " << bad << endl;
+    cout << "ring.mb_per_s " << fixed << setprecision(1)
+	 << (elapsed ? (double)bytes * rounds / elapsed : 0) << endl;
+}
+
+/**
+ * Read whatever ncpd sent until the given time, counting frames.
+ * Returns false if the pty failed.
+ */
+static bool
+drain(int fd, frameCounter &fc, long long until)
+{
+    for (;;) {
+	long long wait = until - now_us();
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	int res = poll(&pfd, 1, (wait > 0) ? (int)((wait + 999) / 1000) : 0);
+	if (res < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	if (res == 0)
+	    return true;
+	unsigned char buf[4096];
+	int n = read(fd, buf, sizeof(buf));
+	if (n < 0) {
+	    if ((errno == EINTR) || (errno == EAGAIN))
+		continue;
+	    return false;
+	}
+	fc.add(buf, n);
+	if (wait <= 0)
+	    return true;
+    }
+}
+
+static int
+replay(const vector<record> &recs, const char *link, double speed,
+       bool sync)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master == -1) || grantpt(master) || unlockpt(master)) {
+	perror("ncpreplay: pty");
+	return 1;
+    }
+    const char *name = ptsname(master);
+    // Keep the slave open, so that the master does not see a hangup
+    // while ncpd closes and reopens the line.
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+	perror(name);
+	return 1;
+    }
+    struct termios t;
+    if (tcgetattr(slave, &t) == 0) {
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+    }
+    if (link) {
+	unlink(link);
+	if (symlink(name, link)) {
+	    perror(link);
+	    return 1;
+	}
+    }
+    cout << _("Replaying on ") << name << endl;
+
+    // The capture starts when ncpd opened the line, which it does
+    // here as soon as it starts sending.
+    frameCounter live;
+    frameCounter recorded;
+    while (live.getCount() == 0)
+	if (!drain(master, live, now_us() + 1000000)) {
+	    perror("ncpreplay: read");
+	    return 1;
+	}
+
+    long long begin = now_us();
+    long long start = begin;
+    long long base = -1;
+    unsigned long rxRecords = 0;
+    unsigned long stalls = 0;
+    long long lastRx = 0;
+    unsigned long recordedMark = 0;
+    unsigned long liveMark = live.getCount();
+    for (size_t i = 0; i < recs.size(); i++) {
+	const record &r = recs[i];
+	if (base < 0) {
+	    // Line up the first frame from ncpd with the capture.
+	    if (r.type != CAP_RAW_TX)
+		continue;
+	    base = lastRx = r.stamp;
+	    recorded.add((const unsigned char *)r.data.data(), r.data.size());
+	    recordedMark = recorded.getCount();
+	    continue;
+	}
+	if (r.type == CAP_RAW_TX) {
+	    recorded.add((const unsigned char *)r.data.data(), r.data.size());
+	    continue;
+	}
+	if (r.type != CAP_RAW_RX)
+	    continue;
+	long long due = start;
+	if (speed > 0)
+	    due += (long long)((r.stamp - base) / speed);
+	if (!drain(master, live, due))
+	    break;
+	if (sync) {
+	    // Wait until ncpd has answered the previous data with as many
+	    // frames as in the capture. Give up after twice the time it
+	    // took back then, as ncpd may legitimately behave differently
+	    // now, e.g. if clients are not doing the same as when
+	    // recording. The time spent waiting does not count for the
+	    // recorded timing.
+	    unsigned long want = recorded.getCount() - recordedMark;
+	    long long waitStart = now_us();
+	    long long limit = 2 * (r.stamp - lastRx);
+	    if (limit < 100000)
+		limit = 100000;
+	    limit += waitStart;
+	    while ((live.getCount() - liveMark < want) && (now_us() < limit))
+		if (!drain(master, live, now_us() + 10000))
+		    break;
+	    if (live.getCount() - liveMark < want) {
+		stalls++;
+		cerr << _("ncpreplay: ncpd sent ") << (live.getCount() - liveMark)
+		     << _(" frames, capture had ") << want
+		     << _(" at ") << (r.stamp - base) << "us" << endl;
+	    }
+	    start += now_us() - waitStart;
+	    recordedMark = recorded.getCount();
+	    liveMark = live.getCount();
+	    lastRx = r.stamp;
+	}
+	const char *p = r.data.data();
+	long len = r.data.size();
+	while (len > 0) {
+	    int n = write(master, p, len);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		perror("ncpreplay: write");
+		return 1;
+	    }
+	    p += n;
+	    len -= n;
+	}
+	rxRecords++;
+    }
+    // Give ncpd a chance to answer the last data.
+    drain(master, live, now_us() + 1000000);
+
+    cout << "replayed_records " << rxRecords << endl;
+    cout << "elapsed_us " << (now_us() - begin) << endl;
+    cout << "recorded_tx_frames " << recorded.getCount() << endl;
+    cout << "live_tx_frames " << live.getCount() << endl;
+    if (sync)
+	cout << "sync_timeouts " << stalls << endl;
+    if (link)
+	unlink(link);
+    close(slave);
+    close(master);
+    return 0;
+}
+
+static void
+help()
+{
+    cout << _(
+	"Usage: ncpreplay [OPTIONS]... FILE\n"
+	"\n"
+	"Replay a capture recorded with ncpd --capture on a pseudo\n"
+	"terminal, playing the part of the Psion. Start ncpd on the\n"
+	"printed device (or the link given with --link) to feed it\n"
+	"the recorded data.\n"
+	"\n"
+	"Supported options:\n"
+	"\n"
+	" -h, --help              Display this text.\n"
+	" -V, --version           Print version and exit.\n"
+	" -d, --dump              Print all records and exit.\n"
+	" -r, --report            Print line utilization, frame counts\n"
+	"                         and idle gaps of the capture and exit.\n"
+	" -l, --link=PATH         Create a symbolic link PATH to the\n"
+	"                         pseudo terminal.\n"
+	" -s, --speed=FACTOR      Replay FACTOR times faster than recorded.\n"
+	"                         0 replays without any delays. Default: 1\n"
+	" -y, --sync              Before sending data, wait until ncpd has\n"
+	"                         answered the previous data with as many\n"
+	"                         frames as when the capture was recorded.\n"
+	" -b, --bench=N           Time building, queueing and copying\n"
+	"                         the captured frames as messages N\n"
+	"                         times, and exit.\n"
+	" -f, --framing=N         Time escaping and decoding the captured\n"
+	"                         frames N times, and exit.\n"
+	" -R, --ring=N            Pass the captured frames N times from\n"
+	"                         one thread to another through a ring,\n"
+	"                         check them, and exit.\n"
+	"\n");
+}
+
+static void
+usage() {
+    cerr << _("Try `ncpreplay --help' for more information") << endl;
+}
+
+static struct option opts[] = {
+    {"help",     no_argument,       0, 'h'},
+    {"version",  no_argument,       0, 'V'},
+    {"dump",     no_argument,       0, 'd'},
+    {"report",   no_argument,       0, 'r'},
+    {"link",     required_argument, 0, 'l'},
+    {"speed",    required_argument, 0, 's'},
+    {"sync",     no_argument,       0, 'y'},
+    {"bench",    required_argument, 0, 'b'},
+    {"framing",  required_argument, 0, 'f'},
+    {"ring",     required_argument, 0, 'R'},
+    {NULL,       0,                 0,  0 }
+};
+
+int
+main(int argc, char **argv)
+{
+    bool doDump = false;
+    bool doReport = false;
+    bool sync = false;
+    int rounds = 0;
+    int framingRounds = 0;
+    int ringRounds = 0;
+    const char *link = NULL;
+    double speed = 1.0;
+
+    setlocale (LC_ALL, "");
+    textdomain(PACKAGE);
+
+    while (1) {
+	int c = getopt_long(argc, argv, "hVdrl:s:yb:f:R:", opts, NULL);
+	if (c == -1)
+	    break;
+	switch (c) {
+	    case '?':
+		usage();
+		return -1;
+	    case 'V':
+		cout << _("ncpreplay Version ") << VERSION << endl;
+		return 0;
+	    case 'h':
+		help();
+		return 0;
+	    case 'd':
+		doDump = true;
+		break;
+	    case 'r':
+		doReport = true;
+		break;
+	    case 'l':
+		link = optarg;
+		break;
+	    case 's':
+		speed = atof(optarg);
+		if (speed < 0) {
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'y':
+		sync = true;
+		break;
+	    case 'b':
+		rounds = atoi(optarg);
+		if (rounds < 1) {
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'f':
+		framingRounds = atoi(optarg);
+		if (framingRounds < 1) {
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'R':
+		ringRounds = atoi(optarg);
+		if (ringRounds < 1) {
+		    usage();
+		    return -1;
+		}
+		break;
+	}
+    }
+    if (optind != argc - 1) {
+	usage();
+	return -1;
+    }
+
+    vector<record> recs;
+    if (!readCapture(argv[optind], recs))
+	return 1;
+    if (doDump)
+	dump(recs);
+    if (doReport)
+	report(recs);
+    if (rounds)
+	bench(recs, rounds);
+    if (framingRounds)
+	benchFraming(recs, framingRounds);
+    if (ringRounds)
+	stressRing(recs, ringRounds);
+    if (doDump || doReport || rounds || framingRounds || ringRounds)
+	return 0;
+    return replay(recs, link, speed, sync);
+}
@@ -0,0 +1,1738 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <plpintl.h>
+#include <ppsocket.h>
+#include <bufferstore.h>
+#include <bufferview.h>
+#include <rfsv.h>
+#include <rfsv32.h>
+#include <rfsvfactory.h>
+#include <rpcs.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <cstring>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <getopt.h>
+
+#include "simservice.h"
+#include "mp_serial.h"
+
+using namespace std;
+
+// Framing
+#define SYN 0x16
+#define DLE 0x10
+#define STX 0x02
+#define ETX 0x03
+#define EOT 0x04
+
+// Link frame types
+#define LINK_ACK  0x00
+#define LINK_DISC 0x10
+#define LINK_REQ  0x20
+#define LINK_DATA 0x30
+#define LINK_SEQMASK 0x7ff
+
+// NCP control messages
+#define NCON_XOFF 1
+#define NCON_XON 2
+#define NCON_CONNECT_TO_SERVER 3
+#define NCON_CONNECT_RESPONSE 4
+#define NCON_NCP_INFO 6
+#define NCON_DISCONNECT 7
+#define NCP_SENDLEN 250
+
+static volatile bool active = true;
+
+static void
+term_handler(int)
+{
+    active = false;
+}
+
+static long long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Settings of the simulated line and Psion.
+ */
+struct simOptions {
+    int baud;           // 0 means unthrottled
+    int rate;           // the only rate understood, 0 means any
+    long latency;       // one way, in microseconds
+    double bitErrors;   // probability of a flipped bit per byte
+    double drop;        // probability of losing a frame
+    long xoffPeriod;    // XOFF storm period in microseconds, 0 = off
+    int window;         // frames sent without ack
+    long rto;           // retransmission timeout in microseconds
+    const char *files;  // directory served by SYS$RFSV, or NULL
+    const char *device; // real serial device instead of a pty, or NULL
+    int speed;          // rate of the real serial device
+    serviceDelays delays;
+    bool verbose;
+};
+
+/**
+ * Traffic counters of the simulator.
+ */
+struct simStats {
+    unsigned long rxFrames;
+    unsigned long txFrames;
+    unsigned long rxPayload;
+    unsigned long txPayload;
+    unsigned long crcErrors;
+    unsigned long droppedRx;
+    unsigned long droppedTx;
+    unsigned long bitErrors;
+    unsigned long retransmits;
+    unsigned long dups;
+    unsigned long xoffSent;
+    unsigned long xoffReceived;
+    unsigned long requests;
+    unsigned long wrongRate;
+    // Round trip times of frames acknowledged without a retransmit
+    unsigned long rttCount;
+    long long rttSum;
+    long rttMax;
+};
+
+/**
+ * A Psion (EPOC) on the slave side of a pseudo terminal, or at the
+ * far end of a serial cable. It speaks the serial framing, link and
+ * NCP protocols of ncpd from the other side. SYS$RFSV and SYS$RPCS are emulated if a directory to serve
+ * is given; every other service ncpd connects to echoes the data it
+ * receives.
+ */
+class psionSim {
+public:
+    psionSim(const simOptions &o);
+    ~psionSim();
+
+    bool open(const char *link);
+    const char *getName() { return name.c_str(); }
+    bool isUp() { return linkUp; }
+    const simStats &getStats() { return stats; }
+
+    /**
+     * Fill in the poll entry for the pseudo terminal.
+     */
+    void prepare(struct pollfd &pfd);
+
+    /**
+     * Handle events on the pseudo terminal and all timers.
+     */
+    void handle(const struct pollfd &pfd);
+
+    /**
+     * Return the next time, at which handle should be called.
+     */
+    long long nextEvent();
+
+private:
+    struct chunk {
+	long long due;
+	string data;
+    };
+    struct txFrame {
+	int seq;
+	string payload;
+	long long stamp;
+	bool resent;
+    };
+    struct reply {
+	long long due;
+	int ps;
+	string data;
+    };
+
+    // Line
+    void lineWrite(const string &raw);
+    void lineRead(const unsigned char *data, int len);
+    void injectErrors(string &data);
+    void checkRate(string &data);
+    void parse(const string &data);
+    void sendFrame(const string &payload);
+    void frameReceived(const string &frame);
+
+    // Link
+    string seqHeader(int type, int seq);
+    void linkReset();
+    void linkReceive(const string &frame);
+    void linkSend(const string &payload);
+    void pumpTx();
+    void retransmit(long long now);
+
+    // NCP
+    void ncpReceive(const string &msg);
+    void ncpControl(int chan, int type, const string &data);
+    void ncpData(int ps, const string &msg);
+    void ncpSend(int pc, int ps, const string &msg);
+    void ncpClose(int ps);
+    void sendReplies(long long now);
+    void xoffStorm(long long now);
+
+    simOptions opt;
+    simStats stats;
+    int master;
+    string name;
+    string linkName;
+    long long hupUntil;
+
+    deque<chunk> outQueue;
+    deque<chunk> inQueue;
+    long long txFree;
+    long long rxFree;
+
+    unsigned short crcTable[256];
+    int state;
+    string frame;
+    unsigned short rxCrc;
+
+    int txSeq;
+    int rxSeq;
+    bool linkUp;
+    deque<txFrame> unacked;
+    deque<string> pending;
+
+    map<int, int> pcChan;          // psion channel -> pc channel
+    map<int, string> services;     // psion channel -> service name
+    map<int, string> reassembly;   // psion channel -> partial message
+    map<int, deque<string> > held; // pc channel -> messages held by XOFF
+    map<int, simService *> servers; // psion channel -> emulated server
+    deque<reply> replies;          // served requests, by due time
+    int nextChan;
+    long long nextXoff;
+    bool stormOn;
+};
+
+psionSim::
+psionSim(const simOptions &o)
+    : opt(o), master(-1), hupUntil(0), txFree(0), rxFree(0), state(0),
+      rxCrc(0), nextChan(1), nextXoff(0), stormOn(false)
+{
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < 256; i++) {
+	unsigned short c = i << 8;
+	for (int j = 0; j < 8; j++)
+	    c = (c & 0x8000) ? ((c << 1) ^ 0x1021) : (c << 1);
+	crcTable[i] = c;
+    }
+    linkReset();
+}
+
+psionSim::
+~psionSim()
+{
+    while (!pcChan.empty())
+	ncpClose(pcChan.begin()->first);
+    if (!linkName.empty())
+	unlink(linkName.c_str());
+    if ((master != -1) && opt.device)
+	ser_exit(master);
+    else if (master != -1)
+	close(master);
+}
+
+bool psionSim::
+open(const char *link)
+{
+    if (opt.device) {
+	// The real line does the pacing, and garbles data sent at
+	// the wrong rate by itself.
+	opt.baud = 0;
+	opt.rate = 0;
+	master = init_serial(opt.device, opt.speed, 0);
+	if (master == -1)
+	    return false;
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	ser_lowlatency(opt.device, master);
+	name = opt.device;
+	return true;
+    }
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master == -1) || grantpt(master) || unlockpt(master)) {
+	perror("ncpsim: pty");
+	return false;
+    }
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    name = ptsname(master);
+    // The slave is not kept open here, as ncpd makes it exclusive
+    // and needs to reopen it after a reset.
+    int slave = ::open(name.c_str(), O_RDWR | O_NOCTTY);
+    if (slave != -1) {
+	struct termios t;
+	if (tcgetattr(slave, &t) == 0) {
+	    cfmakeraw(&t);
+	    tcsetattr(slave, TCSANOW, &t);
+	}
+	close(slave);
+    }
+    if (link) {
+	linkName = link;
+	unlink(link);
+	if (symlink(name.c_str(), link)) {
+	    perror(link);
+	    linkName.clear();
+	    return false;
+	}
+    }
+    return true;
+}
+
+void psionSim::
+prepare(struct pollfd &pfd)
+{
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    // Without anyone on the slave side, the master reports a hangup
+    // all the time.
+    if (now_us() < hupUntil)
+	pfd.fd = -1;
+}
+
+long long psionSim::
+nextEvent()
+{
+    long long t = now_us() + 100000;
+    if (!outQueue.empty() && (outQueue.front().due < t))
+	t = outQueue.front().due;
+    if (!inQueue.empty() && (inQueue.front().due < t))
+	t = inQueue.front().due;
+    if (!unacked.empty() && (unacked.front().stamp + opt.rto < t))
+	t = unacked.front().stamp + opt.rto;
+    if (!replies.empty() && (replies.front().due < t))
+	t = replies.front().due;
+    if (opt.xoffPeriod && linkUp && (nextXoff < t))
+	t = nextXoff;
+    if (hupUntil && (hupUntil < t))
+	t = hupUntil;
+    return t;
+}
+
+void psionSim::
+handle(const struct pollfd &pfd)
+{
+    long long now = now_us();
+
+    if ((pfd.fd != -1) && (pfd.revents & POLLIN)) {
+	unsigned char buf[4096];
+	int n = read(master, buf, sizeof(buf));
+	if (n > 0)
+	    lineRead(buf, n);
+    } else if ((pfd.fd != -1) && (pfd.revents & (POLLHUP | POLLERR)))
+	hupUntil = now + 50000;
+
+    // Data from ncpd arrives after the time it needs on the line.
+    while (!inQueue.empty() && (inQueue.front().due <= now)) {
+	string d = inQueue.front().data;
+	inQueue.pop_front();
+	injectErrors(d);
+	parse(d);
+    }
+    retransmit(now);
+    sendReplies(now);
+    xoffStorm(now);
+    while (!outQueue.empty() && (outQueue.front().due <= now)) {
+	chunk &c = outQueue.front();
+	int n = write(master, c.data.data(), c.data.size());
+	if (n < 0) {
+	    if ((errno == EAGAIN) || (errno == EINTR))
+		break;
+	    // Nobody listening, the data is lost on the line.
+	    n = c.data.size();
+	}
+	c.data.erase(0, n);
+	if (!c.data.empty())
+	    break;
+	outQueue.pop_front();
+    }
+}
+
+void psionSim::
+lineWrite(const string &raw)
+{
+    // The line is busy for 10 bits per byte, then the data
+    // still needs the latency to arrive.
+    long long now = now_us();
+    long long start = (txFree > now) ? txFree : now;
+    chunk c;
+    txFree = start;
+    if (opt.baud)
+	txFree += (long long)raw.size() * 10000000LL / opt.baud;
+    c.due = txFree + opt.latency;
+    c.data = raw;
+    checkRate(c.data);
+    injectErrors(c.data);
+    outQueue.push_back(c);
+}
+
+void psionSim::
+lineRead(const unsigned char *data, int len)
+{
+    long long now = now_us();
+    long long start = (rxFree > now) ? rxFree : now;
+    chunk c;
+    rxFree = start;
+    if (opt.baud)
+	rxFree += (long long)len * 10000000LL / opt.baud;
+    c.due = rxFree + opt.latency;
+    c.data.assign((const char *)data, len);
+    checkRate(c.data);
+    inQueue.push_back(c);
+}
+
+void psionSim::
+checkRate(string &data)
+{
+    static const struct {
+	speed_t code;
+	int rate;
+    } rates[] = {
+	{ B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 },
+	{ B57600, 57600 }, { B115200, 115200 }
+    };
+    struct termios t;
+
+    // The master sees the settings ncpd made on the slave side.
+    if (!opt.rate || (tcgetattr(master, &t) != 0))
+	return;
+    speed_t code = cfgetospeed(&t);
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+	if ((rates[i].code == code) && (rates[i].rate == opt.rate))
+	    return;
+    // Both sides see nothing but noise at different rates.
+    for (size_t i = 0; i < data.size(); i++)
+	data[i] = lrand48();
+    stats.wrongRate += data.size();
+}
+
+void psionSim::
+injectErrors(string &data)
+{
+    if (opt.bitErrors <= 0)
+	return;
+    for (size_t i = 0; i < data.size(); i++)
+	if (drand48() < opt.bitErrors) {
+	    data[i] ^= 1 << (lrand48() % 8);
+	    stats.bitErrors++;
+	}
+}
+
+void psionSim::
+parse(const string &data)
+{
+    for (size_t i = 0; i < data.size(); i++) {
+	unsigned char c = data[i];
+	switch (state) {
+	    case 0:
+		if (c == SYN)
+		    state = 1;
+		break;
+	    case 1:
+		state = (c == DLE) ? 2 : ((c == SYN) ? 1 : 0);
+		break;
+	    case 2:
+		if (c == STX) {
+		    state = 3;
+		    frame.clear();
+		} else
+		    state = 0;
+		break;
+	    case 3:
+		if (c == DLE)
+		    state = 4;
+		else
+		    frame += c;
+		break;
+	    case 4:
+		if (c == ETX)
+		    state = 5;
+		else {
+		    frame += (c == EOT) ? ETX : c;
+		    state = 3;
+		}
+		break;
+	    case 5:
+		rxCrc = c << 8;
+		state = 6;
+		break;
+	    case 6: {
+		rxCrc |= c;
+		state = 0;
+		unsigned short crc = 0;
+		for (size_t j = 0; j < frame.size(); j++)
+		    crc = (crc << 8) ^
+			crcTable[((crc >> 8) ^ (unsigned char)frame[j]) & 0xff];
+		if (crc != rxCrc) {
+		    stats.crcErrors++;
+		    if (opt.verbose)
+			cout << "ncpsim: BAD CRC" << endl;
+		} else if (drand48() < opt.drop)
+		    stats.droppedRx++;
+		else
+		    frameReceived(frame);
+		break;
+	    }
+	}
+    }
+}
+
+void psionSim::
+sendFrame(const string &payload)
+{
+    string out;
+    unsigned short crc = 0;
+
+    out += SYN;
+    out += DLE;
+    out += STX;
+    for (size_t i = 0; i < payload.size(); i++) {
+	unsigned char c = payload[i];
+	crc = (crc << 8) ^ crcTable[((crc >> 8) ^ c) & 0xff];
+	if (c == DLE) {
+	    out += DLE;
+	    out += DLE;
+	} else if (c == ETX) {
+	    out += DLE;
+	    out += EOT;
+	} else
+	    out += c;
+    }
+    out += DLE;
+    out += ETX;
+    out += (char)(crc >> 8);
+    out += (char)(crc & 0xff);
+    stats.txFrames++;
+    if (drand48() < opt.drop) {
+	stats.droppedTx++;
+	return;
+    }
+    lineWrite(out);
+}
+
+void psionSim::
+frameReceived(const string &f)
+{
+    if (f.empty())
+	return;
+    stats.rxFrames++;
+    linkReceive(f);
+}
+
+string psionSim::
+seqHeader(int type, int seq)
+{
+    string h;
+    if (seq > 7) {
+	h += (char)(type | 8 | (seq & 7));
+	h += (char)(seq >> 3);
+    } else
+	h += (char)(type | seq);
+    return h;
+}
+
+void psionSim::
+linkReset()
+{
+    txSeq = 1;
+    rxSeq = 0;
+    linkUp = false;
+    unacked.clear();
+    pending.clear();
+    while (!pcChan.empty())
+	ncpClose(pcChan.begin()->first);
+    held.clear();
+    replies.clear();
+    nextChan = 1;
+    stormOn = false;
+}
+
+void psionSim::
+linkReceive(const string &f)
+{
+    int type = (unsigned char)f[0] & 0xf0;
+    int seq = (unsigned char)f[0] & 0x0f;
+    size_t hlen = 1;
+
+    if ((seq & 8) && (f.size() > 1)) {
+	seq = ((unsigned char)f[1] << 3) + (seq & 7);
+	hlen = 2;
+    }
+    string body = f.substr(hlen);
+
+    switch (type) {
+	case LINK_REQ: {
+	    // ncpd starts a new link, confirm it as an EPOC device.
+	    if (opt.verbose)
+		cout << "ncpsim: link request" << endl;
+	    linkReset();
+	    string con;
+	    con += (char)(LINK_REQ | 4);
+	    con += string("\1\2\3\4", 4);
+	    sendFrame(con);
+	    break;
+	}
+	case LINK_ACK:
+	    for (size_t i = 0; i < unacked.size(); i++)
+		if (unacked[i].seq == seq) {
+		    // Only a frame sent once tells the round trip time.
+		    if (!unacked[i].resent) {
+			long rtt = now_us() - unacked[i].stamp;
+			stats.rttCount++;
+			stats.rttSum += rtt;
+			if (rtt > stats.rttMax)
+			    stats.rttMax = rtt;
+		    }
+		    unacked.erase(unacked.begin(), unacked.begin() + i + 1);
+		    break;
+		}
+	    if (!linkUp && (seq == 0)) {
+		// Our confirm got through. Announce the NCP version and
+		// connect to the link service of ncpd.
+		linkUp = true;
+		nextXoff = now_us() + opt.xoffPeriod;
+		if (opt.verbose)
+		    cout << "ncpsim: link up" << endl;
+		string info;
+		info += (char)6;
+		info += string("\0\0\0\0", 4);
+		ncpControl(0, NCON_NCP_INFO, info);
+		ncpControl(nextChan++, NCON_CONNECT_TO_SERVER,
+			   string("LINK.*\0", 7));
+	    }
+	    pumpTx();
+	    break;
+	case LINK_DATA:
+	    if (seq == ((rxSeq + 1) & LINK_SEQMASK)) {
+		rxSeq = seq;
+		sendFrame(seqHeader(LINK_ACK, seq));
+		stats.rxPayload += body.size();
+		ncpReceive(body);
+	    } else {
+		stats.dups++;
+		sendFrame(seqHeader(LINK_ACK, rxSeq));
+	    }
+	    break;
+	case LINK_DISC:
+	    if (opt.verbose)
+		cout << "ncpsim: link disconnect" << endl;
+	    linkReset();
+	    break;
+    }
+}
+
+void psionSim::
+linkSend(const string &payload)
+{
+    pending.push_back(payload);
+    pumpTx();
+}
+
+void psionSim::
+pumpTx()
+{
+    while (!pending.empty() && ((int)unacked.size() < opt.window)) {
+	txFrame t;
+	t.seq = txSeq;
+	t.payload = pending.front();
+	t.stamp = now_us();
+	t.resent = false;
+	pending.pop_front();
+	txSeq = (txSeq + 1) & LINK_SEQMASK;
+	unacked.push_back(t);
+	stats.txPayload += t.payload.size();
+	sendFrame(seqHeader(LINK_DATA, t.seq) + t.payload);
+    }
+}
+
+void psionSim::
+retransmit(long long now)
+{
+    for (size_t i = 0; i < unacked.size(); i++)
+	if (now - unacked[i].stamp >= opt.rto) {
+	    unacked[i].stamp = now;
+	    unacked[i].resent = true;
+	    stats.retransmits++;
+	    sendFrame(seqHeader(LINK_DATA, unacked[i].seq) + unacked[i].payload);
+	}
+}
+
+void psionSim::
+ncpControl(int chan, int type, const string &data)
+{
+    string m;
+    m += (char)0;
+    m += (char)chan;
+    m += (char)type;
+    linkSend(m + data);
+}
+
+void psionSim::
+ncpReceive(const string &msg)
+{
+    if (msg.size() < 3)
+	return;
+    int dest = (unsigned char)msg[0];
+    if (dest == 0) {
+	int src = (unsigned char)msg[1];
+	int type = (unsigned char)msg[2];
+	string data = msg.substr(3);
+	switch (type) {
+	    case NCON_CONNECT_TO_SERVER: {
+		// Like a Psion, never hand out a channel still open.
+		// Channel 1 is our own connection to the link service.
+		int ps = nextChan;
+		do {
+		    ps = (ps % 255) + 1;
+		} while (((ps == 1) || pcChan.count(ps)) && (ps != nextChan));
+		nextChan = ps;
+		pcChan[ps] = src;
+		string name = data.substr(0, data.find('\0'));
+		if ((name.size() > 2) &&
+		    !name.compare(name.size() - 2, 2, ".*"))
+		    name.erase(name.size() - 2);
+		services[ps] = name;
+		if (opt.files && (name == "SYS$RFSV"))
+		    servers[ps] = new rfsvService(&opt.delays, opt.files);
+		else if (opt.files && (name == "SYS$RPCS"))
+		    servers[ps] = new rpcsService(&opt.delays);
+		if (opt.verbose)
+		    cout << "ncpsim: connect " << services[ps] << " pc="
+			 << src << " psion=" << ps << endl;
+		string resp;
+		resp += (char)src;
+		resp += (char)0;
+		ncpControl(ps, NCON_CONNECT_RESPONSE, resp);
+		break;
+	    }
+	    case NCON_DISCONNECT:
+		if (!data.empty())
+		    ncpClose((unsigned char)data[0]);
+		held.erase(src);
+		break;
+	    case NCON_XOFF:
+		stats.xoffReceived++;
+		held[src];
+		break;
+	    case NCON_XON: {
+		map<int, deque<string> >::iterator i = held.find(src);
+		if (i != held.end()) {
+		    deque<string> q = i->second;
+		    held.erase(i);
+		    while (!q.empty()) {
+			linkSend(q.front());
+			q.pop_front();
+		    }
+		}
+		break;
+	    }
+	}
+	return;
+    }
+    // Data: destination (Psion) channel, source (PC) channel, flag
+    string &r = reassembly[dest];
+    r += msg.substr(3);
+    if (msg[2] == 1) {
+	string m = r;
+	reassembly.erase(dest);
+	ncpData(dest, m);
+    }
+}
+
+void psionSim::
+ncpData(int ps, const string &msg)
+{
+    map<int, int>::iterator i = pcChan.find(ps);
+    if (i == pcChan.end())
+	return;
+    int pc = i->second;
+    if ((services[ps] == "LINK") && !msg.empty() && (msg[0] == 0)) {
+	// Register request: ack it with the same serial number
+	string ack;
+	ack += (char)1;
+	ack += msg.substr(1, 2);
+	ack += string("\0\0\0\0", 4);
+	if (msg.size() > 3)
+	    ack += msg.substr(3, msg.find('\0', 3) - 3);
+	ack += '\0';
+	ncpSend(pc, ps, ack);
+	return;
+    }
+    map<int, simService *>::iterator s = servers.find(ps);
+    if (s == servers.end()) {
+	ncpSend(pc, ps, msg);
+	return;
+    }
+    // The reply is sent once the Psion is done with the request.
+    bufferStore req((const unsigned char *)msg.data(), msg.size());
+    bufferStore out;
+    reply r;
+    r.due = now_us() + s->second->handle(req, out);
+    r.ps = ps;
+    r.data.assign(out.getString(0), out.getLen());
+    stats.requests++;
+    deque<reply>::iterator q = replies.end();
+    while ((q != replies.begin()) && ((q - 1)->due > r.due))
+	q--;
+    replies.insert(q, r);
+}
+
+void psionSim::
+sendReplies(long long now)
+{
+    while (!replies.empty() && (replies.front().due <= now)) {
+	reply &r = replies.front();
+	map<int, int>::iterator i = pcChan.find(r.ps);
+	if (i != pcChan.end())
+	    ncpSend(i->second, r.ps, r.data);
+	replies.pop_front();
+    }
+}
+
+void psionSim::
+ncpClose(int ps)
+{
+    map<int, simService *>::iterator s = servers.find(ps);
+    if (s != servers.end()) {
+	delete s->second;
+	servers.erase(s);
+    }
+    pcChan.erase(ps);
+    services.erase(ps);
+    reassembly.erase(ps);
+}
+
+void psionSim::
+ncpSend(int pc, int ps, const string &msg)
+{
+    size_t off = 0;
+    do {
+	string m;
+	bool last = (msg.size() - off <= NCP_SENDLEN);
+	m += (char)pc;
+	m += (char)ps;
+	m += (char)(last ? 1 : 2);
+	m += msg.substr(off, NCP_SENDLEN);
+	off += NCP_SENDLEN;
+	map<int, deque<string> >::iterator i = held.find(pc);
+	if (i != held.end())
+	    i->second.push_back(m);
+	else
+	    linkSend(m);
+    } while (off < msg.size());
+}
+
+void psionSim::
+xoffStorm(long long now)
+{
+    // Alternately throttle and release every data channel, for
+    // half of the period each.
+    if (!opt.xoffPeriod || !linkUp || (now < nextXoff))
+	return;
+    stormOn = !stormOn;
+    nextXoff = now + opt.xoffPeriod / 2;
+    for (map<int, int>::iterator i = pcChan.begin(); i != pcChan.end(); i++) {
+	if (services[i->first] == "LINK")
+	    continue;
+	ncpControl(i->first, stormOn ? NCON_XOFF : NCON_XON, "");
+	if (stormOn)
+	    stats.xoffSent++;
+    }
+}
+
+/**
+ * A client of ncpd, which sends messages to an echo service of the
+ * simulator and checks the answers.
+ */
+class benchClient {
+public:
+    benchClient(int _size) : fd(-1), size(_size), connected(false),
+			     messages(0), bytes(0), errors(0) {}
+    ~benchClient() { if (fd != -1) close(fd); }
+
+    bool start(const struct sockaddr_storage &addr);
+    void prepare(struct pollfd &pfd);
+    bool handle(const struct pollfd &pfd);
+
+    unsigned long getMessages() { return messages; }
+    unsigned long getBytes() { return bytes; }
+    unsigned long getErrors() { return errors; }
+
+private:
+    void sendFramed(const string &data);
+    void sendMessage();
+
+    int fd;
+    int size;
+    bool connected;
+    string out;
+    string in;
+    string expect;
+    unsigned long messages;
+    unsigned long bytes;
+    unsigned long errors;
+};
+
+bool benchClient::
+start(const struct sockaddr_storage &addr)
+{
+    socklen_t len = (addr.ss_family == AF_UNIX) ?
+	sizeof(struct sockaddr_un) : sizeof(struct sockaddr_in);
+
+    fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+	return false;
+    if (connect(fd, (const struct sockaddr *)&addr, len)) {
+	close(fd);
+	fd = -1;
+	return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // Any name but SYS$RFSV is registered first, and ends up at
+    // the echo service.
+    sendFramed(string("SYS$ECHO\0", 9));
+    return true;
+}
+
+void benchClient::
+sendFramed(const string &data)
+{
+    uint32_t len = htonl(data.size());
+    out += string((const char *)&len, sizeof(len));
+    out += data;
+}
+
+void benchClient::
+sendMessage()
+{
+    expect.resize(size);
+    for (int i = 0; i < size; i++)
+	expect[i] = (char)((messages * 7 + i) & 0xff);
+    sendFramed(expect);
+}
+
+void benchClient::
+prepare(struct pollfd &pfd)
+{
+    pfd.fd = fd;
+    pfd.events = POLLIN | (out.empty() ? 0 : POLLOUT);
+    pfd.revents = 0;
+}
+
+bool benchClient::
+handle(const struct pollfd &pfd)
+{
+    if (pfd.revents & POLLOUT) {
+	int n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+	if (n > 0)
+	    out.erase(0, n);
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+	char buf[16384];
+	int n = recv(fd, buf, sizeof(buf), 0);
+	if (n == 0 || ((n < 0) && (errno != EAGAIN))) {
+	    cerr << _("ncpsim: ncpd closed a benchmark connection") << endl;
+	    return false;
+	}
+	if (n > 0)
+	    in.append(buf, n);
+    }
+    while (in.size() >= 4) {
+	uint32_t len;
+	memcpy(&len, in.data(), sizeof(len));
+	len = ntohl(len);
+	if (in.size() < 4 + len)
+	    break;
+	string msg = in.substr(4, len);
+	in.erase(0, 4 + len);
+	if (!connected) {
+	    if (msg.compare(0, 2, "Ok")) {
+		cerr << _("ncpsim: connect refused by ncpd") << endl;
+		return false;
+	    }
+	    connected = true;
+	} else {
+	    if (msg != expect)
+		errors++;
+	    messages++;
+	    bytes += msg.size();
+	}
+	sendMessage();
+    }
+    return true;
+}
+
+static void
+parse_destination(const char *arg, const char **host, int *port)
+{
+    if (!arg)
+	return;
+    if (!strncmp(arg, "unix:", 5)) {
+	// unix:/run/ncpd.socket
+	*host = arg;
+	return;
+    }
+    // We don't want to modify argv, therefore copy it first ...
+    char *argcpy = strdup(arg);
+    char *pp = strchr(argcpy, ':');
+
+    if (pp) {
+	// host.domain:400
+	// 10.0.0.1:400
+	*pp ++= '\0';
+	*host = argcpy;
+    } else {
+	// 400
+	// host.domain
+	// host
+	// 10.0.0.1
+	if (strchr(argcpy, '.') || !isdigit(argcpy[0])) {
+	    *host = argcpy;
+	    pp = 0L;
+	} else
+	    pp = argcpy;
+    }
+    if (pp)
+	*port = atoi(pp);
+}
+
+static bool
+resolve(const char *host, int port, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (!strncmp(host, "unix:", 5)) {
+	struct sockaddr_un *un = (struct sockaddr_un *)addr;
+	if (strlen(host + 5) >= sizeof(un->sun_path))
+	    return false;
+	un->sun_family = AF_UNIX;
+	strcpy(un->sun_path, host + 5);
+	return true;
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    struct hostent *he = gethostbyname(host);
+    if (!he)
+	return false;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    memcpy(&in->sin_addr, he->h_addr, sizeof(in->sin_addr));
+    return true;
+}
+
+/**
+ * Ask ncpd for its statistics, as ncpstat does.
+ */
+static map<string, unsigned long>
+ncpdStats(const char *host, int port)
+{
+    map<string, unsigned long> res;
+    ppsocket skt;
+    bufferStore a;
+
+    if (!skt.connect(host, port))
+	return res;
+    a.addStringT("NCP$STAT");
+    if (!skt.sendBufferStore(a) || (skt.getBufferStore(a) != 1))
+	return res;
+    if ((a.getLen() < 2) || (a.getByte(0) != rfsv::E_PSI_GEN_NONE))
+	return res;
+    istringstream s(a.getString(1));
+    string key;
+    unsigned long val;
+    while (s >> key) {
+	if (s >> val)
+	    res[key] = val;
+	else
+	    s.clear();
+	s.ignore(1024, '\n');
+    }
+    return res;
+}
+
+/**
+ * Make file server requests through ncpd one after the other, as
+ * plpftp would, and time them. This runs in a child process, as the
+ * requests block. The results are written as "key value" lines to
+ * @p fd.
+ */
+static void
+rfsvBench(const char *host, int port, long long duration, int fd)
+{
+    ppsocket skt;
+    rfsv *r = NULL;
+    unsigned long requests = 0;
+    unsigned long errors = 0;
+    long long sum = 0;
+    long long max = 0;
+
+    if (skt.connect(host, port)) {
+	rfsvfactory f(&skt);
+	r = f.create(false);
+    }
+    if (!r)
+	errors++;
+    long long end = now_us() + duration;
+    while (r && active && (!duration || (now_us() < end))) {
+	uint32_t devbits;
+	long long t = now_us();
+	if (r->devlist(devbits) != rfsv::E_PSI_GEN_NONE) {
+	    errors++;
+	    break;
+	}
+	t = now_us() - t;
+	sum += t;
+	if (t > max)
+	    max = t;
+	requests++;
+    }
+    delete r;
+
+    ostringstream o;
+    o << "bench.rfsv_requests " << requests << endl;
+    o << "bench.rfsv_errors " << errors << endl;
+    if (requests) {
+	o << "bench.rfsv_rtt_avg_us " << sum / requests << endl;
+	o << "bench.rfsv_rtt_max_us " << max << endl;
+    }
+    string s = o.str();
+    if (write(fd, s.data(), s.size()) < 0)
+	perror("ncpsim: write");
+}
+
+static long long
+cpu_ns()
+{
+    // CPU time, so that other processes do not count
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Time parsing a READ_DIR and a QUERY_DRIVE response with @p entries
+ * entries each, as plpftp and plpnfsd would get from a large
+ * directory or a busy Psion.
+ */
+static void
+parseBench(int entries)
+{
+    bufferStore dir;
+    bufferStore procs;
+    PsiTime t;
+
+    for (int i = 0; i < entries; i++) {
+	ostringstream n;
+	n << "Document" << i << ".txt";
+	string name = n.str();
+	dir.addDWord(0);
+	dir.addDWord(0x20);
+	dir.addDWord(i * 7);
+	dir.addDWord(t.getPsiTimeLo());
+	dir.addDWord(t.getPsiTimeHi());
+	dir.addDWord(0x10000037);
+	dir.addDWord(0x1000006d);
+	dir.addDWord(0x1000007f);
+	dir.addDWord(name.size());
+	dir.addString(name.c_str());
+	while (dir.getLen() % 4)
+	    dir.addByte(0);
+	ostringstream p;
+	p << "Program" << i << ".$" << 100 + i;
+	procs.addStringT(p.str().c_str());
+	procs.addStringT("C:\\System\\Apps\\Program\\Program.app");
+    }
+
+    int rounds = 1000000 / entries + 1;
+    unsigned long allocs = bufferStore::allocations();
+    unsigned long copied = bufferStore::copiedBytes();
+    unsigned long sum = 0;
+
+    long long start = cpu_ns();
+    for (int n = 0; n < rounds; n++) {
+	bufferCursor c(dir);
+	PlpDirent e;
+	while (c.remaining() > 16) {
+	    if (!rfsv32::parseDirent(c, e))
+		break;
+	    sum += e.getSize();
+	}
+    }
+    long long dirTime = cpu_ns() - start;
+
+    start = cpu_ns();
+    for (int n = 0; n < rounds; n++) {
+	processList l;
+	rpcs::parseProcesses(procs, l, false);
+	sum += l.size();
+    }
+    long long procTime = cpu_ns() - start;
+    double total = (double)entries * rounds;
+
+    cout << "bench.parse_entries " << entries << endl;
+    cout << "bench.parse_dir_bytes " << dir.getLen() << endl;
+    cout << "bench.parse_dir_ns_per_entry " << fixed << setprecision(1)
+	 << dirTime / total << endl;
+    cout << "bench.parse_proc_bytes " << procs.getLen() << endl;
+    cout << "bench.parse_proc_ns_per_entry " << procTime / total << endl;
+    cout << "bench.parse_bufferstore_copied_bytes "
+	 << bufferStore::copiedBytes() - copied << endl;
+    cout << "bench.parse_bufferstore_allocations "
+	 << bufferStore::allocations() - allocs << endl;
+    // Keeps the compiler from dropping the work.
+    cout << "bench.parse_sum " << sum << endl;
+}
+
+static void
+printStats(const simStats &s)
+{
+    cout << "sim.rx_frames " << s.rxFrames << endl;
+    cout << "sim.tx_frames " << s.txFrames << endl;
+    cout << "sim.rx_payload_bytes " << s.rxPayload << endl;
+    cout << "sim.tx_payload_bytes " << s.txPayload << endl;
+    cout << "sim.crc_errors " << s.crcErrors << endl;
+    cout << "sim.dropped_rx " << s.droppedRx << endl;
+    cout << "sim.dropped_tx " << s.droppedTx << endl;
+    cout << "sim.bit_errors " << s.bitErrors << endl;
+    cout << "sim.retransmits " << s.retransmits << endl;
+    cout << "sim.dups " << s.dups << endl;
+    cout << "sim.xoff_sent " << s.xoffSent << endl;
+    cout << "sim.xoff_received " << s.xoffReceived << endl;
+    cout << "sim.requests " << s.requests << endl;
+    cout << "sim.wrong_rate_bytes " << s.wrongRate << endl;
+    cout << "sim.rtt_avg_us " << (s.rttCount ? s.rttSum / s.rttCount : 0)
+	 << endl;
+    cout << "sim.rtt_max_us " << s.rttMax << endl;
+}
+
+static void
+help()
+{
+    cout << _(
+	"Usage: ncpsim [OPTIONS]... [-- NCPD-OPTIONS...]\n"
+	"\n"
+	"Simulate a Psion (EPOC) on a pseudo terminal, for testing and\n"
+	"benchmarking ncpd without a real device. Every service ncpd\n"
+	"connects to echoes the data it receives.\n"
+	"\n"
+	"Supported options:\n"
+	"\n"
+	" -h, --help              Display this text.\n"
+	" -V, --version           Print version and exit.\n"
+	" -v, --verbose           Log link and NCP events.\n"
+	" -l, --link=PATH         Create a symbolic link PATH to the\n"
+	"                         pseudo terminal.\n"
+	" -P, --device=DEV        Use the serial device DEV instead of a\n"
+	"                         pseudo terminal. ncpd needs its own\n"
+	"                         device in NCPD-OPTIONS (-s DEV).\n"
+	" -s, --baudrate=RATE     Limit the line to RATE baud. Default: 0\n"
+	"                         (unlimited), 115200 with -P.\n"
+	" -R, --rate=RATE         Garble all data while ncpd has set the\n"
+	"                         pseudo terminal to a rate other than\n"
+	"                         RATE, like a Psion set to RATE baud.\n"
+	" -L, --latency=MS        Delay data by MS milliseconds in each\n"
+	"                         direction.\n"
+	" -E, --bit-errors=P      Flip a bit in each byte with probability P.\n"
+	" -D, --drop=P            Lose each frame with probability P.\n"
+	" -x, --xoff=MS           Throttle all data channels of ncpd for\n"
+	"                         half of every MS milliseconds.\n"
+	" -w, --window=N          Send up to N unacknowledged frames.\n"
+	"                         Default: 8\n"
+	" -r, --rto=MS            Retransmit after MS milliseconds.\n"
+	"                         Default: 1000\n"
+	" -S, --seed=N            Seed for the fault injection. Default: 1\n"
+	" -f, --files=DIR         Serve DIR with an emulated SYS$RFSV and\n"
+	"                         SYS$RPCS. Subdirectories A to Z of DIR\n"
+	"                         are the drives.\n"
+	" -d, --delay=[CMD=]MS    Reply to requests of the emulated servers\n"
+	"                         after MS milliseconds, for command CMD\n"
+	"                         (e.g. READ_DIR or RPCS:QUERY_DRIVE) or\n"
+	"                         all others.\n"
+	" -t, --time=SECS         Stop after SECS seconds, counted from the\n"
+	"                         start of the benchmark with -b.\n"
+	" -n, --ncpd=PATH         Start ncpd from PATH on the pseudo\n"
+	"                         terminal, with NCPD-OPTIONS.\n"
+	" -b, --bench=[HOST:]PORT Once the link is up, run a benchmark\n"
+	"                         through ncpd listening at HOST:PORT,\n"
+	"                         or at the Unix domain socket PATH with\n"
+	"                         unix:PATH.\n"
+	" -c, --clients=N         Number of benchmark clients. Default: 1\n"
+	" -m, --size=BYTES        Benchmark message size. Default: 4096\n"
+	" -a, --rfsv              Benchmark with file server requests\n"
+	"                         (GET_DRIVE_LIST), one at a time,\n"
+	"                         instead. Needs -f.\n"
+	" -p, --parse=N           Time parsing directory and process list\n"
+	"                         responses of N entries, then exit.\n"
+	"\n");
+}
+
+static void
+usage() {
+    cerr << _("Try `ncpsim --help' for more information") << endl;
+}
+
+static struct option opts[] = {
+    {"help",       no_argument,       0, 'h'},
+    {"version",    no_argument,       0, 'V'},
+    {"verbose",    no_argument,       0, 'v'},
+    {"link",       required_argument, 0, 'l'},
+    {"device",     required_argument, 0, 'P'},
+    {"baudrate",   required_argument, 0, 's'},
+    {"rate",       required_argument, 0, 'R'},
+    {"latency",    required_argument, 0, 'L'},
+    {"bit-errors", required_argument, 0, 'E'},
+    {"drop",       required_argument, 0, 'D'},
+    {"xoff",       required_argument, 0, 'x'},
+    {"window",     required_argument, 0, 'w'},
+    {"rto",        required_argument, 0, 'r'},
+    {"seed",       required_argument, 0, 'S'},
+    {"files",      required_argument, 0, 'f'},
+    {"delay",      required_argument, 0, 'd'},
+    {"time",       required_argument, 0, 't'},
+    {"ncpd",       required_argument, 0, 'n'},
+    {"bench",      required_argument, 0, 'b'},
+    {"clients",    required_argument, 0, 'c'},
+    {"size",       required_argument, 0, 'm'},
+    {"rfsv",       no_argument,       0, 'a'},
+    {"parse",      required_argument, 0, 'p'},
+    {NULL,         0,                 0,  0 }
+};
+
+int
+main(int argc, char **argv)
+{
+    simOptions o;
+    const char *link = NULL;
+    const char *ncpdPath = NULL;
+    const char *host = "127.0.0.1";
+    int sockNum = DPORT;
+    bool bench = false;
+    bool rfsvMode = false;
+    int parseEntries = 0;
+    int clients = 1;
+    int size = 4096;
+    long seed = 1;
+    long duration = 0;
+
+    o.baud = 0;
+    o.rate = 0;
+    o.latency = 0;
+    o.bitErrors = 0;
+    o.drop = 0;
+    o.xoffPeriod = 0;
+    o.window = 8;
+    o.rto = 1000000;
+    o.files = NULL;
+    o.device = NULL;
+    o.verbose = false;
+
+    setlocale (LC_ALL, "");
+    textdomain(PACKAGE);
+
+    while (1) {
+	int c = getopt_long(argc, argv, "hVvl:P:s:R:L:E:D:x:w:r:S:f:d:t:n:b:c:m:ap:",
+			    opts, NULL);
+	if (c == -1)
+	    break;
+	switch (c) {
+	    case '?':
+		usage();
+		return -1;
+	    case 'V':
+		cout << _("ncpsim Version ") << VERSION << endl;
+		return 0;
+	    case 'h':
+		help();
+		return 0;
+	    case 'v':
+		o.verbose = true;
+		break;
+	    case 'l':
+		link = optarg;
+		break;
+	    case 'P':
+		o.device = optarg;
+		break;
+	    case 's':
+		o.baud = atoi(optarg);
+		break;
+	    case 'R':
+		o.rate = atoi(optarg);
+		break;
+	    case 'L':
+		o.latency = atol(optarg) * 1000;
+		break;
+	    case 'E':
+		o.bitErrors = atof(optarg);
+		break;
+	    case 'D':
+		o.drop = atof(optarg);
+		break;
+	    case 'x':
+		o.xoffPeriod = atol(optarg) * 1000;
+		break;
+	    case 'w':
+		o.window = atoi(optarg);
+		if (o.window < 1)
+		    o.window = 1;
+		break;
+	    case 'r':
+		o.rto = atol(optarg) * 1000;
+		if (o.rto < 1000)
+		    o.rto = 1000;
+		break;
+	    case 'S':
+		seed = atol(optarg);
+		break;
+	    case 'f':
+		o.files = optarg;
+		break;
+	    case 'd':
+		if (!o.delays.parse(optarg)) {
+		    cerr << _("ncpsim: unknown command in ") << optarg << endl;
+		    return 1;
+		}
+		break;
+	    case 't':
+		duration = atol(optarg) * 1000000;
+		break;
+	    case 'n':
+		ncpdPath = optarg;
+		break;
+	    case 'b':
+		bench = true;
+		parse_destination(optarg, &host, &sockNum);
+		break;
+	    case 'c':
+		clients = atoi(optarg);
+		if (clients < 1)
+		    clients = 1;
+		break;
+	    case 'm':
+		size = atoi(optarg);
+		if (size < 1)
+		    size = 1;
+		break;
+	    case 'a':
+		rfsvMode = true;
+		break;
+	    case 'p':
+		parseEntries = atoi(optarg);
+		if (parseEntries < 1)
+		    parseEntries = 1;
+		break;
+	}
+    }
+    srand48(seed);
+    o.speed = o.baud ? o.baud : 115200;
+
+    if (parseEntries) {
+	parseBench(parseEntries);
+	return 0;
+    }
+
+    if (rfsvMode && !o.files) {
+	cerr << _("ncpsim: --rfsv needs --files") << endl;
+	return 1;
+    }
+
+    struct sockaddr_storage addr;
+    if (bench && !resolve(host, sockNum, &addr)) {
+	cerr << _("ncpsim: unknown host ") << host << endl;
+	return 1;
+    }
+
+    psionSim sim(o);
+    if (!sim.open(link))
+	return 1;
+    cout << _("Simulating a Psion on ") << sim.getName() << endl;
+
+    signal(SIGINT, term_handler);
+    signal(SIGTERM, term_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t ncpd = 0;
+    if (ncpdPath) {
+	ncpd = fork();
+	if (ncpd == 0) {
+	    vector<char *> args;
+	    args.push_back((char *)ncpdPath);
+	    args.push_back((char *)"-d");
+	    if (!o.device) {
+		args.push_back((char *)"-s");
+		args.push_back((char *)sim.getName());
+	    }
+	    for (int i = optind; i < argc; i++)
+		args.push_back(argv[i]);
+	    args.push_back(NULL);
+	    execv(ncpdPath, &args[0]);
+	    perror(ncpdPath);
+	    _exit(1);
+	}
+	if (ncpd < 0) {
+	    perror("fork");
+	    return 1;
+	}
+    }
+
+    vector<benchClient *> bc;
+    pid_t rfsvChild = 0;
+    int rfsvFd = -1;
+    string rfsvResult;
+    long long benchStart = 0;
+    long long start = now_us();
+    simStats before;
+    memset(&before, 0, sizeof(before));
+    map<string, unsigned long> nsBefore;
+    bool ok = true;
+    while (active) {
+	long long now = now_us();
+	if (benchStart)
+	    now -= benchStart;
+	else
+	    now -= start;
+	// The rfsv benchmark stops by itself.
+	if (duration && (now >= duration) && !rfsvChild)
+	    break;
+	if (bench && !benchStart && sim.isUp() &&
+	    (now_us() - start > 500000)) {
+	    // Give ncpd a moment to set up its link channel.
+	    if (rfsvMode) {
+		int p[2];
+		if (pipe(p)) {
+		    perror("pipe");
+		    ok = false;
+		    break;
+		}
+		rfsvChild = fork();
+		if (rfsvChild == 0) {
+		    close(p[0]);
+		    rfsvBench(host, sockNum, duration, p[1]);
+		    _exit(0);
+		}
+		close(p[1]);
+		if (rfsvChild < 0) {
+		    perror("fork");
+		    close(p[0]);
+		    ok = false;
+		    break;
+		}
+		rfsvFd = p[0];
+	    }
+	    for (int i = 0; !rfsvMode && (i < clients); i++) {
+		benchClient *c = new benchClient(size);
+		if (!c->start(addr)) {
+		    perror("ncpsim: connect");
+		    delete c;
+		    ok = false;
+		    break;
+		}
+		bc.push_back(c);
+	    }
+	    if (!ok)
+		break;
+	    nsBefore = ncpdStats(host, sockNum);
+	    benchStart = now_us();
+	    before = sim.getStats();
+	}
+
+	vector<struct pollfd> pfds(1 + bc.size());
+	sim.prepare(pfds[0]);
+	for (size_t i = 0; i < bc.size(); i++)
+	    bc[i]->prepare(pfds[i + 1]);
+	if (rfsvFd != -1) {
+	    struct pollfd pfd;
+	    pfd.fd = rfsvFd;
+	    pfd.events = POLLIN;
+	    pfd.revents = 0;
+	    pfds.push_back(pfd);
+	}
+	long long wait = sim.nextEvent() - now_us();
+	if (wait < 0)
+	    wait = 0;
+	if (poll(&pfds[0], pfds.size(), (int)((wait + 999) / 1000)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("poll");
+	    break;
+	}
+	sim.handle(pfds[0]);
+	for (size_t i = 0; i < bc.size(); i++)
+	    if (!bc[i]->handle(pfds[i + 1])) {
+		ok = false;
+		active = false;
+	    }
+	if ((rfsvFd != -1) && pfds.back().revents) {
+	    char buf[1024];
+	    int n = read(rfsvFd, buf, sizeof(buf));
+	    if (n > 0)
+		rfsvResult.append(buf, n);
+	    else if ((n == 0) || (errno != EINTR))
+		break;
+	}
+    }
+    if (rfsvChild > 0) {
+	// Keep serving the line, until the request under way is done.
+	long long deadline = now_us() + 5000000;
+	kill(rfsvChild, SIGTERM);
+	while (now_us() < deadline) {
+	    struct pollfd pfd[2];
+	    sim.prepare(pfd[0]);
+	    pfd[1].fd = rfsvFd;
+	    pfd[1].events = POLLIN;
+	    pfd[1].revents = 0;
+	    poll(pfd, 2, 10);
+	    sim.handle(pfd[0]);
+	    if (pfd[1].revents) {
+		char buf[1024];
+		int n = read(rfsvFd, buf, sizeof(buf));
+		if (n <= 0)
+		    break;
+		rfsvResult.append(buf, n);
+	    }
+	}
+	kill(rfsvChild, SIGKILL);
+	waitpid(rfsvChild, NULL, 0);
+	close(rfsvFd);
+    }
+
+    const simStats &s = sim.getStats();
+    printStats(s);
+    if (bench && benchStart) {
+	double secs = (now_us() - benchStart) / 1000000.0;
+	unsigned long msgs = 0;
+	unsigned long bytes = 0;
+	unsigned long errors = 0;
+	for (size_t i = 0; i < bc.size(); i++) {
+	    msgs += bc[i]->getMessages();
+	    bytes += bc[i]->getBytes();
+	    errors += bc[i]->getErrors();
+	}
+	unsigned long frames = (s.rxFrames - before.rxFrames) +
+	    (s.txFrames - before.txFrames);
+	map<string, unsigned long> ns = ncpdStats(host, sockNum);
+	cout << fixed << setprecision(1);
+	cout << "bench.seconds " << secs << endl;
+	cout << rfsvResult;
+	if (rfsvMode &&
+	    (rfsvResult.find("bench.rfsv_errors 0\n") == string::npos))
+	    ok = false;
+	cout << "bench.messages " << msgs << endl;
+	cout << "bench.errors " << errors << endl;
+	cout << "bench.frames_per_s " << frames / secs << endl;
+	// Every message goes to the simulator and back
+	cout << "bench.payload_bytes_per_s " << 2 * bytes / secs << endl;
+	cout << setprecision(2);
+	if (s.txFrames > before.txFrames)
+	    cout << "bench.sim_retransmit_pct "
+		 << 100.0 * (s.retransmits - before.retransmits) /
+		    (s.txFrames - before.txFrames) << endl;
+	if (ns.count("packet.tx_frames") && ns["packet.tx_frames"])
+	    cout << "bench.ncpd_retransmit_pct "
+		 << 100.0 * ns["link.retransmits"] / ns["packet.tx_frames"]
+		 << endl;
+	// Round trip times as each side sees them, from sending a
+	// frame to its acknowledgement.
+	cout << setprecision(0);
+	if (s.rttCount > before.rttCount)
+	    cout << "bench.sim_rtt_avg_us "
+		 << (double)(s.rttSum - before.rttSum) /
+		    (s.rttCount - before.rttCount) << endl;
+	if (ns.count("link.rtt.avg_us")) {
+	    cout << "bench.ncpd_rtt_avg_us " << ns["link.rtt.avg_us"] << endl;
+	    cout << "bench.ncpd_rtt_max_us " << ns["link.rtt.max_us"] << endl;
+	}
+	// Bytes copied between ncpd's buffers, per byte of payload
+	// passing through it in either direction.
+	if (bytes && ns.count("ncp.copied_bytes") &&
+	    nsBefore.count("ncp.copied_bytes"))
+	    cout << setprecision(2) << "bench.ncpd_copies_per_byte "
+		 << (double)(ns["ncp.copied_bytes"] -
+			     nsBefore["ncp.copied_bytes"]) / (2 * bytes)
+		 << endl;
+	// Likewise for the bufferStores, and their allocations per
+	// message.
+	if (bytes && ns.count("bufferstore.copied_bytes") &&
+	    nsBefore.count("bufferstore.copied_bytes")) {
+	    cout << "bench.ncpd_bufferstore_copies_per_byte "
+		 << (double)(ns["bufferstore.copied_bytes"] -
+			     nsBefore["bufferstore.copied_bytes"]) / (2 * bytes)
+		 << endl;
+	    cout << "bench.ncpd_allocs_per_message "
+		 << (double)(ns["bufferstore.allocations"] -
+			     nsBefore["bufferstore.allocations"]) / msgs
+		 << endl;
+	}
+	if (errors)
+	    ok = false;
+    }
+    for (size_t i = 0; i < bc.size(); i++)
+	delete bc[i];
+    if (ncpd > 0) {
+	// Keep serving the line, while ncpd says goodbye to the Psion.
+	long long deadline = now_us() + 10000000;
+	kill(ncpd, SIGTERM);
+	while (waitpid(ncpd, NULL, WNOHANG) == 0) {
+	    if (now_us() > deadline) {
+		kill(ncpd, SIGKILL);
+		waitpid(ncpd, NULL, 0);
+		break;
+	    }
+	    struct pollfd pfd;
+	    sim.prepare(pfd);
+	    poll(&pfd, 1, 10);
+	    sim.handle(pfd);
+	}
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <plpintl.h>
+#include <ppsocket.h>
+#include <bufferstore.h>
+#include <rfsv.h>
+
+#include <iostream>
+#include <string>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <getopt.h>
+
+using namespace std;
+
+static void
+help()
+{
+    cout << _(
+	"Usage: ncpstat [OPTIONS]...\n"
+	"\n"
+	"Print statistics of the serial link, the NCP channels\n"
+	"and the connected clients of a running ncpd.\n"
+	"\n"
+	"Supported options:\n"
+	"\n"
+	" -h, --help              Display this text.\n"
+	" -V, --version           Print version and exit.\n"
+	" -i, --interval=SECS     Print statistics every SECS seconds.\n"
+	" -p, --port=[HOST:]PORT  Connect to port PORT on host HOST.\n"
+	"    --port=unix:PATH     Connect to the Unix domain socket PATH.\n"
+	"                         Default for HOST is 127.0.0.1\n"
+	"                         Default for PORT is "
+	) << DPORT << "\n\n";
+}
+
+static void
+usage() {
+    cerr << _("Try `ncpstat --help' for more information") << endl;
+}
+
+static struct option opts[] = {
+    {"help",     no_argument,       0, 'h'},
+    {"version",  no_argument,       0, 'V'},
+    {"interval", required_argument, 0, 'i'},
+    {"port",     required_argument, 0, 'p'},
+    {NULL,       0,                 0,  0 }
+};
+
+static void
+parse_destination(const char *arg, const char **host, int *port)
+{
+    if (!arg)
+	return;
+    if (!strncmp(arg, "unix:", 5)) {
+	// unix:/run/ncpd.socket
+	*host = arg;
+	return;
+    }
+    // We don't want to modify argv, therefore copy it first ...
+    char *argcpy = strdup(arg);
+    char *pp = strchr(argcpy, ':');
+
+    if (pp) {
+	// host.domain:400
+	// 10.0.0.1:400
+	*pp ++= '\0';
+	*host = argcpy;
+    } else {
+	// 400
+	// host.domain
+	// host
+	// 10.0.0.1
+	if (strchr(argcpy, '.') || !isdigit(argcpy[0])) {
+	    *host = argcpy;
+	    pp = 0L;
+	} else
+	    pp = argcpy;
+    }
+    if (pp)
+	*port = atoi(pp);
+}
+
+static bool
+getStats(ppsocket &skt)
+{
+    bufferStore a;
+
+    a.addStringT("NCP$STAT");
+    if (!skt.sendBufferStore(a)) {
+	cerr << _("ncpstat: could not send request") << endl;
+	return false;
+    }
+    if (skt.getBufferStore(a) != 1) {
+	cerr << _("ncpstat: no reply from ncpd") << endl;
+	return false;
+    }
+    if ((a.getLen() < 1) || (a.getByte(0) != rfsv::E_PSI_GEN_NONE)) {
+	cerr << _("ncpstat: ncpd does not support statistics") << endl;
+	return false;
+    }
+    if (a.getLen() > 1)
+	cout << a.getString(1);
+    cout.flush();
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    int sockNum = DPORT;
+    int interval = 0;
+
+    setlocale (LC_ALL, "");
+    textdomain(PACKAGE);
+
+    struct servent *se = getservbyname("psion", "tcp");
+    endservent();
+    if (se != 0L)
+	sockNum = ntohs(se->s_port);
+
+    while (1) {
+	int c = getopt_long(argc, argv, "hVi:p:", opts, NULL);
+	if (c == -1)
+	    break;
+	switch (c) {
+	    case '?':
+		usage();
+		return -1;
+	    case 'V':
+		cout << _("ncpstat Version ") << VERSION << endl;
+		return 0;
+	    case 'h':
+		help();
+		return 0;
+	    case 'i':
+		interval = atoi(optarg);
+		if (interval < 1) {
+		    usage();
+		    return -1;
+		}
+		break;
+	    case 'p':
+		parse_destination(optarg, &host, &sockNum);
+		break;
+	}
+    }
+    if (optind < argc) {
+	usage();
+	return -1;
+    }
+
+    ppsocket skt;
+    if (!skt.connect(host, sockNum)) {
+	cerr << _("ncpstat: could not connect to ncpd") << endl;
+	return 1;
+    }
+    if (!getStats(skt))
+	return 1;
+    while (interval) {
+	sleep(interval);
+	cout << endl;
+	if (!getStats(skt))
+	    return 1;
+    }
+    return 0;
+}
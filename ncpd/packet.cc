@@ -33,105 +33,130 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <termios.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 #include "mp_serial.h"
 #include "packet.h"
+#include "capture.h"
 #include "link.h"
 #include "main.h"
 
-#define BUFLEN 4096 // Must be a power of 2
-#define BUFMASK (BUFLEN-1)
-#define hasSpace(dir) (((dir##Write + 1) & BUFMASK) != dir##Read)
-#define hasData(dir) (dir##Write != dir##Read)
-#define inca(idx,amount) do { \
-    idx = (idx + amount) & BUFMASK; \
-} while (0)
-#define inc1(idx) inca(idx, 1)
-#define normalize(idx) do { idx &= BUFMASK; } while (0)
+// The largest frame sent by the Link: the header of ncp, NCP_SENDLEN
+// bytes of data and a sequence number of two bytes.
+#define LINE_MAX_FRAME 255
+
+// With auto-baud, a rate is given up, if no frame is received
+// within this time. It doubles after each round through all rates,
+// in case the Psion is just slow to answer.
+#define PROBE_MSECS 300
+#define PROBE_MAX_MSECS 4800
 
 static unsigned short pumpverbose = 0;
 
-extern "C" {
-/**
- * Signal handler does nothing. It just exists
- * for having the select() below return an
- * interrupted system call.
- */
-static void usr1handler(int sig)
+static long long
+nowUsecs()
 {
-    signal(SIGUSR1, usr1handler);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
 
+extern "C" {
 
 static void *pump_run(void *arg)
 {
     packet *p = (packet *)arg;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    while (1) {
-	if (p->fd != -1) {
-	    fd_set r_set;
-	    fd_set w_set;
-	    int res;
-	    int count;
-
-	    FD_ZERO(&r_set);
-	    w_set = r_set;
-	    if (hasSpace(p->in))
+    while (!p->pumpStop) {
+	fd_set r_set;
+	fd_set w_set;
+	int res;
+	int count;
+	int maxfd;
+
+	if (p->resetPending) {
+	    // Requested by findSync() in this thread, which cannot
+	    // stop and restart itself.
+	    if (p->probing)
+		p->nextRate();
+	    else if (!p->synced) {
+		// Senders may be writing the out buffer, so just drop
+		// what they queued so far.
+		p->outBuffer->discard();
+		p->internalReset();
+	    }
+	    p->resetPending = false;
+	}
+	if (p->fd == -1)
+	    break;
+
+	FD_ZERO(&r_set);
+	FD_ZERO(&w_set);
+	FD_SET(p->pumpWake.fd(), &r_set);
+	if (p->hungUp) {
+	    // Nothing gets through any more until the line is
+	    // reset, so don't keep frames which are resent anyway.
+	    if (!p->outBuffer->empty())
+		p->outBuffer->discard();
+	} else {
+	    if (p->inBuffer->space() > 0)
 		FD_SET(p->fd, &r_set);
-	    if (hasData(p->out))
+	    if (!p->outBuffer->empty())
 		FD_SET(p->fd, &w_set);
-	    res = select(p->fd+1, &r_set, &w_set, NULL, NULL);
-	    switch (res) {
-		case 0:
-		    break;
-		case -1:
-		    break;
-		default:
-		    if (FD_ISSET(p->fd, &w_set)) {
-			count = p->outWrite - p->outRead;
-			if (count < 0)
-			    count = (BUFLEN - p->outRead);
-			res = write(p->fd, &p->outBuffer[p->outRead], count);
-			if (res > 0) {
-			    if (pumpverbose & PKT_DEBUG_DUMP) {
-				int i;
-				printf("pump: wrote %d bytes: (", res);
-				for (i = 0; i<res; i++)
-				    printf("%02x ",
-					   p->outBuffer[p->outRead + i]);
-				printf(")\n");
-			    }
-			    int hadSpace = hasSpace(p->out);
-			    inca(p->outRead, res);
-			    if (!hadSpace)
-				    pthread_kill(p->thisThread, SIGUSR1);
-			}
-		    }
-		    if (FD_ISSET(p->fd, &r_set)) {
-			count = p->inRead - p->inWrite;
-			if (count <= 0)
-			    count = (BUFLEN - p->inWrite);
-			res = read(p->fd, &p->inBuffer[p->inWrite], count);
-			if (res > 0) {
-			    if (pumpverbose & PKT_DEBUG_DUMP) {
-				int i;
-				printf("pump: read %d bytes: (", res);
-				for (i = 0; i<res; i++)
-				    printf("%02x ", p->inBuffer[p->inWrite + i]);
-				printf(")\n");
-			    }
-			    inca(p->inWrite, res);
-			    p->findSync();
-			}
-		    } else {
-			if (hasData(p->in))
-			    p->findSync();
-		    }
-		    break;
+	}
+	maxfd = (p->fd > p->pumpWake.fd()) ? p->fd : p->pumpWake.fd();
+	struct timeval tv;
+	struct timeval *timeout = NULL;
+	if (p->probing && !p->hungUp) {
+	    long long left = p->probeDeadline - nowUsecs();
+	    if (left <= 0) {
+		p->nextRate();
+		continue;
 	    }
+	    tv.tv_sec = left / 1000000;
+	    tv.tv_usec = left % 1000000;
+	    timeout = &tv;
+	}
+	res = select(maxfd + 1, &r_set, &w_set, NULL, timeout);
+	if (res <= 0)
+	    continue;
+	if (FD_ISSET(p->pumpWake.fd(), &r_set)) {
+	    // Frames queued by a flush() racing with this are seen
+	    // on the next round.
+	    p->pumpWake.clear();
+	    p->wakePending = false;
+	}
+	if (FD_ISSET(p->fd, &w_set))
+	    p->writeOut();
+	if (FD_ISSET(p->fd, &r_set)) {
+	    unsigned char *w = p->inBuffer->writePtr(count);
+	    res = read(p->fd, w, count);
+	    if (res > 0) {
+		if (pumpverbose & PKT_DEBUG_DUMP) {
+		    int i;
+		    printf("pump: read %d bytes: (", res);
+		    for (i = 0; i<res; i++)
+			printf("%02x ", w[i]);
+		    printf(")\n");
+		}
+		p->lineRxBytes.add(res);
+		if (p->cap)
+		    p->cap->add(CAP_RAW_RX, w, res);
+		p->inBuffer->commitWrite(res);
+		p->findSync();
+	    } else if ((res == 0) ||
+		       ((errno != EAGAIN) && (errno != EINTR))) {
+		// The device is gone, e.g. a USB adaptor unplugged.
+		p->hungUp = true;
+		p->presence.notify();
+	    }
+	} else {
+	    if (!p->inBuffer->empty())
+		p->findSync();
 	}
     }
+    return NULL;
 }
 
 };
@@ -147,80 +172,195 @@ static const int baud_table[] = {
 
 using namespace std;
 
+static string
+deviceKey(const char *dev)
+{
+    // A USB serial adaptor is known by its serial number, which
+    // stays the same, whichever node it gets. Its tty device is
+    // the USB interface or a child of that.
+    char *real = realpath(dev, NULL);
+    if (real) {
+	const char *name = strrchr(real, '/');
+	string sys = string("/sys/class/tty/") + (name ? name + 1 : real);
+	free(real);
+	const char *up[] = { "/device/../serial", "/device/../../serial" };
+	for (int i = 0; i < 2; i++) {
+	    ifstream f((sys + up[i]).c_str());
+	    string serial;
+	    if (getline(f, serial) && !serial.empty())
+		return "serial:" + serial;
+	}
+    }
+    return dev;
+}
+
+static int
+loadBaud(const char *file, const string &key)
+{
+    // Each line holds a rate, followed by the device.
+    ifstream f(file);
+    string line;
+    while (getline(f, line)) {
+	string::size_type sp = line.find(' ');
+	if ((sp == string::npos) || (line.substr(sp + 1) != key))
+	    continue;
+	int rate = atoi(line.c_str());
+	for (unsigned int i = 0; i < BAUD_TABLE_SIZE; i++)
+	    if (baud_table[i] == rate)
+		return rate;
+    }
+    return 0;
+}
+
+static bool
+saveBaud(const char *file, const string &key, int rate)
+{
+    string tmp = string(file) + ".tmp";
+    ifstream in(file);
+    ofstream out(tmp.c_str());
+    string line;
+    while (getline(in, line)) {
+	string::size_type sp = line.find(' ');
+	if ((sp != string::npos) && (line.substr(sp + 1) != key))
+	    out << line << "\n";
+    }
+    out << rate << " " << key << "\n";
+    out.close();
+    if (!out || (rename(tmp.c_str(), file) != 0)) {
+	unlink(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
 packet::
-packet(const char *fname, int _baud, Link *_link, unsigned short _verbose)
+packet(const char *fname, int _baud, Link *_link, unsigned short _verbose,
+       capture *_cap, const char *_baudFile, const lineTuning *_tuning)
+    : presence(fname)
 {
     verbose = pumpverbose = _verbose;
     devname = strdup(fname);
     assert(devname);
+    baudFile = (_baudFile && *_baudFile) ? strdup(_baudFile) : NULL;
     baud = _baud;
     theLINK = _link;
+    cap = _cap;
+    if (_tuning)
+	tuning = *_tuning;
     isEPOC = false;
     justStarted = true;
 
-    // Initialize CRC table
-    crc_table[0] = 0;
-    for (int i = 0; i < 128; i++) {
-	unsigned int carry = crc_table[i] & 0x8000;
-	unsigned int tmp = (crc_table[i] << 1) & 0xffff;
-	crc_table[i * 2 + (carry ? 0 : 1)] = tmp ^ 0x1021;
-	crc_table[i * 2 + (carry ? 1 : 0)] = tmp;
-    }
-
-    inRead = inWrite = outRead = outWrite = 0;
-    inBuffer = new unsigned char[BUFLEN + 1];
-    outBuffer = new unsigned char[BUFLEN + 1];
-    assert(inBuffer);
-    assert(outBuffer);
+    // The ring takes two windows of the largest frames, even if every
+    // byte is escaped, at any rate: a window and its retransmission.
+    // What does not fit is dropped, see send(). The same size does
+    // for the input.
+    int size = 2 * LNK_EPOC_WINDOW * frameCodec::maxEncodedLen(LINE_MAX_FRAME);
+    inBuffer = new ringBuffer(size);
+    outBuffer = new ringBuffer(size);
 
-    esc = false;
     lastFatal = false;
     serialStatus = -1;
-    lastSYN = startPkt = -1;
-    crcIn = crcOut = 0;
 
-    thisThread = pthread_self();
+    pthread_mutex_init(&outMutex, NULL);
+    wakePending = false;
+    pumpStop = false;
+    resetPending = false;
+    hungUp = false;
+    pumpRunning = false;
+
     realBaud = baud;
+    goodBaud = 0;
+    probing = false;
+    synced = false;
     if (baud < 0) {
-	baud_index = 1;
-	realBaud = baud_table[0];
+	if (baudFile) {
+	    goodBaud = loadBaud(baudFile, deviceKey(devname));
+	    if (goodBaud && (verbose & PKT_DEBUG_LOG))
+		lout << "packet: last rate was " << goodBaud << endl;
+	}
+	setRate(goodBaud ? goodBaud : baud_table[0]);
     }
     fd = init_serial(devname, realBaud, 0);
     if (fd == -1)
 	lastFatal = true;
     else {
-	signal(SIGUSR1, usr1handler);
-	pthread_create(&datapump, NULL, pump_run, this);
+	lineOpened();
+	startPump();
     }
 }
 
 packet::
 ~packet()
 {
+    if (pumpRunning)
+	stopPump();
     if (fd != -1) {
-	pthread_cancel(datapump);
-	pthread_join(datapump, NULL);
+	presence.stopLines();
 	ser_exit(fd);
     }
     fd = -1;
-    delete []inBuffer;
-    delete []outBuffer;
+    pthread_mutex_destroy(&outMutex);
+    delete inBuffer;
+    delete outBuffer;
     free(devname);
+    free(baudFile);
 }
 
 void packet::
 reset()
 {
-    if (fd != -1) {
-	pthread_cancel(datapump);
-	pthread_join(datapump, NULL);
-    }
-    outRead = outWrite = 0;
+    // The pump may have quit by itself, if it failed to reopen the line.
+    if (pumpRunning)
+	stopPump();
+    pthread_mutex_lock(&outMutex);
+    outBuffer->clear();
+    pthread_mutex_unlock(&outMutex);
     internalReset();
-    if (fd != -1) {
-	pthread_create(&datapump, NULL, pump_run, this);
-	realWrite();
+    if (fd != -1)
+	startPump();
+}
+
+void packet::
+startPump()
+{
+    // The pump never blocks in read() or write(), so that it can be
+    // stopped by a wakeup at any time.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    pumpStop = false;
+    pumpRunning = true;
+    pthread_create(&datapump, NULL, pump_run, this);
+
+    // Every frame passes through the pump, so it is the thread to
+    // keep from waiting for a CPU.
+    if (tuning.rtPriority > 0) {
+	struct sched_param sp;
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = tuning.rtPriority;
+	int err = pthread_setschedparam(datapump, SCHED_FIFO, &sp);
+	if (err != 0)
+	    lerr << "packet: cannot set realtime priority "
+		 << tuning.rtPriority << ": " << strerror(err) << endl;
     }
+#if defined(linux) && defined(CPU_SET)
+    if (tuning.cpu >= 0) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(tuning.cpu, &cpus);
+	int err = pthread_setaffinity_np(datapump, sizeof(cpus), &cpus);
+	if (err != 0)
+	    lerr << "packet: cannot pin the data pump to CPU "
+		 << tuning.cpu << ": " << strerror(err) << endl;
+    }
+#endif
+}
+
+void packet::
+stopPump()
+{
+    pumpStop = true;
+    flush();
+    pthread_join(datapump, NULL);
+    pumpRunning = false;
 }
 
 void packet::
@@ -228,31 +368,112 @@ internalReset()
 {
     if (verbose & PKT_DEBUG_LOG)
 	lout << "resetting serial connection" << endl;
+    resets.add();
+    lastFatal = false;
     if (fd != -1) {
+	presence.stopLines();
 	ser_exit(fd);
 	fd = -1;
     }
     usleep(100000);
-    inRead = inWrite = 0;
-    esc = false;
-    lastFatal = false;
+    inBuffer->clear();
+    codec.resetDecoder();
+    hungUp = false;
     serialStatus = -1;
-    lastSYN = startPkt = -1;
-    crcIn = crcOut = 0;
     realBaud = baud;
     justStarted = true;
-    if (baud < 0) {
-	realBaud = baud_table[baud_index++];
-	if (baud_index >= BAUD_TABLE_SIZE)
-	    baud_index = 0;
-    }
+    // Most likely, the Psion comes back at the same rate, so
+    // auto-baud starts with that.
+    if (baud < 0)
+	setRate(goodBaud ? goodBaud : baud_table[0]);
 
     fd = init_serial(devname, realBaud, 0);
     if (verbose & PKT_DEBUG_LOG)
 	lout << "serial connection set to " << dec << realBaud
 	     << " baud, fd=" << fd << endl;
-    if (fd != -1)
-	lastFatal = false;
+    if (fd != -1) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	lineOpened();
+    } else {
+	lastFatal = true;
+	probing = false;
+    }
+}
+
+void packet::
+lineOpened()
+{
+    if (cap)
+	cap->add(CAP_OPEN, realBaud);
+    if (tuning.lowLatency) {
+	int got = ser_lowlatency(devname, fd);
+	if (verbose & PKT_DEBUG_LOG)
+	    lout << "packet: low latency"
+		 << ((got & SER_LOW_LATENCY) ? " ASYNC_LOW_LATENCY" : "")
+		 << ((got & SER_LATENCY_TIMER) ? " latency_timer=1" : "")
+		 << (got ? "" : " not supported by the device") << endl;
+    }
+    presence.watchLines(fd);
+    synced = false;
+    openTime = nowUsecs();
+    probeMsecs = PROBE_MSECS;
+    probeDeadline = openTime + probeMsecs * 1000LL;
+    probing = (baud < 0);
+}
+
+void packet::
+setRate(int rate)
+{
+    // The next rate to probe is the one after this in the table.
+    realBaud = rate;
+    baud_index = 0;
+    for (unsigned int i = 0; i < BAUD_TABLE_SIZE; i++)
+	if (baud_table[i] == rate)
+	    baud_index = (i + 1) % BAUD_TABLE_SIZE;
+}
+
+void packet::
+nextRate()
+{
+    // Called by the pump only, which owns the in buffer and the
+    // receiver state.
+    probes.add();
+    setRate(baud_table[baud_index]);
+    if ((baud_index == 1) && (probeMsecs < PROBE_MAX_MSECS))
+	probeMsecs *= 2;
+    if (verbose & PKT_DEBUG_LOG)
+	lout << "packet: probing " << dec << realBaud << " baud" << endl;
+    if (ser_speed(fd, realBaud) < 0)
+	lastFatal = true;
+    if (cap)
+	cap->add(CAP_OPEN, realBaud);
+    inBuffer->clear();
+    rcv.init();
+    codec.resetDecoder();
+    justStarted = true;
+    probeDeadline = nowUsecs() + probeMsecs * 1000LL;
+
+    pthread_mutex_lock(&outMutex);
+    bufferChain b = probe;
+    pthread_mutex_unlock(&outMutex);
+    if (b.getLen() > 0)
+	send(b);
+}
+
+void packet::
+gotFrame()
+{
+    if (synced)
+	return;
+    synced = true;
+    probing = false;
+    linkTime.add(nowUsecs() - openTime);
+    if ((baud < 0) && (realBaud != goodBaud)) {
+	goodBaud = realBaud;
+	if (baudFile && !saveBaud(baudFile, deviceKey(devname), realBaud) &&
+	    (verbose & PKT_DEBUG_LOG))
+	    lout << "packet: cannot save the rate in " << baudFile << endl;
+    }
 }
 
 short int packet::
@@ -279,14 +500,35 @@ getSpeed()
     return realBaud;
 }
 
+devWatch *packet::
+getDevWatch()
+{
+    return &presence;
+}
+
 void packet::
-send(bufferStore &b)
+getStats(ostream &s)
 {
-    opByte(0x16);
-    opByte(0x10);
-    opByte(0x02);
+    s << "packet.device " << devname << "\n";
+    s << "packet.speed " << realBaud << "\n";
+    s << "packet.tx_frames " << txFrames.get() << "\n";
+    s << "packet.tx_dropped " << txDropped.get() << "\n";
+    s << "packet.tx_bytes " << txBytes.get() << "\n";
+    s << "packet.rx_frames " << rxFrames.get() << "\n";
+    s << "packet.rx_bytes " << rxBytes.get() << "\n";
+    s << "packet.crc_errors " << crcErrors.get() << "\n";
+    s << "packet.line_tx_bytes " << lineTxBytes.get() << "\n";
+    s << "packet.line_rx_bytes " << lineRxBytes.get() << "\n";
+    s << "packet.resets " << resets.get() << "\n";
+    s << "packet.probes " << probes.get() << "\n";
+    linkTime.print(s, "packet.time_to_link");
+    if (cap)
+	s << "packet.capture_dropped " << cap->getDropped() << "\n";
+}
 
-    crcOut = 0;
+void packet::
+send(const bufferChain &b, bool flush)
+{
     long len = b.getLen();
 
     if (verbose & PKT_DEBUG_LOG) {
@@ -298,170 +540,134 @@ send(bufferStore &b)
 	lout << endl;
     }
 
-    for (int i = 0; i < len; i++) {
-	unsigned char c = b.getByte(i);
-	switch (c) {
-	    case 0x03:
-		if (isEPOC) {
-		    opByte(0x10);
-		    opByte(0x04);
-		    addToCrc(0x03, &crcOut);
-		} else
-		    opCByte(c, &crcOut);
-		break;
-	    case 0x10:
-		opByte(0x10);
-		// fall thru
-	    default:
-		opCByte(c, &crcOut);
-	}
+    // Frames from different threads must not be interleaved, so
+    // a frame is only written if all of it fits. The Link calls this
+    // with its queues locked, which the pump needs to get on, so it
+    // must never wait for the pump. A frame which does not fit is
+    // dropped, like one lost on the line: the line is stalled or
+    // slower than the retransmissions, and the Link resends it later.
+    pthread_mutex_lock(&outMutex);
+    if (outBuffer->space() < frameCodec::maxEncodedLen(len)) {
+	txDropped.add();
+	pthread_mutex_unlock(&outMutex);
+	this->flush();
+	return;
     }
-    opByte(0x10);
-    opByte(0x03);
-    opByte(crcOut >> 8);
-    opByte(crcOut & 0xff);
-    realWrite();
-}
 
-void packet::
-opByte(unsigned char a)
-{
-    if (!hasSpace(out))
-	realWrite();
-    outBuffer[outWrite] = a;
-    inc1(outWrite);
+    if (probing)
+	probe = b;
+    txFrames.add();
+    txBytes.add(len);
+    if (cap) {
+	bufferChain c = b;
+	cap->add(CAP_FRAME_TX, c.getBytes(), len);
+    }
+    codec.encode(*outBuffer, b, isEPOC);
+    pthread_mutex_unlock(&outMutex);
+    if (flush)
+	this->flush();
 }
 
 void packet::
-opCByte(unsigned char a, unsigned short *crc)
+flush()
 {
-    addToCrc(a, crc);
-    if (!hasSpace(out))
-	realWrite();
-    outBuffer[outWrite] = a;
-    inc1(outWrite);
+    // Only one wakeup is needed until the pump has seen it, no matter
+    // how many frames are queued in the meantime.
+    if (!wakePending.exchange(true))
+	pumpWake.signal();
 }
 
 void packet::
-realWrite()
+writeOut()
 {
-    pthread_kill(datapump, SIGUSR1);
-    while (!hasSpace(out)) {
-	sigset_t sigs;
-	int dummy;
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGUSR1);
-	sigwait(&sigs, &dummy);
+    struct iovec iov[2];
+    int iovcnt = 1;
+    int res;
+
+    // Write everything queued with a single call, even if it
+    // wraps around the end of the ring.
+    int r = outBuffer->readPos();
+    int w = outBuffer->writePos();
+    if (r == w)
+	return;
+    iov[0].iov_base = (void *)outBuffer->ptr(r);
+    if (w > r)
+	iov[0].iov_len = w - r;
+    else {
+	iov[0].iov_len = outBuffer->size() - r;
+	iov[1].iov_base = (void *)outBuffer->ptr(0);
+	iov[1].iov_len = w;
+	if (w > 0)
+	    iovcnt = 2;
     }
+    res = writev(fd, iov, iovcnt);
+    if (res <= 0)
+	return;
+    lineTxBytes.add(res);
+    if (cap) {
+	long first = ((long)iov[0].iov_len < res) ? iov[0].iov_len : res;
+	cap->add(CAP_RAW_TX, outBuffer->ptr(r), first);
+	if (res > first)
+	    cap->add(CAP_RAW_TX, outBuffer->ptr(0), res - first);
+    }
+    if (pumpverbose & PKT_DEBUG_DUMP) {
+	int i;
+	printf("pump: wrote %d bytes: (", res);
+	for (i = 0; i<res; i++)
+	    printf("%02x ", outBuffer->at(outBuffer->advance(r, i)));
+	printf(")\n");
+    }
+    outBuffer->consume(res);
 }
 
 void packet::
 findSync()
 {
-    int inw = inWrite;
-    int p;
-
- outerLoop:
-    p = (lastSYN >= 0) ? lastSYN : inRead;
-    if (startPkt < 0) {
-	while (p != inw) {
-	    normalize(p);
-	    if (inBuffer[p++] != 0x16)
-		continue;
-	    lastSYN = p - 1;
-	    normalize(p);
-	    if (p == inw)
-		break;
-	    if (inBuffer[p++] != 0x10)
-		continue;
-	    normalize(p);
-	    if (p == inw)
-		break;
-	    if (inBuffer[p++] != 0x02)
-		continue;
-	    normalize(p);
-	    lastSYN = startPkt = p;
-	    crcIn = inCRCstate = 0;
-	    rcv.init();
-	    esc = false;
-	    break;
-	}
-    }
-    if (startPkt >= 0) {
+    frameCodec::result r;
+
+    while ((r = codec.decode(*inBuffer, rcv, !justStarted)) !=
+	   frameCodec::FRAME_NONE) {
 	justStarted = false;
-	while (p != inw) {
-	    unsigned char c = inBuffer[p];
-	    switch (inCRCstate) {
-		case 0:
-		    if (esc) {
-			esc = false;
-			switch (c) {
-			    case 0x03:
-				inCRCstate = 1;
-				break;
-			    case 0x04:
-				addToCrc(0x03, &crcIn);
-				rcv.addByte(0x03);
-				break;
-			    default:
-				addToCrc(c, &crcIn);
-				rcv.addByte(c);
-				break;
-			}
-		    } else {
-			if (c == 0x10)
-			    esc = true;
-			else {
-			    addToCrc(c, &crcIn);
-			    rcv.addByte(c);
-			}
-		    }
-		    break;
-		case 1:
-		    receivedCRC = c;
-		    receivedCRC <<= 8;
-		    inCRCstate = 2;
-		    break;
-		case 2:
-		    receivedCRC |= c;
-		    inc1(p);
-		    inRead = p;
-		    startPkt = lastSYN = -1;
-		    inCRCstate = 0;
-		    if (receivedCRC != crcIn) {
-			if (verbose & PKT_DEBUG_LOG)
-			    lout << "packet: BAD CRC" << endl;
-		    } else {
-			if (verbose & PKT_DEBUG_LOG) {
-			    lout << "packet: << ";
-			    if (verbose & PKT_DEBUG_DUMP)
-				lout << rcv;
-			    else
-				lout << "len=" << dec << rcv.getLen();
-			    lout << endl;
-			}
-			theLINK->receive(rcv);
-		    }
-		    rcv.init();
-		    if (hasData(out))
-			return;
-		    goto outerLoop;
+	if (r == frameCodec::FRAME_BAD) {
+	    crcErrors.add();
+	    // Garbage at a wrong rate, which happened to look like the
+	    // start of a frame.
+	    if (probing)
+		resetPending = true;
+	    if (cap)
+		cap->add(CAP_CRC_ERROR, rcv.getBytes(), rcv.getLen());
+	    if (verbose & PKT_DEBUG_LOG)
+		lout << "packet: BAD CRC" << endl;
+	} else {
+	    rxFrames.add();
+	    rxBytes.add(rcv.getLen());
+	    gotFrame();
+	    if (cap)
+		cap->add(CAP_FRAME_RX, rcv.getBytes(), rcv.getLen());
+	    if (verbose & PKT_DEBUG_LOG) {
+		lout << "packet: << ";
+		if (verbose & PKT_DEBUG_DUMP)
+		    lout << rcv;
+		else
+		    lout << "len=" << dec << rcv.getLen();
+		lout << endl;
 	    }
-	    inc1(p);
-	}
-	lastSYN = p;
-    } else {
-	// If we get here, no sync was found.
-	// If we are just started and the amount of received data exceeds
-	// 15 bytes, the baudrate is obviously wrong.
-	// (or the connected device is not an EPOC device). Reset the
-	// serial connection and try next baudrate, if auto-baud is set.
-	if (justStarted) {
-	    int rx_amount = (inw > inRead) ?
-		inw - inRead : BUFLEN - inRead + inw;
-	    if (rx_amount > 15)
-		reset();
+	    theLINK->receive(rcv);
 	}
+	rcv.init();
+	// Let the pump write out the ack first.
+	if (!outBuffer->empty())
+	    return;
+    }
+    if (codec.inFrame())
+	justStarted = false;
+    else if (justStarted && (inBuffer->used() > 15)) {
+	// No sync was found. If we are just started and the amount of
+	// received data exceeds 15 bytes, the baudrate is obviously
+	// wrong (or the connected device is not an EPOC device). Reset
+	// the serial connection and try the next baudrate, if auto-baud
+	// is set.
+	resetPending = true;
     }
 }
 
@@ -472,9 +678,21 @@ linkFailed()
     int res;
     bool failed = false;
 
+    // The device could not be opened.
     if (fd == -1)
-	return false;
+	return lastFatal;
+    if (hungUp) {
+	if (verbose & PKT_DEBUG_LOG)
+	    lout << "packet: linkHUNGUP\n";
+	return true;
+    }
     res = ioctl(fd, TIOCMGET, &arg);
+    if ((res < 0) && ((errno == ENOTTY) || (errno == EINVAL))) {
+	// No modem lines (pseudo terminal or some USB adaptors),
+	// so there is nothing to watch.
+	arg = TIOCM_DTR | TIOCM_RTS | TIOCM_DSR | TIOCM_CTS | TIOCM_CAR;
+	res = 0;
+    }
     if (res < 0)
 	lastFatal = true;
     if ((serialStatus == -1) || (arg != serialStatus)) {
@@ -24,9 +24,15 @@
 #include "config.h"
 #include <stdio.h>
 #include <pthread.h>
+#include <atomic>
 
 #include "bufferstore.h"
 #include "bufferarray.h"
+#include "bufchain.h"
+#include "devwatch.h"
+#include "framing.h"
+#include "ringbuf.h"
+#include "stats.h"
 
 #define PKT_DEBUG_LOG       16
 #define PKT_DEBUG_DUMP      32
@@ -37,17 +43,58 @@ extern "C" {
 }
 
 class Link;
+class capture;
+
+/**
+ * Optional tuning of the serial line and the data pump for a
+ * shorter round trip time.
+ */
+struct lineTuning {
+    lineTuning() : lowLatency(false), rtPriority(0), cpu(-1) {}
+
+    // Set ASYNC_LOW_LATENCY and the latency timer of an FTDI adaptor.
+    bool lowLatency;
+    // Run the data pump with SCHED_FIFO at this priority, if not 0.
+    int rtPriority;
+    // Pin the data pump to this CPU, if not -1.
+    int cpu;
+};
 
 class packet
 {
 public:
-    packet(const char *fname, int baud, Link *_link, unsigned short verbose = 0);
+    /**
+     * Opens the serial line.
+     *
+     * @param fname The serial device.
+     * @param baud The baud rate, or -1 for auto-baud.
+     * @param _link The link layer, which gets the received frames.
+     * @param verbose The debug flags.
+     * @param cap Where to record the traffic, or NULL.
+     * @param baudFile The file remembering the rate found by
+     *                 auto-baud for each device, or NULL.
+     * @param tuning The low latency settings, or NULL for none.
+     */
+    packet(const char *fname, int baud, Link *_link, unsigned short verbose = 0,
+	   capture *cap = NULL, const char *baudFile = NULL,
+	   const lineTuning *tuning = NULL);
     ~packet();
 
     /**
-     * Send a buffer out to serial line
+     * Send a buffer out to serial line. This never waits: if the
+     * line buffer is full, the frame is dropped.
+     *
+     * @param b The frame payload to send.
+     * @param flush If false, the encoded frame is only queued and
+     *              written out together with later frames on the
+     *              next call to @ref flush.
      */
-    void send(bufferStore &b);
+    void send(const bufferChain &b, bool flush = true);
+
+    /**
+     * Wake up the data pump to write out all queued frames.
+     */
+    void flush();
 
     void setEpoc(bool);
     void setVerbose(short int);
@@ -56,55 +103,86 @@ public:
     bool linkFailed();
     void reset();
 
+    /**
+     * Get the watcher for the device coming and going.
+     */
+    devWatch *getDevWatch();
+
+    /**
+     * Print statistics as lines of the form "packet.key value".
+     */
+    void getStats(std::ostream &s);
+
 private:
     friend void * pump_run(void *);
 
-    inline void addToCrc(unsigned char a, unsigned short *crc) {
-	*crc =  (*crc << 8) ^ crc_table[((*crc >> 8) ^ a) & 0xff];
-    }
-
     void findSync();
-    void opByte(unsigned char a);
-    void opCByte(unsigned char a, unsigned short *crc);
-    void realWrite();
+    void writeOut();
+    void startPump();
+    void stopPump();
     void internalReset();
+    void lineOpened();
+    void setRate(int rate);
+    void nextRate();
+    void gotFrame();
 
     Link *theLINK;
     pthread_t datapump;
-    pthread_t thisThread;
-    unsigned int   crc_table[256];
-
-    unsigned short crcOut;
-    unsigned short crcIn;
-    unsigned short receivedCRC;
-    unsigned short inCRCstate;
-
-    unsigned char *inBuffer;
-    int inWrite;
-    int inRead;
-
-    unsigned char *outBuffer;
-    int outWrite;
-    int outRead;
-
-    int startPkt;
-    int lastSYN;
+    bool pumpRunning;
+    pthread_mutex_t outMutex;
+    wakeupEvent pumpWake;
+    std::atomic<bool> wakePending;
+    std::atomic<bool> pumpStop;
+    std::atomic<bool> resetPending;
+    std::atomic<bool> hungUp;
+    frameCodec codec;
+
+    // Written by the pump, read by findSync() in the pump thread.
+    ringBuffer *inBuffer;
+    // Written by senders, one at a time, read by the pump.
+    ringBuffer *outBuffer;
 
     bufferArray inQueue;
-    bufferStore rcv;
+    bufferChain rcv;
     int foundSync;
     int fd;
     int serialStatus;
     int baud_index;
     int realBaud;
+    // The rate of the last link, tried first with auto-baud.
+    int goodBaud;
     short int verbose;
-    bool esc;
     bool lastFatal;
     bool isEPOC;
     bool justStarted;
+    // A valid frame has been received since the line was opened.
+    bool synced;
+    // With auto-baud, the rates are probed until the line is synced.
+    // The frame sent last meanwhile is repeated at each new rate.
+    std::atomic<bool> probing;
+    bufferChain probe;
+    int probeMsecs;
+    long long probeDeadline;
+    long long openTime;
 
     char *devname;
+    char *baudFile;
     int baud;
+    capture *cap;
+    lineTuning tuning;
+    devWatch presence;
+
+    statCounter txFrames;
+    statCounter txDropped;
+    statCounter txBytes;
+    statCounter rxFrames;
+    statCounter rxBytes;
+    statCounter crcErrors;
+    statCounter lineTxBytes;
+    statCounter lineRxBytes;
+    statCounter resets;
+    statCounter probes;
+    statHistogram linkTime;
 };
 
 #endif
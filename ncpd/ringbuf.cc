@@ -0,0 +1,152 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <cstring>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "ringbuf.h"
+
+ringBuffer::
+ringBuffer(int minSize)
+{
+    int size = 1;
+    while (size < minSize)
+	size <<= 1;
+    buf = new unsigned char[size];
+    mask = size - 1;
+    rd = wr = 0;
+}
+
+ringBuffer::
+~ringBuffer()
+{
+    delete []buf;
+}
+
+int ringBuffer::
+space() const
+{
+    return (rd.load(std::memory_order_acquire) -
+	    wr.load(std::memory_order_relaxed) - 1) & mask;
+}
+
+unsigned char *ringBuffer::
+writePtr(int &len)
+{
+    int w = wr.load(std::memory_order_relaxed);
+    len = space();
+    if (len > mask + 1 - w)
+	len = mask + 1 - w;
+    return buf + w;
+}
+
+void ringBuffer::
+commitWrite(int n)
+{
+    wr.store(advance(wr.load(std::memory_order_relaxed), n),
+	     std::memory_order_release);
+}
+
+void ringBuffer::
+put(const unsigned char *data, int len)
+{
+    assert(len <= space());
+    int w = wr.load(std::memory_order_relaxed);
+    int first = mask + 1 - w;
+    if (first > len)
+	first = len;
+    memcpy(buf + w, data, first);
+    memcpy(buf, data + first, len - first);
+    commitWrite(len);
+}
+
+void ringBuffer::
+clear()
+{
+    rd.store(0, std::memory_order_relaxed);
+    wr.store(0, std::memory_order_relaxed);
+}
+
+wakeupEvent::
+wakeupEvent()
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    rfd = wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rfd != -1)
+	return;
+#endif
+    int p[2];
+    if (pipe(p) != 0) {
+	perror("pipe");
+	exit(1);
+    }
+    rfd = p[0];
+    wfd = p[1];
+    fcntl(rfd, F_SETFL, O_NONBLOCK);
+    fcntl(wfd, F_SETFL, O_NONBLOCK);
+}
+
+wakeupEvent::
+~wakeupEvent()
+{
+    close(rfd);
+    if (wfd != rfd)
+	close(wfd);
+}
+
+void wakeupEvent::
+signal()
+{
+    // An eventfd takes a 64 bit counter, a pipe any byte.
+    uint64_t one = 1;
+    int len = (wfd == rfd) ? sizeof(one) : 1;
+    if ((write(wfd, &one, len) < 0) && (errno != EAGAIN))
+	perror("wakeupEvent: write");
+}
+
+void wakeupEvent::
+clear()
+{
+    char dummy[16];
+    while (read(rfd, dummy, sizeof(dummy)) > 0)
+	;
+}
+
+bool wakeupEvent::
+wait(int msecs)
+{
+    struct pollfd pfd;
+    pfd.fd = rfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, msecs) <= 0)
+	return false;
+    clear();
+    return true;
+}
@@ -0,0 +1,179 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _ringbuf_h
+#define _ringbuf_h
+
+#include "config.h"
+
+#include <atomic>
+
+/**
+ * A ring buffer of bytes, shared by exactly one producer and one
+ * consumer thread without locking.
+ *
+ * The producer publishes data by advancing the write position with
+ * release semantics, which the consumer reads with acquire semantics,
+ * and the same holds for the read position the other way round. So
+ * the bytes in the buffer need no further synchronization. One byte
+ * is always left unused, to tell a full buffer from an empty one.
+ */
+class ringBuffer {
+public:
+    /**
+     * Constructs a new ring buffer.
+     *
+     * @param minSize The minimum size in bytes. It is rounded up to
+     *                the next power of 2.
+     */
+    ringBuffer(int minSize);
+    ~ringBuffer();
+
+    /**
+     * Get the size of the buffer.
+     */
+    int size() const { return mask + 1; }
+
+    /**
+     * Get the position @p n bytes after @p pos.
+     */
+    int advance(int pos, int n) const { return (pos + n) & mask; }
+
+    /**
+     * Producer: Get the number of bytes, which can be written.
+     */
+    int space() const;
+
+    /**
+     * Producer: Get the free space up to the end of the buffer.
+     *
+     * @param len Returns the number of bytes, which can be
+     *            written at the returned address.
+     */
+    unsigned char *writePtr(int &len);
+
+    /**
+     * Producer: Hand bytes written at @ref writePtr to the consumer.
+     */
+    void commitWrite(int n);
+
+    /**
+     * Producer: Copy bytes into the buffer and hand them to the
+     * consumer. The caller must have checked that they fit.
+     */
+    void put(const unsigned char *data, int len);
+
+    /**
+     * Consumer: Get the position of the first unread byte.
+     */
+    int readPos() const { return rd.load(std::memory_order_relaxed); }
+
+    /**
+     * Consumer: Get the position after the last byte written.
+     * All bytes before it may be read.
+     */
+    int writePos() const { return wr.load(std::memory_order_acquire); }
+
+    /**
+     * Consumer: Get the number of bytes, which can be read.
+     */
+    int used() const { return (writePos() - readPos()) & mask; }
+
+    /**
+     * Consumer: Check, if there is nothing to read.
+     */
+    bool empty() const { return writePos() == readPos(); }
+
+    /**
+     * Consumer: Get the address of the byte at @p pos.
+     */
+    const unsigned char *ptr(int pos) const { return buf + pos; }
+
+    /**
+     * Consumer: Get the byte at @p pos.
+     */
+    unsigned char at(int pos) const { return buf[pos]; }
+
+    /**
+     * Consumer: Hand the space up to @p pos back to the producer.
+     */
+    void setReadPos(int pos) { rd.store(pos, std::memory_order_release); }
+
+    /**
+     * Consumer: Hand @p n read bytes back to the producer.
+     */
+    void consume(int n) { setReadPos(advance(readPos(), n)); }
+
+    /**
+     * Consumer: Drop everything written so far.
+     */
+    void discard() { setReadPos(writePos()); }
+
+    /**
+     * Empty the buffer. Neither side may use it at the same time.
+     */
+    void clear();
+
+private:
+    unsigned char *buf;
+    int mask;
+    // Each side writes its own position only, so keep them apart.
+    alignas(64) std::atomic<int> rd;
+    alignas(64) std::atomic<int> wr;
+};
+
+/**
+ * A wakeup, which can be waited for with select() or poll(),
+ * together with other file descriptors. An eventfd is used where
+ * available, a pipe otherwise.
+ */
+class wakeupEvent {
+public:
+    wakeupEvent();
+    ~wakeupEvent();
+
+    /**
+     * Get the file descriptor, which becomes readable on @ref signal.
+     */
+    int fd() const { return rfd; }
+
+    /**
+     * Wake up the waiting thread. Several signals before it has
+     * woken up count as one.
+     */
+    void signal();
+
+    /**
+     * Reset the event after waking up.
+     */
+    void clear();
+
+    /**
+     * Wait for the event and reset it.
+     *
+     * @param msecs The maximum time to wait, -1 for no limit.
+     *
+     * @returns true, if the event was signalled.
+     */
+    bool wait(int msecs = -1);
+
+private:
+    int rfd;
+    int wfd;
+};
+
+#endif
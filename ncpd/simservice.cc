@@ -0,0 +1,864 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <bufferstore.h>
+#include <psitime.h>
+#include <rfsv.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+#include "simservice.h"
+
+using namespace std;
+
+// RFSV32 commands, as in lib/rfsv32.h
+enum rfsvCommands {
+    CLOSE_HANDLE     = 0x01,
+    OPEN_DIR         = 0x10,
+    READ_DIR         = 0x12,
+    GET_DRIVE_LIST   = 0x13,
+    DRIVE_INFO       = 0x14,
+    SET_VOLUME_LABEL = 0x15,
+    OPEN_FILE        = 0x16,
+    TEMP_FILE        = 0x17,
+    READ_FILE        = 0x18,
+    WRITE_FILE       = 0x19,
+    SEEK_FILE        = 0x1a,
+    DELETE           = 0x1b,
+    REMOTE_ENTRY     = 0x1c,
+    FLUSH            = 0x1d,
+    SET_SIZE         = 0x1e,
+    RENAME           = 0x1f,
+    MK_DIR_ALL       = 0x20,
+    RM_DIR           = 0x21,
+    SET_ATT          = 0x22,
+    ATT              = 0x23,
+    SET_MODIFIED     = 0x24,
+    MODIFIED         = 0x25,
+    SET_SESSION_PATH = 0x26,
+    SESSION_PATH     = 0x27,
+    READ_WRITE_FILE  = 0x28,
+    CREATE_FILE      = 0x29,
+    REPLACE_FILE     = 0x2a,
+    PATH_TEST        = 0x2b,
+    LOCK             = 0x2d,
+    UNLOCK           = 0x2e,
+    OPEN_DIR_UID     = 0x2f,
+    DRIVE_NAME       = 0x30,
+    SET_DRIVE_NAME   = 0x31,
+    REPLACE          = 0x32
+};
+
+// RPCS commands, as in lib/rpcs.h
+enum rpcsCommands {
+    QUERY_NCP        = 0x00,
+    EXEC_PROG        = 0x01,
+    QUERY_DRIVE      = 0x02,
+    STOP_PROG        = 0x03,
+    QUERY_PROG       = 0x04,
+    FORMAT_OPEN      = 0x05,
+    FORMAT_READ      = 0x06,
+    GET_UNIQUEID     = 0x07,
+    GET_OWNERINFO    = 0x08,
+    GET_MACHINETYPE  = 0x09,
+    GET_CMDLINE      = 0x0a,
+    FUSER            = 0x0b,
+    GET_MACHINE_INFO = 0x64,
+    SET_TIME         = 0x6b,
+    QUIT_SERVER      = 0xff
+};
+
+struct commandName {
+    int cmd;
+    const char *name;
+};
+
+static const commandName rfsvNames[] = {
+    { CLOSE_HANDLE, "CLOSE_HANDLE" }, { OPEN_DIR, "OPEN_DIR" },
+    { READ_DIR, "READ_DIR" }, { GET_DRIVE_LIST, "GET_DRIVE_LIST" },
+    { DRIVE_INFO, "DRIVE_INFO" }, { SET_VOLUME_LABEL, "SET_VOLUME_LABEL" },
+    { OPEN_FILE, "OPEN_FILE" }, { TEMP_FILE, "TEMP_FILE" },
+    { READ_FILE, "READ_FILE" }, { WRITE_FILE, "WRITE_FILE" },
+    { SEEK_FILE, "SEEK_FILE" }, { DELETE, "DELETE" },
+    { REMOTE_ENTRY, "REMOTE_ENTRY" }, { FLUSH, "FLUSH" },
+    { SET_SIZE, "SET_SIZE" }, { RENAME, "RENAME" },
+    { MK_DIR_ALL, "MK_DIR_ALL" }, { RM_DIR, "RM_DIR" },
+    { SET_ATT, "SET_ATT" }, { ATT, "ATT" },
+    { SET_MODIFIED, "SET_MODIFIED" }, { MODIFIED, "MODIFIED" },
+    { SET_SESSION_PATH, "SET_SESSION_PATH" },
+    { SESSION_PATH, "SESSION_PATH" },
+    { READ_WRITE_FILE, "READ_WRITE_FILE" }, { CREATE_FILE, "CREATE_FILE" },
+    { REPLACE_FILE, "REPLACE_FILE" }, { PATH_TEST, "PATH_TEST" },
+    { LOCK, "LOCK" }, { UNLOCK, "UNLOCK" },
+    { OPEN_DIR_UID, "OPEN_DIR_UID" }, { DRIVE_NAME, "DRIVE_NAME" },
+    { SET_DRIVE_NAME, "SET_DRIVE_NAME" }, { REPLACE, "REPLACE" },
+    { -1, NULL }
+};
+
+static const commandName rpcsNames[] = {
+    { QUERY_NCP, "QUERY_NCP" }, { EXEC_PROG, "EXEC_PROG" },
+    { QUERY_DRIVE, "QUERY_DRIVE" }, { STOP_PROG, "STOP_PROG" },
+    { QUERY_PROG, "QUERY_PROG" }, { FORMAT_OPEN, "FORMAT_OPEN" },
+    { FORMAT_READ, "FORMAT_READ" }, { GET_UNIQUEID, "GET_UNIQUEID" },
+    { GET_OWNERINFO, "GET_OWNERINFO" },
+    { GET_MACHINETYPE, "GET_MACHINETYPE" },
+    { GET_CMDLINE, "GET_CMDLINE" }, { FUSER, "FUSER" },
+    { GET_MACHINE_INFO, "GET_MACHINE_INFO" }, { SET_TIME, "SET_TIME" },
+    { QUIT_SERVER, "QUIT_SERVER" },
+    { -1, NULL }
+};
+
+// EPOC attributes and error codes, as in lib/rfsv32.h
+#define EPOC_ATTR_RONLY      0x0001
+#define EPOC_ATTR_HIDDEN     0x0002
+#define EPOC_ATTR_SYSTEM     0x0004
+#define EPOC_ATTR_DIRECTORY  0x0010
+#define EPOC_ATTR_ARCHIVE    0x0020
+#define EPOC_OMODE_READ_WRITE 0x0200
+
+#define E_EPOC_NONE            0
+#define E_EPOC_NOT_FOUND      -1
+#define E_EPOC_GENERAL        -2
+#define E_EPOC_NOT_SUPPORTED  -5
+#define E_EPOC_ARGUMENT       -6
+#define E_EPOC_BAD_HANDLE     -8
+#define E_EPOC_ALREADY_EXISTS -11
+#define E_EPOC_PATH_NOT_FOUND -12
+#define E_EPOC_IN_USE         -14
+#define E_EPOC_NOT_READY      -18
+#define E_EPOC_ACCESS_DENIED  -21
+#define E_EPOC_EoF            -25
+#define E_EPOC_DISK_FULL      -26
+#define E_EPOC_BAD_NAME       -28
+
+#define RFSV_RESPONSE 0x11
+
+static int
+lookupCommand(const commandName *names, const string &name)
+{
+    for (int i = 0; names[i].name; i++)
+	if (!strcasecmp(names[i].name, name.c_str()))
+	    return names[i].cmd;
+    return -1;
+}
+
+static string
+delayKey(const string &service, int cmd)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), ":%d", cmd);
+    return service + buf;
+}
+
+bool serviceDelays::
+parse(const char *arg)
+{
+    string a = arg;
+    size_t eq = a.find('=');
+
+    if (eq == string::npos) {
+	defaultDelay = atol(arg) * 1000;
+	return true;
+    }
+    string cmd = a.substr(0, eq);
+    long d = atol(a.c_str() + eq + 1) * 1000;
+    string service;
+    size_t colon = cmd.find(':');
+    if (colon != string::npos) {
+	service = cmd.substr(0, colon);
+	cmd = cmd.substr(colon + 1);
+    }
+    int c;
+    if ((service.empty() || !strcasecmp(service.c_str(), "RFSV")) &&
+	((c = lookupCommand(rfsvNames, cmd)) >= 0)) {
+	delays[delayKey("RFSV", c)] = d;
+	return true;
+    }
+    if ((service.empty() || !strcasecmp(service.c_str(), "RPCS")) &&
+	((c = lookupCommand(rpcsNames, cmd)) >= 0)) {
+	delays[delayKey("RPCS", c)] = d;
+	return true;
+    }
+    return false;
+}
+
+long serviceDelays::
+get(const string &service, int cmd) const
+{
+    map<string, long>::const_iterator i = delays.find(delayKey(service, cmd));
+    return (i == delays.end()) ? defaultDelay : i->second;
+}
+
+static int32_t
+errno2epoc(int e)
+{
+    switch (e) {
+	case 0:
+	    return E_EPOC_NONE;
+	case ENOENT:
+	    return E_EPOC_NOT_FOUND;
+	case ENOTDIR:
+	    return E_EPOC_PATH_NOT_FOUND;
+	case EEXIST:
+	    return E_EPOC_ALREADY_EXISTS;
+	case EACCES:
+	case EPERM:
+	case EISDIR:
+	case EROFS:
+	    return E_EPOC_ACCESS_DENIED;
+	case ENOTEMPTY:
+	case EBUSY:
+	    return E_EPOC_IN_USE;
+	case ENOSPC:
+	    return E_EPOC_DISK_FULL;
+	case ENAMETOOLONG:
+	    return E_EPOC_BAD_NAME;
+	case EBADF:
+	    return E_EPOC_BAD_HANDLE;
+	case EINVAL:
+	    return E_EPOC_ARGUMENT;
+    }
+    return E_EPOC_GENERAL;
+}
+
+rfsvService::
+rfsvService(const serviceDelays *d, const string &_root)
+    : simService(d), root(_root), nextHandle(1)
+{
+    // Drive C: must always exist.
+    mkdir((root + "/C").c_str(), 0755);
+}
+
+rfsvService::
+~rfsvService()
+{
+    for (map<uint32_t, fileHandle>::iterator i = handles.begin();
+	 i != handles.end(); i++)
+	if (i->second.fd != -1)
+	    close(i->second.fd);
+}
+
+long rfsvService::
+handle(bufferStore &req, bufferStore &reply)
+{
+    reply.init();
+    if (req.getLen() < 4)
+	return 0;
+    int cmd = req.getWord(0);
+    int serial = req.getWord(2);
+    bufferStore data;
+    req.discardFirstBytes(4);
+    int32_t res = request(cmd, req, data);
+    reply.addWord(RFSV_RESPONSE);
+    reply.addWord(serial);
+    reply.addDWord(res);
+    reply.addBuff(data);
+    requests++;
+    return delays->get("RFSV", cmd);
+}
+
+bool rfsvService::
+getName(bufferStore &req, long &pos, string &name)
+{
+    if ((long)req.getLen() < pos + 2)
+	return false;
+    long len = req.getWord(pos);
+    pos += 2;
+    if ((long)req.getLen() < pos + len)
+	return false;
+    name.assign(req.getString(pos), len);
+    pos += len;
+    return true;
+}
+
+int32_t rfsvService::
+localPath(const string &name, string &path, bool mkdirs)
+{
+    string n = name;
+    char drive = 'C';
+
+    if ((n.size() >= 2) && (n[1] == ':')) {
+	drive = toupper(n[0]);
+	n.erase(0, 2);
+    }
+    if ((drive < 'A') || (drive > 'Z'))
+	return E_EPOC_BAD_NAME;
+    path = root + "/" + drive;
+    struct stat st;
+    if (stat(path.c_str(), &st) || !S_ISDIR(st.st_mode))
+	return E_EPOC_NOT_READY;
+
+    // EPOC names are case insensitive. Use an existing entry
+    // matching in any case, else the name as given.
+    vector<string> parts;
+    size_t p = 0;
+    while (p <= n.size()) {
+	size_t e = n.find('\\', p);
+	if (e == string::npos)
+	    e = n.size();
+	string c = n.substr(p, e - p);
+	if (c == "..")
+	    return E_EPOC_BAD_NAME;
+	if (!c.empty() && (c != "."))
+	    parts.push_back(c);
+	p = e + 1;
+    }
+    for (size_t i = 0; i < parts.size(); i++) {
+	string next = path + "/" + parts[i];
+	bool last = (i == parts.size() - 1);
+	if (lstat(next.c_str(), &st)) {
+	    DIR *d = opendir(path.c_str());
+	    if (d) {
+		struct dirent *de;
+		while ((de = readdir(d)))
+		    if (!strcasecmp(de->d_name, parts[i].c_str())) {
+			next = path + "/" + de->d_name;
+			break;
+		    }
+		closedir(d);
+	    }
+	    if (!last && lstat(next.c_str(), &st)) {
+		if (!mkdirs)
+		    return E_EPOC_PATH_NOT_FOUND;
+		if (mkdir(next.c_str(), 0755))
+		    return errno2epoc(errno);
+	    }
+	}
+	path = next;
+    }
+    return E_EPOC_NONE;
+}
+
+int32_t rfsvService::
+addEntry(const string &name, const string &path, bufferStore &reply)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st))
+	return errno2epoc(errno);
+
+    uint32_t attr = 0;
+    if (S_ISDIR(st.st_mode))
+	attr |= EPOC_ATTR_DIRECTORY;
+    else
+	attr |= EPOC_ATTR_ARCHIVE;
+    if (!(st.st_mode & S_IWUSR))
+	attr |= EPOC_ATTR_RONLY;
+    if (name[0] == '.')
+	attr |= EPOC_ATTR_HIDDEN;
+    PsiTime t(st.st_mtime);
+
+    reply.addDWord(0);
+    reply.addDWord(attr);
+    reply.addDWord(S_ISDIR(st.st_mode) ? 0 : st.st_size);
+    reply.addDWord(t.getPsiTimeLo());
+    reply.addDWord(t.getPsiTimeHi());
+    reply.addDWord(0);
+    reply.addDWord(0);
+    reply.addDWord(0);
+    reply.addDWord(name.size());
+    reply.addString(name.c_str());
+    while (reply.getLen() % 4)
+	reply.addByte(0);
+    return E_EPOC_NONE;
+}
+
+uint32_t rfsvService::
+newHandle(fileHandle &f)
+{
+    uint32_t h = nextHandle++;
+    if (nextHandle == 0)
+	nextHandle = 1;
+    f.pos = 0;
+    handles[h] = f;
+    return h;
+}
+
+rfsvService::fileHandle *rfsvService::
+getHandle(uint32_t h, bool file)
+{
+    map<uint32_t, fileHandle>::iterator i = handles.find(h);
+    if ((i == handles.end()) || ((i->second.fd != -1) != file))
+	return NULL;
+    return &i->second;
+}
+
+int32_t rfsvService::
+openDir(uint32_t attr, const string &name, uint32_t &h)
+{
+    string n = name;
+    string pattern = "*";
+    size_t bs = n.rfind('\\');
+    if (bs != string::npos) {
+	if (bs + 1 < n.size())
+	    pattern = n.substr(bs + 1);
+	n.erase(bs + 1);
+    }
+    string path;
+    int32_t res = localPath(n, path);
+    if (res != E_EPOC_NONE)
+	return res;
+    DIR *d = opendir(path.c_str());
+    if (!d)
+	return errno2epoc(errno);
+
+    fileHandle f;
+    f.fd = -1;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	if ((pattern != "*") && (pattern != "*.*") &&
+	    strcasecmp(pattern.c_str(), de->d_name))
+	    continue;
+	if ((de->d_name[0] == '.') && !(attr & EPOC_ATTR_HIDDEN))
+	    continue;
+	dirEntry e;
+	e.name = de->d_name;
+	e.path = path + "/" + de->d_name;
+	if (!(attr & EPOC_ATTR_DIRECTORY)) {
+	    struct stat st;
+	    if (!stat(e.path.c_str(), &st) && S_ISDIR(st.st_mode))
+		continue;
+	}
+	f.entries.push_back(e);
+    }
+    closedir(d);
+    h = newHandle(f);
+    return E_EPOC_NONE;
+}
+
+int32_t rfsvService::
+openFile(int flags, const string &name, uint32_t &h)
+{
+    string path;
+    int32_t res = localPath(name, path);
+    if (res != E_EPOC_NONE)
+	return res;
+    struct stat st;
+    if (!stat(path.c_str(), &st) && S_ISDIR(st.st_mode))
+	return E_EPOC_ACCESS_DENIED;
+    fileHandle f;
+    f.fd = open(path.c_str(), flags, 0644);
+    if (f.fd == -1)
+	return errno2epoc(errno);
+    h = newHandle(f);
+    return E_EPOC_NONE;
+}
+
+int32_t rfsvService::
+driveInfo(int drive, bufferStore &reply)
+{
+    if ((drive < 0) || (drive > 25))
+	return E_EPOC_ARGUMENT;
+    string path = root + "/" + (char)('A' + drive);
+    struct statvfs sv;
+    if (statvfs(path.c_str(), &sv))
+	return E_EPOC_NOT_READY;
+    unsigned long long size = (unsigned long long)sv.f_blocks * sv.f_frsize;
+    unsigned long long space = (unsigned long long)sv.f_bavail * sv.f_frsize;
+    string name = "Sim";
+    name += (char)('A' + drive);
+
+    reply.addDWord((drive == 2) ? 5 : 3); // RAM or disk
+    reply.addDWord(0);
+    reply.addDWord(0);
+    reply.addDWord(0);
+    reply.addDWord(0x5349 + drive);
+    reply.addDWord(size & 0xffffffff);
+    reply.addDWord(size >> 32);
+    reply.addDWord(space & 0xffffffff);
+    reply.addDWord(space >> 32);
+    reply.addDWord(name.size());
+    reply.addString(name.c_str());
+    return E_EPOC_NONE;
+}
+
+int32_t rfsvService::
+request(int cmd, bufferStore &req, bufferStore &reply)
+{
+    string name;
+    string path;
+    long pos = 0;
+    int32_t res;
+    uint32_t h;
+    fileHandle *f;
+
+    switch (cmd) {
+	case CLOSE_HANDLE:
+	    if (req.getLen() < 4)
+		return E_EPOC_ARGUMENT;
+	    h = req.getDWord(0);
+	    if (handles.find(h) == handles.end())
+		return E_EPOC_BAD_HANDLE;
+	    if (handles[h].fd != -1)
+		close(handles[h].fd);
+	    handles.erase(h);
+	    return E_EPOC_NONE;
+
+	case OPEN_DIR:
+	    pos = 4;
+	    if ((req.getLen() < 4) || !getName(req, pos, name))
+		return E_EPOC_ARGUMENT;
+	    if ((res = openDir(req.getDWord(0), name, h)) == E_EPOC_NONE)
+		reply.addDWord(h);
+	    return res;
+
+	case READ_DIR:
+	    if ((req.getLen() < 4) || !(f = getHandle(req.getDWord(0), false)))
+		return E_EPOC_BAD_HANDLE;
+	    if (f->pos >= f->entries.size())
+		return E_EPOC_EoF;
+	    // Pack as many entries as fit into one reply
+	    while ((f->pos < f->entries.size()) &&
+		   (reply.getLen() < RFSV_SENDLEN - 300)) {
+		dirEntry &e = f->entries[f->pos++];
+		addEntry(e.name, e.path, reply);
+	    }
+	    return E_EPOC_NONE;
+
+	case GET_DRIVE_LIST:
+	    for (int i = 0; i < 26; i++) {
+		struct stat st;
+		string p = root + "/" + (char)('A' + i);
+		reply.addByte((!stat(p.c_str(), &st) && S_ISDIR(st.st_mode)) ?
+			      1 : 0);
+	    }
+	    return E_EPOC_NONE;
+
+	case DRIVE_INFO:
+	    if (req.getLen() < 4)
+		return E_EPOC_ARGUMENT;
+	    return driveInfo(req.getDWord(0), reply);
+
+	case OPEN_FILE:
+	case CREATE_FILE:
+	case REPLACE_FILE: {
+	    pos = 4;
+	    if ((req.getLen() < 4) || !getName(req, pos, name))
+		return E_EPOC_ARGUMENT;
+	    int flags = (req.getDWord(0) & EPOC_OMODE_READ_WRITE) ?
+		O_RDWR : O_RDONLY;
+	    if (cmd == CREATE_FILE)
+		flags = O_RDWR | O_CREAT | O_EXCL;
+	    else if (cmd == REPLACE_FILE)
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	    if ((res = openFile(flags, name, h)) == E_EPOC_NONE)
+		reply.addDWord(h);
+	    return res;
+	}
+
+	case TEMP_FILE: {
+	    string tmp = root + "/C/TMPXXXXXX";
+	    vector<char> buf(tmp.begin(), tmp.end());
+	    buf.push_back(0);
+	    fileHandle nf;
+	    nf.fd = mkstemp(&buf[0]);
+	    if (nf.fd == -1)
+		return errno2epoc(errno);
+	    name = string("C:\\") + (strrchr(&buf[0], '/') + 1);
+	    reply.addDWord(newHandle(nf));
+	    reply.addWord(name.size());
+	    reply.addStringT(name.c_str());
+	    return E_EPOC_NONE;
+	}
+
+	case READ_FILE: {
+	    if ((req.getLen() < 8) || !(f = getHandle(req.getDWord(0))))
+		return E_EPOC_BAD_HANDLE;
+	    uint32_t len = req.getDWord(4);
+	    if (len > 16 * RFSV_SENDLEN)
+		len = 16 * RFSV_SENDLEN;
+	    vector<unsigned char> buf(len + 1);
+	    int n = read(f->fd, &buf[0], len);
+	    if (n < 0)
+		return errno2epoc(errno);
+	    reply.addBytes(&buf[0], n);
+	    return E_EPOC_NONE;
+	}
+
+	case WRITE_FILE: {
+	    if ((req.getLen() < 4) || !(f = getHandle(req.getDWord(0))))
+		return E_EPOC_BAD_HANDLE;
+	    long len = req.getLen() - 4;
+	    if ((len > 0) && (write(f->fd, req.getString(4), len) != len))
+		return errno2epoc(errno);
+	    return E_EPOC_NONE;
+	}
+
+	case SEEK_FILE: {
+	    if ((req.getLen() < 12) || !(f = getHandle(req.getDWord(4))))
+		return E_EPOC_BAD_HANDLE;
+	    int whence;
+	    switch (req.getDWord(8)) {
+		case 1:
+		    whence = SEEK_SET;
+		    break;
+		case 2:
+		    whence = SEEK_CUR;
+		    break;
+		case 3:
+		    whence = SEEK_END;
+		    break;
+		default:
+		    return E_EPOC_ARGUMENT;
+	    }
+	    off_t o = lseek(f->fd, (int32_t)req.getDWord(0), whence);
+	    if (o == (off_t)-1)
+		return errno2epoc(errno);
+	    reply.addDWord(o);
+	    return E_EPOC_NONE;
+	}
+
+	case SET_SIZE:
+	    if ((req.getLen() < 8) || !(f = getHandle(req.getDWord(0))))
+		return E_EPOC_BAD_HANDLE;
+	    if (ftruncate(f->fd, req.getDWord(4)))
+		return errno2epoc(errno);
+	    return E_EPOC_NONE;
+
+	case READ_WRITE_FILE: {
+	    if (req.getLen() < 12)
+		return E_EPOC_ARGUMENT;
+	    fileHandle *to = getHandle(req.getDWord(4));
+	    fileHandle *from = getHandle(req.getDWord(8));
+	    if (!to || !from)
+		return E_EPOC_BAD_HANDLE;
+	    uint32_t len = req.getDWord(0);
+	    uint32_t done = 0;
+	    char buf[8192];
+	    while (done < len) {
+		int n = read(from->fd, buf, min((uint32_t)sizeof(buf),
+						len - done));
+		if (n < 0)
+		    return errno2epoc(errno);
+		if (n == 0)
+		    break;
+		if (write(to->fd, buf, n) != n)
+		    return errno2epoc(errno);
+		done += n;
+	    }
+	    reply.addDWord(done);
+	    return E_EPOC_NONE;
+	}
+
+	case FLUSH:
+	case LOCK:
+	case UNLOCK:
+	    if ((req.getLen() < 4) || !getHandle(req.getDWord(0)))
+		return E_EPOC_BAD_HANDLE;
+	    return E_EPOC_NONE;
+
+	case DELETE:
+	case RM_DIR:
+	case MK_DIR_ALL:
+	case PATH_TEST:
+	case ATT:
+	case MODIFIED:
+	case REMOTE_ENTRY: {
+	    if (!getName(req, pos, name))
+		return E_EPOC_ARGUMENT;
+	    if ((cmd == RM_DIR) || (cmd == MK_DIR_ALL))
+		while (!name.empty() && (name[name.size() - 1] == '\\'))
+		    name.erase(name.size() - 1);
+	    if ((res = localPath(name, path, cmd == MK_DIR_ALL)) !=
+		E_EPOC_NONE)
+		return res;
+	    struct stat st;
+	    if (cmd == MK_DIR_ALL)
+		return errno2epoc(mkdir(path.c_str(), 0755) ? errno : 0);
+	    if (stat(path.c_str(), &st))
+		return errno2epoc(errno);
+	    switch (cmd) {
+		case DELETE:
+		    if (S_ISDIR(st.st_mode))
+			return E_EPOC_ACCESS_DENIED;
+		    return errno2epoc(unlink(path.c_str()) ? errno : 0);
+		case RM_DIR:
+		    return errno2epoc(rmdir(path.c_str()) ? errno : 0);
+		case ATT: {
+		    bufferStore e;
+		    addEntry(path.substr(path.rfind('/') + 1), path, e);
+		    reply.addDWord(e.getDWord(4));
+		    return E_EPOC_NONE;
+		}
+		case MODIFIED: {
+		    PsiTime t(st.st_mtime);
+		    reply.addDWord(t.getPsiTimeLo());
+		    reply.addDWord(t.getPsiTimeHi());
+		    return E_EPOC_NONE;
+		}
+		case REMOTE_ENTRY: {
+		    size_t bs = path.rfind('/');
+		    return addEntry(path.substr(bs + 1), path, reply);
+		}
+	    }
+	    return E_EPOC_NONE;
+	}
+
+	case RENAME:
+	case REPLACE: {
+	    string to;
+	    string toPath;
+	    if (!getName(req, pos, name) || !getName(req, pos, to))
+		return E_EPOC_ARGUMENT;
+	    if (((res = localPath(name, path)) != E_EPOC_NONE) ||
+		((res = localPath(to, toPath)) != E_EPOC_NONE))
+		return res;
+	    struct stat st;
+	    if ((cmd == RENAME) && !lstat(toPath.c_str(), &st) &&
+		strcasecmp(path.c_str(), toPath.c_str()))
+		return E_EPOC_ALREADY_EXISTS;
+	    return errno2epoc(::rename(path.c_str(), toPath.c_str()) ?
+			      errno : 0);
+	}
+
+	case SET_ATT: {
+	    pos = 8;
+	    if ((req.getLen() < 8) || !getName(req, pos, name))
+		return E_EPOC_ARGUMENT;
+	    if ((res = localPath(name, path)) != E_EPOC_NONE)
+		return res;
+	    struct stat st;
+	    if (stat(path.c_str(), &st))
+		return errno2epoc(errno);
+	    mode_t mode = st.st_mode & 07777;
+	    if (req.getDWord(0) & EPOC_ATTR_RONLY)
+		mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	    if (req.getDWord(4) & EPOC_ATTR_RONLY)
+		mode |= S_IWUSR;
+	    return errno2epoc(chmod(path.c_str(), mode) ? errno : 0);
+	}
+
+	case SET_MODIFIED: {
+	    pos = 8;
+	    if ((req.getLen() < 8) || !getName(req, pos, name))
+		return E_EPOC_ARGUMENT;
+	    if ((res = localPath(name, path)) != E_EPOC_NONE)
+		return res;
+	    PsiTime t(req.getDWord(4), req.getDWord(0));
+	    struct timeval tv[2];
+	    tv[0] = tv[1] = t.getTimeval();
+	    return errno2epoc(utimes(path.c_str(), tv) ? errno : 0);
+	}
+    }
+    return E_EPOC_NOT_SUPPORTED;
+}
+
+long rpcsService::
+handle(bufferStore &req, bufferStore &reply)
+{
+    reply.init();
+    if (req.getLen() < 1)
+	return 0;
+    int cmd = req.getByte(0);
+    requests++;
+
+    switch (cmd) {
+	case QUERY_NCP:
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    reply.addByte(6);
+	    reply.addByte(0);
+	    break;
+	case GET_MACHINETYPE:
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    reply.addWord(32); // Series 5
+	    break;
+	case GET_OWNERINFO:
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    reply.addString("Simulated Psion\006plptools");
+	    break;
+	case GET_MACHINE_INFO: {
+	    bufferStore mi;
+	    struct timeval tv;
+	    gettimeofday(&tv, NULL);
+	    PsiTime t(&tv);
+	    mi.addDWord(32);              // 0: machine type
+	    mi.addByte(1);                // 4: ROM version
+	    mi.addByte(0);
+	    mi.addWord(100);
+	    while (mi.getLen() < 16)
+		mi.addByte(0);
+	    mi.addString("SERIES5");      // 16: machine name
+	    while (mi.getLen() < 32)
+		mi.addByte(0);
+	    mi.addDWord(640);             // 32: display
+	    mi.addDWord(240);
+	    mi.addDWord(0x12345678);      // 40: UID
+	    mi.addDWord(0);
+	    mi.addDWord(t.getPsiTimeLo()); // 48: time
+	    mi.addDWord(t.getPsiTimeHi());
+	    while (mi.getLen() < 80)
+		mi.addByte(0);
+	    mi.addDWord(3);               // 80: main battery good
+	    while (mi.getLen() < 108)
+		mi.addByte(0);
+	    mi.addDWord(3);               // 108: backup battery good
+	    while (mi.getLen() < 136)
+		mi.addByte(0);
+	    mi.addDWord(16 << 20);        // 136: RAM
+	    mi.addDWord(12 << 20);        // 140: ROM
+	    mi.addDWord(8 << 20);         // 144: max free RAM
+	    mi.addDWord(8 << 20);         // 148: free RAM
+	    while (mi.getLen() < 164)
+		mi.addByte(0);
+	    mi.addDWord(1);               // 164: English
+	    while (mi.getLen() < 256)
+		mi.addByte(0);
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    reply.addBuff(mi);
+	    break;
+	}
+	case QUERY_DRIVE:
+	    // No programs running; the status is the last byte here.
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    break;
+	case GET_UNIQUEID:
+	case QUERY_PROG:
+	case STOP_PROG:
+	case GET_CMDLINE:
+	    reply.addByte(rfsv::E_PSI_FILE_NXIST);
+	    break;
+	case FUSER:
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    reply.addByte(0);
+	    break;
+	case EXEC_PROG:
+	case SET_TIME:
+	case QUIT_SERVER:
+	    reply.addByte(rfsv::E_PSI_GEN_NONE);
+	    break;
+	default:
+	    reply.addByte(rfsv::E_PSI_GEN_NSUP);
+	    break;
+    }
+    return delays->get("RPCS", cmd);
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _SIMSERVICE_H_
+#define _SIMSERVICE_H_
+
+#include <string>
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+
+class bufferStore;
+
+/**
+ * Service times of the emulated Psion servers, per command.
+ */
+class serviceDelays {
+public:
+    serviceDelays() : defaultDelay(0) {}
+
+    /**
+     * Set the delay for a command, given as
+     * [SERVICE:]COMMAND=MS or just MS for all commands.
+     *
+     * @returns false, if the command is unknown.
+     */
+    bool parse(const char *arg);
+
+    /**
+     * Return the delay in microseconds for a command of a service.
+     */
+    long get(const std::string &service, int cmd) const;
+
+private:
+    long defaultDelay;
+    std::map<std::string, long> delays;
+};
+
+/**
+ * A server running on the emulated Psion, answering the requests
+ * a client sends on one NCP channel.
+ */
+class simService {
+public:
+    simService(const serviceDelays *d) : delays(d), requests(0) {}
+    virtual ~simService() {}
+
+    /**
+     * Handle a request and fill in the reply.
+     *
+     * @returns the time in microseconds, the Psion needs for the
+     * request, after which the reply is sent.
+     */
+    virtual long handle(bufferStore &req, bufferStore &reply) = 0;
+
+    unsigned long getRequests() { return requests; }
+
+protected:
+    const serviceDelays *delays;
+    unsigned long requests;
+};
+
+/**
+ * SYS$RFSV of an EPOC Psion, serving a local directory. Every
+ * subdirectory with a single letter name is a drive; drive C:
+ * is always present.
+ */
+class rfsvService : public simService {
+public:
+    rfsvService(const serviceDelays *d, const std::string &root);
+    ~rfsvService();
+
+    long handle(bufferStore &req, bufferStore &reply);
+
+private:
+    struct dirEntry {
+	std::string name;
+	std::string path;
+    };
+    struct fileHandle {
+	int fd;
+	std::vector<dirEntry> entries;
+	size_t pos;
+    };
+
+    int32_t request(int cmd, bufferStore &req, bufferStore &reply);
+    bool getName(bufferStore &req, long &pos, std::string &name);
+    int32_t localPath(const std::string &name, std::string &path,
+		      bool mkdirs = false);
+    int32_t addEntry(const std::string &name, const std::string &path,
+		     bufferStore &reply);
+    int32_t openDir(uint32_t attr, const std::string &name, uint32_t &h);
+    int32_t openFile(int flags, const std::string &name, uint32_t &h);
+    uint32_t newHandle(fileHandle &f);
+    fileHandle *getHandle(uint32_t h, bool file = true);
+    int32_t driveInfo(int drive, bufferStore &reply);
+
+    std::string root;
+    std::map<uint32_t, fileHandle> handles;
+    uint32_t nextHandle;
+};
+
+/**
+ * SYS$RPCS of an EPOC Psion with no running programs.
+ */
+class rpcsService : public simService {
+public:
+    rpcsService(const serviceDelays *d) : simService(d) {}
+
+    long handle(bufferStore &req, bufferStore &reply);
+};
+
+#endif
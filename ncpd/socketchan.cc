@@ -21,31 +21,52 @@
 #include "config.h"
 
 #include <string>
+#include <sstream>
+#include <utility>
 
 #include <ppsocket.h>
+#include <iowatch.h>
 #include <rfsv.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "socketchan.h"
+#include "chanpool.h"
 #include "ncp.h"
 #include "main.h"
 
 using namespace std;
 
-socketChan:: socketChan(ppsocket * _skt, ncp * _ncpController):
+socketChan:: socketChan(ppsocket * _skt, ncp * _ncpController, IOWatch *_iow,
+			chanPool *_pool):
     channel(_ncpController)
 {
     skt = _skt;
+    iow = _iow;
+    pool = _pool;
     registerName = 0;
     connectTry = 0;
     connected = false;
+    pthread_mutex_init(&outMutex, NULL);
+    outOffset = 0;
+    outBytes = 0;
+    xoffSent = false;
+    outMax = 0;
+    writeWatched = false;
+    outFailed = false;
+    closed = false;
 }
 
 socketChan::~socketChan()
 {
+    ncpRelease();
+    // Last chance for e.g. a final NAK to get out
+    flushOutput();
     skt->closeSocket();
+    pthread_mutex_destroy(&outMutex);
     delete skt;
     skt = 0;
     if (registerName)
@@ -56,11 +77,115 @@ void socketChan::
 ncpDataCallback(bufferStore & a)
 {
     if (registerName != 0) {
-	skt->sendBufferStore(a);
+	queueOutput(a);
     } else
 	lerr << "socketchan: Connect without name!!!\n";
 }
 
+void socketChan::
+queueOutput(const bufferStore &a)
+{
+    // Data for the client is never sent blocking, as this is called
+    // from the NCP as well: a slow client must not stall the link.
+    uint32_t hl = htonl(a.getLen());
+    bufferStore b;
+    b.addBytes(reinterpret_cast<const unsigned char *>(&hl), sizeof(hl));
+    b.addBuff(a);
+
+    pthread_mutex_lock(&outMutex);
+    if (!outFailed) {
+	if (outBytes + b.getLen() > OUT_MAX) {
+	    lerr << "socketchan: client does not read, dropping it" << endl;
+	    outFailed = true;
+	} else {
+	    outBytes += b.getLen();
+	    if (outBytes > outMax)
+		outMax = outBytes;
+	    outQueue.append(std::move(b));
+	}
+    }
+    pthread_mutex_unlock(&outMutex);
+    flushOutput();
+}
+
+void socketChan::
+flushOutput()
+{
+    bool stop = false;
+    bool resume = false;
+
+    pthread_mutex_lock(&outMutex);
+    while (!outQueue.empty() && !outFailed) {
+	bufferStore &b = outQueue[0];
+	int res = skt->sendNoWait(b.getString(outOffset),
+				  b.getLen() - outOffset);
+	if (res < 0)
+	    outFailed = true;
+	if (res <= 0)
+	    break;
+	outOffset += res;
+	outBytes -= res;
+	sentBytes.add(res);
+	if (outOffset == b.getLen()) {
+	    outQueue.pop();
+	    outOffset = 0;
+	}
+    }
+    if (outFailed) {
+	outQueue.clear();
+	outOffset = outBytes = 0;
+    }
+    // Throttle the Psion while the client lags behind.
+    if (!xoffSent && (outBytes > OUT_HIGH_WATER)) {
+	stop = xoffSent = true;
+	clock_gettime(CLOCK_MONOTONIC, &xoffStamp);
+	xoffs.add();
+    } else if (xoffSent && (outBytes < OUT_LOW_WATER)) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	xoffHist.add((now.tv_sec - xoffStamp.tv_sec) * 1000000L +
+		     (now.tv_nsec - xoffStamp.tv_nsec) / 1000);
+	xoffSent = false;
+	resume = true;
+    }
+    bool pending = (outBytes > 0) || outFailed;
+    pthread_mutex_unlock(&outMutex);
+
+    if (stop || resume) {
+	if (verbose)
+	    lout << "socketchan: " << (stop ? "XOFF" : "XON") << endl;
+	ncpFlowControl(stop);
+    }
+    // Have the main loop start watching for the socket to become
+    // writable (or drop the client).
+    if (pending && !writeWatched)
+	iow->wakeup();
+}
+
+bool socketChan::
+hasOutput()
+const {
+    pthread_mutex_lock(&outMutex);
+    bool res = (outBytes > 0) || outFailed;
+    pthread_mutex_unlock(&outMutex);
+    return res;
+}
+
+void socketChan::
+getStats(ostream &s, const string &prefix)
+{
+    pthread_mutex_lock(&outMutex);
+    long queued = outBytes;
+    long maxQueued = outMax;
+    pthread_mutex_unlock(&outMutex);
+
+    s << prefix << ".client_queue " << queued << "\n";
+    s << prefix << ".client_queue_max " << maxQueued << "\n";
+    s << prefix << ".client_bytes " << sentBytes.get() << "\n";
+    s << prefix << ".client_xoffs " << xoffs.get() << "\n";
+    xoffHist.print(s, prefix + ".client_xoff");
+}
+
 const char *socketChan::
 getNcpRegisterName()
 {
@@ -92,7 +217,7 @@ ncpCommand(bufferStore & a)
 		a.addStringT("Unknown!");
 		break;
 	}
-	skt->sendBufferStore(a);
+	queueOutput(a);
 	ok = true;
     } else if (!strncmp(str, "CONN", 4)) {
 	// Connect to a channel that was placed in 'pending' mode, by
@@ -116,7 +241,25 @@ ncpCommand(bufferStore & a)
 	a.init();
 	a.addByte(rfsv::E_PSI_GEN_NONE);
 	a.addDWord(ncpGetSpeed());
-	skt->sendBufferStore(a);
+	queueOutput(a);
+	ok = true;
+    } else if (!strncmp(str, "QLEN", 4)) {
+	// Get transmit queue status of all channels
+	a.init();
+	a.addByte(rfsv::E_PSI_GEN_NONE);
+	ncpGetQueueStatus(a);
+	queueOutput(a);
+	ok = true;
+    } else if (!strncmp(str, "STAT", 4)) {
+	// Get statistics of link and channels as "key value" lines
+	ostringstream s;
+	ncpGetStats(s);
+	if (pool)
+	    pool->getStats(s);
+	a.init();
+	a.addByte(rfsv::E_PSI_GEN_NONE);
+	a.addStringT(s.str().c_str());
+	queueOutput(a);
 	ok = true;
     } else if (!strncmp(str, "REGS", 4)) {
 	// Register a server-process on the PC side.
@@ -128,14 +271,14 @@ ncpCommand(bufferStore & a)
 	    ncpRegisterPcServer(skt, name);
 	    a.addByte(rfsv::E_PSI_GEN_NONE);
 	}
-	skt->sendBufferStore(a);
+	queueOutput(a);
 	ok = true;
     }
     if (!ok) {
 	lerr << "socketChan:: received unknown NCP command (" << a << ")" << endl;
 	a.init();
 	a.addByte(rfsv::E_PSI_GEN_NSUP);
-	skt->sendBufferStore(a);
+	queueOutput(a);
     }
     return ok;
 }
@@ -144,11 +287,12 @@ ncpCommand(bufferStore & a)
 void socketChan::
 ncpConnectAck()
 {
-    bufferStore a;
-    a.addStringT("Ok");
-    skt->sendBufferStore(a);
+    // The client may start sending as soon as it sees the reply.
     connected = true;
     connectTry = 3;
+    bufferStore a;
+    a.addStringT("Ok");
+    queueOutput(a);
 }
 
 void socketChan::
@@ -156,7 +300,7 @@ ncpConnectTerminate()
 {
     bufferStore a;
     a.addStringT("NAK");
-    skt->sendBufferStore(a);
+    queueOutput(a);
     ncpDisconnect();
 }
 
@@ -184,9 +328,30 @@ socketPoll()
 {
     int res;
 
+    if (closed)
+	return;
+    flushOutput();
+    if (outFailed) {
+	closed = true;
+	if (connected)
+	    ncpDisconnect();
+	else
+	    terminateWhenAsked();
+	skt->closeSocket();
+	return;
+    }
+    bool want = hasOutput();
+    if (want != writeWatched) {
+	skt->watchWrite(want);
+	writeWatched = want;
+    }
+
     if (registerName == 0) {
 	bufferStore a;
 	res = skt->getBufferStore(a, false);
+	// The main loop does not see messages read ahead with this one.
+	if (skt->hasBuffered())
+	    iow->wakeup();
 	switch (res) {
 	    case 1:
 		// A client has connected, and is announcing who it
@@ -232,6 +397,10 @@ socketPoll()
 		registerName = strdup(a.getString());
 		connectTry++;
 
+		// A channel connected ahead of time answers at once.
+		if (pool && pool->take(registerName, this))
+		    break;
+
 		// If this is SYS$RFSV, we immediately connect. In all
 		// other cases, we first perform a registration. Connect
 		// is then triggered by RegisterAck and uses the name
@@ -249,6 +418,9 @@ socketPoll()
     } else if (connected) {
 	bufferStore a;
 	res = skt->getBufferStore(a, false);
+	// The main loop does not see messages read ahead with this one.
+	if (skt->hasBuffered())
+	    iow->wakeup();
 	if (res == -1) {
 	    ncpDisconnect();
 	    skt->closeSocket();
@@ -261,6 +433,11 @@ socketPoll()
 	    }
 	    ncpSend(a);
 	}
+    } else if (skt->isReady()) {
+	// The client waits for our reply to its connect request, so
+	// the socket only becomes readable if the client has gone away.
+	ncpDisconnect();
+	skt->closeSocket();
     } else if (time(0) > (tryStamp + 15))
 	terminateWhenAsked();
 }
@@ -270,3 +447,10 @@ isConnected()
 const {
     return connected;
 }
+
+bool socketChan::
+socketReady()
+const {
+    return skt->isReady() || skt->isWritable() ||
+	(hasOutput() != writeWatched);
+}
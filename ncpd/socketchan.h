@@ -22,12 +22,22 @@
 #define _socketchan_h_
 
 #include "config.h"
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "bufferarray.h"
 #include "channel.h"
+#include "stats.h"
 class ppsocket;
+class IOWatch;
+class chanPool;
 
 class socketChan : public channel {
 public:
-  socketChan(ppsocket* comms, ncp* ncpController);
+  socketChan(ppsocket* comms, ncp* ncpController, IOWatch *iow,
+	     chanPool *pool = NULL);
   virtual ~socketChan();
 
   void ncpDataCallback(bufferStore& a);
@@ -39,15 +49,44 @@ public:
   void ncpConnectNak();
 
   bool isConnected() const;
+  bool socketReady() const;
   void socketPoll();
+  void getStats(std::ostream &s, const std::string &prefix);
 private:
   enum protocolVersionType { PV_SERIES_5 = 6, PV_SERIES_3 = 3 };
+  // Limits for data queued to the client, in bytes
+  enum outputLimits {
+    OUT_LOW_WATER = 16384,   // send XON below this
+    OUT_HIGH_WATER = 65536,  // send XOFF above this
+    OUT_MAX = 1048576        // drop the client above this
+  };
   bool ncpCommand(bufferStore &a);
+  void queueOutput(const bufferStore &a);
+  void flushOutput();
+  bool hasOutput() const;
   ppsocket* skt;
+  IOWatch *iow;
+  chanPool *pool;
+  bufferArray outQueue;
+  mutable pthread_mutex_t outMutex;
+  unsigned long outOffset;
+  long outBytes;
+  bool xoffSent;
+  long outMax;
+  struct timespec xoffStamp;
+  statCounter xoffs;
+  statCounter sentBytes;
+  statHistogram xoffHist;
+  // Shared between the main loop and the NCP callbacks on the pump
+  // thread, outFailed is only changed under outMutex.
+  std::atomic<bool> writeWatched;
+  std::atomic<bool> outFailed;
+  std::atomic<bool> closed;
   char* registerName;
-  bool connected;
-  int connectTry;
-  int tryStamp;
+  // Set by the NCP callbacks on the pump thread as well
+  std::atomic<bool> connected;
+  std::atomic<int> connectTry;
+  std::atomic<int> tryStamp;
 };
 
 #endif
@@ -0,0 +1,69 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include "config.h"
+
+#include <string>
+
+#include "stats.h"
+
+using namespace std;
+
+statHistogram::statHistogram()
+    : max(0)
+{
+}
+
+void statHistogram::
+add(long usecs)
+{
+    if (usecs < 0)
+	usecs = 0;
+    int b = 0;
+    for (long ms = usecs / 1000; ms && (b < STAT_HIST_BUCKETS - 1); ms >>= 1)
+	b++;
+    bucket[b].add();
+    count.add();
+    sum.add(usecs);
+    long m = max.load(memory_order_relaxed);
+    while ((usecs > m) &&
+	   !max.compare_exchange_weak(m, usecs, memory_order_relaxed))
+	;
+}
+
+void statHistogram::
+reset()
+{
+    for (int i = 0; i < STAT_HIST_BUCKETS; i++)
+	bucket[i].reset();
+    count.reset();
+    sum.reset();
+    max.store(0, memory_order_relaxed);
+}
+
+void statHistogram::
+print(ostream &s, const string &name) const
+{
+    unsigned long n = count.get();
+    s << name << ".count " << n << "\n";
+    s << name << ".avg_us " << (n ? (sum.get() / n) : 0) << "\n";
+    s << name << ".max_us " << max.load(memory_order_relaxed) << "\n";
+    s << name << ".hist_ms";
+    for (int i = 0; i < STAT_HIST_BUCKETS; i++)
+	s << " " << bucket[i].get();
+    s << "\n";
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _stats_h_
+#define _stats_h_
+
+#include "config.h"
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+/**
+ * An event counter, which may be updated from any
+ * thread without locking.
+ */
+class statCounter {
+public:
+    statCounter() : val(0) {}
+
+    /**
+     * Add to the counter.
+     *
+     * @param n The amount to add.
+     */
+    void add(unsigned long n = 1) {
+	val.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /**
+     * Get the current value.
+     */
+    unsigned long get() const {
+	return val.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Reset the counter to 0.
+     */
+    void reset() {
+	val.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<unsigned long> val;
+};
+
+#define STAT_HIST_BUCKETS 16
+
+/**
+ * A histogram of durations, which may be updated from
+ * any thread without locking.
+ *
+ * Bucket 0 counts durations below 1ms, bucket n those from
+ * 2^(n-1)ms up to 2^n ms. The last bucket also takes
+ * everything longer.
+ */
+class statHistogram {
+public:
+    statHistogram();
+
+    /**
+     * Record a duration.
+     *
+     * @param usecs The duration in microseconds.
+     */
+    void add(long usecs);
+
+    /**
+     * Reset all buckets.
+     */
+    void reset();
+
+    /**
+     * Print the histogram as lines of the form "name.key value".
+     *
+     * @param s The stream to print on.
+     * @param name The name of the histogram.
+     */
+    void print(std::ostream &s, const std::string &name) const;
+
+private:
+    statCounter bucket[STAT_HIST_BUCKETS];
+    statCounter count;
+    statCounter sum;
+    std::atomic<long> max;
+};
+
+#endif
@@ -343,6 +343,7 @@ help()
 	"    -h, --help              Display this text\n"
 	"    -V, --version           Print version and exit\n"
 	"    -p, --port=[HOST:]PORT  Connect to port PORT on host HOST\n"
+	"        --port=unix:PATH    Connect to the Unix domain socket PATH\n"
 	"                            Default for HOST is 127.0.0.1\n"
 	"                            Default for PORT is "
 	) << DPORT << "\n\n";
@@ -361,6 +362,11 @@ parse_destination(const char *arg, const char **host, int *port)
 {
     if (!arg)
 	return;
+    if (!strncmp(arg, "unix:", 5)) {
+	// unix:/run/ncpd.socket
+	*host = arg;
+	return;
+    }
     // We don't want to modify argv, therefore copy it first ...
     char *argcpy = strdup(arg);
     char *pp = strchr(argcpy, ':');
@@ -281,7 +281,7 @@ ps_bitmap(FILE *f, unsigned long llx, unsigned long lly, unsigned long urx,
 }
 
 static void
-convertPage(FILE *f, int page, bool last, bufferStore buf)
+convertPage(FILE *f, int page, bool last, const bufferStore &buf)
 {
     int len = buf.getLen();
     int i = 0;
@@ -894,6 +894,7 @@ help() {
         " -v, --verbose          Increase verbosity.\n"
         " -V, --version          Print version and exit.\n"
         " -p, --port=[HOST:]PORT Connect to port PORT on host HOST.\n"
+        "    --port=unix:PATH    Connect to the Unix domain socket PATH.\n"
         " -s, --spooldir=DIR     Specify spooldir DIR.\n"
         "                        Default: " SPOOLDIR "\n"
         " -c, --printcmd=CMD     Specify print command.\n"
@@ -922,6 +923,11 @@ parse_destination(const char *arg, const char **host, int *port)
 {
     if (!arg)
         return;
+    if (!strncmp(arg, "unix:", 5)) {
+        // unix:/run/ncpd.socket
+        *host = arg;
+        return;
+    }
     // We don't want to modify argv, therefore copy it first ...
     char *argcpy = strdup(arg);
     char *pp = strchr(argcpy, ':');